@@ -0,0 +1,413 @@
+/**
+ * @file alarm.cpp
+ * @brief Alarm rules evaluated on the device as readings are decoded, instead of on the
+ *        backend after the MySQL insert.
+ *
+ * A low Jackery voltage or a high temperature was only noticed once the row had gone
+ * through the HTTP upload and the backend, a full ingest delay after the sample.
+ *
+ * @details
+ * - **Rules**: `alarm.rules` in the config, separated by ';':
+ *   `<sensor>.<qty>[*<qty>]<op><trigger>[/<clear>]`, e.g. "ADS1115.volt*ratio<11.5/12"
+ *   (Jackery below 11.5 V, cleared above 12 V) or "BME280.temp^3" (more than 3 degrees per
+ *   minute). Quantities: value, temp, hum, volt, supply, ratio (reading.h). Operators:
+ *   '<' below, '>' above, '^' absolute rate of change per minute above.
+ * - **Hysteresis**: an alarm triggers when the condition holds and clears only once the
+ *   value is past `<clear>` on the other side, a value hovering around the trigger does not
+ *   flap. Without `/<clear>` it clears as soon as the condition no longer holds.
+ * - **Compile**: the text is parsed once, at boot and after a config change, into a flat
+ *   table sorted by sensor id with the first rule and the rule count per id. It is compiled
+ *   into a private table, copied into the idle one of two live tables once no evaluation
+ *   still reads it (reader count per table), and published under the alarm lock together
+ *   with the recounted number of active alarms.
+ * - **Evaluate**: `alarmEvaluate()` from `processSensorData()` for every decoded reading,
+ *   polled or pushed. The sensor id indexes the table, only the rules of that sensor are
+ *   looked at, each with a few compares on its own state: constant time per reading, no
+ *   allocation, no history. State is kept per device (reading key), `ALARM_KEYS` per rule.
+ * - **Trigger**: a Blynk event `ALARM_EVENT` and a terminal line through the mailbox,
+ *   written on the next loop pass, and a log line. A clear goes to the terminal.
+ *   `setAlarm` (main.cpp) is true while any alarm is active. While a device's alarm is
+ *   active its readings are uploaded in the high flow class (flow.cpp).
+ * - **Report**: "alarm" lists the rules and the active alarms, "abench" times the
+ *   evaluation of one reading against a private copy of the table.
+ * - **Metrics**: `alarm_triggers_total`.
+ *
+ * @note Evaluated by the poller, the worker pool, the recovery and the push tasks, the rule
+ *       state is guarded by a spinlock.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <atomic>
+#include <algorithm>
+#include <math.h>
+#include <Blynk/BlynkHandlers.h>
+#include "alarm.h"
+#include "config.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "binLog.h"
+
+#define ALARM_RATE_MIN_MS 1000 // samples closer than this give no rate
+#define ALARM_BENCH_READINGS 1000
+
+extern bool setAlarm;
+
+static alarmTable_t tables[2];
+static alarmTable_t staging; // alarmReload() compiles here, the live tables are only copied into
+static std::atomic<alarmTable_t *> active(&tables[0]);
+static int readers[2];       // evaluate() calls on each table, guarded by alarmMux
+static int activeAlarms = 0; // of the active table, guarded by alarmMux
+static portMUX_TYPE alarmMux = portMUX_INITIALIZER_UNLOCKED;
+static char compileError[80];
+static metric_t *mTriggers;
+static const char *const qtyName[] = {"value", "temp", "hum", "volt", "supply", "ratio"};
+static const char opChar[] = "<>^"; // by alarmOp_t
+
+static int findQty(const char *name, size_t len)
+{
+    for (size_t i = 0; i < sizeof(qtyName) / sizeof(qtyName[0]); i++)
+        if (strlen(qtyName[i]) == len && !strncasecmp(qtyName[i], name, len))
+            return i;
+    return -1;
+}
+
+/**
+ * @brief Parses one rule, "<sensor>.<qty>[*<qty>]<op><trigger>[/<clear>]".
+ */
+static bool parseRule(const char *text, alarmRule_t &r)
+{
+    memset(&r, 0, sizeof(r));
+    strncpy(r.text, text, sizeof(r.text) - 1);
+    char sensor[12];
+    const char *dot = strchr(text, '.');
+    if (dot == NULL || dot == text || dot - text >= (int)sizeof(sensor))
+        return false;
+    memcpy(sensor, text, dot - text);
+    sensor[dot - text] = 0;
+    int code = sensorCode(sensor);
+    if (code < 0 || code >= ALARM_CODES)
+        return false;
+    r.code = code;
+
+    const char *p = dot + 1;
+    size_t n = strcspn(p, "*<>^");
+    int qty = findQty(p, n);
+    if (qty < 0)
+        return false;
+    r.qty = qty;
+    r.qty2 = ALARM_NO_QTY;
+    p += n;
+    if (*p == '*')
+    {
+        p++;
+        n = strcspn(p, "<>^");
+        if ((qty = findQty(p, n)) < 0)
+            return false;
+        r.qty2 = qty;
+        p += n;
+    }
+    const char *op = strchr(opChar, *p);
+    if (*p == 0 || op == NULL)
+        return false;
+    r.op = (alarmOp_t)(op - opChar);
+
+    char *end;
+    r.trigger = strtof(p + 1, &end);
+    if (end == p + 1)
+        return false;
+    r.clear = r.trigger;
+    if (*end == '/')
+    {
+        p = end + 1;
+        r.clear = strtof(p, &end);
+        if (end == p)
+            return false;
+    }
+    if (*end != 0)
+        return false;
+    // the clear level must lie on the safe side of the trigger
+    return r.op == ALARM_BELOW ? r.clear >= r.trigger : r.clear <= r.trigger;
+}
+
+/**
+ * @brief Compiles `rules` into `t`, sorted by sensor id.
+ *
+ * @param error Filled with the first rule that did not parse, empty if all did.
+ * @return The number of rules compiled, bad ones are skipped.
+ */
+int alarmCompile(alarmTable_t &t, const char *rules, char *error, size_t len)
+{
+    char text[CONFIG_RULES_LEN];
+    memset(&t, 0, sizeof(t));
+    error[0] = 0;
+    strncpy(text, rules, sizeof(text) - 1);
+    text[sizeof(text) - 1] = 0;
+    char *save;
+    for (char *tok = strtok_r(text, "; ", &save); tok != NULL; tok = strtok_r(NULL, "; ", &save))
+    {
+        if (t.count == ALARM_MAX_RULES)
+        {
+            snprintf(error, len, "more than %d rules", ALARM_MAX_RULES);
+            break;
+        }
+        alarmRule_t r;
+        if (!parseRule(tok, r))
+        {
+            if (!error[0])
+                snprintf(error, len, "bad rule %s", tok);
+            continue;
+        }
+        int i = t.count++;
+        while (i > 0 && t.rule[i - 1].code > r.code) // insertion, stable for a sensor's rules
+        {
+            t.rule[i] = t.rule[i - 1];
+            i--;
+        }
+        t.rule[i] = r;
+    }
+    for (int i = t.count - 1; i >= 0; i--)
+    {
+        t.first[t.rule[i].code] = i;
+        t.rules[t.rule[i].code]++;
+    }
+    return t.count;
+}
+
+// the active table, counted as read until tableEnd()
+static alarmTable_t &tableBegin()
+{
+    portENTER_CRITICAL(&alarmMux);
+    alarmTable_t *t = active.load();
+    readers[t == &tables[1]]++;
+    portEXIT_CRITICAL(&alarmMux);
+    return *t;
+}
+
+static void tableEnd(alarmTable_t &t)
+{
+    portENTER_CRITICAL(&alarmMux);
+    readers[&t == &tables[1]]--;
+    portEXIT_CRITICAL(&alarmMux);
+}
+
+/**
+ * @brief Recompiles `alarm.rules` and publishes it, the alarm states start over. Called by
+ *        `initRTOS()` and by the poller after a config reload, one caller at a time.
+ *
+ * The idle table may still be read by an evaluation that started before the previous
+ * reload, it is only overwritten once its reader count is 0. Evaluations that still run on
+ * the old table after the swap no longer change the active count (see `evaluate()`).
+ */
+bool alarmReload()
+{
+    int n = alarmCompile(staging, cfg()->alarmRules, compileError, sizeof(compileError));
+    if (mTriggers == NULL)
+        mTriggers = metricRegister("alarm_triggers_total", "Alarm rules that triggered", METRIC_COUNTER);
+    int idle = active.load() == &tables[0] ? 1 : 0;
+    for (;;)
+    {
+        portENTER_CRITICAL(&alarmMux);
+        bool busy = readers[idle] > 0;
+        portEXIT_CRITICAL(&alarmMux);
+        if (!busy)
+            break;
+        vTaskDelay(1); // an evaluation of the table before last is finishing
+    }
+    tables[idle] = staging; // no new readers: they only take the active table
+    int on = 0;
+    portENTER_CRITICAL(&alarmMux);
+    active.store(&tables[idle]);
+    for (int i = 0; i < tables[idle].count; i++)
+        for (const alarmState_t &st : tables[idle].rule[i].state)
+            on += st.valid && st.active;
+    activeAlarms = on;
+    setAlarm = on > 0;
+    portEXIT_CRITICAL(&alarmMux);
+    if (compileError[0])
+        LOG_W("alarm: %s", compileError);
+    LOG_I("alarm: %d rules", n);
+    return compileError[0] == 0;
+}
+
+// the state of `key`, the least recently updated one is reused for a new device
+static alarmState_t &stateOf(alarmRule_t &r, int key, int &evicted)
+{
+    int oldest = 0;
+    for (int i = 0; i < ALARM_KEYS; i++)
+    {
+        if (r.state[i].valid && r.state[i].key == key)
+            return r.state[i];
+        if (!r.state[i].valid || (r.state[oldest].valid && r.state[i].lastMs < r.state[oldest].lastMs))
+            oldest = i;
+    }
+    alarmState_t &s = r.state[oldest];
+    evicted = s.active ? -1 : 0;
+    memset(&s, 0, sizeof(s));
+    s.key = key;
+    return s;
+}
+
+/**
+ * @brief Advances the state `s` of rule `r` with `value`.
+ * @return 1 triggered, -1 cleared, 0 no change.
+ */
+static int step(const alarmRule_t &r, alarmState_t &s, float value, uint32_t now, float &seen)
+{
+    seen = value;
+    if (r.op == ALARM_RATE)
+    {
+        bool first = !s.valid;
+        uint32_t dt = now - s.lastMs;
+        if (!first && dt < ALARM_RATE_MIN_MS)
+            return 0;
+        seen = first ? 0 : fabsf(value - s.last) * 60000.0f / dt;
+        s.last = value;
+        s.lastMs = now;
+        s.valid = true;
+        if (first)
+            return 0;
+    }
+    else
+    {
+        s.lastMs = now;
+        s.valid = true;
+    }
+    bool below = r.op == ALARM_BELOW;
+    if (!s.active && (below ? seen < r.trigger : seen > r.trigger))
+    {
+        s.active = true;
+        return 1;
+    }
+    if (s.active && (below ? seen > r.clear : seen < r.clear))
+    {
+        s.active = false;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs the rules of `t` for one reading, `notify` false for the benchmark.
+ * @return true if a rule is active for the reading's device afterwards.
+ */
+static bool evaluate(alarmTable_t &t, const sensorReading_t &reading, bool notify)
+{
+    bool alarmed = false;
+    if (reading.sensor == NULL || reading.code >= ALARM_CODES)
+        return false;
+    int first = t.first[reading.code], n = t.rules[reading.code];
+    if (n == 0)
+        return false;
+    uint32_t now = millis();
+    int key = readingKey(reading);
+    for (int i = first; i < first + n; i++)
+    {
+        alarmRule_t &r = t.rule[i];
+        const readingChannel_t *a = readingFind(reading, r.qty);
+        const readingChannel_t *b = r.qty2 == ALARM_NO_QTY ? NULL : readingFind(reading, r.qty2);
+        if (a == NULL || (r.qty2 != ALARM_NO_QTY && b == NULL))
+            continue;
+        float value = b ? a->value * b->value : a->value, seen;
+        int evicted = 0;
+        portENTER_CRITICAL(&alarmMux);
+        alarmState_t &s = stateOf(r, key, evicted);
+        int change = step(r, s, value, now, seen);
+        alarmed |= s.active;
+        if (notify && &t == active.load()) // a table replaced meanwhile no longer counts
+        {
+            activeAlarms += change + evicted;
+            setAlarm = activeAlarms > 0;
+        }
+        portEXIT_CRITICAL(&alarmMux);
+        if (!notify || change == 0)
+            continue;
+
+        char msg[MAILBOX_TEXT_LEN];
+        snprintf(msg, sizeof(msg), "alarm %s %s (%.2f, key %d)\n", change > 0 ? "ON" : "off", r.text, seen, key);
+        widgetPrint(V42, msg);
+        if (change > 0)
+        {
+            msg[strlen(msg) - 1] = 0;
+            widgetEvent(ALARM_EVENT, msg);
+            metricInc(mTriggers);
+            LOG_W("%s", msg);
+        }
+        else
+            LOG_I("alarm cleared %s", r.text);
+    }
+    return alarmed;
+}
+
+/**
+ * @brief Evaluates the alarm rules of the reading's sensor, called for every decoded
+ *        reading.
+ * @return true while an alarm of the reading's device is active, the reading is then
+ *         uploaded ahead of the others (flow.cpp).
+ */
+bool alarmEvaluate(const sensorReading_t &reading)
+{
+    alarmTable_t &t = tableBegin();
+    bool alarmed = evaluate(t, reading, true);
+    tableEnd(t);
+    return alarmed;
+}
+
+/**
+ * @brief Terminal "alarm": the compiled rules and which devices have them active.
+ */
+void alarmReport()
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    alarmTable_t &t = tableBegin();
+    snprintf(tmp, sizeof(tmp), "alarm: %d rules, %d active%s%s\n", t.count, activeAlarms,
+             compileError[0] ? ", " : "", compileError);
+    widgetPrint(V42, tmp);
+    for (int i = 0; i < t.count; i++)
+    {
+        const alarmRule_t &r = t.rule[i];
+        int n = snprintf(tmp, sizeof(tmp), "\t%s", r.text);
+        for (const alarmState_t &s : r.state)
+            if (s.valid && s.active && n < (int)sizeof(tmp))
+                n += snprintf(tmp + n, sizeof(tmp) - n, " ON:%d", s.key);
+        snprintf(tmp + std::min(n, (int)sizeof(tmp) - 2), 2, "\n");
+        widgetPrint(V42, tmp);
+    }
+    tableEnd(t);
+}
+
+/**
+ * @brief Terminal "abench": compile time and per-reading evaluation time of the configured
+ *        rules, on a private table, the live alarm states are not touched.
+ */
+void alarmBench()
+{
+    static alarmTable_t bench; // too big for the loop stack
+    static readingBatch_t batch;
+    char tmp[MAILBOX_TEXT_LEN], error[80];
+    uint32_t start = micros();
+    int rules = alarmCompile(bench, cfg()->alarmRules, error, sizeof(error));
+    uint32_t compileUs = micros() - start;
+    if (rules == 0)
+    {
+        widgetPrint(V42, "abench: no rules\n");
+        return;
+    }
+    // a reading of the first rule's sensor, every channel present
+    readingBegin(batch);
+    sensorReading_t *r = readingOpen(batch, bench.rule[0].code);
+    for (int i = 0; i < 3; i++)
+        readingPush(batch, 10.0f + i);
+    uint32_t n = bench.rules[bench.rule[0].code];
+
+    start = micros();
+    for (int i = 0; i < ALARM_BENCH_READINGS; i++)
+    {
+        r->channel[0].value = 10.0f + (i & 7); // crosses the thresholds now and then
+        evaluate(bench, *r, false);
+    }
+    uint32_t evalUs = micros() - start;
+    snprintf(tmp, sizeof(tmp), "abench: %d rules compiled in %u us, %u ns/reading (%s, %u rules)\n", rules, compileUs,
+             (unsigned)((uint64_t)evalUs * 1000 / ALARM_BENCH_READINGS), r->sensor ? r->sensor : "?", n);
+    widgetPrint(V42, tmp);
+}
@@ -0,0 +1,53 @@
+/**
+ * @file alarm.h
+ * @brief On-device alarm rules: threshold, rate of change and hysteresis conditions compiled
+ *        from the config into a flat table, evaluated on every decoded reading.
+ */
+#pragma once
+#include <Arduino.h>
+#include "reading.h"
+
+#define ALARM_MAX_RULES 16
+#define ALARM_CODES 128 // sensor ids index the table directly
+#define ALARM_KEYS 4    // devices tracked per rule, by reading key
+#define ALARM_EVENT "sensor_alarm" // Blynk event code, set up in the Blynk console
+#define ALARM_NO_QTY 0xff
+
+typedef enum : uint8_t
+{
+    ALARM_BELOW, // '<'
+    ALARM_ABOVE, // '>'
+    ALARM_RATE,  // '^', |change| per minute above
+} alarmOp_t;
+
+typedef struct
+{
+    int key;         // reading key of the device
+    bool valid;      // last/lastMs hold a sample
+    bool active;
+    float last;      // value of the previous sample, for the rate
+    uint32_t lastMs;
+} alarmState_t;
+
+typedef struct
+{
+    uint8_t code;         // sensor id
+    uint8_t qty, qty2;    // quantity_t, the value is their product if qty2 is set
+    alarmOp_t op;
+    float trigger, clear; // clear == trigger: no hysteresis
+    char text[32];        // the rule as written, for the messages
+    alarmState_t state[ALARM_KEYS];
+} alarmRule_t;
+
+typedef struct
+{
+    uint8_t count;
+    uint8_t first[ALARM_CODES], rules[ALARM_CODES]; // rules of a sensor id, contiguous
+    alarmRule_t rule[ALARM_MAX_RULES];
+} alarmTable_t;
+
+int alarmCompile(alarmTable_t &t, const char *rules, char *error, size_t len);
+bool alarmReload();
+bool alarmEvaluate(const sensorReading_t &reading);
+void alarmReport();
+void alarmBench();
@@ -0,0 +1,293 @@
+/**
+ * @file binLog.cpp
+ * @brief Deferred-format logging: per-core lock-free rings of binary records, drained and
+ *        formatted by a low priority task.
+ *
+ * `Serial.printf` formats in the calling task and blocks it until the UART has taken the
+ * line, at 115200 baud about 87 us per character once the 128 byte FIFO is full. A failed
+ * socket read or POST printed several lines from the socket and HTTP tasks, i.e. several
+ * milliseconds with the sensor pipeline stopped.
+ *
+ * @details
+ * - **Record**: `LOG_x(fmt, ...)` (binLog.h) reserves a 96 byte record in the ring of the
+ *   calling core, stores the format pointer (the literal stays in flash, it is the format
+ *   id), `micros()` and the raw arguments with a one byte type tag each. Strings are copied
+ *   since the caller's buffers do not live until the drain, long ones are cut.
+ * - **Ring**: multi-producer, single consumer, lock-free. A producer claims a position with
+ *   a compare-and-swap on `head` and commits by storing position + 1 in the record's `seq`.
+ *   Tasks on the same core can preempt each other, hence the CAS, but the cores never touch
+ *   each other's ring. A full ring drops the record and counts it, the caller never waits.
+ * - **Drain**: `taskLog` (core 0, priority 1) merges both rings in time order, formats each
+ *   record with the format string and its tagged arguments and writes it to Serial. Only
+ *   this task waits for the UART. `warmRestart()` drains synchronously before the reset.
+ * - **Levels**: calls above `LOG_LEVEL` are removed by the preprocessor, there is no
+ *   runtime check.
+ * - **Benchmark**: the "lbench" terminal command times a `LOG_I` with three arguments
+ *   against the same line through `Serial.printf`.
+ * - **Metrics**: `log_dropped_total`.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <atomic>
+#include <algorithm>
+#include <Blynk/BlynkHandlers.h>
+#include "binLog.h"
+#include "mailbox.h"
+#include "metrics.h"
+
+#define LOG_CORE 0
+#define LOG_PRIORITY 1
+#define LOG_STACK_SIZE 3072 // snprintf of floats
+#define LOG_DRAIN_MS 20
+#define LOG_LINE_LEN 192
+#define LOG_BENCH_CALLS 32
+#define WORDS_PER_BYTE 4
+
+typedef struct
+{
+    std::atomic<uint32_t> head; // next position to claim
+    std::atomic<uint32_t> tail; // next position to drain, written by the drain only
+    std::atomic<uint32_t> dropped;
+    logRecord_t rec[LOG_RING_RECORDS];
+} logRing_t;
+
+static_assert(sizeof(void *) != 4 || sizeof(logRecord_t) == LOG_RECORD_SIZE, "log record layout");
+
+static logRing_t rings[portNUM_PROCESSORS];
+static TaskHandle_t log_task_handle;
+static metric_t *mDropped;
+static std::atomic<bool> draining(false); // one consumer: the drain task or warmRestart()
+
+// Function Prototypes
+void taskLog(void *pvParameters);
+
+/**
+ * @brief Claims a record in the calling core's ring, NULL if the ring is full.
+ */
+logRecord_t *logBegin(uint8_t level, const char *fmt)
+{
+    logRing_t &ring = rings[xPortGetCoreID()];
+    uint32_t pos = ring.head.load(std::memory_order_relaxed);
+    do
+    {
+        if (pos - ring.tail.load(std::memory_order_acquire) >= LOG_RING_RECORDS)
+        {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return NULL;
+        }
+    } while (!ring.head.compare_exchange_weak(pos, pos + 1, std::memory_order_acquire, std::memory_order_relaxed));
+
+    logRecord_t *r = &ring.rec[pos % LOG_RING_RECORDS];
+    r->fmt = fmt;
+    r->us = micros();
+    r->pos = pos;
+    r->level = level;
+    r->len = 0;
+    r->truncated = false;
+    return r;
+}
+
+/**
+ * @brief Commits a record claimed by `logBegin()`.
+ */
+void logEnd(logRecord_t *r)
+{
+    r->seq.store(r->pos + 1, std::memory_order_release);
+}
+
+/**
+ * @brief Starts the drain task, called by `initRTOS()`.
+ */
+bool logStart()
+{
+    mDropped = metricRegister("log_dropped_total", "Log records dropped, ring full", METRIC_COUNTER);
+    xTaskCreatePinnedToCore(taskLog, "Task Log", LOG_STACK_SIZE, NULL, LOG_PRIORITY, &log_task_handle, LOG_CORE);
+    return log_task_handle != NULL;
+}
+
+static inline void advance(size_t &n, int written, size_t cap)
+{
+    if (written > 0)
+        n = std::min(n + written, cap - 1);
+}
+
+/**
+ * @brief Formats a record: time, level, then the format with the tagged arguments.
+ */
+static size_t logFormat(const logRecord_t &r, char *out, size_t cap)
+{
+    size_t n = 0;
+    advance(n, snprintf(out, cap, "%u.%03u %c ", (unsigned)(r.us / 1000000), (unsigned)(r.us / 1000 % 1000), "-EWID"[r.level & 7]), cap);
+    const uint8_t *a = r.data, *end = r.data + r.len;
+    const char *p = r.fmt;
+    while (*p && n < cap - 1)
+    {
+        if (*p != '%')
+        {
+            out[n++] = *p++;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            out[n++] = '%';
+            p += 2;
+            continue;
+        }
+        char spec[16] = "%";
+        int k = 1;
+        p++;
+        while (*p && strchr("-+ #0123456789.", *p) && k < 8)
+            spec[k++] = *p++;
+        while (*p && strchr("hlzjtL", *p)) // the size comes from the tag
+            p++;
+        char conv = *p ? *p++ : 0;
+        if (a >= end)
+        {
+            advance(n, snprintf(out + n, cap - n, "?"), cap);
+            continue;
+        }
+        switch (*a++)
+        {
+        case LOG_TAG_I32:
+        {
+            int32_t v;
+            memcpy(&v, a, 4);
+            a += 4;
+            spec[k++] = strchr("diouxXc", conv) ? conv : 'd';
+            advance(n, snprintf(out + n, cap - n, spec, v), cap);
+            break;
+        }
+        case LOG_TAG_I64:
+        {
+            long long v;
+            memcpy(&v, a, 8);
+            a += 8;
+            if (conv == 'p')
+                advance(n, snprintf(out + n, cap - n, "0x%llx", v), cap);
+            else
+            {
+                spec[k++] = 'l';
+                spec[k++] = 'l';
+                spec[k++] = strchr("diouxX", conv) ? conv : 'd';
+                advance(n, snprintf(out + n, cap - n, spec, v), cap);
+            }
+            break;
+        }
+        case LOG_TAG_F64:
+        {
+            double v;
+            memcpy(&v, a, 8);
+            a += 8;
+            spec[k++] = strchr("fFeEgG", conv) ? conv : 'f';
+            advance(n, snprintf(out + n, cap - n, spec, v), cap);
+            break;
+        }
+        case LOG_TAG_STR:
+        {
+            int len = *a++;
+            char *dot = strchr(spec, '.'); // the copy has its length, precision is not needed
+            k = dot ? dot - spec : k;
+            strcpy(spec + k, ".*s");
+            advance(n, snprintf(out + n, cap - n, spec, len, (const char *)a), cap);
+            a += len;
+            break;
+        }
+        default:
+            a = end; // corrupt, stop decoding arguments
+        }
+    }
+    n = std::min(n, cap - 3); // room for "~\n"
+    if (out[n - 1] == '\n')
+        n--;
+    if (r.truncated)
+        out[n++] = '~';
+    out[n++] = '\n';
+    out[n] = 0;
+    return n;
+}
+
+/**
+ * @brief Formats and prints every committed record, oldest first across both rings.
+ *        Returns at once if another task is draining.
+ */
+void logDrain()
+{
+    char line[LOG_LINE_LEN];
+    if (draining.exchange(true, std::memory_order_acquire))
+        return;
+    for (;;)
+    {
+        logRing_t *pick = NULL;
+        logRecord_t *rec = NULL;
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+        {
+            logRing_t &ring = rings[core];
+            uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+            logRecord_t *r = &ring.rec[tail % LOG_RING_RECORDS];
+            if (r->seq.load(std::memory_order_acquire) != tail + 1)
+                continue;
+            if (rec == NULL || (int32_t)(r->us - rec->us) < 0)
+            {
+                pick = &ring;
+                rec = r;
+            }
+        }
+        if (rec == NULL)
+            break;
+        size_t n = logFormat(*rec, line, sizeof(line));
+        pick->tail.fetch_add(1, std::memory_order_release); // the record is free again
+        Serial.write((const uint8_t *)line, n);
+    }
+
+    for (int core = 0; core < portNUM_PROCESSORS; core++)
+    {
+        uint32_t dropped = rings[core].dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped)
+        {
+            Serial.printf("log: %u records dropped on core %d\n", dropped, core);
+            if (mDropped != NULL) // a drain before logStart()
+                metricInc(mDropped, dropped);
+        }
+    }
+    draining.store(false, std::memory_order_release);
+}
+
+/**
+ * @brief Drain task, prints the log every `LOG_DRAIN_MS`.
+ *
+ * No heartbeat: at priority 1 it may be starved for a while under load, the rings then
+ * drop records, the device is not stalled.
+ *
+ * @param pvParameters Unused.
+ */
+void taskLog(void *pvParameters)
+{
+    Serial.printf("Task Log running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    for (;;)
+    {
+        logDrain();
+        vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_MS));
+    }
+}
+
+/**
+ * @brief Terminal "lbench": time per call of `LOG_I` against `Serial.printf`, same line.
+ */
+void logBench()
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    const char *host = "192.168.1.42";
+    uint32_t start = micros();
+    for (int i = 0; i < LOG_BENCH_CALLS; i++)
+        LOG_I("lbench %d host %s rtt %.2f ms", i, host, 1.25f * i);
+    uint32_t logUs = micros() - start;
+    start = micros();
+    for (int i = 0; i < LOG_BENCH_CALLS; i++)
+        Serial.printf("lbench %d host %s rtt %.2f ms\n", i, host, 1.25f * i);
+    uint32_t serialUs = micros() - start;
+    snprintf(tmp, sizeof(tmp), "lbench: %d calls, LOG_I %u ns/call, Serial.printf %u ns/call\n", LOG_BENCH_CALLS,
+             (unsigned)((uint64_t)logUs * 1000 / LOG_BENCH_CALLS), (unsigned)((uint64_t)serialUs * 1000 / LOG_BENCH_CALLS));
+    widgetPrint(V42, tmp);
+}
@@ -0,0 +1,136 @@
+/**
+ * @file binLog.h
+ * @brief Deferred-format logging: the caller stores the format pointer and the raw
+ *        arguments in a per-core ring, a low priority task formats and prints them.
+ *
+ * `LOG_E`/`LOG_W`/`LOG_I`/`LOG_D` take a printf format (a string literal) and its arguments.
+ * Levels above `LOG_LEVEL` compile to nothing, their arguments are not evaluated. Build with
+ * e.g. `-DLOG_LEVEL=LOG_LEVEL_DEBUG` to keep the debug calls.
+ *
+ * Supported arguments: integers up to 64 bit, float/double, C strings (copied, truncated to
+ * the record) and pointers. `String` is not, pass `.c_str()`.
+ */
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_RECORD_SIZE 96
+#define LOG_PAYLOAD (LOG_RECORD_SIZE - 20)
+#define LOG_RING_RECORDS 48 // per core
+
+enum logTag_t : uint8_t
+{
+    LOG_TAG_I32,
+    LOG_TAG_I64,
+    LOG_TAG_F64,
+    LOG_TAG_STR, // length byte, bytes, no terminator
+};
+
+typedef struct
+{
+    std::atomic<uint32_t> seq; // position + 1 once committed
+    const char *fmt;
+    uint32_t us;  // micros() at the call
+    uint32_t pos; // ring position
+    uint8_t level, len;
+    bool truncated;
+    uint8_t data[LOG_PAYLOAD];
+} logRecord_t;
+
+logRecord_t *logBegin(uint8_t level, const char *fmt);
+void logEnd(logRecord_t *r);
+bool logStart();
+void logDrain();
+void logBench();
+
+static inline void logPut(logRecord_t &r, logTag_t tag, const void *v, size_t n)
+{
+    if (r.len + 1 + n > LOG_PAYLOAD)
+    {
+        r.truncated = true;
+        return;
+    }
+    r.data[r.len++] = tag;
+    memcpy(r.data + r.len, v, n);
+    r.len += n;
+}
+
+static inline void logArg(logRecord_t &r, int v) { int32_t x = v; logPut(r, LOG_TAG_I32, &x, 4); }
+static inline void logArg(logRecord_t &r, unsigned v) { uint32_t x = v; logPut(r, LOG_TAG_I32, &x, 4); }
+static inline void logArg(logRecord_t &r, long v) { int64_t x = v; logPut(r, LOG_TAG_I64, &x, 8); }
+static inline void logArg(logRecord_t &r, unsigned long v) { uint64_t x = v; logPut(r, LOG_TAG_I64, &x, 8); }
+static inline void logArg(logRecord_t &r, long long v) { logPut(r, LOG_TAG_I64, &v, 8); }
+static inline void logArg(logRecord_t &r, unsigned long long v) { logPut(r, LOG_TAG_I64, &v, 8); }
+static inline void logArg(logRecord_t &r, double v) { logPut(r, LOG_TAG_F64, &v, 8); }
+static inline void logArg(logRecord_t &r, const void *v) { uint64_t x = (uintptr_t)v; logPut(r, LOG_TAG_I64, &x, 8); }
+static inline void logArg(logRecord_t &r, const char *s)
+{
+    size_t n = s ? strnlen(s, LOG_PAYLOAD) : 0;
+    if (r.len + 2 + n > LOG_PAYLOAD) // keep what fits
+    {
+        r.truncated = true;
+        n = r.len + 2 < LOG_PAYLOAD ? LOG_PAYLOAD - r.len - 2 : 0;
+        if (n == 0)
+            return;
+    }
+    r.data[r.len++] = LOG_TAG_STR;
+    r.data[r.len++] = (uint8_t)n;
+    memcpy(r.data + r.len, s, n);
+    r.len += n;
+}
+static inline void logArg(logRecord_t &r, char *s) { logArg(r, (const char *)s); }
+
+static inline void logArgs(logRecord_t &r) {}
+template <typename T, typename... R>
+static inline void logArgs(logRecord_t &r, T v, R... rest)
+{
+    logArg(r, v);
+    logArgs(r, rest...);
+}
+
+// printf format checking only, never called
+static inline void logCheck(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static inline void logCheck(const char *fmt, ...) {}
+
+#define LOG_AT(level, fmt, ...)                                  \
+    do                                                           \
+    {                                                            \
+        if (0)                                                   \
+            logCheck(fmt, ##__VA_ARGS__);                        \
+        logRecord_t *_r = logBegin(level, "" fmt); /* literal */ \
+        if (_r)                                                  \
+        {                                                        \
+            logArgs(*_r, ##__VA_ARGS__);                         \
+            logEnd(_r);                                          \
+        }                                                        \
+    } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#else
+#define LOG_E(fmt, ...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_W(fmt, ...) LOG_AT(LOG_LEVEL_WARN, fmt, ##__VA_ARGS__)
+#else
+#define LOG_W(fmt, ...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOG_I(fmt, ...) do {} while (0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
+#else
+#define LOG_D(fmt, ...) do {} while (0)
+#endif
@@ -0,0 +1,110 @@
+/**
+ * @file boot.cpp
+ * @brief Staged boot helpers: phase timing log, Wi-Fi fast reconnect and the "Wi-Fi up" gate.
+ *
+ * `setup()` starts the Wi-Fi association first and overlaps everything that does not need
+ * the network with it (task creation, OLED, widget replay). The poller waits on the Wi-Fi
+ * gate only, so sensor polling starts as soon as the station has an IP, not when the Blynk
+ * cloud answers.
+ *
+ * @details
+ * - **Fast reconnect**: the BSSID and channel of the last association are kept in the warm
+ *   restart snapshot (warmState.cpp). When present, `wifiStart()` connects to that AP
+ *   directly, skipping the all-channel scan. If it does not associate within `WIFI_FAST_MS`
+ *   a normal scan connect follows. After power on there is no cache, a full scan is done.
+ * - **Gate**: `wifiWait()` sets `WIFI_UP_BIT` in the boot event group, `bootWaitWifi()`
+ *   blocks on it.
+ * - **Phases**: `bootPhase()` logs the time since power up and since the previous phase and
+ *   exports it as the `boot_phase_ms` gauge (label = phase).
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <WiFi.h>
+#include "warmState.h"
+#include "metrics.h"
+
+#define WIFI_FAST_MS 3000            // cached BSSID/channel attempt before a full scan
+#define WIFI_CONNECT_MS (30 * 1000)  // give up and restart
+#define WIFI_UP_BIT BIT0
+
+static EventGroupHandle_t bootEvents;
+static uint32_t lastPhaseMs;
+static bool fastConnect;
+
+// Function Prototypes
+void bootPhase(const char *phase);
+bool wifiStart(const char *ssid, const char *pass);
+bool wifiWait(const char *ssid, const char *pass);
+void bootWaitWifi();
+
+/**
+ * @brief Logs the completion of a boot phase.
+ *
+ * @param phase Phase name, e.g. "creds", "wifi_up".
+ */
+void bootPhase(const char *phase)
+{
+    uint32_t now = millis();
+    Serial.printf("boot: %-10s %6u ms (+%u ms)\n", phase, now, now - lastPhaseMs);
+    lastPhaseMs = now;
+    metricSet(metricRegister("boot_phase_ms", "Time since power up at the end of a boot phase", METRIC_GAUGE, "phase", phase), now);
+}
+
+/**
+ * @brief Starts the station association without waiting for it.
+ *
+ * @return true if the cached BSSID/channel is used.
+ */
+bool wifiStart(const char *ssid, const char *pass)
+{
+    if (bootEvents == NULL)
+        bootEvents = xEventGroupCreate();
+    const warmState_t *warm = warmSnapshot();
+    WiFi.mode(WIFI_STA);
+    WiFi.setAutoReconnect(true);
+    fastConnect = warm->wifiChannel != 0;
+    if (fastConnect)
+        WiFi.begin(ssid, pass, warm->wifiChannel, warm->wifiBssid);
+    else
+        WiFi.begin(ssid, pass);
+    return fastConnect;
+}
+
+/**
+ * @brief Waits for the station to get an IP, falls back to a scan if the cached AP is gone.
+ *
+ * On success the AP is cached for the next warm boot and the Wi-Fi gate is opened.
+ *
+ * @return false if Wi-Fi is not up after `WIFI_CONNECT_MS`.
+ */
+bool wifiWait(const char *ssid, const char *pass)
+{
+    uint32_t start = millis();
+    while (WiFi.status() != WL_CONNECTED)
+    {
+        if (fastConnect && millis() - start > WIFI_FAST_MS)
+        {
+            Serial.println("wifi: cached AP not answering, scanning");
+            fastConnect = false;
+            WiFi.disconnect();
+            WiFi.begin(ssid, pass);
+        }
+        if (millis() - start > WIFI_CONNECT_MS)
+            return false;
+        delay(10);
+    }
+    Serial.printf("wifi: %s ch %d %s\n", WiFi.localIP().toString().c_str(), WiFi.channel(), fastConnect ? "fast reconnect" : "scan");
+    warmNoteWifi(WiFi.BSSID(), WiFi.channel());
+    xEventGroupSetBits(bootEvents, WIFI_UP_BIT);
+    return true;
+}
+
+/**
+ * @brief Blocks the calling task until the station has an IP (first association only).
+ */
+void bootWaitWifi()
+{
+    if (bootEvents != NULL)
+        xEventGroupWaitBits(bootEvents, WIFI_UP_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+}
@@ -0,0 +1,308 @@
+/**
+ * @file broadcast.cpp
+ * @brief Fleet-wide command broadcast: the command goes to every selected device at the same
+ *        time, the replies are collected into one status table.
+ *
+ * `BLYNK_WRITE(BLINK_TST)` sent `BLK` to one device after the other from the Blynk loop with
+ * a blocking `socketClient()` overload (now removed): up to 35 s per device, 5 s `delay` per failure, a
+ * `malloc` per reply and the refresh timer disabled meanwhile. 20 devices stalled the UI for
+ * minutes.
+ *
+ * @details
+ * - **Task**: `broadcastStart()` spawns the short lived `taskBroadcast`, the Blynk loop and
+ *   the poll schedule go on. One broadcast at a time.
+ * - **Targets**: copied from `ipMap` under `xMutex_ipMap` into the static result table, a
+ *   filter selects devices whose name contains it (any case) or whose IP is it. The table
+ *   holds as many devices as the poll schedule, targets beyond it are counted in the
+ *   summary. No heap is used, the table, the sockets and the summary are static or on the
+ *   task stack.
+ * - **Concurrency**: non-blocking lwIP sockets multiplexed with `select()` like the ping
+ *   probes (probe.cpp), up to `BCAST_MAX_INFLIGHT` at once. A broadcast of `BLK` takes about
+ *   one command run, not one per device.
+ * - **Timeouts**: connect from the device's estimator, reply `rttCommandMs()` (rtt.cpp), a
+ *   command that runs on the device adds its run time. Connects feed the estimator.
+ * - **Result**: a status per device (ok, refused, timeout, closed), the connect to reply
+ *   time and the first line of the reply. `done` gets the table in the broadcast task, the
+ *   summary goes to the terminal as one write (`widgetPrintBuffer()`).
+ * - **Metrics**: `broadcast_replies_total{ok|failed}`.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <lwip/sockets.h>
+#include <Blynk/BlynkHandlers.h>
+#include "broadcast.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "config.h"
+#include "rtt.h"
+
+#define BCAST_MAX_INFLIGHT 8 // stay well inside the lwIP socket table
+#define BCAST_SUMMARY_LEN 1024
+#define BCAST_CORE 0
+#define BCAST_PRIORITY 1
+#define BCAST_STACK_SIZE 4096
+
+typedef struct
+{
+    int fd;
+    int target;
+    uint32_t startUs;
+    uint32_t limitMs; // connect, then reply
+    bool sent;
+    uint8_t len; // reply bytes so far
+} bcastSocket_t;
+
+extern std::map<std::string, std::string> ipMap;
+extern SemaphoreHandle_t xMutex_ipMap;
+
+static bcastResult_t results[BCAST_MAX_DEVICES];
+static int targetCount, skippedCount; // skipped: matched, table full
+static char command[BCAST_CMD_LEN];
+static bcastDone_t onDone;
+static void *doneArg;
+static char summary[BCAST_SUMMARY_LEN];
+static volatile bool summaryBusy = false; // summary owned by the loop until written
+static std::atomic<bool> broadcastBusy(false);
+static metric_t *mOk, *mFailed;
+static const char *const statusName[] = {"pending", "ok", "refused", "timeout", "closed"};
+
+// Function Prototypes
+void taskBroadcast(void *pvParameters);
+
+// `name` contains `part`, any case
+static bool containsNoCase(const char *name, const char *part)
+{
+    size_t n = strlen(part);
+    for (; *name; name++)
+        if (!strncasecmp(name, part, n))
+            return true;
+    return n == 0;
+}
+
+/**
+ * @brief Copies the devices matching `filter` (NULL, "" or "all": every device) from `ipMap`.
+ */
+static void selectTargets(const char *filter)
+{
+    bool all = filter == NULL || !*filter || !strcasecmp(filter, "all");
+    targetCount = skippedCount = 0;
+    xSemaphoreTake(xMutex_ipMap, portMAX_DELAY);
+    for (const auto &pair : ipMap)
+    {
+        if (!all && !containsNoCase(pair.first.c_str(), filter) && pair.second != filter)
+            continue;
+        if (targetCount >= BCAST_MAX_DEVICES)
+        {
+            skippedCount++;
+            continue;
+        }
+        bcastResult_t &r = results[targetCount++];
+        memset(&r, 0, sizeof(r));
+        strncpy(r.name, pair.first.c_str(), sizeof(r.name) - 1);
+        strncpy(r.ip, pair.second.c_str(), sizeof(r.ip) - 1);
+    }
+    xSemaphoreGive(xMutex_ipMap);
+}
+
+/**
+ * @brief Opens a non-blocking socket to target `t` and starts the connect.
+ * @return The socket, or -1 if the connect failed right away.
+ */
+static int bcastOpen(int t)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg()->sensorPort);
+    addr.sin_addr.s_addr = inet_addr(results[t].ip);
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Advances one socket that is ready.
+ * @return The final status, or `BCAST_PENDING` while still in flight.
+ */
+static bcastStatus_t bcastStep(bcastSocket_t &s, bool readable, bool writable)
+{
+    bcastResult_t &r = results[s.target];
+    if (!s.sent && writable)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+            return BCAST_REFUSED;
+        rttSample(r.ip, RTT_CONNECT, micros() - s.startUs);
+        char line[BCAST_CMD_LEN + 2];
+        int n = snprintf(line, sizeof(line), "%s\r\n", command);
+        if (send(s.fd, line, n, 0) != n)
+            return BCAST_CLOSED;
+        s.sent = true;
+        s.startUs = micros();
+        s.limitMs = rttCommandMs(r.ip, command);
+    }
+    else if (s.sent && readable)
+    {
+        char buf[BCAST_REPLY_LEN];
+        int n = recv(s.fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return s.len ? BCAST_OK : BCAST_CLOSED;
+        for (int i = 0; i < n; i++)
+        {
+            if (buf[i] == '\n')
+                return BCAST_OK;
+            if (buf[i] != '\r' && s.len < BCAST_REPLY_LEN - 1)
+                r.reply[s.len++] = buf[i];
+        }
+    }
+    return BCAST_PENDING;
+}
+
+/**
+ * @brief Sends `command` to every target concurrently and fills in their status.
+ * @return Duration of the run in ms.
+ */
+static uint32_t broadcastRun()
+{
+    bcastSocket_t inflight[BCAST_MAX_INFLIGHT];
+    int active = 0, next = 0;
+    uint32_t begin = millis();
+
+    for (;;)
+    {
+        while (active < BCAST_MAX_INFLIGHT && next < targetCount)
+        {
+            int t = next++;
+            int fd = bcastOpen(t);
+            if (fd < 0)
+                results[t].status = BCAST_REFUSED;
+            else
+                inflight[active++] = {fd, t, (uint32_t)micros(), rttTimeout(results[t].ip, RTT_CONNECT), false, 0};
+        }
+        if (active == 0)
+            break;
+
+        fd_set rd, wr;
+        FD_ZERO(&rd);
+        FD_ZERO(&wr);
+        int maxFd = -1;
+        uint32_t now = micros(), waitUs = UINT32_MAX;
+        for (int i = 0; i < active; i++)
+        {
+            FD_SET(inflight[i].fd, inflight[i].sent ? &rd : &wr);
+            maxFd = std::max(maxFd, inflight[i].fd);
+            uint32_t age = now - inflight[i].startUs;
+            waitUs = std::min(waitUs, age < inflight[i].limitMs * 1000 ? inflight[i].limitMs * 1000 - age : 0);
+        }
+        struct timeval tv = {(time_t)(waitUs / 1000000), (suseconds_t)(waitUs % 1000000)};
+        if (select(maxFd + 1, &rd, &wr, NULL, &tv) < 0)
+        {
+            FD_ZERO(&rd);
+            FD_ZERO(&wr);
+        }
+
+        for (int i = active - 1; i >= 0; i--)
+        {
+            bcastSocket_t &s = inflight[i];
+            bcastResult_t &r = results[s.target];
+            bcastStatus_t st = bcastStep(s, FD_ISSET(s.fd, &rd), FD_ISSET(s.fd, &wr));
+            if (st == BCAST_PENDING && micros() - s.startUs >= s.limitMs * 1000) // startUs moves on the send
+            {
+                rttExpired(r.ip, s.sent ? RTT_REPLY : RTT_CONNECT);
+                st = BCAST_TIMEOUT;
+            }
+            if (st == BCAST_PENDING)
+                continue;
+            r.status = st;
+            r.ms = (micros() - s.startUs) / 1000;
+            close(s.fd);
+            inflight[i] = inflight[--active];
+        }
+    }
+    return millis() - begin;
+}
+
+/**
+ * @brief Broadcast task: runs the broadcast, hands the table to `onDone` and writes the
+ *        summary to the terminal. Deletes itself when done.
+ *
+ * @param pvParameters Unused, the command and the targets are set by `broadcastStart()`.
+ */
+void taskBroadcast(void *pvParameters)
+{
+    uint32_t ms = broadcastRun();
+    int ok = 0;
+    for (int i = 0; i < targetCount; i++)
+        ok += results[i].status == BCAST_OK;
+    metricInc(mOk, ok);
+    metricInc(mFailed, targetCount - ok);
+    if (onDone != NULL)
+        onDone(results, targetCount, doneArg);
+
+    while (summaryBusy) // previous summary not written out yet
+        vTaskDelay(pdMS_TO_TICKS(10));
+    size_t n = snprintf(summary, sizeof(summary), "bcast %s to %d devices in %u ms, %d ok", command, targetCount, ms, ok);
+    if (skippedCount)
+        n += snprintf(summary + n, sizeof(summary) - n, ", %d not sent (table full)", skippedCount);
+    n += snprintf(summary + n, sizeof(summary) - n, "\n");
+    for (int i = 0; i < targetCount && n < sizeof(summary); i++)
+    {
+        const bcastResult_t &r = results[i];
+        n += snprintf(summary + n, sizeof(summary) - n, "\t%s %s %u ms %s\n", r.name, statusName[r.status], r.ms, r.reply);
+    }
+    if (ok != targetCount) // #D3435C - Blynk RED
+        widgetColor(V42, "#D3435C");
+    if (!widgetPrintBuffer(V42, summary, &summaryBusy))
+        Serial.println("bcast: mailbox full, summary dropped");
+
+    broadcastBusy = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Starts sending `cmd` to the devices matching `filter` in the background.
+ *
+ * @param done Called from the broadcast task with the status table, may be NULL.
+ * @return false if a broadcast is in progress or the task could not be created.
+ */
+bool broadcastStart(const char *cmd, const char *filter, bcastDone_t done, void *arg)
+{
+    if (broadcastBusy.exchange(true))
+        return false;
+    if (mOk == NULL)
+    {
+        mOk = metricRegister("broadcast_replies_total", "Devices that answered or failed a broadcast", METRIC_COUNTER, "result", "ok");
+        mFailed = metricRegister("broadcast_replies_total", "Devices that answered or failed a broadcast", METRIC_COUNTER, "result", "failed");
+    }
+    strncpy(command, cmd, sizeof(command) - 1);
+    command[sizeof(command) - 1] = 0;
+    onDone = done;
+    doneArg = arg;
+    selectTargets(filter);
+    if (xTaskCreatePinnedToCore(taskBroadcast, "bcast", BCAST_STACK_SIZE, NULL, BCAST_PRIORITY, NULL, BCAST_CORE) != pdPASS)
+    {
+        broadcastBusy = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief true while a broadcast is in progress.
+ */
+bool broadcastRunning()
+{
+    return broadcastBusy;
+}
@@ -0,0 +1,34 @@
+/**
+ * @file broadcast.h
+ * @brief One command to every device (or a filtered subset) concurrently, with a status per
+ *        device.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define BCAST_MAX_DEVICES 32 // MAX_DEVICES of the poll schedule (scheduler.cpp)
+#define BCAST_CMD_LEN 16
+#define BCAST_REPLY_LEN 32
+
+typedef enum : uint8_t
+{
+    BCAST_PENDING,
+    BCAST_OK,      // replied
+    BCAST_REFUSED, // connect failed
+    BCAST_TIMEOUT, // no connect or no reply in time
+    BCAST_CLOSED,  // closed without a reply
+} bcastStatus_t;
+
+typedef struct
+{
+    char name[24];
+    char ip[16];
+    bcastStatus_t status;
+    uint32_t ms;                 // command sent to reply, or the failed connect
+    char reply[BCAST_REPLY_LEN]; // first line of the reply, cut
+} bcastResult_t;
+
+typedef void (*bcastDone_t)(const bcastResult_t *results, int n, void *arg);
+
+bool broadcastStart(const char *cmd, const char *filter, bcastDone_t done = NULL, void *arg = NULL);
+bool broadcastRunning();
@@ -0,0 +1,523 @@
+/**
+ * @file config.cpp
+ * @brief Binary configuration store: credentials, backend endpoints, fleet and pipeline
+ *        settings in one versioned, CRC32 checked record (`/config.bin` on LittleFS).
+ *
+ * Replaces the byte-by-byte reads of `/blynkAuth.txt`, `/aes.txt`, `/iv.txt` and
+ * `/ssid_pass_aes.txt` with their `strtok`/`sscanf` parsing, and the server URLs, API key,
+ * intervals and queue depths hardcoded in main.cpp, freeRtos.cpp, poller.cpp and
+ * scheduler.cpp.
+ *
+ * @details
+ * - **Load**: `configLoad()` at the top of `setup()` opens the file and reads the whole record
+ *   with a single `read()` straight into `config_t`, then checks magic, version, size and
+ *   CRC32. There is no parsing. The time from open to publish is logged, exported as the
+ *   `config_load_us` gauge and shown by the "config" terminal command.
+ * - **Migration**: when the record is missing or invalid, the compiled defaults plus the
+ *   legacy text files (login.cpp) are used and written back as `/config.bin`, so this
+ *   happens once. Keep the legacy files until the new record has been written.
+ * - **Versioning**: fields are only appended. An older record (lower version, smaller size)
+ *   is loaded over the defaults and the fields it lacks keep their default values.
+ * - **Access**: `cfg()` returns the active record. Two slots are used: a reload fills the
+ *   inactive slot and publishes it with one atomic pointer store, readers never see a half
+ *   loaded record. Do not keep the pointer across a blocking call, re-read `cfg()` instead.
+ *   Some tasks still hold it for one step (an HTTP call, an MQTT connect), so a retired slot
+ *   is only refilled `CONFIG_GRACE_MS` after it was retired, longer than any watchdog step.
+ *   A reload before that is refused, `configSet()` has already written the file then.
+ * - **Reload**: `configReload()` ("config reload") or `configSet()` ("config set key value",
+ *   writes the file first) take effect without a reboot for endpoints, intervals, delays,
+ *   deadbands and alarm rules. The poller re-applies the poll intervals and recompiles the
+ *   alarm rules. Credentials, the NTP server, the
+ *   queue depths, the reading sink and the discovery, push and metrics sockets are read once at boot,
+ *   a change is reported as needing a reboot.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <CRC32.h>
+#include <stddef.h>
+#include <atomic>
+#include <algorithm>
+#include "config.h"
+#include "metrics.h"
+
+#define CONFIG_MAGIC 0x45434647 // "ECFG"
+#define CONFIG_TMP_FILE "/config.tmp"
+#define CONFIG_HEADER_LEN offsetof(config_t, blynkAuth)
+#define CONFIG_MIN_MS 1000
+#define CONFIG_GRACE_MS (30 * 1000) // > the longest heartbeat step (20 s)
+
+typedef enum
+{
+    CFG_STR,
+    CFG_U8,
+    CFG_U16,
+    CFG_U32,
+    CFG_FLOAT,
+} cfgType_t;
+
+typedef struct
+{
+    const char *name; // terminal key
+    cfgType_t type;
+    uint16_t offset;
+    uint16_t len;
+    bool reboot; // read once at boot
+} cfgField_t;
+
+#define CFG_FIELD(name, type, member, reboot) {name, type, offsetof(config_t, member), sizeof(((config_t *)0)->member), reboot}
+
+// settable / printable fields, the credentials are neither
+static const cfgField_t cfgFields[] = {
+    CFG_FIELD("url.list", CFG_STR, urlList, false),
+    CFG_FIELD("url.rows", CFG_STR, urlRows, false),
+    CFG_FIELD("url.deleteall", CFG_STR, urlDeleteAll, false),
+    CFG_FIELD("url.deleteip", CFG_STR, urlDeleteIp, false),
+    CFG_FIELD("url.data", CFG_STR, urlData, false),
+    CFG_FIELD("url.post", CFG_STR, urlPost, false),
+    CFG_FIELD("url.delete", CFG_STR, urlDelete, false),
+    CFG_FIELD("url.deletemac", CFG_STR, urlDeleteMac, false),
+    CFG_FIELD("apikey", CFG_STR, apiKey, false),
+    CFG_FIELD("location", CFG_STR, location, false),
+    CFG_FIELD("ntp", CFG_STR, ntpServer, true),
+    CFG_FIELD("port", CFG_U16, sensorPort, false),
+    CFG_FIELD("registry_ms", CFG_U32, registryMs, false),
+    CFG_FIELD("refresh_ms", CFG_U32, refreshMs, false),
+    CFG_FIELD("poll_ms", CFG_U32, defaultPollMs, false),
+    CFG_FIELD("queue.socket", CFG_U8, socketQueue, true),
+    CFG_FIELD("queue.http", CFG_U8, httpQueue, true),
+    CFG_FIELD("delay.socket", CFG_U32, socketDelayMs, false),
+    CFG_FIELD("delay.http", CFG_U32, httpDelayMs, false),
+    CFG_FIELD("deadband.temp", CFG_FLOAT, deadbandTemp, false),
+    CFG_FIELD("deadband.humidity", CFG_FLOAT, deadbandHumidity, false),
+    CFG_FIELD("deadband.volt", CFG_FLOAT, deadbandVolt, false),
+    CFG_FIELD("sink", CFG_U8, sink, true),
+    CFG_FIELD("mqtt.host", CFG_STR, mqttHost, false),
+    CFG_FIELD("mqtt.port", CFG_U16, mqttPort, false),
+    CFG_FIELD("mqtt.topic", CFG_STR, mqttTopic, false),
+    CFG_FIELD("mqtt.window", CFG_U8, mqttWindow, false),
+    CFG_FIELD("mqtt.keepalive", CFG_U16, mqttKeepAliveS, false),
+    CFG_FIELD("discovery", CFG_U8, discovery, true),
+    CFG_FIELD("discovery.group", CFG_STR, discoveryGroup, true),
+    CFG_FIELD("discovery.port", CFG_U16, discoveryPort, true),
+    CFG_FIELD("seed_ms", CFG_U32, seedMs, false),
+    CFG_FIELD("push", CFG_U8, push, true),
+    CFG_FIELD("push.port", CFG_U16, pushPort, true),
+    CFG_FIELD("liveness_ms", CFG_U32, livenessMs, false),
+    CFG_FIELD("url.batch", CFG_STR, urlBatch, false),
+    CFG_FIELD("batch.rows", CFG_U8, batchRows, false),
+    CFG_FIELD("batch.zlib", CFG_U8, batchZlib, false),
+    CFG_FIELD("batch.linger_ms", CFG_U32, batchLingerMs, false),
+    CFG_FIELD("alarm.rules", CFG_STR, alarmRules, false),
+    CFG_FIELD("metrics", CFG_U8, metricsHttp, true),
+    CFG_FIELD("metrics.port", CFG_U16, metricsPort, true),
+};
+#define CFG_FIELDS (sizeof(cfgFields) / sizeof(cfgFields[0]))
+
+static config_t slots[2];
+static config_t staging; // configSet() edit buffer
+static std::atomic<const config_t *> active(&slots[0]);
+static uint32_t loadUs;
+static metric_t *mLoadUs;
+static uint32_t retiredMs; // millis() the inactive slot stopped being active
+static bool retired = false;
+
+// Function Prototypes
+bool configImportLegacy(config_t &c);
+bool requestReconfigure();
+
+/**
+ * @brief Compiled defaults, the values that used to be hardcoded.
+ */
+static void configDefaults(config_t &c)
+{
+    static const cfgInterval_t devices[] = {
+        {"ADC", 5 * 1000},
+    };
+    static const cfgInterval_t sensors[] = {
+        {"ADS1115", 5 * 1000},
+        {"BME280", 60 * 1000},
+        {"BMP390", 60 * 1000},
+        {"BMP280", 60 * 1000},
+        {"SHT35", 60 * 1000},
+        {"DS1", 60 * 1000},
+    };
+    memset(&c, 0, sizeof(c));
+    strcpy(c.urlList, "http://192.168.1.252/ip.php");
+    strcpy(c.urlRows, "http://192.168.1.252/rows.php");
+    strcpy(c.urlDeleteAll, "http://192.168.1.252/deleteALL.php");
+    strcpy(c.urlDeleteIp, "http://192.168.1.252/deleteIP.php");
+    strcpy(c.urlData, "http://192.168.1.252/esp-data.php");
+    strcpy(c.urlPost, "http://192.168.1.252/post-esp-data.php");
+    strcpy(c.urlDelete, "http://192.168.1.252/delete.php?key=");
+    strcpy(c.urlDeleteMac, "http://192.168.1.252/deleteMAC.php?key=");
+    strcpy(c.apiKey, "tPmAT5Ab3j7F9");
+    strcpy(c.location, "HOME");
+    strcpy(c.ntpServer, "pool.ntp.org");
+    c.sensorPort = 8888;
+    c.registryMs = 20 * 1000;
+    c.refreshMs = 20 * 1000;
+    c.defaultPollMs = 20 * 1000;
+    c.deviceIntervals = sizeof(devices) / sizeof(devices[0]);
+    memcpy(c.deviceInterval, devices, sizeof(devices));
+    c.sensorIntervals = sizeof(sensors) / sizeof(sensors[0]);
+    memcpy(c.sensorInterval, sensors, sizeof(sensors));
+    c.socketQueue = 2;
+    c.httpQueue = 5;
+    c.socketDelayMs = 50;
+    c.httpDelayMs = 2000;
+    c.sink = SINK_HTTP;
+    strcpy(c.mqttHost, "192.168.1.252");
+    c.mqttPort = 1883;
+    strcpy(c.mqttTopic, "esp32/HOME");
+    c.mqttWindow = 8;
+    c.mqttKeepAliveS = 30;
+    c.discovery = 1;
+    strcpy(c.discoveryGroup, "239.255.0.88");
+    c.discoveryPort = 8889;
+    c.seedMs = 5 * 60 * 1000;
+    c.pushPort = 8890;
+    c.livenessMs = 5 * 60 * 1000;
+    strcpy(c.urlBatch, "http://192.168.1.252/post-esp-batch.php");
+    c.batchRows = 1;
+    c.batchZlib = 1;
+    c.batchLingerMs = 500;
+    strcpy(c.alarmRules, "ADS1115.volt*ratio<11.5/12;BME280.temp>30/28");
+    c.metricsHttp = 1;
+    c.metricsPort = 9100;
+}
+
+static uint32_t configCrc(const config_t &c, size_t size)
+{
+    return CRC32::calculate((const uint8_t *)&c + CONFIG_HEADER_LEN, size - CONFIG_HEADER_LEN);
+}
+
+/**
+ * @brief Terminates every string and clamps the numbers, a bad value must not take the
+ *        pipeline down.
+ */
+static void configSanitize(config_t &c)
+{
+    for (size_t i = 0; i < CFG_FIELDS; i++)
+        if (cfgFields[i].type == CFG_STR)
+            ((char *)&c)[cfgFields[i].offset + cfgFields[i].len - 1] = 0;
+    c.blynkAuth[sizeof(c.blynkAuth) - 1] = c.wifiCipher[sizeof(c.wifiCipher) - 1] = 0;
+    c.deviceIntervals = std::min(c.deviceIntervals, (uint8_t)CONFIG_MAX_INTERVALS);
+    c.sensorIntervals = std::min(c.sensorIntervals, (uint8_t)CONFIG_MAX_INTERVALS);
+    for (int i = 0; i < CONFIG_MAX_INTERVALS; i++)
+    {
+        c.deviceInterval[i].key[sizeof(c.deviceInterval[i].key) - 1] = 0;
+        c.sensorInterval[i].key[sizeof(c.sensorInterval[i].key) - 1] = 0;
+        c.deviceInterval[i].intervalMs = std::max(c.deviceInterval[i].intervalMs, (uint32_t)CONFIG_MIN_MS);
+        c.sensorInterval[i].intervalMs = std::max(c.sensorInterval[i].intervalMs, (uint32_t)CONFIG_MIN_MS);
+    }
+    c.registryMs = std::max(c.registryMs, (uint32_t)CONFIG_MIN_MS);
+    c.refreshMs = std::max(c.refreshMs, (uint32_t)CONFIG_MIN_MS);
+    c.defaultPollMs = std::max(c.defaultPollMs, (uint32_t)CONFIG_MIN_MS);
+    c.socketQueue = std::min(std::max(c.socketQueue, (uint8_t)1), (uint8_t)CONFIG_MAX_QUEUE);
+    c.httpQueue = std::min(std::max(c.httpQueue, (uint8_t)1), (uint8_t)CONFIG_MAX_QUEUE);
+    c.sink = std::min(c.sink, (uint8_t)SINK_BOTH);
+    c.mqttWindow = std::min(std::max(c.mqttWindow, (uint8_t)1), (uint8_t)CONFIG_MAX_WINDOW);
+    c.mqttKeepAliveS = std::max(c.mqttKeepAliveS, (uint16_t)5);
+    c.seedMs = std::max(c.seedMs, (uint32_t)CONFIG_MIN_MS);
+    c.livenessMs = std::max(c.livenessMs, (uint32_t)CONFIG_MIN_MS);
+    c.batchRows = std::max(c.batchRows, (uint8_t)1);
+    c.batchLingerMs = std::min(c.batchLingerMs, (uint32_t)CONFIG_MIN_MS * 5);
+}
+
+/**
+ * @brief Reads `/config.bin` over the defaults already in `c`, one `read()` call.
+ *
+ * @return false if the file is missing, truncated, from a newer firmware or fails the CRC.
+ */
+static bool configRead(config_t &c)
+{
+    File file = LittleFS.open(CONFIG_FILE, "r");
+    if (!file)
+        return false;
+    config_t defaults = c;
+    size_t n = file.read((uint8_t *)&c, sizeof(c));
+    file.close();
+
+    bool ok = n > CONFIG_HEADER_LEN && c.magic == CONFIG_MAGIC && c.version <= CONFIG_VERSION &&
+              c.size == n && c.crc == configCrc(c, c.size);
+    if (!ok)
+    {
+        Serial.printf("config: %s invalid (%u bytes, version %u)\n", CONFIG_FILE, (unsigned)n, n > CONFIG_HEADER_LEN ? c.version : 0);
+        c = defaults;
+        return false;
+    }
+    if (n < sizeof(c)) // older layout, the appended fields keep their defaults
+        memcpy((uint8_t *)&c + n, (const uint8_t *)&defaults + n, sizeof(c) - n);
+    configSanitize(c);
+    return true;
+}
+
+/**
+ * @brief Stamps and writes a record, through a temporary file so a reset half way leaves
+ *        the old record in place.
+ */
+static bool configWrite(config_t &c)
+{
+    c.magic = CONFIG_MAGIC;
+    c.version = CONFIG_VERSION;
+    c.size = sizeof(config_t);
+    c.crc = configCrc(c, sizeof(config_t));
+    File file = LittleFS.open(CONFIG_TMP_FILE, "w");
+    if (!file)
+        return false;
+    size_t n = file.write((const uint8_t *)&c, sizeof(c));
+    file.close();
+    if (n != sizeof(c))
+        return false;
+    LittleFS.remove(CONFIG_FILE);
+    return LittleFS.rename(CONFIG_TMP_FILE, CONFIG_FILE);
+}
+
+static void noteLoad(uint32_t us)
+{
+    loadUs = us;
+    if (mLoadUs == NULL)
+        mLoadUs = metricRegister("config_load_us", "Read, check and publish of the config record", METRIC_GAUGE);
+    metricSet(mLoadUs, us);
+}
+
+/**
+ * @brief Mounts LittleFS and loads the config record, migrating the legacy text files the
+ *        first time.
+ *
+ * Must run at the top of `setup()`, everything else reads its settings through `cfg()`.
+ *
+ * @return true if `/config.bin` was loaded, false if it had to be rebuilt.
+ */
+bool configLoad()
+{
+    if (!LittleFS.begin())
+    {
+        Serial.println("Error mounting the file system");
+        ESP.restart();
+    }
+    uint32_t start = micros();
+    config_t &c = slots[0];
+    configDefaults(c);
+    bool ok = configRead(c);
+    active.store(&c);
+    uint32_t us = (uint32_t)micros() - start;
+    if (!ok)
+    {
+        Serial.println("config: rebuilding from defaults and the legacy files");
+        if (!configImportLegacy(c))
+            Serial.println("config: legacy credentials missing");
+        configSanitize(c);
+        if (!configWrite(c))
+            Serial.printf("config: cannot write %s\n", CONFIG_FILE);
+    }
+    noteLoad(us);
+    Serial.printf("config: v%u %u bytes loaded in %u us\n", c.version, (unsigned)sizeof(config_t), us);
+    return ok;
+}
+
+/**
+ * @brief The active configuration, never NULL.
+ */
+const config_t *cfg()
+{
+    return active.load();
+}
+
+uint32_t configLoadUs()
+{
+    return loadUs;
+}
+
+/**
+ * @brief Reloads `/config.bin` without a reboot.
+ *
+ * The record is read into the inactive slot and only published if it is valid, a bad file
+ * leaves the running configuration untouched. The poller is asked to re-apply the poll
+ * intervals. Refused within `CONFIG_GRACE_MS` of the last reload, a task may still read
+ * the inactive slot.
+ *
+ * @param report Filled with the outcome, one terminal line.
+ * @return true if the new record is active.
+ */
+bool configReload(char *report, size_t len)
+{
+    const config_t *old = active.load();
+    config_t &c = old == &slots[0] ? slots[1] : slots[0];
+    uint32_t since = millis() - retiredMs;
+    if (retired && since < CONFIG_GRACE_MS)
+    {
+        snprintf(report, len, "config: previous config may still be in use, reload again in %u s\n",
+                 (unsigned)(CONFIG_GRACE_MS - since + 999) / 1000);
+        return false;
+    }
+    uint32_t start = micros();
+    configDefaults(c);
+    if (!configRead(c))
+    {
+        snprintf(report, len, "config: %s invalid, keeping the running config\n", CONFIG_FILE);
+        return false;
+    }
+    active.store(&c);
+    retiredMs = millis();
+    retired = true;
+    uint32_t us = (uint32_t)micros() - start;
+    noteLoad(us);
+
+    bool reboot = memcmp(c.blynkAuth, old->blynkAuth, sizeof(c.blynkAuth)) ||
+                  memcmp(c.wifiCipher, old->wifiCipher, sizeof(c.wifiCipher));
+    for (size_t i = 0; i < CFG_FIELDS; i++)
+        if (cfgFields[i].reboot)
+            reboot |= memcmp((const uint8_t *)&c + cfgFields[i].offset, (const uint8_t *)old + cfgFields[i].offset, cfgFields[i].len) != 0;
+    requestReconfigure();
+    snprintf(report, len, "config: v%u reloaded in %u us%s\n", c.version, us, reboot ? ", reboot to apply credentials/ntp/queues/sink/discovery/push/metrics" : "");
+    return true;
+}
+
+/**
+ * @brief Adds, changes or (ms = 0) removes an entry of a poll interval table.
+ */
+static bool setInterval(cfgInterval_t *table, uint8_t &count, const char *key, uint32_t ms)
+{
+    int i = 0;
+    while (i < count && strcasecmp(table[i].key, key))
+        i++;
+    if (ms == 0)
+    {
+        if (i == count)
+            return false;
+        memmove(&table[i], &table[i + 1], (count - i - 1) * sizeof(table[0]));
+        count--;
+        return true;
+    }
+    if (i == CONFIG_MAX_INTERVALS || strlen(key) >= sizeof(table[0].key))
+        return false;
+    if (i == count)
+    {
+        memset(&table[i], 0, sizeof(table[i]));
+        strcpy(table[i].key, key);
+        count++;
+    }
+    table[i].intervalMs = ms;
+    return true;
+}
+
+/**
+ * @brief Changes one setting, writes the record and reloads it.
+ *
+ * @param key A field name (see `configLine()`), "poll.<sensor type>" or "devpoll.<device
+ *            prefix>". A poll interval of 0 removes the entry.
+ * @param value New value as text.
+ * @param report Filled with the outcome, one terminal line.
+ */
+bool configSet(const char *key, const char *value, char *report, size_t len)
+{
+    staging = *cfg();
+    bool ok = false;
+    if (!strncasecmp(key, "poll.", 5))
+        ok = setInterval(staging.sensorInterval, staging.sensorIntervals, key + 5, strtoul(value, NULL, 10));
+    else if (!strncasecmp(key, "devpoll.", 8))
+        ok = setInterval(staging.deviceInterval, staging.deviceIntervals, key + 8, strtoul(value, NULL, 10));
+    else
+    {
+        for (size_t i = 0; i < CFG_FIELDS && !ok; i++)
+        {
+            const cfgField_t &f = cfgFields[i];
+            if (strcasecmp(key, f.name))
+                continue;
+            uint8_t *p = (uint8_t *)&staging + f.offset;
+            switch (f.type)
+            {
+            case CFG_STR:
+                ok = strlen(value) < f.len;
+                if (ok)
+                    strcpy((char *)p, value);
+                break;
+            case CFG_U8:
+                *(uint8_t *)p = (uint8_t)strtoul(value, NULL, 10);
+                ok = true;
+                break;
+            case CFG_U16:
+                *(uint16_t *)p = (uint16_t)strtoul(value, NULL, 10);
+                ok = true;
+                break;
+            case CFG_U32:
+                *(uint32_t *)p = strtoul(value, NULL, 10);
+                ok = true;
+                break;
+            case CFG_FLOAT:
+                *(float *)p = atof(value);
+                ok = true;
+                break;
+            }
+        }
+    }
+    if (!ok)
+    {
+        snprintf(report, len, "config: cannot set %s\n", key);
+        return false;
+    }
+    configSanitize(staging);
+    if (!configWrite(staging))
+    {
+        snprintf(report, len, "config: cannot write %s\n", CONFIG_FILE);
+        return false;
+    }
+    return configReload(report, len);
+}
+
+/**
+ * @brief Formats one line of the configuration listing ("config" terminal command).
+ *
+ * @param index Line number, from 0.
+ * @return false past the last line.
+ */
+bool configLine(int index, char *line, size_t len)
+{
+    const config_t *c = cfg();
+    if (index == 0)
+    {
+        snprintf(line, len, "config v%u %u bytes, load %u us\n", c->version, (unsigned)sizeof(config_t), loadUs);
+        return true;
+    }
+    index--;
+    if (index < (int)CFG_FIELDS)
+    {
+        const cfgField_t &f = cfgFields[index];
+        const uint8_t *p = (const uint8_t *)c + f.offset;
+        switch (f.type)
+        {
+        case CFG_STR:
+            snprintf(line, len, "\t%s %s\n", f.name, f.offset == offsetof(config_t, apiKey) ? "****" : (const char *)p);
+            break;
+        case CFG_U8:
+            snprintf(line, len, "\t%s %u\n", f.name, *(const uint8_t *)p);
+            break;
+        case CFG_U16:
+            snprintf(line, len, "\t%s %u\n", f.name, *(const uint16_t *)p);
+            break;
+        case CFG_U32:
+            snprintf(line, len, "\t%s %u\n", f.name, *(const uint32_t *)p);
+            break;
+        case CFG_FLOAT:
+            snprintf(line, len, "\t%s %.3f\n", f.name, *(const float *)p);
+            break;
+        }
+        return true;
+    }
+    index -= CFG_FIELDS;
+    if (index < c->deviceIntervals)
+    {
+        snprintf(line, len, "\tdevpoll.%s %u\n", c->deviceInterval[index].key, c->deviceInterval[index].intervalMs);
+        return true;
+    }
+    index -= c->deviceIntervals;
+    if (index < c->sensorIntervals)
+    {
+        snprintf(line, len, "\tpoll.%s %u\n", c->sensorInterval[index].key, c->sensorInterval[index].intervalMs);
+        return true;
+    }
+    return false;
+}
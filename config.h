@@ -0,0 +1,114 @@
+/**
+ * @file config.h
+ * @brief Versioned, CRC32 checked binary configuration record, read from LittleFS with one
+ *        `read()` into a typed struct.
+ *
+ * New fields are only ever appended: a record written by an older firmware (smaller
+ * `size`, lower `version`) loads with defaults for the fields it does not have.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define CONFIG_FILE "/config.bin"
+#define CONFIG_VERSION 7
+#define CONFIG_URL_LEN 64
+#define CONFIG_MAX_INTERVALS 8
+#define CONFIG_MAX_WINDOW 16 // MQTT in-flight publishes
+#define CONFIG_MAX_QUEUE 16  // queue.socket / queue.http, the warm snapshot holds as many
+#define CONFIG_RULES_LEN 160
+
+// reading sinks
+#define SINK_HTTP 0 // form POST to post-esp-data.php
+#define SINK_MQTT 1
+#define SINK_BOTH 2
+
+typedef struct
+{
+    char key[12]; // device name prefix or sensor type
+    uint32_t intervalMs;
+} cfgInterval_t;
+
+typedef struct
+{
+    // header, the CRC covers everything after it up to `size`
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+    uint32_t crc;
+
+    // credentials, applied at boot only
+    char blynkAuth[40];
+    uint8_t aesKey[16];
+    uint8_t aesIv[16];
+    char wifiCipher[128]; // base64 AES of "ssid:pass"
+
+    // backend endpoints
+    char urlList[CONFIG_URL_LEN];      // ip.php, device registry
+    char urlRows[CONFIG_URL_LEN];      // rows.php
+    char urlDeleteAll[CONFIG_URL_LEN]; // deleteALL.php
+    char urlDeleteIp[CONFIG_URL_LEN];  // deleteIP.php
+    char urlData[CONFIG_URL_LEN];      // esp-data.php
+    char urlPost[CONFIG_URL_LEN];      // post-esp-data.php
+    char urlDelete[CONFIG_URL_LEN];    // delete.php?key=, the key is appended
+    char urlDeleteMac[CONFIG_URL_LEN]; // deleteMAC.php?key=
+    char apiKey[24];
+    char location[16];
+    char ntpServer[32];
+
+    // fleet
+    uint16_t sensorPort;
+    uint32_t registryMs; // ip.php refresh
+    uint32_t refreshMs;  // counter widgets
+    uint32_t defaultPollMs;
+    uint8_t deviceIntervals, sensorIntervals;
+    cfgInterval_t deviceInterval[CONFIG_MAX_INTERVALS]; // device name prefix -> poll interval
+    cfgInterval_t sensorInterval[CONFIG_MAX_INTERVALS]; // reported sensor type -> poll interval
+
+    // pipeline
+    uint8_t socketQueue, httpQueue; // queue depths, applied at boot only
+    uint32_t socketDelayMs, httpDelayMs;
+
+    // widget deadbands, a value closer than this to the last one written is not sent, 0 = off
+    float deadbandTemp;
+    float deadbandHumidity;
+    float deadbandVolt;
+
+    // version 2: MQTT sink
+    uint8_t sink; // SINK_HTTP, SINK_MQTT or SINK_BOTH, applied at boot
+    char mqttHost[40];
+    uint16_t mqttPort;
+    char mqttTopic[32]; // topic prefix, readings go to <prefix>/<sensor>
+    uint8_t mqttWindow; // unacknowledged QoS 1 publishes
+    uint16_t mqttKeepAliveS;
+
+    // version 3: multicast discovery
+    uint8_t discovery;       // 0 = ip.php only, applied at boot
+    char discoveryGroup[16]; // multicast group, applied at boot
+    uint16_t discoveryPort;  // applied at boot
+    uint32_t seedMs;         // ip.php refresh while announced devices are alive
+
+    // version 4: push ingestion
+    uint8_t push;        // 0 = poll only, applied at boot
+    uint16_t pushPort;   // applied at boot
+    uint32_t livenessMs; // a device that pushed within this is not polled
+
+    // version 5: batched uploads
+    char urlBatch[CONFIG_URL_LEN]; // post-esp-batch.php, one form row per line
+    uint8_t batchRows;             // rows per POST, 1 = one POST per row to urlPost
+    uint8_t batchZlib;             // deflate the batch body
+    uint32_t batchLingerMs;        // wait for more rows after the first
+
+    // version 6: alarm rules, "<sensor>.<qty>[*<qty>]<op><trigger>[/<clear>];..." (alarm.cpp)
+    char alarmRules[CONFIG_RULES_LEN];
+
+    // version 7: local Prometheus endpoint (metricsHttp.cpp)
+    uint8_t metricsHttp;  // 0 = off, applied at boot
+    uint16_t metricsPort; // applied at boot
+} config_t;
+
+bool configLoad();
+const config_t *cfg();
+bool configReload(char *report, size_t len);
+bool configSet(const char *key, const char *value, char *report, size_t len);
+bool configLine(int index, char *line, size_t len);
+uint32_t configLoadUs();
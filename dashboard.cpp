@@ -0,0 +1,220 @@
+/**
+ * @file dashboard.cpp
+ * @brief Live dashboard on the SSD1306 OLED: last reading per sensor and device health,
+ *        only the changed part of the screen goes over I2C.
+ *
+ * `flashSSD()` drew a static screen once at boot. A full 128x64 redraw is 1 KB over I2C,
+ * about 25 ms at 400 kHz, plus `display()` slowing the bus back to 100 kHz, too much for
+ * the Blynk loop on every reading.
+ *
+ * @details
+ * - **Task**: `taskDash` (core 0, priority 1) redraws every `DASH_PERIOD_MS`, the loop never
+ *   touches the display. The boot screen stays up for `DASH_SPLASH_MS`.
+ * - **Layout**: 8 text lines of 21 characters, one per SSD1306 page: IP address, the last
+ *   reading of up to `DASH_SENSORS` sensors ('?' once older than `DASH_STALE_MS`), socket
+ *   pass/fail/recovered counts, uptime (minutes) and RSSI. Nothing on the screen changes
+ *   faster than its value.
+ * - **Rendering**: text is drawn with Adafruit_GFX into the `display` framebuffer,
+ *   `display.display()` is never called. `oledDiff()` (oledFrame.cpp) compares the frame
+ *   with a shadow of the panel and returns the changed columns of each page.
+ * - **Flush**: per dirty page the column and page address are set and only the span is
+ *   written, in I2C transfers of `DASH_I2C_CHUNK` bytes at `DASH_I2C_HZ`. A failed transfer
+ *   ends the update, the span stays dirty.
+ * - **Input**: `dashNote()` from `upDateWidget()` (main.cpp) keeps the last values per
+ *   sensor, called by the poller, the worker pool and the recovery task.
+ * - **Metrics**: `oled_bytes_total` bytes written to the panel (addressing included),
+ *   `oled_updates_total` updates that sent anything, `oled_update_bytes` the last one.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <atomic>
+#include <algorithm>
+#include <WiFi.h>
+#include <Wire.h>
+#include <Adafruit_SSD1306.h>
+#include "dashboard.h"
+#include "oledFrame.h"
+#include "metrics.h"
+
+#define DASH_CORE 0
+#define DASH_PRIORITY 1
+#define DASH_STACK_SIZE 3072
+#define DASH_PERIOD_MS 1000
+#define DASH_SPLASH_MS 3000
+#define DASH_STALE_MS (60 * 1000)
+#define DASH_LINE_LEN 22 // 21 characters of 6 pixels
+#define DASH_I2C_HZ 400000
+#define DASH_I2C_CHUNK 32 // ESP32 Wire buffer is 128, stay small to keep other I2C users going
+#define WORDS_PER_BYTE 4
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
+#define SSD1306_CTRL_CMD 0x00
+#define SSD1306_CTRL_DATA 0x40
+
+typedef struct
+{
+    char name[10];
+    uint8_t values;
+    float value[2];
+    uint32_t ms; // millis() of the reading, 0: slot free
+} dashSensor_t;
+
+extern Adafruit_SSD1306 display;
+extern std::atomic<int> failSocket, passSocket, recoveredSocket;
+
+static dashSensor_t sensors[DASH_SENSORS];
+static portMUX_TYPE dashMux = portMUX_INITIALIZER_UNLOCKED;
+static oledShadow_t shadow;
+static uint8_t oledAddr;
+static TaskHandle_t dash_task_handle;
+static metric_t *mBytes, *mUpdates, *mLast;
+
+// Function Prototypes
+void taskDash(void *pvParameters);
+
+/**
+ * @brief Keeps the first two values of `reading` for its sensor line.
+ */
+void dashNote(const sensorReading_t &reading)
+{
+    if (reading.sensor == NULL)
+        return;
+    portENTER_CRITICAL(&dashMux);
+    int slot = -1, oldest = 0;
+    for (int i = 0; i < DASH_SENSORS && slot < 0; i++)
+    {
+        if (!strncmp(sensors[i].name, reading.sensor, sizeof(sensors[i].name) - 1))
+            slot = i;
+        else if (sensors[i].ms < sensors[oldest].ms)
+            oldest = i;
+    }
+    if (slot < 0)
+        slot = oldest;
+    dashSensor_t &s = sensors[slot];
+    strncpy(s.name, reading.sensor, sizeof(s.name) - 1);
+    s.values = std::min((int)reading.channels, 2);
+    for (int i = 0; i < s.values; i++)
+        s.value[i] = reading.channel[i].value;
+    s.ms = millis() | 1;
+    portEXIT_CRITICAL(&dashMux);
+}
+
+/**
+ * @brief Draws the dashboard into the `display` framebuffer.
+ */
+static void render()
+{
+    char line[DASH_LINE_LEN];
+    dashSensor_t copy[DASH_SENSORS];
+    portENTER_CRITICAL(&dashMux);
+    memcpy(copy, sensors, sizeof(copy));
+    portEXIT_CRITICAL(&dashMux);
+
+    uint32_t now = millis();
+    display.clearDisplay();
+    display.setTextSize(1);
+    display.setTextColor(WHITE);
+    display.setCursor(0, 0);
+    snprintf(line, sizeof(line), "IP %s", WiFi.localIP().toString().c_str());
+    display.println(line);
+    for (const dashSensor_t &s : copy)
+    {
+        if (s.ms == 0)
+            line[0] = 0;
+        else if (s.values == 2)
+            snprintf(line, sizeof(line), "%-7.7s%6.1f%6.1f%c", s.name, s.value[0], s.value[1], now - s.ms > DASH_STALE_MS ? '?' : ' ');
+        else
+            snprintf(line, sizeof(line), "%-7.7s%6.1f%c", s.name, s.values ? s.value[0] : 0.0f, now - s.ms > DASH_STALE_MS ? '?' : ' ');
+        display.println(line);
+    }
+    snprintf(line, sizeof(line), "ok%d f%d r%d", passSocket.load(), failSocket.load(), recoveredSocket.load());
+    display.println(line);
+    uint32_t min = now / 60000;
+    snprintf(line, sizeof(line), "up %ud%02u:%02u %ddBm", min / 1440, min / 60 % 24, min % 60,
+             WiFi.status() == WL_CONNECTED ? (int)WiFi.RSSI() : 0);
+    display.println(line);
+}
+
+/**
+ * @brief Sends the span of one page, `SSD1306_CTRL_DATA` transfers of up to
+ *        `DASH_I2C_CHUNK` bytes.
+ * @return Bytes written, 0 if a transfer failed.
+ */
+static size_t flushSpan(const uint8_t *frame, const oledSpan_t &span)
+{
+    const uint8_t addressing[] = {SSD1306_CTRL_CMD, SSD1306_COLUMNADDR, span.x0, span.x1, SSD1306_PAGEADDR, span.page, span.page};
+    Wire.beginTransmission(oledAddr);
+    Wire.write(addressing, sizeof(addressing));
+    if (Wire.endTransmission() != 0)
+        return 0;
+    size_t bytes = sizeof(addressing);
+    const uint8_t *p = frame + span.page * OLED_COLS + span.x0;
+    int left = span.x1 - span.x0 + 1;
+    while (left > 0)
+    {
+        int n = std::min(left, DASH_I2C_CHUNK - 1);
+        Wire.beginTransmission(oledAddr);
+        Wire.write(SSD1306_CTRL_DATA);
+        Wire.write(p, n);
+        if (Wire.endTransmission() != 0)
+            return 0;
+        bytes += n + 1;
+        p += n;
+        left -= n;
+    }
+    return bytes;
+}
+
+/**
+ * @brief Dashboard task: renders, diffs against the panel and sends the dirty spans.
+ *
+ * No heartbeat: at priority 1 it may be starved for a while under load, the screen then
+ * lags, the device is not stalled.
+ *
+ * @param pvParameters Unused.
+ */
+void taskDash(void *pvParameters)
+{
+    oledSpan_t spans[OLED_PAGES];
+    Serial.printf("Task Dash running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    vTaskDelay(pdMS_TO_TICKS(DASH_SPLASH_MS));
+    Wire.setClock(DASH_I2C_HZ);
+    for (;;)
+    {
+        render();
+        const uint8_t *frame = display.getBuffer();
+        int n = oledDiff(&shadow, frame, spans);
+        size_t bytes = 0;
+        for (int i = 0; i < n; i++)
+        {
+            size_t sent = flushSpan(frame, spans[i]);
+            if (sent == 0)
+                break; // stays dirty, next update
+            oledCommit(&shadow, frame, &spans[i]);
+            bytes += sent;
+        }
+        if (bytes)
+        {
+            metricInc(mBytes, bytes);
+            metricInc(mUpdates);
+            metricSet(mLast, bytes);
+        }
+        vTaskDelay(pdMS_TO_TICKS(DASH_PERIOD_MS));
+    }
+}
+
+/**
+ * @brief Starts the dashboard on the panel at `i2cAddr`, called once the OLED was found.
+ */
+bool dashStart(uint8_t i2cAddr)
+{
+    oledAddr = i2cAddr;
+    oledInvalidate(&shadow); // the boot screen is on the panel
+    mBytes = metricRegister("oled_bytes_total", "Bytes written to the OLED", METRIC_COUNTER);
+    mUpdates = metricRegister("oled_updates_total", "OLED updates that changed the screen", METRIC_COUNTER);
+    mLast = metricRegister("oled_update_bytes", "Bytes written by the last OLED update", METRIC_GAUGE);
+    xTaskCreatePinnedToCore(taskDash, "Task Dash", DASH_STACK_SIZE, NULL, DASH_PRIORITY, &dash_task_handle, DASH_CORE);
+    return dash_task_handle != NULL;
+}
@@ -0,0 +1,13 @@
+/**
+ * @file dashboard.h
+ * @brief Live sensor and health dashboard on the SSD1306 OLED, redrawn incrementally by a
+ *        low priority task.
+ */
+#pragma once
+#include <Arduino.h>
+#include "reading.h"
+
+#define DASH_SENSORS 5 // text lines 1..5
+
+bool dashStart(uint8_t i2cAddr);
+void dashNote(const sensorReading_t &reading);
@@ -0,0 +1,221 @@
+/**
+ * @file deflate.cpp
+ * @brief Deflate encoder for the upload batches: LZ77 over the batch plus the fixed Huffman
+ *        code, zlib wrapped (RFC 1950/1951), so any inflate decodes it.
+ *
+ * The form rows posted to post-esp-data.php repeat "api_key=...&sensor=...&location=HOME&
+ * value1=" in every row, only the numbers change. Within a batch every row after the first
+ * is mostly one or two back references.
+ *
+ * @details
+ * - **Footprint**: the only state is a 2 KB table of the last position of each 3 byte hash
+ *   (`deflateState_t`, owned by the caller) and the output buffer. There is no window copy,
+ *   the batch buffer is the window, and no dynamic Huffman tables, the fixed code costs a
+ *   few percent on text this repetitive. miniz/zlib need tens to hundreds of KB for the same.
+ * - **Matching**: greedy, one candidate per hash (the most recent one), which is exactly
+ *   the previous row for the repeated field names.
+ * - **Output**: zlib header 0x78 0x01, one final fixed Huffman block, Adler-32. The server
+ *   side is `gzuncompress()` in PHP or `zlib.decompress()` in Python.
+ * - **Benchmark**: the "zbench" terminal command compresses batches of 1 to 16 rows in the
+ *   real upload format and prints size, ratio and CPU time per batch.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <algorithm>
+#include <Blynk/BlynkHandlers.h>
+#include "deflate.h"
+#include "mailbox.h"
+
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_BENCH_ROWS 16
+#define DEFLATE_BENCH_RUNS 20
+#define ADLER_MOD 65521
+
+typedef struct
+{
+    uint8_t *out;
+    size_t cap, pos;
+    uint32_t bits;
+    int count;
+    bool overflow;
+} bitWriter_t;
+
+static const uint16_t lenBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                     35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t lenExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                     3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t distBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                      257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                      8193, 12289, 16385, 24577};
+static const uint8_t distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                      7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Function Prototypes
+int httpRow(char *line, size_t len, const char *sensor, float value1, float value2, int value3);
+
+// deflate packs bits LSB first
+static inline void putBits(bitWriter_t &w, uint32_t value, int n)
+{
+    w.bits |= value << w.count;
+    w.count += n;
+    while (w.count >= 8)
+    {
+        if (w.pos < w.cap)
+            w.out[w.pos++] = (uint8_t)w.bits;
+        else
+            w.overflow = true;
+        w.bits >>= 8;
+        w.count -= 8;
+    }
+}
+
+// Huffman codes are defined MSB first
+static inline void putCode(bitWriter_t &w, uint32_t code, int n)
+{
+    uint32_t reversed = 0;
+    for (int i = 0; i < n; i++, code >>= 1)
+        reversed = (reversed << 1) | (code & 1);
+    putBits(w, reversed, n);
+}
+
+static void putSymbol(bitWriter_t &w, int sym)
+{
+    if (sym < 144)
+        putCode(w, 0x30 + sym, 8);
+    else if (sym < 256)
+        putCode(w, 0x190 + sym - 144, 9);
+    else if (sym < 280)
+        putCode(w, sym - 256, 7);
+    else
+        putCode(w, 0xc0 + sym - 280, 8);
+}
+
+static void putMatch(bitWriter_t &w, size_t len, size_t dist)
+{
+    int i = 28;
+    while (lenBase[i] > len)
+        i--;
+    putSymbol(w, 257 + i);
+    putBits(w, len - lenBase[i], lenExtra[i]);
+    int d = 29;
+    while (distBase[d] > dist)
+        d--;
+    putCode(w, d, 5);
+    putBits(w, dist - distBase[d], distExtra[d]);
+}
+
+static inline uint32_t hash3(const uint8_t *p)
+{
+    return (((uint32_t)p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static uint32_t adler32(const uint8_t *p, size_t len)
+{
+    uint32_t a = 1, b = 0;
+    while (len--)
+    {
+        a = (a + *p++) % ADLER_MOD;
+        b = (b + a) % ADLER_MOD;
+    }
+    return b << 16 | a;
+}
+
+/**
+ * @brief Largest output `deflateZlib()` can produce for `len` input bytes.
+ */
+size_t deflateBound(size_t len)
+{
+    return len + len / 8 + 16; // 9 bit literals, headers, Adler-32
+}
+
+/**
+ * @brief Compresses `in` into a zlib stream.
+ *
+ * @param state Hash table workspace, one per calling task.
+ * @param in Input, at most `DEFLATE_MAX_IN` bytes.
+ * @param out Output buffer, `deflateBound(len)` bytes always suffice.
+ * @param cap Size of `out`.
+ * @return The compressed size, 0 if `out` is too small or `in` too long.
+ */
+size_t deflateZlib(deflateState_t &state, const uint8_t *in, size_t len, uint8_t *out, size_t cap)
+{
+    if (len > DEFLATE_MAX_IN)
+        return 0;
+    bitWriter_t w = {out, cap, 0, 0, 0, false};
+    putBits(w, 0x78, 8); // 32 KB window, deflate
+    putBits(w, 0x01, 8); // fastest, header check
+    putBits(w, 1, 1);    // final block
+    putBits(w, 1, 2);    // fixed Huffman
+    memset(state.head, 0, sizeof(state.head));
+
+    size_t i = 0;
+    while (i < len)
+    {
+        size_t best = 0, dist = 0;
+        if (i + DEFLATE_MIN_MATCH <= len)
+        {
+            uint32_t h = hash3(in + i);
+            size_t cand = state.head[h];
+            state.head[h] = i + 1;
+            if (cand--)
+            {
+                size_t max = std::min(len - i, (size_t)DEFLATE_MAX_MATCH);
+                while (best < max && in[cand + best] == in[i + best])
+                    best++;
+                dist = i - cand;
+            }
+        }
+        if (best >= DEFLATE_MIN_MATCH)
+        {
+            putMatch(w, best, dist);
+            for (size_t k = i + 1; k < i + best && k + DEFLATE_MIN_MATCH <= len; k++)
+                state.head[hash3(in + k)] = k + 1;
+            i += best;
+        }
+        else
+            putSymbol(w, in[i++]);
+    }
+    putSymbol(w, 256); // end of block
+    if (w.count)
+        putBits(w, 0, 8 - w.count);
+    uint32_t adler = adler32(in, len);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        putBits(w, (adler >> shift) & 0xff, 8);
+    return w.overflow ? 0 : w.pos;
+}
+
+/**
+ * @brief Terminal "zbench": size, ratio and CPU time of batches of 1 to 16 upload rows.
+ *
+ * The rows are made by `httpRow()`, the formatter of the HTTP sink, from readings that
+ * drift like real ones, so the figures match the uploads.
+ */
+void deflateBench()
+{
+    static const char *sensors[] = {"BME280", "ADS1115", "SHT35", "BMP390"};
+    static char raw[DEFLATE_BENCH_ROWS * 128];
+    static uint8_t wire[DEFLATE_BENCH_ROWS * 128 + DEFLATE_BENCH_ROWS * 16 + 16];
+    static deflateState_t state;
+    char tmp[MAILBOX_TEXT_LEN];
+
+    widgetPrint(V42, "zbench: rows raw wire ratio us/batch\n");
+    for (int rows = 1; rows <= DEFLATE_BENCH_ROWS; rows *= 2)
+    {
+        size_t len = 0;
+        for (int r = 0; r < rows; r++)
+        {
+            len += httpRow(raw + len, sizeof(raw) - len, sensors[r % 4], 71.5f + r * 0.13f, 40.2f - r * 0.07f, 1200 + r);
+            raw[len++] = '\n';
+        }
+        size_t n = 0;
+        uint32_t start = micros();
+        for (int run = 0; run < DEFLATE_BENCH_RUNS; run++)
+            n = deflateZlib(state, (const uint8_t *)raw, len, wire, sizeof(wire));
+        uint32_t us = (micros() - start) / DEFLATE_BENCH_RUNS;
+        snprintf(tmp, sizeof(tmp), "\t%2d %5u %5u %4.1fx %5u\n", rows, (unsigned)len, (unsigned)n, n ? (float)len / n : 0.0f, us);
+        Serial.print(tmp);
+        widgetPrint(V42, tmp);
+    }
+}
@@ -0,0 +1,18 @@
+/**
+ * @file deflate.h
+ * @brief Small deflate encoder (fixed Huffman, zlib wrapped) for upload batches.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define DEFLATE_HASH_BITS 10
+#define DEFLATE_MAX_IN 32768 // the whole input is the window
+
+typedef struct
+{
+    uint16_t head[1 << DEFLATE_HASH_BITS]; // last position + 1 of each 3 byte hash
+} deflateState_t;
+
+size_t deflateZlib(deflateState_t &state, const uint8_t *in, size_t len, uint8_t *out, size_t cap);
+size_t deflateBound(size_t len);
+void deflateBench();
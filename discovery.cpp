@@ -0,0 +1,389 @@
+/**
+ * @file discovery.cpp
+ * @brief UDP multicast device discovery: the sensor devices announce their name and sensor
+ *        types, the client keeps a live registry with TTL expiry.
+ *
+ * Until now the device list came only from ip.php, i.e. a mySQL query on the backend every
+ * `registry_ms`, and a device that just booted was not polled before the next refresh.
+ * With discovery a device is on the registry as soon as its first announcement arrives and
+ * ip.php is only fetched every `seed_ms` as a seed for devices without announcements.
+ *
+ * @details
+ * - **Protocol** (text datagrams, group `discovery.group`, port `discovery.port`):
+ *   - Announce, device -> group: `ESPD1|<name>|<period s>|<sensor>,<sensor>,...`
+ *     e.g. "ESPD1|BME_1|10|BME280,ADS1115". The IP is the datagram source address.
+ *     Devices announce at boot and then every `<period>` seconds.
+ *   - Leave: the same with a period of 0, the entry is dropped right away.
+ *   - Query, client -> group: `ESPQ1`. Every device answers with its announcement (after a
+ *     random 0-200 ms delay). Sent once the station is up and every `DISC_QUERY_MS` while
+ *     nobody answered, so devices already running are known within a second of boot.
+ * - **TTL**: an entry expires `DISC_TTL_PERIODS` announce periods after it was last heard,
+ *   i.e. two announcements can be lost before a device is dropped.
+ * - **Registry**: `taskDiscovery` owns the table. When a device joins, moves or expires it
+ *   asks the poller (`requestDiscoverySync()`) to merge the table with the last ip.php list
+ *   (see poller.cpp), at most once per `DISC_TICK_MS`. The announced sensor types set the
+ *   poll interval before the first poll (`schedHint()`).
+ * - **Fallback**: with discovery off (`discovery 0`), or while no announced device is alive,
+ *   ip.php is fetched every `registry_ms` as before.
+ * - **Metrics**: `discovery_devices`, `discovery_announces_total`, `discovery_expired_total`,
+ *   `discovery_bad_total` and `discovery_first_device_ms` (boot to first announcement).
+ *
+ * @note The "disc" terminal command lists the live table with the age of every entry.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <algorithm>
+#include <lwip/sockets.h>
+#include <Blynk/BlynkHandlers.h>
+#include "discovery.h"
+#include "config.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "watchDog.h"
+
+#define DISC_CORE 0
+#define DISC_PRIORITY 1
+#define DISC_STACK_SIZE 3072
+#define DISC_HEARTBEAT_MS (5 * 1000)
+#define DISC_TICK_MS 1000           // expiry check and registry sync
+#define DISC_QUERY_MS (10 * 1000)   // re-query while nobody answered
+#define DISC_RETRY_MS (5 * 1000)    // socket setup failed
+#define DISC_TTL_PERIODS 3
+#define DISC_PERIOD_MAX_S 600
+#define DISC_PACKET_LEN 128
+#define DISC_ANNOUNCE "ESPD1|"
+#define DISC_QUERY "ESPQ1"
+#define WORDS_PER_BYTE 4
+// #define DEBUG_DISC
+
+typedef struct
+{
+    discDevice_t dev;
+    uint32_t lastSeen; // millis()
+    uint32_t ttlMs;
+    bool inUse;
+} discEntry_t;
+
+static discEntry_t table[DISC_MAX_DEVICES];
+static portMUX_TYPE discMux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t disc_task_handle;
+static metric_t *mDevices, *mAnnounces, *mExpired, *mBad, *mFirst;
+
+// Function Prototypes
+void taskDiscovery(void *pvParameters);
+bool requestDiscoverySync();
+void bootWaitWifi();
+
+/**
+ * @brief Starts the discovery task, called by `initRTOS()` when the config enables it.
+ */
+bool discoveryStart()
+{
+    mDevices = metricRegister("discovery_devices", "Devices alive on the discovery registry", METRIC_GAUGE);
+    mAnnounces = metricRegister("discovery_announces_total", "Device announcements received", METRIC_COUNTER);
+    mExpired = metricRegister("discovery_expired_total", "Devices dropped after their TTL", METRIC_COUNTER);
+    mBad = metricRegister("discovery_bad_total", "Malformed discovery datagrams", METRIC_COUNTER);
+    mFirst = metricRegister("discovery_first_device_ms", "Boot to the first device announcement", METRIC_GAUGE);
+    xTaskCreatePinnedToCore(taskDiscovery, "Task Discovery", DISC_STACK_SIZE, NULL, DISC_PRIORITY, &disc_task_handle, DISC_CORE);
+    return disc_task_handle != NULL;
+}
+
+/**
+ * @brief Opens the UDP socket bound to the discovery port and joins the group.
+ * @return The socket or -1.
+ */
+static int discOpen(const config_t *c, struct sockaddr_in &group)
+{
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(c->discoveryPort);
+    if (inet_aton(c->discoveryGroup, &group.sin_addr) == 0)
+    {
+        Serial.printf("discovery: bad group %s\n", c->discoveryGroup);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    uint8_t loop = 0, ttl = 1; // own queries are not looped back, never leave the LAN
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(c->discoveryPort);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    struct ip_mreq mreq = {};
+    mreq.imr_multiaddr = group.sin_addr;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    {
+        Serial.printf("discovery: cannot join %s:%u (%d)\n", c->discoveryGroup, c->discoveryPort, errno);
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    return fd;
+}
+
+static void discQuery(int fd, const struct sockaddr_in &group)
+{
+    sendto(fd, DISC_QUERY, strlen(DISC_QUERY), 0, (const struct sockaddr *)&group, sizeof(group));
+}
+
+static void noteFirst(const discDevice_t &dev)
+{
+    static bool done = false;
+    if (done)
+        return;
+    done = true;
+
+    char tmp[MAILBOX_TEXT_LEN];
+    uint32_t ms = millis();
+    metricSet(mFirst, ms);
+    snprintf(tmp, sizeof(tmp), "discovery: first device %s %u ms after boot\n", dev.name, ms);
+    Serial.print(tmp);
+    widgetPrint(V42, tmp);
+}
+
+/**
+ * @brief Parses one datagram and updates the table.
+ * @return true if a device joined, moved, left or announced other sensors.
+ */
+static bool discHandle(char *buf, int n, const struct sockaddr_in &src, uint32_t now)
+{
+    while (n && (buf[n - 1] == '\n' || buf[n - 1] == '\r'))
+        n--;
+    buf[n] = 0;
+    if (!strcmp(buf, DISC_QUERY))
+        return false; // another client asking
+    if (strncmp(buf, DISC_ANNOUNCE, strlen(DISC_ANNOUNCE)))
+    {
+        metricInc(mBad);
+        return false;
+    }
+
+    char *save = NULL;
+    char *name = strtok_r(buf + strlen(DISC_ANNOUNCE), "|", &save);
+    char *period = strtok_r(NULL, "|", &save);
+    char *sensors = strtok_r(NULL, "|", &save);
+    if (name == NULL || period == NULL || strlen(name) >= sizeof(discDevice_t::name))
+    {
+        metricInc(mBad);
+        return false;
+    }
+    metricInc(mAnnounces);
+
+    discDevice_t dev = {};
+    strcpy(dev.name, name);
+    strncpy(dev.ip, inet_ntoa(src.sin_addr), sizeof(dev.ip) - 1);
+    if (sensors)
+        strncpy(dev.sensors, sensors, sizeof(dev.sensors) - 1);
+    uint32_t periodS = std::min((uint32_t)strtoul(period, NULL, 10), (uint32_t)DISC_PERIOD_MAX_S);
+
+    bool changed = false, joined = false, full = false;
+    portENTER_CRITICAL(&discMux);
+    discEntry_t *e = NULL, *freeSlot = NULL;
+    for (int i = 0; i < DISC_MAX_DEVICES && e == NULL; i++)
+    {
+        if (table[i].inUse && !strcmp(table[i].dev.name, dev.name))
+            e = &table[i];
+        else if (!table[i].inUse && freeSlot == NULL)
+            freeSlot = &table[i];
+    }
+    if (periodS == 0) // leaving
+    {
+        if (e)
+        {
+            e->inUse = false;
+            changed = true;
+        }
+    }
+    else
+    {
+        if (e == NULL && freeSlot)
+        {
+            e = freeSlot;
+            e->inUse = changed = joined = true;
+        }
+        if (e)
+        {
+            changed |= strcmp(e->dev.ip, dev.ip) || strcmp(e->dev.sensors, dev.sensors);
+            e->dev = dev;
+            e->lastSeen = now;
+            e->ttlMs = periodS * 1000 * DISC_TTL_PERIODS;
+        }
+        else
+            full = true;
+    }
+    portEXIT_CRITICAL(&discMux);
+
+    char tmp[MAILBOX_TEXT_LEN];
+    if (full)
+        Serial.printf("discovery: table full, %s ignored\n", dev.name);
+    else if (changed)
+    {
+        snprintf(tmp, sizeof(tmp), "\t%s: %s %s %s\n", periodS ? (joined ? "joined" : "moved") : "left", dev.name, dev.ip, dev.sensors);
+        Serial.print(tmp);
+        widgetPrint(V42, tmp);
+        if (joined)
+            noteFirst(dev);
+    }
+#ifdef DEBUG_DISC
+    Serial.printf("discovery: %s %s period %u s\n", dev.name, dev.ip, periodS);
+#endif
+    return changed;
+}
+
+/**
+ * @brief Drops the entries not heard from within their TTL.
+ * @return true if any entry expired.
+ */
+static bool discExpire(uint32_t now)
+{
+    char expired[DISC_MAX_DEVICES][sizeof(discDevice_t::name)];
+    int n = 0;
+    portENTER_CRITICAL(&discMux);
+    for (int i = 0; i < DISC_MAX_DEVICES; i++)
+    {
+        if (table[i].inUse && now - table[i].lastSeen >= table[i].ttlMs)
+        {
+            table[i].inUse = false;
+            strcpy(expired[n++], table[i].dev.name);
+        }
+    }
+    portEXIT_CRITICAL(&discMux);
+
+    char tmp[MAILBOX_TEXT_LEN];
+    for (int i = 0; i < n; i++)
+    {
+        metricInc(mExpired);
+        snprintf(tmp, sizeof(tmp), "\texpired: %s\n", expired[i]);
+        Serial.print(tmp);
+        widgetPrint(V42, tmp);
+    }
+    return n > 0;
+}
+
+/**
+ * @brief Discovery task, receives announcements, expires entries and hands changes to the
+ *        poller.
+ *
+ * @param pvParameters Unused.
+ */
+void taskDiscovery(void *pvParameters)
+{
+    char buf[DISC_PACKET_LEN];
+    struct sockaddr_in group;
+    heartbeat_t *hb = hbRegister("discovery", DISC_HEARTBEAT_MS);
+    Serial.printf("Task Discovery running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    hbIdle(hb);
+    bootWaitWifi();
+
+    int fd;
+    while ((fd = discOpen(cfg(), group)) < 0)
+        vTaskDelay(pdMS_TO_TICKS(DISC_RETRY_MS));
+    discQuery(fd, group);
+    uint32_t lastQuery = millis();
+
+    for (;;)
+    {
+        fd_set rd;
+        FD_ZERO(&rd);
+        FD_SET(fd, &rd);
+        struct timeval tv = {DISC_TICK_MS / 1000, (DISC_TICK_MS % 1000) * 1000};
+        hbIdle(hb);
+        int ready = select(fd + 1, &rd, NULL, NULL, &tv);
+        hbCheckIn(hb, "announce");
+
+        bool changed = false;
+        uint32_t now = millis();
+        if (ready > 0)
+        {
+            struct sockaddr_in src;
+            socklen_t len = sizeof(src);
+            int n;
+            while ((n = recvfrom(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT, (struct sockaddr *)&src, &len)) > 0)
+            {
+                changed |= discHandle(buf, n, src, now);
+                len = sizeof(src);
+            }
+        }
+        changed |= discExpire(now);
+
+        if (changed)
+        {
+            int alive = discoverySnapshot(NULL, 0);
+            metricSet(mDevices, alive);
+            requestDiscoverySync();
+        }
+        if (!discoveryAlive() && now - lastQuery >= DISC_QUERY_MS)
+        {
+            discQuery(fd, group);
+            lastQuery = now;
+        }
+    }
+}
+
+/**
+ * @brief Copies the live devices into `list`.
+ *
+ * @param list Destination, may be NULL to only count.
+ * @param max Capacity of `list`.
+ * @return The number of live devices (may be larger than `max`).
+ */
+int discoverySnapshot(discDevice_t *list, int max)
+{
+    int n = 0;
+    portENTER_CRITICAL(&discMux);
+    for (int i = 0; i < DISC_MAX_DEVICES; i++)
+    {
+        if (!table[i].inUse)
+            continue;
+        if (list && n < max)
+            list[n] = table[i].dev;
+        n++;
+    }
+    portEXIT_CRITICAL(&discMux);
+    return n;
+}
+
+/**
+ * @brief true while at least one announced device is alive, ip.php is then only a seed.
+ */
+bool discoveryAlive()
+{
+    return disc_task_handle != NULL && discoverySnapshot(NULL, 0) > 0;
+}
+
+/**
+ * @brief Prints the discovery table on the terminal ("disc" command).
+ */
+void discoveryReport()
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    if (disc_task_handle == NULL)
+    {
+        widgetPrint(V42, "discovery off, devices from ip.php only\n");
+        return;
+    }
+    uint32_t now = millis();
+    snprintf(tmp, sizeof(tmp), "discovery %s:%u, %d devices\n", cfg()->discoveryGroup, cfg()->discoveryPort, discoverySnapshot(NULL, 0));
+    widgetPrint(V42, tmp);
+    for (int i = 0; i < DISC_MAX_DEVICES; i++)
+    {
+        portENTER_CRITICAL(&discMux);
+        discEntry_t e = table[i];
+        portEXIT_CRITICAL(&discMux);
+        if (!e.inUse)
+            continue;
+        snprintf(tmp, sizeof(tmp), "\t%s %s %s seen %us ago ttl %us\n",
+                 e.dev.name, e.dev.ip, e.dev.sensors, (now - e.lastSeen) / 1000, e.ttlMs / 1000);
+        widgetPrint(V42, tmp);
+    }
+}
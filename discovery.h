@@ -0,0 +1,22 @@
+/**
+ * @file discovery.h
+ * @brief UDP multicast device discovery, live registry of the devices that announced
+ *        themselves, each entry expiring after its TTL.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define DISC_MAX_DEVICES 32 // MAX_DEVICES of the scheduler
+#define DISC_SENSORS_LEN 48
+
+typedef struct
+{
+    char name[16];
+    char ip[20];
+    char sensors[DISC_SENSORS_LEN]; // announced sensor types, "BME280,SHT35"
+} discDevice_t;
+
+bool discoveryStart();
+int discoverySnapshot(discDevice_t *list, int max);
+bool discoveryAlive();
+void discoveryReport();
@@ -0,0 +1,317 @@
+/**
+ * @file exchange.cpp
+ * @brief Pipelined command exchanges with a device: all commands on one connection, the
+ *        replies matched to the commands by order.
+ *
+ * Every command (`ALL`, `TST`, `BLK`, `RST`) took its own connect, `println` and close, so
+ * reading a device and then blinking its LED cost two handshakes and two round trips.
+ *
+ * @details
+ * - **Matching**: a reply is one line. The device answers in the order it reads the
+ *   commands, reply i belongs to command i. The device protocol has no request id field,
+ *   the order is the only key.
+ * - **Negotiation**: the mode of a device is learned, not configured. A device not seen
+ *   yet gets one command at a time on the connection: if the connection is still open after
+ *   the first reply and the second command is answered on it, the device is marked
+ *   pipelined and later exchanges write all commands in one segment. If the device closes
+ *   after a reply it is marked single and gets one connection per command from then on.
+ *   The command it closed on was never read by the device, it is sent again on a new
+ *   connection, during negotiation no command runs twice.
+ * - **Downgrade**: a pipelined device that closes early (older firmware flashed) is marked
+ *   single. Its unanswered commands were all written in one segment and may have run, only
+ *   the read-only ones (`ALL`, `TST`) are resent one per connection. `BLK`/`RST` are not
+ *   sent again and report no reply, a reset must not run twice.
+ * - **Timeouts**: connect and reply from the device's estimators (rtt.cpp); `BLK`/`RST` add
+ *   `CMD_RUN_MS`. A reply that does not come abandons the rest of the exchange, the stream
+ *   can no longer be matched by order. The exchange takes no RTT samples, the replies of a
+ *   pipeline queue behind each other.
+ * - **Benchmark**: "xbench [cmd ..]" (default "ALL TST") runs the sequence against every
+ *   device in ipMap, one connection per command and pipelined, `XBENCH_ROUNDS` each, in the
+ *   short lived `taskExchangeBench`. The Blynk loop is not blocked.
+ * - **Metrics**: `exchange_commands_total{piped|single}`, `exchange_resent_total` (commands).
+ *
+ * @note The mode table is shared by the tasks that talk to devices and guarded by a
+ *       spinlock.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <WiFi.h>
+#include <map>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <lwip/sockets.h>
+#include <Blynk/BlynkHandlers.h>
+#include "exchange.h"
+#include "config.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "rtt.h"
+
+#define XBENCH_ROUNDS 3
+#define XBENCH_REPLY_LEN 96
+#define XBENCH_CORE 0
+#define XBENCH_PRIORITY 1
+#define XBENCH_STACK_SIZE 4096
+#define REPLY_CLOSED 3 // peer closed before the reply, internal
+
+typedef enum : uint8_t
+{
+    PIPE_UNKNOWN,
+    PIPE_YES, // keeps the connection open, commands are pipelined
+    PIPE_NO,  // closes after one reply
+} pipeMode_t;
+
+typedef struct
+{
+    in_addr_t addr;
+    pipeMode_t mode;
+} pipeDevice_t;
+
+static pipeDevice_t devices[EXCHANGE_MAX_DEVICES];
+static int nextDevice = 0; // round robin replacement
+static portMUX_TYPE exMux = portMUX_INITIALIZER_UNLOCKED;
+static std::atomic<bool> benchRunning(false);
+static char benchArgs[EXCHANGE_MAX_CMDS * EXCHANGE_CMD_LEN];
+static metric_t *mPiped, *mSingle, *mResent;
+
+// Function Prototypes
+void taskExchangeBench(void *pvParameters);
+std::map<std::string, std::string> ipMapSnapshot();
+
+static pipeMode_t modeOf(const char *ip)
+{
+    in_addr_t addr = inet_addr(ip);
+    pipeMode_t mode = PIPE_UNKNOWN;
+    portENTER_CRITICAL(&exMux);
+    for (const pipeDevice_t &d : devices)
+        if (d.addr == addr)
+            mode = d.mode;
+    portEXIT_CRITICAL(&exMux);
+    return mode;
+}
+
+static void setMode(const char *ip, pipeMode_t mode)
+{
+    in_addr_t addr = inet_addr(ip);
+    portENTER_CRITICAL(&exMux);
+    int slot = -1;
+    for (int i = 0; i < EXCHANGE_MAX_DEVICES && slot < 0; i++)
+        if (devices[i].addr == addr)
+            slot = i;
+    if (slot < 0)
+    {
+        slot = nextDevice;
+        nextDevice = (nextDevice + 1) % EXCHANGE_MAX_DEVICES;
+    }
+    devices[slot].addr = addr;
+    devices[slot].mode = mode;
+    portEXIT_CRITICAL(&exMux);
+}
+
+/**
+ * @brief Reads one reply line into `x.reply`.
+ *
+ * @return 0 read (a line, or the bytes before the peer closed), 2 timeout, `REPLY_CLOSED`
+ *         if the peer closed without sending anything.
+ */
+static int readReply(WiFiClient &client, exchange_t &x, uint32_t limitMs)
+{
+    size_t n = 0;
+    uint32_t start = millis();
+    for (;;)
+    {
+        while (client.available())
+        {
+            char c = client.read();
+            if (c == '\n')
+            {
+                if (n && x.reply[n - 1] == '\r')
+                    n--;
+                x.reply[n] = 0;
+                return 0;
+            }
+            if (n < x.len - 1)
+                x.reply[n++] = c;
+        }
+        if (!client.connected())
+        {
+            x.reply[n] = 0;
+            return n ? 0 : REPLY_CLOSED;
+        }
+        if (millis() - start > limitMs)
+            return 2;
+        vTaskDelay(1);
+    }
+}
+
+// a command that acts on the device, it must not be resent when it may have run
+static bool hasEffect(const char *cmd)
+{
+    return !strncmp(cmd, "BLK", 3) || !strncmp(cmd, "RST", 3);
+}
+
+// all commands from `first` in one write
+static void sendAll(WiFiClient &client, exchange_t *x, int first, int n)
+{
+    char out[EXCHANGE_MAX_CMDS * (EXCHANGE_CMD_LEN + 2)];
+    size_t len = 0;
+    for (int i = first; i < n; i++)
+        len += snprintf(out + len, sizeof(out) - len, "%.*s\r\n", EXCHANGE_CMD_LEN, x[i].cmd);
+    client.write((const uint8_t *)out, len);
+}
+
+/**
+ * @brief Sends the `n` commands of `x` to `ip` and reads their replies.
+ *
+ * @param pipeline false: one connection per command whatever the device supports.
+ * @return The number of commands answered, `x[i].rc` tells which.
+ */
+int socketExchange(const char *ip, exchange_t *x, int n, bool pipeline)
+{
+    if (mPiped == NULL)
+    {
+        mPiped = metricRegister("exchange_commands_total", "Device commands sent in an exchange", METRIC_COUNTER, "mode", "piped");
+        mSingle = metricRegister("exchange_commands_total", "Device commands sent in an exchange", METRIC_COUNTER, "mode", "single");
+        mResent = metricRegister("exchange_resent_total", "Commands resent after the device closed early", METRIC_COUNTER);
+    }
+    n = std::min(n, EXCHANGE_MAX_CMDS);
+    for (int i = 0; i < n; i++)
+    {
+        x[i].rc = 2;
+        x[i].reply[0] = 0;
+    }
+    int done = 0, answered = 0;
+    bool mayHaveRun[EXCHANGE_MAX_CMDS] = {}; // written in a pipeline the device closed on
+    while (done < n)
+    {
+        while (done < n && mayHaveRun[done])
+            done++; // not resent, rc stays "no reply"
+        if (done == n)
+            break;
+        WiFiClient client;
+        if (!client.connect(ip, cfg()->sensorPort, rttTimeout(ip, RTT_CONNECT)))
+        {
+            for (int i = done; i < n; i++)
+                x[i].rc = 1;
+            break;
+        }
+        pipeMode_t mode = pipeline ? modeOf(ip) : PIPE_NO;
+        int first = done, sent = done;
+        if (mode == PIPE_YES)
+        {
+            sendAll(client, x, done, n);
+            metricInc(mPiped, n - done);
+            sent = n;
+        }
+        bool abandon = false;
+        while (done < n)
+        {
+            if (done == sent)
+            {
+                if (done > first && (mode == PIPE_NO || !client.connected()))
+                    break; // next command on a new connection
+                sendAll(client, x, done, done + 1);
+                metricInc(mSingle);
+                sent++;
+            }
+            int rc = readReply(client, x[done], rttCommandMs(ip, x[done].cmd));
+            if (rc == REPLY_CLOSED && done > first)
+            {
+                if (pipeline)
+                    setMode(ip, PIPE_NO);
+                int resent = 1; // the device closed without reading it
+                if (mode == PIPE_YES) // all of them were written, any may have run
+                {
+                    resent = 0;
+                    for (int i = done; i < n; i++)
+                    {
+                        mayHaveRun[i] = hasEffect(x[i].cmd);
+                        resent += !mayHaveRun[i];
+                    }
+                }
+                metricInc(mResent, resent);
+                break;
+            }
+            if (rc)
+            {
+                abandon = true; // no reply, the order of what follows is lost
+                break;
+            }
+            if (done > first && mode == PIPE_UNKNOWN)
+                setMode(ip, mode = PIPE_YES); // second reply on the same connection
+            x[done++].rc = 0;
+            answered++;
+        }
+        if (pipeline && !abandon && mode == PIPE_UNKNOWN && done == first + 1 && done < n)
+            setMode(ip, PIPE_NO); // closed after the first reply
+        client.stop();
+        if (abandon)
+            break;
+    }
+    return answered;
+}
+
+/**
+ * @brief Starts "xbench" with the commands in `args`, false if a run is in progress.
+ */
+bool exchangeBenchStart(const char *args)
+{
+    if (benchRunning.exchange(true))
+        return false;
+    strncpy(benchArgs, args, sizeof(benchArgs) - 1);
+    benchArgs[sizeof(benchArgs) - 1] = 0;
+    if (xTaskCreatePinnedToCore(taskExchangeBench, "xbench", XBENCH_STACK_SIZE, NULL, XBENCH_PRIORITY, NULL, XBENCH_CORE) != pdPASS)
+    {
+        benchRunning = false;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Times the command sequence one connection per command against pipelined, per
+ *        device. Deletes itself when done.
+ */
+void taskExchangeBench(void *pvParameters)
+{
+    char cmds[EXCHANGE_MAX_CMDS][EXCHANGE_CMD_LEN];
+    char replies[EXCHANGE_MAX_CMDS][XBENCH_REPLY_LEN];
+    char tmp[MAILBOX_TEXT_LEN];
+    exchange_t x[EXCHANGE_MAX_CMDS];
+    int n = 0;
+    for (char *save, *tok = strtok_r(benchArgs, " ", &save); tok && n < EXCHANGE_MAX_CMDS; tok = strtok_r(NULL, " ", &save))
+        snprintf(cmds[n++], EXCHANGE_CMD_LEN, "%s", tok);
+    if (n == 0)
+    {
+        strcpy(cmds[n++], "ALL");
+        strcpy(cmds[n++], "TST");
+    }
+    for (int i = 0; i < n; i++)
+        x[i] = {cmds[i], replies[i], XBENCH_REPLY_LEN, 0};
+
+    snprintf(tmp, sizeof(tmp), "xbench %d cmds x%d: single/piped ms, answered\n", n, XBENCH_ROUNDS);
+    widgetPrint(V42, tmp);
+    for (const auto &pair : ipMapSnapshot())
+    {
+        const char *ip = pair.second.c_str();
+        uint32_t ms[2] = {0, 0};
+        int ok[2] = {0, 0};
+        for (int round = 0; round < XBENCH_ROUNDS; round++)
+        {
+            for (int piped = 0; piped < 2; piped++)
+            {
+                uint32_t start = millis();
+                ok[piped] += socketExchange(ip, x, n, piped);
+                ms[piped] += millis() - start;
+            }
+        }
+        pipeMode_t mode = modeOf(ip);
+        snprintf(tmp, sizeof(tmp), "\t%s %u/%u ms %d/%d %s\n", pair.first.c_str(), ms[0] / XBENCH_ROUNDS,
+                 ms[1] / XBENCH_ROUNDS, ok[0], ok[1], mode == PIPE_YES ? "piped" : mode == PIPE_NO ? "single" : "?");
+        widgetPrint(V42, tmp);
+    }
+    benchRunning = false;
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,22 @@
+/**
+ * @file exchange.h
+ * @brief Several commands to one device on one connection, pipelined when the device keeps
+ *        the connection open, one connection per command otherwise.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define EXCHANGE_MAX_CMDS 4
+#define EXCHANGE_CMD_LEN 16
+#define EXCHANGE_MAX_DEVICES 32
+
+typedef struct
+{
+    const char *cmd; // "ALL", "TST", "BLK", "RST"
+    char *reply;     // one line, without the line end
+    size_t len;
+    int rc;          // 0 answered, 1 connect failed, 2 no reply (BLK/RST: may have run)
+} exchange_t;
+
+int socketExchange(const char *ip, exchange_t *x, int n, bool pipeline = true);
+bool exchangeBenchStart(const char *args);
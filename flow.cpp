@@ -0,0 +1,223 @@
+/**
+ * @file flow.cpp
+ * @brief Explicit flow control between the producers of work (the sweep, the push server,
+ *        failed reads) and the stages that consume it (the mySQL uploader, the socket
+ *        recovery task).
+ *
+ * `setupHTTP_request()` looked at the free slots of the 5 deep HTTP queue and parked or
+ * lost whatever did not fit, `socketRecovery()` answered a full queue by deleting the
+ * device's MAC row and resetting the queue, throwing away every pending retry. Nothing told
+ * the poller to slow down and a Jackery voltage was worth no more than a room temperature.
+ *
+ * @details
+ * - **Credits**: each stage starts with one credit per slot of its queue. A producer takes
+ *   a credit before it queues, the stage returns it once the item is done (posted, or
+ *   recovered), not when it is dequeued, so the credits count the work still owed and a
+ *   queue send never finds the queue full. A failed item that is requeued keeps its credit.
+ * - **Classes**: `flowClassOf()` puts a reading with an active alarm (alarm.cpp) or a power
+ *   quantity (ADS1115 volt / supply) in `FLOW_HIGH`, readings of temperature and humidity
+ *   only (BME280, DS1, ...) in `FLOW_LOW`, the rest in `FLOW_NORMAL`.
+ * - **Admission**: a class is admitted while more credits are free than its reserve,
+ *   `reservePct` of the stage's credits: high takes the last credit, normal leaves a
+ *   quarter, low half. Under overload ambient readings are refused first and the power
+ *   readings keep flowing.
+ * - **Policies**: a refused reading follows `policy[class]`: high and normal are parked in
+ *   the outage spill and replayed with their read time, low is dropped, the next sample of
+ *   a room temperature replaces it and the spill file stays for the readings that matter.
+ *   A refused recovery entry is dropped, the device is read again on its next slot. A
+ *   recovery entry that keeps failing gives its credit back after `RECOVERY_MAX_TRIES`
+ *   (freeRtos.cpp) and is counted as dropped too.
+ * - **Backpressure**: the scheduler asks `flowThrottled()` before a poll and skips the slot
+ *   of a device whose readings would only be refused (`polls_skipped_total{backpressure}`),
+ *   the sweep slows down to what the uploader takes instead of reading and discarding.
+ * - **Report**: "flow" on the terminal prints the credits of each stage and the readings
+ *   admitted, parked and dropped per class.
+ * - **Metrics**: `flow_credits{upload|recovery}`, `flow_admitted_total{class}`,
+ *   `flow_parked_total{class}`, `flow_dropped_total{class|recovery}`.
+ *
+ * @note Called from the poller, the workers, the push, HTTP and recovery tasks. The credit
+ *       counts are atomics, no lock.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <atomic>
+#include <algorithm>
+#include <Blynk/BlynkHandlers.h>
+#include "flow.h"
+#include "config.h"
+#include "mailbox.h"
+#include "metrics.h"
+
+typedef struct
+{
+    std::atomic<int> credits; // free
+    int total;
+    metric_t *mCredits;
+} flowStageState_t;
+
+static flowStageState_t stages[FLOW_STAGES];
+static const char *const stageName[FLOW_STAGES] = {"upload", "recovery"};
+static const char *const className[FLOW_CLASSES] = {"high", "normal", "low"};
+static const uint8_t reservePct[FLOW_CLASSES] = {0, 25, 50};
+static const flowPolicy_t policy[FLOW_CLASSES] = {FLOW_PARK, FLOW_PARK, FLOW_DROP};
+static metric_t *mAdmitted[FLOW_CLASSES], *mParked[FLOW_CLASSES], *mDropped[FLOW_CLASSES], *mRecoveryDropped;
+
+static int reserve(const flowStageState_t &s, flowClass_t cls)
+{
+    return s.total * reservePct[cls] / 100;
+}
+
+/**
+ * @brief Sets the credits of a stage to its queue depth, called by `initRTOS()` right after
+ *        the queue is created and before anything is queued.
+ */
+void flowBegin(flowStage_t stage, int credits)
+{
+    flowStageState_t &s = stages[stage];
+    s.total = credits;
+    s.credits.store(credits);
+    s.mCredits = metricRegister("flow_credits", "Free credits of a flow stage", METRIC_GAUGE, "stage", stageName[stage]);
+    metricSet(s.mCredits, credits);
+    if (stage != FLOW_UPLOAD)
+        return;
+    for (int c = 0; c < FLOW_CLASSES; c++)
+    {
+        mAdmitted[c] = metricRegister("flow_admitted_total", "Readings admitted to the upload stage", METRIC_COUNTER, "class", className[c]);
+        mParked[c] = metricRegister("flow_parked_total", "Readings refused and parked in the spill", METRIC_COUNTER, "class", className[c]);
+        mDropped[c] = metricRegister("flow_dropped_total", "Work refused and dropped", METRIC_COUNTER, "class", className[c]);
+    }
+    mRecoveryDropped = metricRegister("flow_dropped_total", "Work refused and dropped", METRIC_COUNTER, "stage", "recovery");
+}
+
+/**
+ * @brief Takes a credit of `stage` if `cls` is admitted, never blocks.
+ *
+ * @return false if the stage has no credit above the reserve of the class.
+ */
+bool flowAcquire(flowStage_t stage, flowClass_t cls)
+{
+    flowStageState_t &s = stages[stage];
+    int keep = reserve(s, cls);
+    int avail = s.credits.load(std::memory_order_relaxed);
+    do
+    {
+        if (avail <= keep)
+            return false;
+    } while (!s.credits.compare_exchange_weak(avail, avail - 1, std::memory_order_acquire, std::memory_order_relaxed));
+    metricSet(s.mCredits, avail - 1);
+    if (stage == FLOW_UPLOAD)
+        metricInc(mAdmitted[cls]);
+    return true;
+}
+
+/**
+ * @brief Returns `n` credits once the stage is done with the items.
+ */
+void flowRelease(flowStage_t stage, int n)
+{
+    flowStageState_t &s = stages[stage];
+    metricSet(s.mCredits, s.credits.fetch_add(n, std::memory_order_release) + n);
+}
+
+/**
+ * @brief Free credits of a stage.
+ */
+int flowCredits(flowStage_t stage)
+{
+    return stages[stage].credits.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Counts a refused item and returns what to do with it.
+ */
+flowPolicy_t flowRefused(flowStage_t stage, flowClass_t cls)
+{
+    if (stage == FLOW_RECOVERY)
+    {
+        flowDropped(stage, cls);
+        return FLOW_DROP;
+    }
+    metricInc(policy[cls] == FLOW_PARK ? mParked[cls] : mDropped[cls]);
+    return policy[cls];
+}
+
+/**
+ * @brief Counts items dropped whatever the policy of their class, e.g. a recovery entry
+ *        given up or queued work that found no credit on a warm restore.
+ */
+void flowDropped(flowStage_t stage, flowClass_t cls, int n)
+{
+    metricInc(stage == FLOW_RECOVERY ? mRecoveryDropped : mDropped[cls], n);
+}
+
+/**
+ * @brief true while readings of `cls` would be dropped by the upload stage, the poller
+ *        then skips the devices of that class.
+ */
+bool flowThrottled(flowClass_t cls)
+{
+    const flowStageState_t &s = stages[FLOW_UPLOAD];
+    return cfg()->sink != SINK_MQTT && s.total && policy[cls] == FLOW_DROP &&
+           s.credits.load(std::memory_order_relaxed) <= reserve(s, cls);
+}
+
+/**
+ * @brief Priority class of a reading.
+ *
+ * @param alarmed An alarm rule of the reading is active, see `alarmEvaluate()`.
+ */
+flowClass_t flowClassOf(const sensorReading_t &reading, bool alarmed)
+{
+    if (alarmed || readingFind(reading, QTY_VOLT) || readingFind(reading, QTY_SUPPLY))
+        return FLOW_HIGH;
+    bool ambient = false;
+    for (int i = 0; i < reading.channels; i++)
+    {
+        uint8_t q = reading.channel[i].quantity;
+        if (q == QTY_TEMPERATURE || q == QTY_HUMIDITY)
+            ambient = true;
+        else if (q != QTY_VALUE) // untyped, e.g. the key channel
+            return FLOW_NORMAL;
+    }
+    return ambient ? FLOW_LOW : FLOW_NORMAL;
+}
+
+/**
+ * @brief Class of a device: the highest class of the readings it reported.
+ */
+flowClass_t flowBatchClass(const readingBatch_t &batch)
+{
+    flowClass_t cls = FLOW_LOW;
+    for (const sensorReading_t *r = batch.first; r != NULL; r = r->next)
+        if (r->sensor != NULL)
+            cls = std::min(cls, flowClassOf(*r, false));
+    return cls;
+}
+
+/**
+ * @brief Terminal "flow": credits per stage, readings admitted / parked / dropped per class.
+ */
+void flowReport()
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    for (int i = 0; i < FLOW_STAGES; i++)
+    {
+        snprintf(tmp, sizeof(tmp), "flow %s: %d of %d credits free\n", stageName[i], flowCredits((flowStage_t)i), stages[i].total);
+        widgetPrint(V42, tmp);
+    }
+    for (int c = 0; c < FLOW_CLASSES; c++)
+    {
+        if (mAdmitted[c] == NULL)
+            break; // upload stage not started
+        snprintf(tmp, sizeof(tmp), "\t%-6s reserve %d admitted %d parked %d dropped %d%s\n", className[c],
+                 reserve(stages[FLOW_UPLOAD], (flowClass_t)c), (int)mAdmitted[c]->value, (int)mParked[c]->value,
+                 (int)mDropped[c]->value, flowThrottled((flowClass_t)c) ? " throttled" : "");
+        widgetPrint(V42, tmp);
+    }
+    if (mRecoveryDropped != NULL)
+    {
+        snprintf(tmp, sizeof(tmp), "\trecovery dropped %d\n", (int)mRecoveryDropped->value);
+        widgetPrint(V42, tmp);
+    }
+}
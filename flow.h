@@ -0,0 +1,40 @@
+/**
+ * @file flow.h
+ * @brief Credit-based flow control between the sweep and the upload and recovery stages,
+ *        with priority classes and per-class drop policies.
+ */
+#pragma once
+#include <Arduino.h>
+#include "reading.h"
+
+typedef enum : uint8_t
+{
+    FLOW_HIGH,   // power readings and readings with an active alarm
+    FLOW_NORMAL, // anything not classified
+    FLOW_LOW,    // ambient temperature and humidity
+    FLOW_CLASSES,
+} flowClass_t;
+
+typedef enum : uint8_t
+{
+    FLOW_UPLOAD,   // QueHTTP_Handle and the row being posted
+    FLOW_RECOVERY, // QueSocket_Handle and the read being retried
+    FLOW_STAGES,
+} flowStage_t;
+
+typedef enum : uint8_t
+{
+    FLOW_PARK, // refused readings go to the outage spill (spill.cpp)
+    FLOW_DROP, // refused readings are dropped and counted
+} flowPolicy_t;
+
+void flowBegin(flowStage_t stage, int credits);
+bool flowAcquire(flowStage_t stage, flowClass_t cls);
+void flowRelease(flowStage_t stage, int n = 1);
+int flowCredits(flowStage_t stage);
+flowPolicy_t flowRefused(flowStage_t stage, flowClass_t cls);
+void flowDropped(flowStage_t stage, flowClass_t cls, int n = 1);
+bool flowThrottled(flowClass_t cls);
+flowClass_t flowClassOf(const sensorReading_t &reading, bool alarmed);
+flowClass_t flowBatchClass(const readingBatch_t &batch);
+void flowReport();
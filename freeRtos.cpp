@@ -11,6 +11,9 @@
  *   - `taskBlink`: Toggles the built-in LED at a specified interval.
  *   - `taskSocketRecov`: Handles socket recovery by retrying failed socket operations.
  *   - `taskSQL_HTTP`: Logs sensor data to a MySQL database using HTTP POST requests.
+ *   - `taskPoller`: Sweeps the sensor fleet off the Arduino loop (see poller.cpp).
+ *   - `taskHeartbeat`: Heartbeat watchdog, every task checks in (see watchDog.cpp).
+ *   - `taskMQTT`: Optional MQTT sink for the readings, selected by config `sink` (see mqtt.cpp).
  *
  * - **Queues**:
  *   - `QueSocket_Handle`: Queue for managing socket recovery tasks.
@@ -19,19 +22,27 @@
  * - **Mutexes**:
  *   - `xMutex_sock`: Mutex for synchronizing access to socket-related resources.
  *   - `xMutex_http`: Mutex for synchronizing access to HTTP-related resources.
+ *   - `xMutex_ipMap`: Mutex guarding `ipMap`, rebuilt by the poller and read by the loop.
  *
  * - **Constants**:
- *   - `SOCKET_QUEUE_SIZE`: Maximum size of the socket queue.
- *   - `HTTP_QUEUE_SIZE`: Maximum size of the HTTP queue.
  *   - `TASK_STACK_SIZE`: Stack size for each task.
- *   - `SOCKET_DELAY_MS`, `HTTP_DELAY_MS`, `BLINK_DELAY_MS`: Delays for respective tasks.
+ *   - `BLINK_DELAY_MS`: Delay for the blink task.
  *   - `LED_BUILTIN`: GPIO pin for the built-in LED.
  *
+ * - **Flow control** (flow.cpp): each queue starts with one credit per slot. A producer takes
+ *   a credit before it queues, the task returns it when the item is done. Readings are
+ *   classed (power and alarm readings first, ambient temperature last), a refused reading
+ *   is parked in the spill or dropped by its class, a refused recovery entry is dropped.
+ *
+ * - **Config** (config.cpp): the queue depths (`queue.socket`, `queue.http`, at boot), the
+ *   socket/HTTP task delays, the backend URLs and the API key are read from `cfg()`.
+ *
  * - **Global Variables**:
  *   - `xMutex_sock`, `xMutex_http`: Mutex handles.
  *   - `QueSocket_Handle`, `QueHTTP_Handle`: Queue handles.
  *   - `socket_task_handle`, `http_task_handle`, `blink_task_handle`: Task handles.
- *   - `lastMsg`, `failSocket`, `passSocket`, `recoveredSocket`, `retry`: Variables for tracking task statuses.
+ *   - `failSocket`, `passSocket`, `recoveredSocket`, `retry`: Task status counters, `std::atomic<int>`
+ *     since the pool workers on both cores update them (main.cpp).
  *
  * - **Functions**:
  *   - `initRTOS`: Initializes FreeRTOS tasks, queues, and mutexes.
@@ -40,7 +51,7 @@
  *   - `taskSQL_HTTP`: Processes HTTP POST requests from the queue.
  *   - `setupHTTP_request`: Prepares and enqueues an HTTP POST request.
  *   - `taskBlink`: Toggles the built-in LED at regular intervals.
- *   - `queStat`: Checks the status of queues and ensures all tasks are complete.
+ *   - `queStat`: Waits, bounded, for a POST in flight before a restart.
  *   - `deleteRow`: Deletes a row from the database using a PHP script.
  *   - `socketClient`: Sends a command to a server via a socket connection.
  *
@@ -56,45 +67,74 @@
  * @date 2025-3-28
  */
 #include <Arduino.h>
+#include <atomic>
 #include <FS.h>
 #include <WiFi.h>
 #include <HTTPClient.h>
 #include <time.h>
 #include <CRC32.h>
 #include <Wire.h>
+#include <algorithm>
+#include "watchDog.h"
+#include "warmState.h"
+#include "config.h"
+#include "metrics.h"
+#include "deflate.h"
+#include "gorilla.h"
+#include "binLog.h"
+#include "reading.h"
+#include "workPool.h"
+#include "rtt.h"
+#include "alarm.h"
+#include "metricsHttp.h"
+#include "flow.h"
 
 // Constants
 // #define DEBUG
-#define SOCKET_QUEUE_SIZE 2
-#define HTTP_QUEUE_SIZE 5
 #define TASK_STACK_SIZE 2048 
-#define SOCKET_DELAY_MS 50
-#define HTTP_DELAY_MS 2000
 #define BLINK_DELAY_MS 1000
 #define NO_UPDATE_FAIL 0
 #define INPUT_BUFFER_LIMIT 2048
 #define MAX_LINE_LENGTH 120
 #define LED_BUILTIN 2
 #define MAX_RETRY 5
+#define RECOVERY_MAX_TRIES 5 // failed retries of one entry before it gives its credit back
 #define WORDS_PER_BYTE 4
+#define HTTP_HEARTBEAT_MS (15 * 1000)   // one POST or one delete retry
+#define SOCKET_HEARTBEAT_MS (15 * 1000) // one socketClient() read
+#define BLINK_HEARTBEAT_MS (5 * 1000)
+#define QUE_STAT_WAIT_MS (3 * 1000) // one POST, well inside the loop heartbeat
+#define UPLOAD_BATCH_MAX 16 // rows per batch POST
+#define UPLOAD_BATCH_LEN (UPLOAD_BATCH_MAX * (MAX_LINE_LENGTH + 1))
 
 // Global Variables
-SemaphoreHandle_t xMutex_sock, xMutex_http;
+SemaphoreHandle_t xMutex_sock, xMutex_http, xMutex_ipMap, xMutex_aes;
 QueueHandle_t QueSocket_Handle, QueHTTP_Handle;
 TaskHandle_t socket_task_handle, http_task_handle, blink_task_handle;
-extern String lastMsg;
-extern int failSocket, passSocket, recoveredSocket, retry;
+extern std::atomic<int> failSocket, passSocket, recoveredSocket, retry;
 
 // Function Prototypes
 void initRTOS();
 int socketRecovery(char *IP, char *cmd2Send);
 void taskSocketRecov(void *pvParameters);
 void taskSQL_HTTP(void *pvParameters);
-void setupHTTP_request(String sensorName, float tokens[]);
+void setupHTTP_request(const sensorReading_t &reading, bool alarmed);
+int httpRow(char *line, size_t len, const char *sensor, float value1, float value2, int value3);
 void taskBlink(void *pvParameters);
 void taskPing(void *pvParameters);
 
 bool queStat();
+int pendingCollect(warmState_t &state);
+void pendingRestore(const warmState_t &state);
+bool initPoller();
+bool twStart();
+bool mqttStart();
+bool mqttPublish(const sensorReading_t &reading);
+bool discoveryStart();
+bool pushStart();
+bool spillStart();
+void spillPark(const sensorReading_t &reading);
+int spillReplay(bool (*send)(const char *sensor, uint32_t ts, const float values[]), int budget);
 int deleteRow(String phpScript);
 int socketClient(char *espServer, char *command, bool updateErrorQueue);
 // Struct Definitions
@@ -103,6 +143,7 @@ typedef struct
     int (*fun_ptr)(char *, char *, bool);
     char ipAddr[20];
     char cmd[20];
+    uint8_t tries; // failed recovery attempts
 } socket_t;
 socket_t socketQue;
 
@@ -114,6 +155,14 @@ typedef struct
 } message_t;
 message_t message;
 
+static message_t batch[UPLOAD_BATCH_MAX]; // HTTP task only
+static char batchRaw[UPLOAD_BATCH_LEN];
+static uint8_t batchWire[UPLOAD_BATCH_LEN + UPLOAD_BATCH_LEN / 8 + 16]; // deflateBound()
+static deflateState_t batchDeflate;
+static metric_t *mBatchRows, *mRawBytes, *mWireBytes, *mCompressUs;
+static const uint32_t batchRowBounds[HIST_BUCKETS] = {1, 2, 4, 6, 8, 10, 12, 16};
+static const uint32_t compressBoundsUs[HIST_BUCKETS] = {50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
 /**
  * @brief Initializes the FreeRTOS components for the application.
  *
@@ -121,53 +170,61 @@ message_t message;
  * required for the application to function. It performs the following:
  *
  * - Configures the built-in LED pin as an output.
- * - Creates two queues:
+ * - Creates two queues, their depths come from the config record:
  *   - `QueSocket_Handle`: A queue for socket-related data.
  *   - `QueHTTP_Handle`: A queue for HTTP-related messages.
+ *   Each gets as many flow credits as it has slots (`flowBegin()`, flow.cpp).
+ * - Creates four mutexes before any task is started so no task can see a NULL handle:
+ *   - `xMutex_sock`: A mutex for socket-related synchronization.
+ *   - `xMutex_http`: A mutex for HTTP-related synchronization.
+ *   - `xMutex_ipMap`: A mutex guarding the device map shared by poller and loop.
+ *   - `xMutex_aes`: A mutex guarding the AES buffers used to decode device frames.
  * - Creates three tasks with specific priorities and stack sizes:
  *   - `taskBlink`: Handles LED blinking functionality.
  *   - `taskSQL_HTTP`: Manages HTTP-related operations.
  *   - `taskSocketRecov`: Handles socket recovery operations.
+ * - Starts the log drain task via `logStart()` first, the tasks log through binLog.h.
+ * - Requeues the recovery work saved by a warm restart (see warmState.cpp).
+ * - Starts the outage spill via `spillStart()` before any task can park a reading.
+ * - Starts the heartbeat watchdog via `hbStart()` before any task that checks in.
+ * - Starts the worker pool via `poolStart()`, one worker per core for the device reads.
+ * - Compiles the alarm rules via `alarmReload()` before the first reading is decoded.
+ * - Starts the timing wheel driver via `twStart()`, then the poller task via `initPoller()`.
+ * - Starts the MQTT sink via `mqttStart()` when the config selects it.
+ * - Starts multicast device discovery via `discoveryStart()` unless the config turns it off.
+ * - Starts the push ingestion server via `pushStart()` when the config enables it.
+ * - Starts the Prometheus endpoint via `metricsHttpStart()` when the config enables it.
  * - FreeRTOS Scheduler: Once the above tasks are created, the FreeRTOS scheduler automatically manages their
  *                       execution based on their priorities and delays (vTaskDelay).
- * - Creates two mutexes:
- *   - `xMutex_sock`: A mutex for socket-related synchronization.
- *   - `xMutex_http`: A mutex for HTTP-related synchronization.
  *
  * If any queue or mutex creation fails, an error message is printed to the
  * serial monitor.
  *
  * @note This function assumes that the following macros are defined:
- * - `SOCKET_DELAY_MS`: Delay for socket task.
- * - `HTTP_DELAY_MS`: Delay for HTTP task.
  * - `BLINK_DELAY_MS`: Delay for blink task.
- * - `SOCKET_QUEUE_SIZE`: Size of the socket queue.
- * - `HTTP_QUEUE_SIZE`: Size of the HTTP queue.
  * - `TASK_STACK_SIZE`: Base stack size for tasks.
+ * @note Must run after `configLoad()`. The socket and HTTP tasks read their delays from
+ *       `cfg()` on every message, so a config reload changes them.
+ * @note A warm restart keeps every queued entry, the snapshot holds `CONFIG_MAX_QUEUE` of each.
  * - `LED_BUILTIN`: Pin number for the built-in LED.
  */
 void initRTOS()
 {
-    uint32_t socket_delay = SOCKET_DELAY_MS, http_delay = HTTP_DELAY_MS, blink_delay = BLINK_DELAY_MS;
+    static uint32_t blink_delay = BLINK_DELAY_MS; // read by the task after initRTOS() returns
     pinMode(LED_BUILTIN, OUTPUT);
+    if (!logStart())
+        Serial.println("log drain not running");
 
-    QueSocket_Handle = xQueueCreate(SOCKET_QUEUE_SIZE, sizeof(socket_t));
+    QueSocket_Handle = xQueueCreate(cfg()->socketQueue, sizeof(socket_t));
     if (QueSocket_Handle == NULL)
         Serial.println("Queue  socket could not be created..");
+    flowBegin(FLOW_RECOVERY, cfg()->socketQueue);
 
-    QueHTTP_Handle = xQueueCreate(HTTP_QUEUE_SIZE, sizeof(message_t));
+    QueHTTP_Handle = xQueueCreate(cfg()->httpQueue, sizeof(message_t));
     if (QueHTTP_Handle == NULL)
         Serial.println("Queue could not be created..");
+    flowBegin(FLOW_UPLOAD, cfg()->httpQueue);
 
-    xTaskCreatePinnedToCore(taskBlink, "Task Blink", TASK_STACK_SIZE, (uint32_t *)&blink_delay, 1, &blink_task_handle, 1);
-    xTaskCreatePinnedToCore(taskSQL_HTTP, "Task HTTP", TASK_STACK_SIZE * 2, (uint32_t *)&http_delay, 2, &http_task_handle, 0);
-    xTaskCreatePinnedToCore(taskSocketRecov, "Task Sockets", TASK_STACK_SIZE * 2, (uint32_t *)&socket_delay, 3, &socket_task_handle, 1);
-
-    if (blink_task_handle == NULL || socket_task_handle == NULL || http_task_handle == NULL)
-    {
-        Serial.println("tasks not running");
-        ESP.restart();
-    }
     xMutex_sock = xSemaphoreCreateMutex();
     if (xMutex_sock == NULL)
     {
@@ -176,51 +233,176 @@ void initRTOS()
     xMutex_http = xSemaphoreCreateMutex();
     if (xMutex_http == NULL)
     {
-        Serial.println("Mutex sock can not be created");
+        Serial.println("Mutex http can not be created");
+    }
+    xMutex_ipMap = xSemaphoreCreateMutex();
+    if (xMutex_ipMap == NULL)
+    {
+        Serial.println("Mutex ipMap can not be created");
+    }
+    xMutex_aes = xSemaphoreCreateMutex();
+    if (xMutex_aes == NULL)
+    {
+        Serial.println("Mutex aes can not be created");
+    }
+    pendingRestore(*warmSnapshot());
+    if (!spillStart())
+        Serial.println("outage spill not running");
+    if (!hbStart())
+        Serial.println("heartbeat watchdog not running");
+    if (!poolStart())
+        Serial.println("worker pool not running, the poller reads the devices");
+    if (!alarmReload())
+        Serial.println("alarm rules with errors, see \"alarm\"");
+
+    xTaskCreatePinnedToCore(taskBlink, "Task Blink", TASK_STACK_SIZE, (uint32_t *)&blink_delay, 1, &blink_task_handle, 1);
+    xTaskCreatePinnedToCore(taskSQL_HTTP, "Task HTTP", TASK_STACK_SIZE * 2, NULL, 2, &http_task_handle, 0);
+    xTaskCreatePinnedToCore(taskSocketRecov, "Task Sockets", TASK_STACK_SIZE * 2, NULL, 3, &socket_task_handle, 1);
+
+    if (cfg()->sink != SINK_HTTP && !mqttStart())
+        Serial.println("mqtt sink not running");
+    if (cfg()->discovery && !discoveryStart())
+        Serial.println("discovery not running");
+    if (cfg()->push && !pushStart())
+        Serial.println("push server not running");
+    if (cfg()->metricsHttp && !metricsHttpStart())
+        Serial.println("metrics endpoint not running");
+
+    if (blink_task_handle == NULL || socket_task_handle == NULL || http_task_handle == NULL || !twStart() || !initPoller())
+    {
+        Serial.println("tasks not running");
+        ESP.restart();
     }
 }
 
+// queues a recovery entry, the caller holds its credit
+static int recoveryQueue(const char *IP, const char *cmd2Send, uint8_t tries = 0)
+{
+    socket_t socketQue;
+    socketQue.fun_ptr = &socketClient;
+    strlcpy(socketQue.ipAddr, IP, sizeof(socketQue.ipAddr));
+    strlcpy(socketQue.cmd, cmd2Send, sizeof(socketQue.cmd));
+    socketQue.tries = tries;
+    int ret = xQueueSend(QueSocket_Handle, (void *)&socketQue, 0);
+    if (ret != pdTRUE)
+        flowRelease(FLOW_RECOVERY);
+    return ret;
+}
+
 /**
  * @brief Sends a socket structure to a FreeRTOS queue for processing.
  *
  * This function attempts to send a `socket_t` structure containing the IP address
- * and command to a FreeRTOS queue. If the queue is full, it resets the queue and
- * optionally deletes a row from a remote database using an HTTP request.
+ * and command to a FreeRTOS queue. The entry needs a recovery credit (flow.cpp), without
+ * one the recovery task is already busy with as many retries as the queue holds: the
+ * entry is dropped and counted (`flow_dropped_total{recovery}`), the pending retries are
+ * kept and the device is read again on its next poll slot.
  *
  * @param IP Pointer to a character array containing the IP address.
  * @param cmd2Send Pointer to a character array containing the command to send.
  * @return int `pdTRUE` (1) if the structure was successfully sent to the queue,
- *             `errQUEUE_FULL` (0) if the queue is full, or 10 if the queue handle is NULL.
+ *             `errQUEUE_FULL` (0) if no credit was left, or 10 if the queue handle is NULL.
  *
  * @note Ensure that `QueSocket_Handle` is initialized before calling this function.
- *       If the queue is full, the function will reset the queue and attempt to delete
- *       a row from the database using the provided IP address.
  */
 int socketRecovery(char *IP, char *cmd2Send)
 {
-    socket_t socketQue;
     if (QueSocket_Handle == NULL)
-        Serial.println("QueSocket_Handle failed");
+        LOG_E("QueSocket_Handle failed");
+    else if (!flowAcquire(FLOW_RECOVERY, FLOW_HIGH))
+    {
+        flowRefused(FLOW_RECOVERY, FLOW_HIGH);
+        LOG_W(".......recovery busy, retry of %s dropped", IP);
+        return errQUEUE_FULL;
+    }
     else
+        return recoveryQueue(IP, cmd2Send);
+    return 10;
+}
+
+/**
+ * @brief Recovers a row whose POST failed: deletes a possibly half written row through
+ *        delete.php, then puts the row back on the queue for another try. The row keeps
+ *        its upload credit while it is queued again.
+ */
+static void postFailed(const message_t &msg, int httpResponseCode, TickType_t xDelay, heartbeat_t *hb, int &recovered)
+{
+    String phpScript = String(cfg()->urlDelete) + msg.key;
+    LOG_I("%s", phpScript.c_str());
+    int j = 0, rc = 0;
+    while (1)
     {
-        socketQue.fun_ptr = &socketClient;
-        strcpy(socketQue.ipAddr, IP);
-        strcpy(socketQue.cmd, cmd2Send);
-        int ret = xQueueSend(QueSocket_Handle, (void *)&socketQue, 0);
-        if (ret == pdTRUE)
-        { /* Serial.println("recovering struct send to QueSocket sucessfully"); */
-        }
-        else if (ret == errQUEUE_FULL)
+        hbCheckIn(hb, "delete");
+        vTaskDelay(xDelay); 
+        rc = deleteRow(phpScript);
+        if (rc || j++ == MAX_RETRY)
+            break; //
+    }
+    LOG_I("rc %d", rc);
+    LOG_E("HTTP Error rc: %d %s %d", httpResponseCode, msg.line, msg.key);
+    int ret = xQueueSend(QueHTTP_Handle, (void *)&msg, 0); // send message back to queue, it keeps its credit
+    if (ret == pdTRUE)
+        recovered++;                            //
+    else
+        flowRelease(FLOW_UPLOAD);
+    LOG_I("recoverd %d", recovered); // checked mySQL and the entry exists
+}
+
+/**
+ * @brief Queues a row replayed from the outage spill, with the time it was read, when a
+ *        normal class reading would be admitted.
+ */
+static bool queueSpilled(const char *sensor, uint32_t ts, const float values[])
+{
+    message_t msg = {};
+    int n = httpRow(msg.line, sizeof(msg.line), sensor, values[0], values[1], passSocket);
+    if (ts >= GORILLA_EPOCH_VALID && n + 26 < (int)sizeof(msg.line))
+        snprintf(msg.line + n, sizeof(msg.line) - n, "&reading_time=%u", ts);
+    msg.key = values[2];
+    if (!flowAcquire(FLOW_UPLOAD, FLOW_NORMAL))
+        return false; // replay again after the next POST
+    if (xQueueSend(QueHTTP_Handle, (void *)&msg, 0) == pdTRUE)
+        return true;
+    flowRelease(FLOW_UPLOAD);
+    return false;
+}
+
+/**
+ * @brief POSTs `rows` rows of `batch` to the batch endpoint, one row per line, deflated
+ *        when `batch.zlib` is set and it makes the body smaller.
+ *
+ * @return The HTTP response code, <= 0 on a transport error.
+ */
+static int postBatch(HTTPClient &http, WiFiClient &client, int rows)
+{
+    const config_t *c = cfg();
+    size_t len = 0;
+    for (int i = 0; i < rows; i++)
+    {
+        len += strlcpy(batchRaw + len, batch[i].line, sizeof(batchRaw) - len);
+        batchRaw[len++] = '\n';
+    }
+    const uint8_t *body = (const uint8_t *)batchRaw;
+    size_t wireLen = len;
+
+    http.begin(client, c->urlBatch);
+    http.addHeader("Content-Type", "text/plain");
+    if (c->batchZlib)
+    {
+        uint32_t start = micros();
+        size_t n = deflateZlib(batchDeflate, body, len, batchWire, sizeof(batchWire));
+        metricObserve(mCompressUs, micros() - start);
+        if (n && n < len)
         {
-            Serial.println(".......unable to send data to socket  Queue is Full");
-            String phpScript = "http://192.168.1.252/deleteMAC.php?key=" + (String)IP;
-            deleteRow(phpScript); // delete 
-            //Blynk.logEvent("");
-            xQueueReset(QueSocket_Handle);
+            body = batchWire;
+            wireLen = n;
+            http.addHeader("Content-Encoding", "deflate");
         }
-        return ret;
     }
-    return 10;
+    metricObserve(mBatchRows, rows);
+    metricInc(mRawBytes, len);
+    metricInc(mWireBytes, wireLen);
+    return http.POST((uint8_t *)body, wireLen);
 }
 
 /**
@@ -231,26 +413,37 @@ int socketRecovery(char *IP, char *cmd2Send)
  * sends them to a server via HTTP POST, and handles errors by attempting
  * to delete the corresponding row in the database if the POST fails.
  *
- * @param pvParameters Pointer to the delay time (in milliseconds) passed
- *                     as a parameter to the task.
+ * @param pvParameters Unused, the pacing delay is `cfg()->httpDelayMs`.
  *
  * @details
  * - The task uses a queue (`QueHTTP_Handle`) to receive messages containing
  *   data to be posted to the server.
  * - A mutex (`xMutex_http`) is used to ensure thread-safe HTTP operations.
+ * - **Batching**: with `batch.rows` > 1 the task waits up to `batch.linger_ms` after the
+ *   first row for more rows and posts them together to `url.batch`, one form row per line,
+ *   zlib deflated (deflate.cpp) with `Content-Encoding: deflate` when `batch.zlib` is set.
+ *   The endpoint inflates the body (`gzuncompress()`) and inserts every line like
+ *   post-esp-data.php does. With `batch.rows` 1 every row is posted to `url.post` as before.
+ *   The pacing delay is paid once per POST, so a batch of n rows goes out n times faster.
  * - If the HTTP POST request succeeds, the task increments the success counter.
  * - If the HTTP POST request fails, the task attempts to delete the corresponding
  *   row in the database by sending a DELETE request to a PHP script. It retries
- *   the deletion up to 5 times with a delay between attempts.
+ *   the deletion up to 5 times with a delay between attempts. For a batch every row
+ *   of it goes through this.
  * - If the deletion is successful, the task re-queues the message for retry.
+ * - Flow control: a row's upload credit (flow.cpp) is returned once it has been posted,
+ *   a requeued row keeps it. While the credits run low the producers refuse or park new
+ *   readings by class and the poller skips ambient sensors.
  * - The task logs various statistics, including the number of successful posts,
  *   failed posts, and recovered messages.
+ * - Metrics: `upload_batch_rows`, `upload_bytes_total` (label raw / wire, the ratio is
+ *   raw / wire) and `upload_compress_us`.
  *
  * @note
  * - The task uses non-blocking delays (`vTaskDelay`) to avoid affecting other tasks.
  * - The HTTP client (`HTTPClient`) and WiFi client (`WiFiClient`) are used for
  *   communication with the php server.
- * - The server URL and PHP script paths are hardcoded in the task.
+ * - The server URL and PHP script paths come from the config record, read per message.
  *
  *
  */
@@ -260,57 +453,81 @@ void taskSQL_HTTP(void *pvParameters)
     HTTPClient http;
     // mysql includes
     WiFiClient client_sql;
-    String serverName = "http://192.168.1.252/post-esp-data.php";
     int passPost = 0, failPost = 0, recovered = 0;
-    uint32_t http_delay = *((uint32_t *)pvParameters);
-    TickType_t xDelay = http_delay / portTICK_PERIOD_MS;
+    heartbeat_t *hb = hbRegister("http", HTTP_HEARTBEAT_MS);
+    metric_t *mSent = metricRegister("sink_sent_total", "Readings delivered by the sink", METRIC_COUNTER, "sink", "http");
+    metric_t *mSendMs = metricRegister("sink_send_ms", "Send to acknowledgement of one reading", METRIC_HISTOGRAM, "sink", "http");
+    mBatchRows = metricRegister("upload_batch_rows", "Rows per HTTP upload batch", METRIC_HISTOGRAM, NULL, NULL, batchRowBounds);
+    mRawBytes = metricRegister("upload_bytes_total", "HTTP batch body bytes", METRIC_COUNTER, "body", "raw");
+    mWireBytes = metricRegister("upload_bytes_total", "HTTP batch body bytes", METRIC_COUNTER, "body", "wire");
+    mCompressUs = metricRegister("upload_compress_us", "Deflate time per upload batch", METRIC_HISTOGRAM, NULL, NULL, compressBoundsUs);
     Serial.printf("Task Post SQL running on CoreID:%d xDelay:%u ms Free Bytes: %d\n",
-                  xPortGetCoreID(), (unsigned int)xDelay, uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+                  xPortGetCoreID(), cfg()->httpDelayMs, uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
 
     for (;;)
     {
         if (QueHTTP_Handle != NULL)
         {
-            int ret = xQueueReceive(QueHTTP_Handle, &message, portMAX_DELAY); // wait for message
+            hbIdle(hb);
+            int ret = xQueueReceive(QueHTTP_Handle, &batch[0], portMAX_DELAY); // wait for message
             if (ret == pdPASS)
             {
-                //  "take" blocks calls to esp restart while messages are on queue see queStat()
+                // "take" lets queStat() wait for this POST before a restart
+                hbCheckIn(hb, "lock");
                 xSemaphoreTake(xMutex_http, portMAX_DELAY);
-                http.begin(client_sql, serverName.c_str());
-                http.addHeader("Content-Type", "application/x-www-form-urlencoded");
-                int httpResponseCode = http.POST(message.line);
-                if (httpResponseCode > 0)
+                const config_t *c = cfg();
+                int maxRows = std::min((int)c->batchRows, UPLOAD_BATCH_MAX), rows = 1;
+                TickType_t lingerEnd = xTaskGetTickCount() + pdMS_TO_TICKS(c->batchLingerMs);
+                while (rows < maxRows)
                 {
-                    passPost++;
-                    String payload = http.getString();
+                    hbCheckIn(hb, "batch");
+                    TickType_t now = xTaskGetTickCount();
+                    TickType_t wait = (int32_t)(lingerEnd - now) > 0 ? lingerEnd - now : 0;
+                    if (xQueueReceive(QueHTTP_Handle, &batch[rows], wait) != pdPASS)
+                        break;
+                    rows++;
                 }
+
+                hbCheckIn(hb, "post");
+                TickType_t xDelay = cfg()->httpDelayMs / portTICK_PERIOD_MS;
+                uint32_t postStart = millis();
+                int httpResponseCode;
+                if (maxRows > 1)
+                    httpResponseCode = postBatch(http, client_sql, rows);
                 else
                 {
-                    String phpScript = "http://192.168.1.252/delete.php?key=" + message.key;
-                    Serial.println(phpScript);
-                    failPost++;
-                    int j = 0, rc = 0;
-                    while (1)
+                    http.begin(client_sql, cfg()->urlPost);
+                    http.addHeader("Content-Type", "application/x-www-form-urlencoded");
+                    httpResponseCode = http.POST(batch[0].line);
+                }
+                if (httpResponseCode > 0)
+                {
+                    passPost += rows;
+                    String payload = http.getString();
+                    metricObserve(mSendMs, millis() - postStart);
+                    metricInc(mSent, rows);
+                    flowRelease(FLOW_UPLOAD, rows);
+                    int spare = flowCredits(FLOW_UPLOAD);
+                    if (spare > 1) // backend is up, leave half the credits to live readings
                     {
-                        vTaskDelay(xDelay); 
-                        rc = deleteRow(phpScript);
-                        if (rc || j++ == MAX_RETRY)
-                            break; //
+                        hbCheckIn(hb, "replay");
+                        spillReplay(queueSpilled, spare / 2);
                     }
-                    Serial.printf("rc %d\n", rc);
-                    Serial.printf("HTTP Error rc: %d %s %d \n", httpResponseCode, message.line, message.key);
-                    Serial.printf("passed %d  failed %d ", passPost, failPost);
-                    int ret = xQueueSend(QueHTTP_Handle, (void *)&message, 0); // send message back to queue
-                    if (ret == pdTRUE)
-                        recovered++;                            //
-                    Serial.printf("recoverd %d \n", recovered); // checked mySQL and the entry exists
                 }
+                else
+                {
+                    failPost += rows;
+                    for (int i = 0; i < rows; i++)
+                        postFailed(batch[i], httpResponseCode, xDelay, hb, recovered);
+                    LOG_I("passed %d  failed %d", passPost, failPost);
+                }
+                hbCheckIn(hb, "pace");
                 http.end();
                 vTaskDelay(xDelay);
                 xSemaphoreGive(xMutex_http);
             }
             else if (ret == pdFALSE)
-                Serial.println("The setSQL_HTTP was unable to receive data from the Queue");
+                LOG_E("The setSQL_HTTP was unable to receive data from the Queue");
         } // Sanity check
     }
 }
@@ -322,8 +539,8 @@ void taskSQL_HTTP(void *pvParameters)
  * operation, and updates recovery statistics. If recovery fails, the task re-queues
  * the socket operation for another recovery attempt.
  *
- * @param pvParameters Pointer to a uint32_t value specifying the delay (in milliseconds)
- *                     between recovery attempts.
+ * @param pvParameters Unused, the delay before a recovery attempt is the device's backed-off
+ *        timeout (`rttRetryMs()`, rtt.cpp), at least `cfg()->socketDelayMs`.
  *
  * The task performs the following steps in an infinite loop:
  * 1. Waits for a socket message from the queue (blocking indefinitely).
@@ -331,7 +548,11 @@ void taskSQL_HTTP(void *pvParameters)
  * 3. Delays for the specified amount of time before attempting recovery.
  * 4. Calls the function pointer associated with the socket message to attempt recovery.
  * 5. Updates recovery statistics based on the success or failure of the recovery attempt.
- * 6. If recovery fails, re-queues the socket message for another recovery attempt.
+ * 6. If recovery fails, re-queues the socket message for another recovery attempt. The entry
+ *    keeps its recovery credit (flow.cpp) until it is recovered, or until it failed
+ *    `RECOVERY_MAX_TRIES` times: then it is dropped and counted
+ *    (`flow_dropped_total{recovery}`) so a dead device cannot hold a credit for good, and
+ *    the device is read again on its next poll slot.
  * 7. Releases the mutex after processing the message.
  *
  * @warning This task assumes that the function pointer in the `socket_t` structure is valid
@@ -340,31 +561,42 @@ void taskSQL_HTTP(void *pvParameters)
 void taskSocketRecov(void *pvParameters)
 {
     socket_t socketQue;
-    uint32_t socket_delay = *((uint32_t *)pvParameters);
-    const TickType_t xDelay = socket_delay / portTICK_PERIOD_MS;
+    heartbeat_t *hb = hbRegister("recovery", SOCKET_HEARTBEAT_MS);
     Serial.printf("Task Socket Recovery running on CoreID:%d xDelay:%u ms Free Bytes:%d\n",
-                  (unsigned int)xPortGetCoreID(), (unsigned int)xDelay, uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+                  (unsigned int)xPortGetCoreID(), cfg()->socketDelayMs, uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
     for (;;)
     {
         if (QueSocket_Handle != NULL)
         {
+            hbIdle(hb);
             if (xQueueReceive(QueSocket_Handle, &socketQue, portMAX_DELAY) == pdPASS)
             {
-                //"take" blocks calls to esp restart when messages are on queue
-                // see queStat()
+                hbCheckIn(hb, "lock");
                 xSemaphoreTake(xMutex_sock, portMAX_DELAY);
-                vTaskDelay(xDelay);
+                hbCheckIn(hb, "backoff");
+                vTaskDelay(std::max(cfg()->socketDelayMs, rttRetryMs(socketQue.ipAddr)) / portTICK_PERIOD_MS);
+                hbCheckIn(hb, "recover");
                 retry++;
                 // Serial.printf("socket error %s %s \n", socketQue.ipAddr, socketQue.cmd);
                 int x = (*socketQue.fun_ptr)(socketQue.ipAddr, socketQue.cmd, NO_UPDATE_FAIL);
                 if (!x)
                 {
+                    flowRelease(FLOW_RECOVERY);
                     recoveredSocket++;
-                    Serial.printf("Recovered last network fail for host:%s s \n", socketQue.ipAddr);
-                    Serial.printf("passSocket %d failSocket %d  recovered %d retry %d \n", passSocket, failSocket, recoveredSocket, retry);
+                    LOG_I("Recovered last network fail for host:%s", socketQue.ipAddr);
+                    LOG_I("passSocket %d failSocket %d  recovered %d retry %d", passSocket.load(), failSocket.load(), recoveredSocket.load(), retry.load());
+                }
+                else if (++socketQue.tries >= RECOVERY_MAX_TRIES)
+                {
+                    flowRelease(FLOW_RECOVERY);
+                    flowDropped(FLOW_RECOVERY, FLOW_HIGH);
+                    LOG_W("Recovery of %s given up after %d tries", socketQue.ipAddr, (int)socketQue.tries);
                 }
                 else
-                    socketRecovery(socketQue.ipAddr, socketQue.cmd); //  ********SEND Fail to que here for recovery****
+                {
+                    hbCheckIn(hb, "requeue");
+                    recoveryQueue(socketQue.ipAddr, socketQue.cmd, socketQue.tries); // back on the queue, with the credit it holds
+                }
                 xSemaphoreGive(xMutex_sock);
             }
         }
@@ -375,62 +607,84 @@ void taskSocketRecov(void *pvParameters)
  * @brief Prepares and sends an HTTP request message to a FreeRTOS queue.
  *
  * This function constructs an HTTP request string using the provided sensor name,
- * token values, and a predefined API key and sensor location. It then packages
+ * token values, and the API key and sensor location from the config record. It then packages
  * the request into a message structure and attempts to send it to a FreeRTOS queue.
  *
- * @param sensorName The name of the sensor to include in the HTTP request.
- * @param tokens An array of float values used to populate the HTTP request data.
- *               - tokens[1]: First value to include in the request.
- *               - tokens[2]: Second value to include in the request.
- *               - tokens[3]: Key value to associate with the message.
+ * @param reading One sensor reading of the batch being processed (reading.h).
+ * @param alarmed An alarm rule of the reading is active (`alarmEvaluate()`), it goes first.
+ *                - `sensor`: The sensor name to include in the HTTP request.
+ *                - channel 0 and 1: value1 and value2 of the request.
+ *                - `readingKey()`: Key value to associate with the message.
  *
  * @note The function uses an external variable `passSocket` for additional data
  *       in the HTTP request and an external FreeRTOS queue handle `QueHTTP_Handle`.
  *
  * @details The constructed HTTP request string includes the following parameters:
- *          - api_key: A predefined API key,
+ *          - api_key: The configured API key (`apikey`).
  *          - sensor: The provided sensor name.
- *          - location: A predefined sensor location ("HOME").
- *          - value1, value2: Values from the `tokens` array.
+ *          - location: The configured sensor location (`location`, default "HOME").
+ *          - value1, value2: The first two values of the reading.
  *          - value3: The value of the external variable `passSocket`.
  *
- * If the queue is full, the function logs a message to the serial output.
+ * The reading needs an upload credit for its class (`flowAcquire()`, flow.cpp). Without one,
+ * e.g. while the backend is down, a power or alarm reading is parked by `spillPark()`
+ * (spill.cpp) and replayed later, an ambient temperature is dropped and counted.
+ *
+ * Depending on config `sink` the reading goes to the HTTP queue, to the MQTT sink
+ * (`mqttPublish()`, see mqtt.cpp) or to both.
  *
  * @warning Ensure that `QueHTTP_Handle` is initialized and has sufficient space
  *          before calling this function. The function does not block if the queue
  *          is full.
  */
-void setupHTTP_request(String sensorName, float tokens[])
+void setupHTTP_request(const sensorReading_t &reading, bool alarmed)
 {
     message_t message;
-    String apiKeyValue = "tPmAT5Ab3j7F9";
-    String sensorLocation = "HOME";
-    extern int passSocket;
+    const config_t *c = cfg();
 
-    if (QueHTTP_Handle != NULL && uxQueueSpacesAvailable(QueHTTP_Handle) > 0)
+    if (c->sink != SINK_HTTP)
+        mqttPublish(reading);
+    if (c->sink == SINK_MQTT || QueHTTP_Handle == NULL)
+        return;
+    flowClass_t cls = flowClassOf(reading, alarmed);
+    if (!flowAcquire(FLOW_UPLOAD, cls))
     {
-        String httpRequestData = "api_key=" + apiKeyValue;
-        httpRequestData += "&sensor=" + sensorName;
-        httpRequestData += "&location=" + sensorLocation;
-        httpRequestData += "&value1=" + String(tokens[1]);
-        httpRequestData += "&value2=" + String(tokens[2]);
-        httpRequestData += "&value3=" + String(passSocket) + "";
-#ifdef DEBUG
-        Serial.printf("http req data %s %d\n", httpRequestData.c_str(), passSocket);
-#endif
-
-        strcpy(message.line, httpRequestData.c_str());
-        message.key = tokens[3];
-        message.line[strlen(message.line)] = 0; // Add the terminating null
+        if (flowRefused(FLOW_UPLOAD, cls) == FLOW_PARK)
+            spillPark(reading);
+    }
+    else
+    {
+        httpRow(message.line, sizeof(message.line), reading.sensor, readingValue(reading, 0), readingValue(reading, 1), passSocket);
+        LOG_D("http req data %s %d", message.line, passSocket.load());
+        message.key = readingKey(reading);
         int ret = xQueueSend(QueHTTP_Handle, (void *)&message, 0);
         if (ret == pdTRUE)
         {
             /*  Serial.println(" msg struct send to QueSocket sucessfully"); */
         }
         else if (ret == errQUEUE_FULL)
-            Serial.println(".......unable to send data to htpp Queue is Full");
+        {
+            LOG_W(".......unable to send data to htpp Queue is Full");
+            flowRelease(FLOW_UPLOAD);
+            spillPark(reading);
+        }
     }
 }
+/**
+ * @brief Formats one upload row, the form body of post-esp-data.php.
+ *
+ * "api_key=<apikey>&sensor=<sensor>&location=<location>&value1=<t1>&value2=<t2>&value3=<n>"
+ * with two decimals like `String(float)`.
+ *
+ * @return The length of the row (truncated to `len` - 1).
+ */
+int httpRow(char *line, size_t len, const char *sensor, float value1, float value2, int value3)
+{
+    const config_t *c = cfg();
+    int n = snprintf(line, len, "api_key=%s&sensor=%s&location=%s&value1=%.2f&value2=%.2f&value3=%d",
+                     c->apiKey, sensor, c->location, value1, value2, value3);
+    return std::min(n, (int)len - 1);
+}
 /**
  * @brief Task function to blink an LED at a specified interval.
  *
@@ -452,10 +706,12 @@ void taskBlink(void *pvParameters)
 {
     uint32_t blink_delay = *((uint32_t *)pvParameters);
     const TickType_t xDelay = blink_delay / portTICK_PERIOD_MS;
+    heartbeat_t *hb = hbRegister("blink", BLINK_HEARTBEAT_MS);
     Serial.printf("Task Blink running on CoreID:%d xDelay:%u ms Free Bytes: %d\n",
                   (unsigned int)xPortGetCoreID(), (unsigned int)xDelay, uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
     for (;;)
     {
+        hbCheckIn(hb, "blink");
         digitalWrite(LED_BUILTIN, LOW);
         vTaskDelay(xDelay);
         digitalWrite(LED_BUILTIN, HIGH);
@@ -463,38 +719,99 @@ void taskBlink(void *pvParameters)
     }
 }
 /**
- * @brief Checks the status of two FreeRTOS queues and waits until they are empty.
+ * @brief Lets a POST in flight finish before a restart, for at most `QUE_STAT_WAIT_MS`.
  *
- * This function monitors the message count of two queues (`QueSocket_Handle` and
- * `QueHTTP_Handle`) and waits until both are empty. If the queues are not empty
- * within a 5-second timeout, the function logs a timeout message and returns false.
- * Otherwise, it takes two mutexes (`xMutex_sock` and `xMutex_http`) to ensure
- * exclusive access and logs a completion message before returning true.
+ * The queued entries are not waited for, `warmRestart()` moves them into the snapshot. The
+ * recovery task is not waited for either: it holds `xMutex_sock` through its backoff and a
+ * full read, and the device is read again after the restart. Runs in the loop, the wait
+ * stays well inside its heartbeat.
  *
- * @return true If both queues are empty and the mutexes are successfully taken.
- * @return false If the queues are not empty within the 5-second timeout.
+ * @return true if the HTTP task was idle or finished its POST in time.
  */
 bool queStat()
 {
-    unsigned long timeout = millis();
+    if (xSemaphoreTake(xMutex_http, pdMS_TO_TICKS(QUE_STAT_WAIT_MS)) != pdTRUE)
+    {
+        LOG_W(">>> POST still in flight, restarting anyway");
+        return false;
+    }
+    LOG_I("HTTP task idle");
+    return true;
+}
+
+/**
+ * @brief Moves the queued socket recovery and mySQL posts into the warm restart snapshot.
+ *
+ * Non-blocking, safe from the watchdog monitor. The queues are left empty, only call this
+ * right before a restart.
+ *
+ * @return Number of entries saved.
+ */
+int pendingCollect(warmState_t &state)
+{
+    socket_t sock;
+    message_t msg;
+    while (QueSocket_Handle != NULL && state.sockets < WARM_MAX_SOCKETS && xQueueReceive(QueSocket_Handle, &sock, 0) == pdPASS)
+    {
+        warmSocket_t &w = state.socket[state.sockets++];
+        memcpy(w.ipAddr, sock.ipAddr, sizeof(w.ipAddr));
+        memcpy(w.cmd, sock.cmd, sizeof(w.cmd));
+    }
+    while (QueHTTP_Handle != NULL && state.posts < WARM_MAX_POSTS && xQueueReceive(QueHTTP_Handle, &msg, 0) == pdPASS)
+    {
+        warmPost_t &w = state.post[state.posts++];
+        memcpy(w.device, msg.device, sizeof(w.device));
+        memcpy(w.line, msg.line, sizeof(w.line));
+        w.key = msg.key;
+    }
+    return state.sockets + state.posts;
+}
 
-    while (uxQueueMessagesWaiting(QueSocket_Handle) > 0 || uxQueueMessagesWaiting(QueHTTP_Handle) > 0)
+/**
+ * @brief Puts the recovery work saved by the previous boot back on the queues, each entry
+ *        with a flow credit. Entries that find no credit or no queue slot are dropped and
+ *        counted (`flow_dropped_total`).
+ */
+void pendingRestore(const warmState_t &state)
+{
+    socket_t sock;
+    message_t msg;
+    int lostSockets = 0, lostPosts = 0;
+    for (int i = 0; i < state.sockets; i++)
     {
-        if (millis() - timeout > 5000)
+        sock.fun_ptr = &socketClient;
+        memcpy(sock.ipAddr, state.socket[i].ipAddr, sizeof(sock.ipAddr));
+        memcpy(sock.cmd, state.socket[i].cmd, sizeof(sock.cmd));
+        sock.ipAddr[sizeof(sock.ipAddr) - 1] = sock.cmd[sizeof(sock.cmd) - 1] = 0;
+        sock.tries = 0;
+        if (!flowAcquire(FLOW_RECOVERY, FLOW_HIGH))
+            lostSockets++;
+        else if (xQueueSend(QueSocket_Handle, (void *)&sock, 0) != pdTRUE)
         {
-            Serial.println(">>> Queue Timeout!");
-            return false;
+            flowRelease(FLOW_RECOVERY);
+            lostSockets++;
         }
-        Serial.println("Queues are busy...");
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
     }
-    Serial.println("Queues are clear...");
-
-    // if the tasks are running will do a non-block wait unit its done
-    xSemaphoreTake(xMutex_sock, portMAX_DELAY);
-    xSemaphoreTake(xMutex_http, portMAX_DELAY);
-    Serial.println("All tasks complete");
-    return true;
+    for (int i = 0; i < state.posts; i++)
+    {
+        memcpy(msg.device, state.post[i].device, sizeof(msg.device));
+        memcpy(msg.line, state.post[i].line, sizeof(msg.line));
+        msg.device[sizeof(msg.device) - 1] = msg.line[sizeof(msg.line) - 1] = 0;
+        msg.key = state.post[i].key;
+        if (!flowAcquire(FLOW_UPLOAD, FLOW_HIGH))
+            lostPosts++;
+        else if (xQueueSend(QueHTTP_Handle, (void *)&msg, 0) != pdTRUE)
+        {
+            flowRelease(FLOW_UPLOAD);
+            lostPosts++;
+        }
+    }
+    if (lostSockets)
+        flowDropped(FLOW_RECOVERY, FLOW_HIGH, lostSockets);
+    if (lostPosts)
+        flowDropped(FLOW_UPLOAD, FLOW_HIGH, lostPosts);
+    if (lostSockets || lostPosts)
+        LOG_W("warm restore: %d retries and %d posts dropped, no credit", lostSockets, lostPosts);
 }
 
 /**
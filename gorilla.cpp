@@ -0,0 +1,312 @@
+/**
+ * @file gorilla.cpp
+ * @brief Columnar encoder for sensor readings: delta-of-delta timestamps and Gorilla XOR
+ *        float compression (Pelkonen et al., "Gorilla", VLDB 2015), adapted to float32.
+ *
+ * A reading queued for mySQL is a ~90 byte form line in a 120 byte `message_t`, a raw row
+ * is 16 bytes (timestamp + 3 floats). Poll timestamps are nearly periodic and a sensor value
+ * changes little between polls, so most samples encode to a few bits per column.
+ *
+ * @details
+ * - **Columns**: every block has one bit stream for the timestamps and one per value
+ *   column, so each column keeps its own XOR window and a constant column (e.g. the ADS1115
+ *   multiplier) costs one bit per sample.
+ * - **Timestamps** (seconds): the first is kept in `t0`. After that the delta-of-delta
+ *   `dod` is written as '0' (dod 0), '10'+7 bits (-63..64), '110'+9 bits (-255..256),
+ *   '1110'+12 bits (-2047..2048) or '1111'+32 bits.
+ * - **Values** (float32 bits): the first is written as 32 bits. After that the XOR with the
+ *   previous value is written as '0' (equal), '10'+meaningful bits when they fit in the
+ *   previous leading/trailing zero window, or '11'+5 bits leading zeros+5 bits length-1+
+ *   meaningful bits.
+ * - **Blocks**: `gorillaAppend()` returns false when a column could not take a worst case
+ *   sample any more, the caller seals the block and starts a new one. Blocks are fixed
+ *   size PODs, history.cpp keeps them in RAM and spill.cpp writes them to LittleFS.
+ * - **Decoding**: `gorillaOpen()`/`gorillaNext()` stream the samples back one at a time,
+ *   the cursor is a few dozen bytes and can be kept across calls (spill replay).
+ * - **Benchmark**: the "gbench" terminal command encodes and decodes synthetic temperature
+ *   (60 s) and voltage (5 s) series and prints bytes per sample and ns per sample.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <time.h>
+#include <Blynk/BlynkHandlers.h>
+#include "gorilla.h"
+#include "mailbox.h"
+
+#define TS_WORST_BITS 36
+#define VAL_WORST_BITS 44
+#define NO_WINDOW 0xff
+#define GORILLA_BENCH_SAMPLES 20000
+#define GORILLA_BENCH_CHUNK 64
+
+static void putBits(uint8_t *buf, uint16_t &pos, uint32_t value, int n)
+{
+    while (n > 0)
+    {
+        int room = 8 - (pos & 7);
+        int take = n < room ? n : room;
+        uint32_t bits = (value >> (n - take)) & ((1u << take) - 1);
+        buf[pos >> 3] |= bits << (room - take);
+        pos += take;
+        n -= take;
+    }
+}
+
+static uint32_t getBits(const uint8_t *buf, uint16_t &pos, int n)
+{
+    uint32_t value = 0;
+    while (n > 0)
+    {
+        int room = 8 - (pos & 7);
+        int take = n < room ? n : room;
+        value = (value << take) | ((buf[pos >> 3] >> (room - take)) & ((1u << take) - 1));
+        pos += take;
+        n -= take;
+    }
+    return value;
+}
+
+static inline uint32_t floatBits(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static inline float bitsFloat(uint32_t u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+void gorillaReset(gorillaBlock_t &b)
+{
+    memset(&b, 0, sizeof(b));
+    memset(b.lead, NO_WINDOW, sizeof(b.lead));
+}
+
+static void putTimestamp(gorillaBlock_t &b, uint32_t ts)
+{
+    int32_t delta = (int32_t)(ts - b.lastTs);
+    int32_t dod = delta - b.lastDelta;
+    if (dod == 0)
+        putBits(b.ts, b.tsBits, 0, 1);
+    else if (dod >= -63 && dod <= 64)
+        putBits(b.ts, b.tsBits, 0x2 << 7 | (dod + 63), 9);
+    else if (dod >= -255 && dod <= 256)
+        putBits(b.ts, b.tsBits, 0x6 << 9 | (dod + 255), 12);
+    else if (dod >= -2047 && dod <= 2048)
+        putBits(b.ts, b.tsBits, 0xe << 12 | (dod + 2047), 16);
+    else
+    {
+        putBits(b.ts, b.tsBits, 0xf, 4);
+        putBits(b.ts, b.tsBits, (uint32_t)dod, 32);
+    }
+    b.lastDelta = delta;
+}
+
+static void putValue(gorillaBlock_t &b, int col, uint32_t u)
+{
+    uint8_t *buf = b.val[col];
+    uint16_t &pos = b.valBits[col];
+    uint32_t x = u ^ b.lastVal[col];
+    b.lastVal[col] = u;
+    if (x == 0)
+    {
+        putBits(buf, pos, 0, 1);
+        return;
+    }
+    int lead = __builtin_clz(x), trail = __builtin_ctz(x);
+    if (lead > 31)
+        lead = 31;
+    if (b.lead[col] != NO_WINDOW && lead >= b.lead[col] && trail >= b.trail[col])
+    {
+        int len = 32 - b.lead[col] - b.trail[col];
+        putBits(buf, pos, 0x2, 2);
+        putBits(buf, pos, x >> b.trail[col], len);
+        return;
+    }
+    int len = 32 - lead - trail;
+    putBits(buf, pos, 0x3, 2);
+    putBits(buf, pos, lead, 5);
+    putBits(buf, pos, len - 1, 5);
+    putBits(buf, pos, x >> trail, len);
+    b.lead[col] = lead;
+    b.trail[col] = trail;
+}
+
+/**
+ * @brief Appends one sample to a block.
+ *
+ * @param ts Timestamp in seconds, not older than the previous sample.
+ * @param values One value per column.
+ * @return false if the block is full, the sample was not added.
+ */
+bool gorillaAppend(gorillaBlock_t &b, uint32_t ts, const float values[GORILLA_COLUMNS])
+{
+    if (b.count && b.tsBits + TS_WORST_BITS > GORILLA_TS_BYTES * 8)
+        return false;
+    for (int col = 0; col < GORILLA_COLUMNS; col++)
+        if (b.valBits[col] + VAL_WORST_BITS > GORILLA_VALUE_BYTES * 8)
+            return false;
+
+    if (b.count == 0)
+    {
+        b.t0 = b.lastTs = ts;
+        for (int col = 0; col < GORILLA_COLUMNS; col++)
+        {
+            b.lastVal[col] = floatBits(values[col]);
+            putBits(b.val[col], b.valBits[col], b.lastVal[col], 32);
+        }
+    }
+    else
+    {
+        putTimestamp(b, ts);
+        b.lastTs = ts;
+        for (int col = 0; col < GORILLA_COLUMNS; col++)
+            putValue(b, col, floatBits(values[col]));
+    }
+    b.count++;
+    return true;
+}
+
+/**
+ * @brief Encoded size of a block's samples (header plus the used bits of every column).
+ */
+uint16_t gorillaBytes(const gorillaBlock_t &b)
+{
+    uint16_t bytes = sizeof(b.t0) + sizeof(b.count) + (b.tsBits + 7) / 8;
+    for (int col = 0; col < GORILLA_COLUMNS; col++)
+        bytes += (b.valBits[col] + 7) / 8;
+    return bytes;
+}
+
+void gorillaOpen(gorillaCursor_t &c, const gorillaBlock_t *b)
+{
+    memset(&c, 0, sizeof(c));
+    c.b = b;
+}
+
+/**
+ * @brief Decodes the next sample of the cursor's block.
+ * @return false when the block has no more samples.
+ */
+bool gorillaNext(gorillaCursor_t &c, uint32_t &ts, float values[GORILLA_COLUMNS])
+{
+    const gorillaBlock_t &b = *c.b;
+    if (c.i >= b.count || c.tsPos > b.tsBits || b.tsBits > GORILLA_TS_BYTES * 8)
+        return false; // done, or a corrupt block
+    if (c.i == 0)
+    {
+        c.ts = b.t0;
+        for (int col = 0; col < GORILLA_COLUMNS; col++)
+            c.val[col] = getBits(b.val[col], c.valPos[col], 32);
+    }
+    else
+    {
+        int32_t dod;
+        if (getBits(b.ts, c.tsPos, 1) == 0)
+            dod = 0;
+        else if (getBits(b.ts, c.tsPos, 1) == 0)
+            dod = (int32_t)getBits(b.ts, c.tsPos, 7) - 63;
+        else if (getBits(b.ts, c.tsPos, 1) == 0)
+            dod = (int32_t)getBits(b.ts, c.tsPos, 9) - 255;
+        else if (getBits(b.ts, c.tsPos, 1) == 0)
+            dod = (int32_t)getBits(b.ts, c.tsPos, 12) - 2047;
+        else
+            dod = (int32_t)getBits(b.ts, c.tsPos, 32);
+        c.delta += dod;
+        c.ts += c.delta;
+
+        for (int col = 0; col < GORILLA_COLUMNS; col++)
+        {
+            const uint8_t *buf = b.val[col];
+            uint16_t &pos = c.valPos[col];
+            if (getBits(buf, pos, 1) == 0)
+                continue; // same value
+            if (getBits(buf, pos, 1))
+            {
+                c.lead[col] = getBits(buf, pos, 5);
+                c.trail[col] = 32 - c.lead[col] - (getBits(buf, pos, 5) + 1);
+            }
+            c.val[col] ^= getBits(buf, pos, 32 - c.lead[col] - c.trail[col]) << c.trail[col];
+        }
+    }
+    ts = c.ts;
+    for (int col = 0; col < GORILLA_COLUMNS; col++)
+        values[col] = bitsFloat(c.val[col]);
+    c.i++;
+    return true;
+}
+
+/**
+ * @brief Sample timestamp: epoch seconds once NTP has set the clock, uptime seconds before.
+ */
+uint32_t gorillaNow()
+{
+    time_t now = time(NULL);
+    return now >= GORILLA_EPOCH_VALID ? (uint32_t)now : millis() / 1000;
+}
+
+static void benchSeries(const char *name, uint32_t period, float base, float step, float noise, float scale)
+{
+    static gorillaBlock_t block;
+    static uint32_t stamps[GORILLA_BENCH_CHUNK];
+    static float rows[GORILLA_BENCH_CHUNK][GORILLA_COLUMNS];
+    gorillaCursor_t cur;
+    char tmp[MAILBOX_TEXT_LEN];
+    uint32_t bytes = 0, encUs = 0, decUs = 0, decoded = 0, ts = 1700000000, seed = 12345;
+    float v = base, out[GORILLA_COLUMNS];
+
+    gorillaReset(block);
+    for (int n = 0; n < GORILLA_BENCH_SAMPLES; n += GORILLA_BENCH_CHUNK)
+    {
+        for (int i = 0; i < GORILLA_BENCH_CHUNK; i++, ts += period)
+        {
+            seed = seed * 1103515245 + 12345;
+            v += step + noise * ((int)((seed >> 8) % 201) - 100) / 100.0f;
+            stamps[i] = ts + ((seed >> 16) % 3 == 0); // a poll now and then lands a second late
+            rows[i][0] = roundf(v * 100) / 100;       // the devices send two decimals
+            rows[i][1] = roundf((v * 0.5f + 10) * 100) / 100;
+            rows[i][2] = scale;
+        }
+        int i = 0;
+        while (i < GORILLA_BENCH_CHUNK)
+        {
+            uint32_t start = micros();
+            while (i < GORILLA_BENCH_CHUNK && gorillaAppend(block, stamps[i], rows[i]))
+                i++;
+            encUs += micros() - start;
+            if (i == GORILLA_BENCH_CHUNK)
+                break;
+            bytes += gorillaBytes(block); // full, decode it and start the next one
+            start = micros();
+            gorillaOpen(cur, &block);
+            uint32_t t;
+            while (gorillaNext(cur, t, out))
+                decoded++;
+            decUs += micros() - start;
+            gorillaReset(block);
+        }
+    }
+    bytes += gorillaBytes(block);
+    snprintf(tmp, sizeof(tmp), "\t%s %.2f B/sample (text 120, raw 16) enc %u ns dec %u ns\n", name,
+             (float)bytes / GORILLA_BENCH_SAMPLES, (unsigned)((uint64_t)encUs * 1000 / GORILLA_BENCH_SAMPLES),
+             (unsigned)(decoded ? (uint64_t)decUs * 1000 / decoded : 0));
+    Serial.print(tmp);
+    widgetPrint(V42, tmp);
+}
+
+/**
+ * @brief Terminal "gbench": bytes per sample and encode/decode time per sample.
+ */
+void gorillaBench()
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    snprintf(tmp, sizeof(tmp), "gbench: %d samples per series\n", GORILLA_BENCH_SAMPLES);
+    widgetPrint(V42, tmp);
+    benchSeries("temp 60s", 60, 71.5f, 0.001f, 0.05f, 1.0f);
+    benchSeries("volt 5s", 5, 12.8f, -0.0001f, 0.02f, 4.0f);
+}
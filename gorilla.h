@@ -0,0 +1,47 @@
+/**
+ * @file gorilla.h
+ * @brief Columnar block encoding of sensor readings: delta-of-delta timestamps and
+ *        Gorilla XOR floats, one bit stream per column.
+ *
+ * A block is a fixed size POD, it can be kept in RAM or written to LittleFS as is.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define GORILLA_COLUMNS 3 // first three values of a sensor reading
+#define GORILLA_TS_BYTES 48
+#define GORILLA_VALUE_BYTES 96
+#define GORILLA_EPOCH_VALID 1600000000 // timestamps below are uptime, NTP had not set the clock
+
+typedef struct
+{
+    uint32_t t0; // first timestamp, seconds
+    uint16_t count;
+    uint16_t tsBits;
+    uint16_t valBits[GORILLA_COLUMNS];
+    // encoder state, not needed to decode
+    uint32_t lastTs;
+    int32_t lastDelta;
+    uint32_t lastVal[GORILLA_COLUMNS];
+    uint8_t lead[GORILLA_COLUMNS], trail[GORILLA_COLUMNS];
+    uint8_t ts[GORILLA_TS_BYTES];
+    uint8_t val[GORILLA_COLUMNS][GORILLA_VALUE_BYTES];
+} gorillaBlock_t;
+
+typedef struct
+{
+    const gorillaBlock_t *b;
+    uint16_t i, tsPos, valPos[GORILLA_COLUMNS];
+    uint32_t ts;
+    int32_t delta;
+    uint32_t val[GORILLA_COLUMNS];
+    uint8_t lead[GORILLA_COLUMNS], trail[GORILLA_COLUMNS];
+} gorillaCursor_t;
+
+void gorillaReset(gorillaBlock_t &b);
+bool gorillaAppend(gorillaBlock_t &b, uint32_t ts, const float values[GORILLA_COLUMNS]);
+uint16_t gorillaBytes(const gorillaBlock_t &b);
+void gorillaOpen(gorillaCursor_t &c, const gorillaBlock_t *b);
+bool gorillaNext(gorillaCursor_t &c, uint32_t &ts, float values[GORILLA_COLUMNS]);
+uint32_t gorillaNow();
+void gorillaBench();
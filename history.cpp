@@ -0,0 +1,184 @@
+/**
+ * @file history.cpp
+ * @brief Recent reading history per sensor type, kept Gorilla encoded in RAM.
+ *
+ * Every row `processSensorData()` accepts is appended to its sensor's channel: a ring of
+ * `HIST_BLOCKS` blocks (gorilla.cpp), the oldest block is dropped when a new one is started.
+ * At a few bytes per sample a 9 KB table keeps hours of 60 s readings where the same RAM
+ * would hold about 100 queued form lines.
+ *
+ * @details
+ * - **Append**: `historyAppend()` encodes under a spinlock, a few microseconds, safe from
+ *   the poller, push and recovery tasks.
+ * - **Export**: `historyForEach()` streams the samples of a sensor oldest first through a
+ *   callback, one block copy at a time, the lock is not held while the callback runs.
+ * - **Terminal**: "hist" lists samples, encoded bytes, bytes per sample and the time span
+ *   per sensor; "hist <sensor>" prints the last `HIST_SHOW` decoded samples.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <Blynk/BlynkHandlers.h>
+#include "gorilla.h"
+#include "mailbox.h"
+#include "reading.h"
+
+#define HIST_SENSORS 6 // sensor types in sensorMap
+#define HIST_BLOCKS 4
+#define HIST_SHOW 8
+
+typedef struct
+{
+    char sensor[10];
+    uint8_t head, used; // newest block, blocks in use
+    gorillaBlock_t block[HIST_BLOCKS];
+} histChannel_t;
+
+typedef struct
+{
+    uint32_t ts[HIST_SHOW];
+    float values[HIST_SHOW][GORILLA_COLUMNS];
+    int n;
+} histTail_t;
+
+static histChannel_t channels[HIST_SENSORS];
+static int channelCount = 0;
+static portMUX_TYPE histMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Function Prototypes
+void historyAppend(const sensorReading_t &reading);
+int historyForEach(const char *sensor, void (*fn)(uint32_t ts, const float values[], void *arg), void *arg);
+void historyReport(String args);
+
+// called with histMux held, the name is matched without case ("hist bme280" from the terminal)
+static histChannel_t *findChannel(const char *sensor, bool create)
+{
+    for (int i = 0; i < channelCount; i++)
+        if (strncasecmp(channels[i].sensor, sensor, sizeof(channels[i].sensor) - 1) == 0)
+            return &channels[i];
+    if (!create || channelCount == HIST_SENSORS)
+        return NULL;
+    histChannel_t *ch = &channels[channelCount++];
+    strncpy(ch->sensor, sensor, sizeof(ch->sensor) - 1);
+    gorillaReset(ch->block[0]);
+    ch->head = 0;
+    ch->used = 1;
+    return ch;
+}
+
+/**
+ * @brief Appends one sensor reading (its first `GORILLA_COLUMNS` values: value1, value2 and
+ *        the key) to the sensor's history.
+ */
+void historyAppend(const sensorReading_t &reading)
+{
+    float values[GORILLA_COLUMNS];
+    readingValues(reading, values, GORILLA_COLUMNS);
+    uint32_t ts = gorillaNow();
+    portENTER_CRITICAL(&histMux);
+    histChannel_t *ch = findChannel(reading.sensor, true);
+    if (ch != NULL && !gorillaAppend(ch->block[ch->head], ts, values))
+    {
+        ch->head = (ch->head + 1) % HIST_BLOCKS;
+        if (ch->used < HIST_BLOCKS)
+            ch->used++;
+        gorillaReset(ch->block[ch->head]);
+        gorillaAppend(ch->block[ch->head], ts, values);
+    }
+    portEXIT_CRITICAL(&histMux);
+}
+
+/**
+ * @brief Streams the history of a sensor, oldest sample first.
+ *
+ * @return Number of samples passed to `fn`.
+ */
+int historyForEach(const char *sensor, void (*fn)(uint32_t ts, const float values[], void *arg), void *arg)
+{
+    gorillaBlock_t copy;
+    gorillaCursor_t cur;
+    float values[GORILLA_COLUMNS];
+    uint32_t ts;
+    int n = 0;
+
+    for (int k = HIST_BLOCKS - 1; k >= 0; k--)
+    {
+        bool valid = false;
+        portENTER_CRITICAL(&histMux);
+        histChannel_t *ch = findChannel(sensor, false);
+        if (ch != NULL && k < ch->used)
+        {
+            memcpy(&copy, &ch->block[(ch->head + HIST_BLOCKS - k) % HIST_BLOCKS], sizeof(copy));
+            valid = true;
+        }
+        portEXIT_CRITICAL(&histMux);
+        if (!valid)
+            continue;
+        gorillaOpen(cur, &copy);
+        while (gorillaNext(cur, ts, values))
+        {
+            fn(ts, values, arg);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void keepTail(uint32_t ts, const float values[], void *arg)
+{
+    histTail_t *tail = (histTail_t *)arg;
+    int i = tail->n++ % HIST_SHOW;
+    tail->ts[i] = ts;
+    memcpy(tail->values[i], values, sizeof(tail->values[i]));
+}
+
+/**
+ * @brief Terminal "hist": per sensor size of the history, "hist <sensor>" its last samples.
+ */
+void historyReport(String args)
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    args.trim();
+    if (args.length())
+    {
+        static histTail_t tail; // terminal handler only
+        tail.n = 0;
+        historyForEach(args.c_str(), keepTail, &tail);
+        snprintf(tmp, sizeof(tmp), "hist %s: %d samples\n", args.c_str(), tail.n);
+        widgetPrint(V42, tmp);
+        for (int k = tail.n > HIST_SHOW ? tail.n - HIST_SHOW : 0; k < tail.n; k++)
+        {
+            int i = k % HIST_SHOW;
+            snprintf(tmp, sizeof(tmp), "\t%u %.2f %.2f %.2f\n", tail.ts[i], tail.values[i][0], tail.values[i][1], tail.values[i][2]);
+            widgetPrint(V42, tmp);
+        }
+        return;
+    }
+
+    widgetPrint(V42, "hist: sensor samples bytes B/sample span\n");
+    for (int i = 0; i < HIST_SENSORS; i++)
+    {
+        char sensor[10];
+        uint32_t samples = 0, bytes = 0, first = 0, last = 0;
+        portENTER_CRITICAL(&histMux);
+        bool valid = i < channelCount;
+        if (valid)
+        {
+            histChannel_t &ch = channels[i];
+            memcpy(sensor, ch.sensor, sizeof(sensor));
+            for (int k = 0; k < ch.used; k++)
+            {
+                samples += ch.block[k].count;
+                bytes += gorillaBytes(ch.block[k]);
+            }
+            first = ch.block[(ch.head + HIST_BLOCKS - ch.used + 1) % HIST_BLOCKS].t0;
+            last = ch.block[ch.head].lastTs;
+        }
+        portEXIT_CRITICAL(&histMux);
+        if (!valid)
+            break;
+        snprintf(tmp, sizeof(tmp), "\t%-8s %5u %6u %5.2f %5.1f h\n", sensor, samples, bytes,
+                 samples ? (float)bytes / samples : 0.0f, (last - first) / 3600.0f);
+        widgetPrint(V42, tmp);
+    }
+}
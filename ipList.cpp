@@ -0,0 +1,125 @@
+/**
+ * @file ipList.cpp
+ * @brief Incremental parser of the ip.php device list, fed straight from the HTTP body.
+ *
+ * Format: "<count>|<name>:<ip>|<name>:<ip>|...", e.g. "2|DS1_DS1:192.168.1.5|BMP:192.168.1.7|".
+ * A name may carry a prefix up to a ',' which is dropped (only the part after the last ','
+ * is the device name), whitespace and line ends are ignored.
+ *
+ * @details
+ * - **Streaming**: `ipListFeed()` takes the body in pieces of any size, a record may be
+ *   split anywhere. The state is one name and one IP buffer, memory does not grow with
+ *   the fleet.
+ * - **Records**: every complete "<name>:<ip>|" is passed to `onDevice` as it ends. A field
+ *   longer than its buffer or a record without ':' is skipped.
+ * - **End**: `ipListDone()` is true once `<count>` records have been seen. A body cut
+ *   short is not done, the caller keeps its previous list.
+ * - **Change detection**: `hash` is FNV-1a over the bytes fed, the poller compares it with
+ *   the previous fetch instead of keeping the previous body.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <algorithm>
+#include "ipList.h"
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define IPLIST_MAX_COUNT 10000
+
+enum
+{
+    IPL_COUNT,
+    IPL_NAME,
+    IPL_IP,
+    IPL_END,
+};
+
+void ipListBegin(ipListParser_t &p, ipListDevice_t onDevice, void *arg)
+{
+    memset(&p, 0, sizeof(p));
+    p.state = IPL_COUNT;
+    p.hash = FNV_OFFSET;
+    p.onDevice = onDevice;
+    p.arg = arg;
+}
+
+static inline void put(ipListParser_t &p, char *field, size_t size, char c)
+{
+    if (p.len < size - 1)
+        field[p.len++] = c;
+    else
+        p.overflow = true;
+}
+
+// '|' ends a record
+static void endRecord(ipListParser_t &p, bool complete)
+{
+    if (complete && !p.overflow && p.name[0] && p.len)
+    {
+        p.ip[p.len] = 0;
+        p.onDevice(p.name, p.ip, p.arg);
+        p.count++;
+    }
+    p.seen++;
+    p.state = p.seen >= p.expected ? IPL_END : IPL_NAME;
+    p.len = 0;
+    p.overflow = false;
+    p.name[0] = 0;
+}
+
+/**
+ * @brief Parses the next `n` bytes of the body.
+ */
+void ipListFeed(ipListParser_t &p, const char *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        char c = buf[i];
+        p.hash = (p.hash ^ (uint8_t)c) * FNV_PRIME;
+        if (c == ' ' || c == '\r' || c == '\n' || c == '\t')
+            continue;
+        switch (p.state)
+        {
+        case IPL_COUNT:
+            if (c >= '0' && c <= '9')
+                p.expected = std::min(p.expected * 10 + (c - '0'), IPLIST_MAX_COUNT);
+            else if (c == '|')
+                p.state = p.expected ? IPL_NAME : IPL_END;
+            break;
+        case IPL_NAME:
+            if (c == '|')
+                endRecord(p, false); // no ip
+            else if (c == ',')
+            {
+                p.len = 0; // prefix, the name follows
+                p.overflow = false;
+            }
+            else if (c == ':')
+            {
+                p.name[p.len] = 0;
+                p.len = 0;
+                p.state = IPL_IP;
+            }
+            else
+                put(p, p.name, sizeof(p.name), c);
+            break;
+        case IPL_IP:
+            if (c == '|')
+                endRecord(p, true);
+            else
+                put(p, p.ip, sizeof(p.ip), c);
+            break;
+        case IPL_END:
+            break;
+        }
+    }
+}
+
+/**
+ * @brief true once the announced number of records has been parsed.
+ */
+bool ipListDone(const ipListParser_t &p)
+{
+    return p.state == IPL_END;
+}
@@ -0,0 +1,30 @@
+/**
+ * @file ipList.h
+ * @brief Incremental parser of the ip.php device list "<count>|<name>:<ip>|...".
+ */
+#pragma once
+#include <Arduino.h>
+
+#define IPLIST_NAME_LEN 24
+#define IPLIST_IP_LEN 20
+
+typedef void (*ipListDevice_t)(const char *name, const char *ip, void *arg);
+
+typedef struct
+{
+    uint8_t state;
+    uint8_t len;
+    bool overflow;        // current field longer than its buffer, record skipped
+    int expected;         // <count>
+    int seen;             // records ended by '|'
+    int count;            // records passed to onDevice
+    uint32_t hash;        // FNV-1a of the body, to tell whether the list changed
+    ipListDevice_t onDevice;
+    void *arg;
+    char name[IPLIST_NAME_LEN];
+    char ip[IPLIST_IP_LEN];
+} ipListParser_t;
+
+void ipListBegin(ipListParser_t &p, ipListDevice_t onDevice, void *arg);
+void ipListFeed(ipListParser_t &p, const char *buf, size_t n);
+bool ipListDone(const ipListParser_t &p);
@@ -29,7 +29,8 @@
  *
  * Usage:
  * - Call aes_init() to initialize the AES library before using encryption or decryption functions.
- * - Use decryptWifiCredentials() to retrieve and decrypt WiFi credentials stored in a file.
+ * - Use decryptWifiCredentials() to decrypt the WiFi credentials kept in the config record (config.cpp).
+ * - configImportLegacy() reads the old text files once, when the config record is built.
  * - Use encrypt_stub() or encrypt_to_ciphertext() to encrypt data.
  * - Use decrypt_to_cleartext() to decrypt data.
  */
@@ -38,6 +39,7 @@
 #include <WiFi.h>
 #include <AESLib.h>
 #include <LittleFS.h>
+#include "config.h"
 #define INPUT_BUFFER_LIMIT 2048
 AESLib aesLib;
 byte aes_key[N_BLOCK] ;
@@ -52,8 +54,25 @@ uint16_t encrypt_to_ciphertext(char *msg, byte iv[]);
 void encrypt_stub(char *str, char *str2);
 void decrypt_to_cleartext(char *msg, uint16_t msgLen, byte iv[], char *cleartext);
 int decryptWifiCredentials(char *auth, char *ssid, char *pass);
+bool configImportLegacy(config_t &c);
 int readAES(char *fileName, byte data[]);
 
+/**
+ * @brief Reads a whole file with one read() call instead of one call per byte.
+ */
+static String readFile(File &file)
+{
+  size_t len = file.size();
+  char *buf = (char *)malloc(len + 1);
+  if (buf == NULL)
+    return String();
+  size_t n = file.read((uint8_t *)buf, len);
+  buf[n] = 0;
+  String text(buf);
+  free(buf);
+  return text;
+}
+
 void aes_init()
 {
   // aesLib.gen_iv(aes_iv);
@@ -147,63 +166,31 @@ void decrypt_to_cleartext(char *msg, uint16_t msgLen, byte iv[], char *cleartext
 /**
  * @brief Decrypts Wi-Fi credentials (SSID and password) and retrieves the Blynk authentication token.
  * 
- * This function reads encrypted Wi-Fi credentials and a Blynk authentication token from the file system,
- * decrypts the credentials, and stores the results in the provided buffers.
+ * The token, the AES key/IV and the encrypted credentials come from the config record
+ * (`cfg()`, see config.cpp), already loaded by `configLoad()`. Nothing is read from flash here.
  * 
  * @param auth Pointer to a character array where the Blynk authentication token will be stored.
  * @param ssid Pointer to a character array where the decrypted Wi-Fi SSID will be stored.
  * @param pass Pointer to a character array where the decrypted Wi-Fi password will be stored.
- * @return int Returns 0 on success, or 2 if the encrypted credentials file cannot be opened.
- * 
- * @note This function relies on the LittleFS file system and assumes the existence of specific files:
- *       - "/blynkAuth.txt" for the Blynk authentication token.
- *       - "/aes.txt" for the AES encryption key.
- *       - "/iv.txt" for the AES initialization vector.
- *       - "/ssid_pass_aes.txt" for the encrypted Wi-Fi credentials.
- * 
- * @warning If the file system cannot be mounted or required files are missing, the function will
- *          restart the ESP device.
+ * @return int Returns 0 on success, or 2 if the config record holds no encrypted credentials.
  * 
  * @warning The function assumes that the provided buffers are large enough to hold the respective
  *          strings. Ensure proper buffer sizes to avoid buffer overflows.
  */
 int decryptWifiCredentials(char * auth ,char *ssid, char *pass)
 {
-  String ssid_psw_aes,tmp;
-
-  bool success = LittleFS.begin();
-  if (!success)
+  const config_t *c = cfg();
+  strcpy(auth, c->blynkAuth);
+  memcpy(aes_key, c->aesKey, sizeof(aes_key));
+  memcpy(aes_iv, c->aesIv, sizeof(aes_iv));
+  if (!c->wifiCipher[0])
   {
-    Serial.println("Error mounting the file system");
-    ESP.restart();
-  }
-  File file = LittleFS.open("/blynkAuth.txt", "r");
-  if (!file)
-  {
-    Serial.println("Failed to open blynkAuth.txt file for reading");
-    ESP.restart();
-  }
-  tmp.clear();
-  while (file.available())
-    tmp.concat(static_cast<char>(file.read()));
-  strcpy(auth, tmp.c_str());
-
-  readAES((char *)"/aes.txt", aes_key);
-  readAES((char *)"/iv.txt", aes_iv);
-   file = LittleFS.open("/ssid_pass_aes.txt", "r");
-  if (!file)
-  {
-    Serial.println("Failed to open ssid_pass_aes.txt file for reading");
+    Serial.println("No encrypted WiFi credentials in the config");
     return 2;
   }
-  ssid_psw_aes.clear();
-  while (file.available())
-    ssid_psw_aes.concat(static_cast<char>(file.read()));
-
-  file.close();
   // save a copy decrypt_to_cleartext() corrupts byte array aes_iv!
   memcpy(enc_iv_to, aes_iv, sizeof(aes_iv));
-  decrypt_to_cleartext((char *)ssid_psw_aes.c_str(), ssid_psw_aes.length(), enc_iv_to, cleartext);
+  decrypt_to_cleartext((char *)c->wifiCipher, strlen(c->wifiCipher), enc_iv_to, cleartext);
   String temp = cleartext;
   int index = temp.indexOf(":");
   strcpy(ssid, (temp.substring(0, index)).c_str());
@@ -211,21 +198,65 @@ int decryptWifiCredentials(char * auth ,char *ssid, char *pass)
 
   return 0;
 }
+/**
+ * @brief Copies the credentials from the legacy text files into a config record.
+ *
+ * Only used when the config record is built (first boot with config.cpp, or after the
+ * record was lost). The files are:
+ *       - "/blynkAuth.txt" for the Blynk authentication token.
+ *       - "/aes.txt" for the AES encryption key.
+ *       - "/iv.txt" for the AES initialization vector.
+ *       - "/ssid_pass_aes.txt" for the encrypted Wi-Fi credentials.
+ *
+ * @return false if a file is missing, whatever was found is kept.
+ */
+bool configImportLegacy(config_t &c)
+{
+  bool ok = true;
+  File file = LittleFS.open("/blynkAuth.txt", "r");
+  if (file)
+  {
+    String tmp = readFile(file);
+    file.close();
+    tmp.trim();
+    strncpy(c.blynkAuth, tmp.c_str(), sizeof(c.blynkAuth) - 1);
+  }
+  else
+  {
+    Serial.println("Failed to open blynkAuth.txt file for reading");
+    ok = false;
+  }
+  ok &= readAES((char *)"/aes.txt", c.aesKey) == 0;
+  ok &= readAES((char *)"/iv.txt", c.aesIv) == 0;
+  file = LittleFS.open("/ssid_pass_aes.txt", "r");
+  if (file)
+  {
+    String tmp = readFile(file);
+    file.close();
+    tmp.trim();
+    strncpy(c.wifiCipher, tmp.c_str(), sizeof(c.wifiCipher) - 1);
+  }
+  else
+  {
+    Serial.println("Failed to open ssid_pass_aes.txt file for reading");
+    ok = false;
+  }
+  return ok;
+}
 int readAES(char *fileName, byte data[])
 {
   File file = LittleFS.open(fileName, "r");
   if (!file)
   {
-    Serial.println("Failed to open /aes.txt file for reading");
+    Serial.printf("Failed to open %s file for reading\n", fileName);
     return 2;
   }
-  String key;
-  while (file.available())
-    key.concat(static_cast<char>(file.read()));
+  String key = readFile(file);
+  file.close();
 
   int foo, i = 0;
   char *token = strtok((char *)key.c_str(), ",");
-  while (token != NULL)
+  while (token != NULL && i < N_BLOCK)
   {
     sscanf(token, "%x", &foo); // convert ASCII string to hex 0xYY
     data[i++] = foo;
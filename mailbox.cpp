@@ -0,0 +1,172 @@
+/**
+ * @file mailbox.cpp
+ * @brief Bounded lock-free multi-producer/single-consumer mailbox for widget updates.
+ *
+ * @details
+ * - Each slot carries a sequence number; producers claim a slot with a CAS on `head`,
+ *   fill it, then publish it by bumping the slot sequence (Vyukov bounded queue).
+ * - The loop task is the only consumer and calls `mailboxFetch()` until it returns false.
+ * - Posting never blocks: when the mailbox is full the update is dropped and counted,
+ *   the next sweep will send a fresh value anyway.
+ *
+ * @note No FreeRTOS primitives are used so posting is safe from any task without
+ *       risking priority inversion with the Blynk loop.
+ * @note Slot sequences are stored relative to the slot index so the zero-initialised
+ *       array is already a valid empty mailbox, no init call is needed before tasks start.
+ */
+#include <Arduino.h>
+#include <atomic>
+#include <algorithm>
+#include "mailbox.h"
+
+typedef struct
+{
+    std::atomic<uint32_t> seq;
+    widget_t msg;
+} slot_t;
+
+static slot_t slots[MAILBOX_SIZE];
+static std::atomic<uint32_t> head(0), tail(0), dropped(0);
+
+static inline uint32_t slotSeq(uint32_t pos)
+{
+    return slots[pos & (MAILBOX_SIZE - 1)].seq.load(std::memory_order_acquire) + (pos & (MAILBOX_SIZE - 1));
+}
+
+static inline void setSlotSeq(uint32_t pos, uint32_t seq)
+{
+    slots[pos & (MAILBOX_SIZE - 1)].seq.store(seq - (pos & (MAILBOX_SIZE - 1)), std::memory_order_release);
+}
+
+/**
+ * @brief Posts a widget update to the mailbox.
+ *
+ * @param msg The update to copy into the mailbox.
+ * @return true if the update was queued, false if the mailbox is full (update dropped).
+ */
+bool mailboxPost(const widget_t &msg)
+{
+    uint32_t pos = head.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t seq = slotSeq(pos);
+        int32_t diff = (int32_t)seq - (int32_t)pos;
+        if (diff == 0)
+        {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                slots[pos & (MAILBOX_SIZE - 1)].msg = msg;
+                setSlotSeq(pos, pos + 1);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            dropped++;
+            return false; // full
+        }
+        else
+            pos = head.load(std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Fetches the oldest pending widget update. Loop task only.
+ *
+ * @param msg Receives the update.
+ * @return true if an update was returned, false if the mailbox is empty.
+ */
+bool mailboxFetch(widget_t &msg)
+{
+    uint32_t pos = tail.load(std::memory_order_relaxed);
+    uint32_t seq = slotSeq(pos);
+    if ((int32_t)seq - (int32_t)(pos + 1) < 0)
+        return false; // empty
+
+    msg = slots[pos & (MAILBOX_SIZE - 1)].msg;
+    tail.store(pos + 1, std::memory_order_relaxed);
+    setSlotSeq(pos, pos + MAILBOX_SIZE);
+    return true;
+}
+
+bool widgetWrite(uint8_t pin, float value)
+{
+    widget_t msg;
+    msg.pin = pin;
+    msg.type = WIDGET_FLOAT;
+    msg.f = value;
+    msg.text[0] = 0;
+    return mailboxPost(msg);
+}
+
+bool widgetWrite(uint8_t pin, int value)
+{
+    widget_t msg;
+    msg.pin = pin;
+    msg.type = WIDGET_INT;
+    msg.i = value;
+    msg.text[0] = 0;
+    return mailboxPost(msg);
+}
+
+bool widgetPrint(uint8_t pin, const char *text)
+{
+    widget_t msg;
+    msg.pin = pin;
+    msg.type = WIDGET_TEXT;
+    strncpy(msg.text, text, MAILBOX_TEXT_LEN - 1);
+    msg.text[MAILBOX_TEXT_LEN - 1] = 0;
+    return mailboxPost(msg);
+}
+
+/**
+ * @brief Posts a Blynk event, the description is cut to what fits after the code.
+ */
+bool widgetEvent(const char *code, const char *description)
+{
+    widget_t msg;
+    msg.pin = 0;
+    msg.type = WIDGET_EVENT;
+    size_t n = std::min(strlen(code), (size_t)MAILBOX_TEXT_LEN / 2);
+    memcpy(msg.text, code, n);
+    msg.text[n++] = 0;
+    strncpy(msg.text + n, description, MAILBOX_TEXT_LEN - n - 1);
+    msg.text[MAILBOX_TEXT_LEN - 1] = 0;
+    return mailboxPost(msg);
+}
+
+bool widgetColor(uint8_t pin, const char *color)
+{
+    widget_t msg;
+    msg.pin = pin;
+    msg.type = WIDGET_COLOR;
+    strncpy(msg.text, color, MAILBOX_TEXT_LEN - 1);
+    msg.text[MAILBOX_TEXT_LEN - 1] = 0;
+    return mailboxPost(msg);
+}
+
+/**
+ * @brief Posts a string longer than `MAILBOX_TEXT_LEN` without copying it.
+ *
+ * The caller sets `*inUse` and must leave `buf` alone until the loop has written it and
+ * cleared `*inUse`. If the post fails `*inUse` is cleared here.
+ */
+bool widgetPrintBuffer(uint8_t pin, const char *buf, volatile bool *inUse)
+{
+    widget_t msg;
+    msg.pin = pin;
+    msg.type = WIDGET_BUFFER;
+    msg.buf = buf;
+    msg.inUse = inUse;
+    msg.text[0] = 0;
+    *inUse = true;
+    if (mailboxPost(msg))
+        return true;
+    *inUse = false;
+    return false;
+}
+
+uint32_t mailboxDropped()
+{
+    return dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,49 @@
+/**
+ * @file mailbox.h
+ * @brief Lock-free mailbox carrying widget updates from worker tasks to the Arduino loop.
+ *
+ * Only the loop task may call `Blynk.virtualWrite()`. Every other task (poller, socket
+ * recovery, ...) posts a `widget_t` here and the loop drains the mailbox on each pass.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define MAILBOX_SIZE 32     // number of slots, must be a power of 2
+#define MAILBOX_TEXT_LEN 96 // longest string payload (terminal line / status message)
+
+enum widgetType_t : uint8_t
+{
+    WIDGET_FLOAT,
+    WIDGET_INT,
+    WIDGET_TEXT,
+    WIDGET_COLOR,  // text holds the color, sent with Blynk.setProperty()
+    WIDGET_BUFFER, // buf points to a caller owned string, *inUse is cleared once written
+    WIDGET_EVENT,  // text holds "<event code>\0<description>", sent with Blynk.logEvent()
+};
+
+typedef struct
+{
+    uint8_t pin;
+    widgetType_t type;
+    union
+    {
+        float f;
+        int i;
+        struct
+        {
+            const char *buf;
+            volatile bool *inUse;
+        };
+    };
+    char text[MAILBOX_TEXT_LEN];
+} widget_t;
+
+bool mailboxPost(const widget_t &msg);
+bool mailboxFetch(widget_t &msg);
+bool widgetWrite(uint8_t pin, float value);
+bool widgetWrite(uint8_t pin, int value);
+bool widgetPrint(uint8_t pin, const char *text);
+bool widgetColor(uint8_t pin, const char *color);
+bool widgetPrintBuffer(uint8_t pin, const char *buf, volatile bool *inUse);
+bool widgetEvent(const char *code, const char *description);
+uint32_t mailboxDropped();
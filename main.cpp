@@ -5,11 +5,11 @@
  *
  * This program connects an ESP32 to a Wi-Fi network, integrates with the Blynk IoT platform,
  * and communicates with a server to fetch and display device data. It also uses an OLED display
- * to show basic information and implements a watchdog timer for system reliability.
+ * to show basic information and checks every task in with a heartbeat watchdog.
  * @details
  * - The program uses Blynk for IoT communication and virtual pin updates.
  * - It fetches device information from a server and processes it for display and control.
- * - A loop watchdog timer (LWD) is implemented to reboot the system in case of a hang.
+ * - A heartbeat watchdog (watchDog.cpp) reboots the system when the loop or a task hangs.
  * - The program supports updating Blynk widgets with sensor data and managing device connections.
  *
  * @dependencies
@@ -17,7 +17,7 @@
  * - Blynk library
  * - Adafruit SSD1306 library for OLED display
  * - HTTPClient for server communication
- * - Ticker for watchdog timer
+ * - esp_task_wdt for the heartbeat watchdog
  *
  * @author Leon Freimour
  * @date YYYY-MM-DD
@@ -26,26 +26,28 @@
  *
  * @section Functions
  * - setup(): Initializes the system, connects to Wi-Fi, and sets up Blynk and the OLED display.
- * - loop(): Runs the Blynk and timer tasks.
- * - flashSSD(): Displays basic information on the OLED screen.
- * - refreshWidgets(): Periodically fetches device data from the server(s) and updates Blynk widgets.
- * - lwdtcb(): Watchdog timer callback to restart the system if the loop hangs.
- * - lwdtFeed(): Feeds the watchdog timer to prevent unnecessary restarts.
+ * - loop(): Runs the Blynk and timer tasks, drains the widget mailbox and flushes the
+ *           buffered V42 terminal output (terminal.cpp).
+ * - flashSSD(): Displays basic information on the OLED screen at boot, the live dashboard
+ *   (dashboard.cpp) takes over after a few seconds.
+ * - refreshWidgets(): Periodically writes the socket/queue counters to Blynk widgets.
+ * - widgetDrain(): Writes widget updates posted by the poller (and other tasks) to Blynk.
  * - upDateWidget(): Updates Blynk widgets with sensor data based on the sensor type.
  * - decryptWifiCredentials(): Decrypts Wi-Fi credentials for secure connection.
  * - socketClient(): Handles socket communication with devices.
- * - queStat(): Checks the status of the error queues.
+ * - queStat(): Lets a POST in flight finish before a restart, bounded.
  * - BLYNK_CONNECTED(): Callback for Blynk connection events.
  * - BLYNK_WRITE(): Handles virtual pin writes from the Blynk app.
  *
  * @section Constants
  * - BLYNK_TEMPLATE_ID, BLYNK_TEMPLATE_NAME, BLYNK_AUTH_TOKEN: Blynk configuration constants.
  * - SCREEN_WIDTH, SCREEN_HEIGHT: OLED display dimensions.
- * - LWD_TIMEOUT: Timeout value for the loop watchdog timer.
- * - Various server URLs for fetching and managing device data.
+ * - LOOP_HEARTBEAT_MS: Longest pass of the loop before the watchdog restarts the system.
+ * - Server URLs, intervals and deadbands live in the config record (config.cpp).
  *
  * @section Notes
  * - Debugging can be enabled by defining the DEBUG macron.
+ * - Sensor polling runs in its own task (poller.cpp); only the loop calls Blynk.virtualWrite().
  * - Ensure the OLED display is properly connected to the ESP32.
  * - The program assumes a specific server API for fetching device data.
  */
@@ -56,8 +58,10 @@
 // #define BLYNK_TEMPLATE_ID "TMPL2sDJhOygV"
 // #define BLYNK_TEMPLATE_NAME "House"
 // #define BLYNK_AUTH_TOKEN "3plcY4yZM3HpnupyR5nmnDlUcXADV9sU"
+#define BLYNK_MAX_SENDBYTES 1024 // room for multi-line terminal reports (ping summary)
 #include <Arduino.h>
 #include <map>
+#include <atomic>
 #include <FS.h>
 #include <WiFi.h>
 #include <HTTPClient.h>
@@ -67,7 +71,20 @@
 #include <Wire.h>
 #include <Adafruit_SSD1306.h>
 #include "blynk_widget.h"
-#include <Ticker.h>
+#include "mailbox.h"
+#include "watchDog.h"
+#include "warmState.h"
+#include "config.h"
+#include "metrics.h"
+#include "terminal.h"
+#include "reading.h"
+#include "workPool.h"
+#include "rtt.h"
+#include "exchange.h"
+#include "broadcast.h"
+#include "dashboard.h"
+#include "alarm.h"
+#include "flow.h"
 #include <Wire.h>
 #include <LittleFS.h>
 
@@ -80,92 +97,148 @@
 //  #define TEMPV6 V6 // Define TEMPV6 as virtual pin V6
 Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, -1);
 #define SSD_ADDR 0x3c
+#define LAST_MSG_LEN 48 // V39 warning text
 
 void initRTOS();
 void flashSSD();
 bool checkSSD();
 
 void refreshWidgets();
+void setLastMsg(const char *what, const char *host);
+void widgetDrain();
+static void termSink(const char *text);
 void getBootTime(char *lastBook, char *strReason);
-int getSensorData(const String &sensorsConnected);
+void ntpStart();
+void bootPhase(const char *phase);
+void ntpPoll();
+bool wifiStart(const char *ssid, const char *pass);
+bool wifiWait(const char *ssid, const char *pass);
 String performHttpGet(const char *url);
 int decryptWifiCredentials(char *auth, char *ssid, char *psw);
 int socketClient(char *espServer, char *command, bool updateErorrQue);
-char *socketClient(char *espServer, char *command);
-void upDateWidget(char *sensorName, float tokens[]);
-void lwdtFeed(void);
-void ICACHE_RAM_ATTR lwdtcb(void);
+void upDateWidget(const sensorReading_t &reading);
 bool queStat();
 bool isServerConnected(const char *serverIP, uint16_t port = 8888);
 void generateInterrupt();
 void printUptime();
 String getIP(String sensorName);
-void printTokens(float tokens[5][5]);
+bool requestSweep(bool forceList);
+bool requestConnectedSweep();
+bool requestDeviceRead(const char *ip, const char *label, const char *postFix);
+bool requestSchedReport();
+int twBench(int timers, char *report, size_t len);
+void timerBench();
+void configCommand(const char *command);
+bool mqttBench();
+void discoveryReport();
+void deflateBench();
+void gorillaBench();
+void logBench();
+void historyReport(String args);
+std::map<std::string, std::string> ipMapSnapshot();
+bool probeStart();
 
 std::map<std::string, std::string> ipMap;
 const uint16_t port = 8888;
 String sensorName = "NO DEVICE";
-int failSocket, passSocket, recoveredSocket, retry, timerID1, passPost;
-String sensorsConnected;
-HTTPClient http;
-String lastMsg;
-char lastBoot[20], strReason[60];
+std::atomic<int> failSocket, passSocket, recoveredSocket, retry; // updated by the poller, the workers and the recovery task
+int timerID1, passPost;
+static char lastMsg[LAST_MSG_LEN] = "no warnings"; // V39, guarded by lastMsgMux
+static portMUX_TYPE lastMsgMux = portMUX_INITIALIZER_UNLOCKED;
+char lastBoot[64], strReason[60];
 BlynkTimer timer;
-float tokens[5][5] = {};
-bool setAlarm = false;
-Ticker lwdTicker;
-String lastSensorsConnected = "";
-#define LWD_TIMEOUT 15 * 1000 // Reboot if loop watchdog timer reaches this time out value
-unsigned long lwdTime = 0;
-unsigned long lwdTimeout = LWD_TIMEOUT;
-const char *getRowCnt = "http://192.168.1.252/rows.php";
-const char *deleteAll = "http://192.168.1.252/deleteALL.php";
-const char *ipList = "http://192.168.1.252/ip.php";
-const char *ipDelete = "http://192.168.1.252/deleteIP.php";
-const char *esp_data = "http://192.168.1.252/esp-data.php";
+bool setAlarm = false; // an alarm rule is active (see alarm.cpp)
+#define LOOP_HEARTBEAT_MS (10 * 1000) // Reboot if one pass of the loop takes longer
+heartbeat_t *hbLoop;
 
 /**
  * @brief Sets up the initial configuration for the ESP32 client application.
  *
- * This function initializes the serial communication, decrypts Wi-Fi credentials,
- * connects to the Blynk server, checks and flashes the OLED SSD if connected,
- * sets up a timer for refreshing widgets, initializes the RTOS, and configures
- * the lightweight watchdog timer (LWDT).
- *
- * Steps performed:
- * - Initializes serial communication at 115200 baud rate.
- * - Decrypts Wi-Fi credentials and connects to the Blynk server using the provided authentication token.
- * - Checks if the OLED SSD is connected and flashes it if necessary.
- * - Sets up a timer to refresh widgets every 20 seconds.
- * - Initializes the RTOS for multitasking.
- * - Feeds the lightweight watchdog timer to prevent resets.
- * - Attaches a callback routine to the LWDT ticker to handle timeout events.
+ * The boot is staged so independent steps overlap: the Wi-Fi association runs in the
+ * background while the tasks are created, the OLED is probed and the last readings are
+ * replayed. Sensor polling starts as soon as Wi-Fi is up (the poller waits on the Wi-Fi
+ * gate, see boot.cpp), the Blynk cloud connection and NTP are not waited for.
+ *
+ * Steps performed, each logged with its timing by `bootPhase()`:
+ * - Initializes serial communication at 115200 baud rate and restores the warm restart
+ *   snapshot (warmState.cpp) if the last reset left a valid one.
+ * - Loads the config record (config.cpp) with one read.
+ * - Decrypts Wi-Fi credentials and the Blynk authentication token.
+ * - Starts the Wi-Fi association, directly to the cached AP/channel on a warm boot.
+ * - Initializes the RTOS for multitasking, this also starts the sensor poller task.
+ * - Checks if the OLED SSD is connected.
+ * - On a warm boot, replays the last readings of each sensor to the widgets.
+ * - Waits for Wi-Fi, shows the IP on the OLED and starts NTP in the background.
+ * - Configures Blynk, `Blynk.run()` in the loop connects to the cloud.
+ * - Sets up a timer to refresh the counter widgets (`refresh_ms`, 20 seconds by default).
+ * - Registers the loop heartbeat, `loop()` checks in on every pass.
  */
 void setup()
 {
   Serial.begin(115200);
-  char auth[50];
-  // = "Z1kJtYwbYfKjPOEsLoXMeeTo8DZiq85H";
+  warmRestore(); // before anything touches the counters
+  bootPhase("restore");
+  configLoad();
+  bootPhase("config");
+  static char auth[50]; // Blynk keeps the pointer
   char ssid[40], pass[40];
-  lastMsg = "no warnings";
-  String tmp;
   if (decryptWifiCredentials(auth, ssid, pass))
     ESP.restart();
-  Blynk.begin(auth, ssid, pass);
-  if (checkSSD()) //  is OLED SSD connected?
+  bootPhase("creds");
+
+  wifiStart(ssid, pass); // associates while the rest of the boot runs
+  initRTOS();            // the poller blocks until Wi-Fi is up
+  bootPhase("tasks");
+  bool oled = checkSSD(); //  is OLED SSD connected?
+  bootPhase("oled");
+  if (warmBoot()) // serve the last known readings while the first live sweep runs
+  {
+    readingBatch_t batch;
+    readingBegin(batch);
+    for (int i = 0; i < warmSnapshot()->readings; i++)
+    {
+      const warmReading_t &last = warmSnapshot()->reading[i];
+      if (readingOpen(batch, last.code) == NULL)
+        break;
+      for (int j = 0; j < last.values; j++)
+        readingPush(batch, last.value[j]);
+    }
+    for (sensorReading_t *r = batch.first; r != NULL; r = r->next)
+      if (r->sensor != NULL)
+        upDateWidget(*r);
+  }
+
+  if (!wifiWait(ssid, pass))
+  {
+    Serial.println("WiFi not connected");
+    warmRestart();
+  }
+  bootPhase("wifi_up");
+  if (oled)
+  {
     flashSSD();
+    dashStart(SSD_ADDR); // live readings once the boot screen has been up a while
+  }
+  ntpStart();
+  Blynk.config(auth);
 
   // Serial.println("Turned off timer");
-  timerID1 = timer.setInterval(1000L * 20, refreshWidgets); //
-  initRTOS();
-  lwdtFeed();
-  lwdTicker.attach_ms(LWD_TIMEOUT, lwdtcb); // attach lwdt callback routine to Ticker object
+  timerID1 = timer.setInterval(cfg()->refreshMs, refreshWidgets);
+  termBegin(termSink);
+  hbLoop = hbRegister("loop", LOOP_HEARTBEAT_MS);
+  bootPhase("setup");
 }
 void loop()
 {
-  lwdtFeed();
+  hbCheckIn(hbLoop, "blynk");
   Blynk.run();
+  hbCheckIn(hbLoop, "timer");
   timer.run();
+  hbCheckIn(hbLoop, "drain");
+  widgetDrain();
+  ntpPoll();
+  if (Blynk.connected())
+    termPoll();
 
   // // Example: Trigger the interrupt manually for testing
   // if (millis() % 10000 == 0) // Every 10 seconds
@@ -187,78 +260,123 @@ void flashSSD()
 }
 
 /**
- * @brief Refreshes the widgets by fetching sensor data, updating the Blynk terminal,
- *        and writing relevant data to virtual pins.
- *
- * This function is called periodically by a timer. It performs the following tasks:
- * - Fetches the list of connected sensors from a remote server using an HTTP GET request.
- * - Parses the fetched sensor data and updates the internal state if there are changes.
- * - Updates the Blynk terminal with the list of connected sensors and their IP addresses.
- * - Writes various statistics (e.g., pass, fail, recovered, retry counts, and last message)
- *   to specific Blynk virtual pins.
- *
- * @note If the HTTP GET request fails or no sensors are connected, the function logs an error
- *       message and exits early.
+ * @brief Refreshes the counter widgets.
+ *
+ * This function is called periodically by a timer. It writes various statistics
+ * (e.g., pass, fail, recovered, retry counts, and last message) to specific Blynk
+ * virtual pins.
+ *
+ * @note Fetching the device list and reading the sensors is done by the poller task
+ *       (see poller.cpp), the results arrive through the mailbox and are written by
+ *       `widgetDrain()`.
  * */
 void refreshWidgets() // called every x seconds by SimpleTimer
 {
-  char tmp[256];
-  String sensorsConnected = performHttpGet(ipList);
-  if (sensorsConnected.isEmpty())
-  {
-    sprintf(tmp, "Failed to fetch sensors from mySQL ");
-    Blynk.virtualWrite(V39, tmp);
-    return;
-  }
-  if (!getSensorData(sensorsConnected))
-  {
-    sprintf(tmp, "No devices connected to network");
-    Blynk.virtualWrite(V39, tmp);
-    return;
-  }
+  char msg[LAST_MSG_LEN];
+  portENTER_CRITICAL(&lastMsgMux);
+  memcpy(msg, lastMsg, sizeof(msg));
+  portEXIT_CRITICAL(&lastMsgMux);
+  Blynk.virtualWrite(V7, passSocket.load());
+  Blynk.virtualWrite(V20, failSocket.load());
+  Blynk.virtualWrite(V19, recoveredSocket.load());
+  Blynk.virtualWrite(V34, retry.load());
+  Blynk.virtualWrite(V39, msg);
+}
 
-  if (lastSensorsConnected != sensorsConnected)
+/**
+ * @brief Sets the last warning shown on V39, e.g. "Client Timeout 192.168.1.5".
+ *
+ * Called from the poller, the pool workers and the recovery task on both cores, the text
+ * is formatted first and copied under `lastMsgMux`, `refreshWidgets()` copies it out.
+ */
+void setLastMsg(const char *what, const char *host)
+{
+  char msg[LAST_MSG_LEN];
+  snprintf(msg, sizeof(msg), "%s %s", what, host);
+  portENTER_CRITICAL(&lastMsgMux);
+  memcpy(lastMsg, msg, sizeof(lastMsg));
+  portEXIT_CRITICAL(&lastMsgMux);
+}
+/**
+ * @brief Writes a chunk of buffered terminal output (terminal.cpp) to V42.
+ */
+static void termSink(const char *text)
+{
+  Blynk.virtualWrite(V42, text);
+}
+/**
+ * @brief Writes the widget updates posted to the mailbox by other tasks to Blynk.
+ *
+ * Text for the V42 terminal goes through the buffered writer (terminal.cpp) and is sent
+ * in chunks. Called on every pass of `loop()`. At most `MAILBOX_SIZE` updates are written per call
+ * so a burst from the poller cannot starve `Blynk.run()`. Nothing is written before the
+ * cloud connection is up, the poller may already be running.
+ */
+void widgetDrain()
+{
+  widget_t msg;
+  if (!Blynk.connected())
+    return; // keep the updates until the cloud is up, virtualWrite() would drop them
+  for (int budget = MAILBOX_SIZE; budget > 0 && mailboxFetch(msg); budget--)
   {
-    Blynk.virtualWrite(V42, "\nStart:\n"); // clear Blynk terminal
-    for (const auto &pair : ipMap)
+    switch (msg.type)
     {
-      Serial.printf("Sensor: %s, IP: %s\n", pair.first.c_str(), pair.second.c_str());
-      sprintf(tmp, "\tSensor: %s, IP: %s\n", pair.first.c_str(), pair.second.c_str());
-      Blynk.virtualWrite(V42, tmp);
+    case WIDGET_FLOAT:
+      Blynk.virtualWrite(msg.pin, msg.f);
+      warmFirstWidget(); // only sensor readings are posted as floats
+      break;
+    case WIDGET_INT:
+      Blynk.virtualWrite(msg.pin, msg.i);
+      break;
+    case WIDGET_TEXT:
+      if (msg.pin == V42)
+        termPrint(msg.text); // coalesced, see terminal.cpp
+      else
+        Blynk.virtualWrite(msg.pin, msg.text);
+      break;
+    case WIDGET_COLOR:
+      if (msg.pin == V42)
+        termFlush(); // the color applies to what follows
+      Blynk.setProperty(msg.pin, "color", msg.text);
+      break;
+    case WIDGET_BUFFER:
+      if (msg.pin == V42)
+        termPrint(msg.buf);
+      else
+        Blynk.virtualWrite(msg.pin, msg.buf);
+      *msg.inUse = false; // hand the buffer back to its owner
+      break;
+    case WIDGET_EVENT:
+      Blynk.logEvent(msg.text, msg.text + strlen(msg.text) + 1);
+      break;
     }
-    sprintf(tmp, "\n\tenter 'list' for valid commands\n");
-    Blynk.virtualWrite(V42, tmp);
-    lastSensorsConnected = sensorsConnected;
   }
-
-  Blynk.virtualWrite(V7, passSocket);
-  Blynk.virtualWrite(V20, failSocket);
-  Blynk.virtualWrite(V19, recoveredSocket);
-  Blynk.virtualWrite(V34, retry);
-  Blynk.virtualWrite(V39, lastMsg);
 }
 /**
  * @brief Callback function that is triggered when the device connects to the Blynk server.
  *
  * This function performs the following tasks:
- * - Resets the counters for failed and recovered socket connections, as well as retry attempts.
+ * - Resets the counters for failed and recovered socket connections, as well as retry attempts,
+ *   except on the first connection after a warm restart which keeps the restored counters.
  * - Checks the connection status to the Blynk server. If not connected, it restarts the ESP device.
  * - Logs the connection status to the serial monitor.
  * - Sends the last boot time, reset reason, and other diagnostic data to specific virtual pins on the Blynk server.
- * - Performs an HTTP GET request to retrieve data, processes the response, and updates the corresponding virtual pin.
- * - Refreshes widgets and updates the passSocket value based on the HTTP response.
- *
- * @note If the HTTP request fails, the function logs an error message and exits early.
+ * - Asks the poller task to refresh passSocket from rows.php and to run a sweep that lists
+ *   the connected devices on the terminal. The loop does not wait for it.
  */
 BLYNK_CONNECTED()
 {
-
-  failSocket = recoveredSocket = retry = 0;
+  static bool firstConnect = true;
+  if (firstConnect)
+    bootPhase("blynk");
+  if (!(firstConnect && warmBoot())) // a warm restart keeps its counters
+    failSocket = recoveredSocket = retry = 0;
+  firstConnect = false;
   bool isconnected = Blynk.connected();
   if (isconnected == false)
   {
     Serial.println("Blynk Not Connected");
-    ESP.restart();
+    warmRestart();
   }
   else
     Serial.println("Blynk Connected");
@@ -266,30 +384,17 @@ BLYNK_CONNECTED()
   getBootTime(lastBoot, strReason);
   Blynk.virtualWrite(V25, lastBoot);
   Blynk.virtualWrite(V26, strReason);
-  Blynk.virtualWrite(V20, failSocket);
-  Blynk.virtualWrite(V19, recoveredSocket);
-  Blynk.virtualWrite(V34, retry);
-  Blynk.virtualWrite(V39, "boot");
+  Blynk.virtualWrite(V7, passSocket.load());
+  Blynk.virtualWrite(V20, failSocket.load());
+  Blynk.virtualWrite(V19, recoveredSocket.load());
+  Blynk.virtualWrite(V34, retry.load());
+  Blynk.virtualWrite(V39, hbLastStall() ? hbLastStall() : "boot");
 
-  String payload = performHttpGet(getRowCnt);
-  if (payload.isEmpty())
-  {
-    Serial.println("Failed to HHTP request ");
-    return;
-  }
-  else
-  {
-    lastSensorsConnected = ""; // force output
-    refreshWidgets();
-    passSocket = payload.toInt();
-    Blynk.virtualWrite(V7, passSocket);
-
-    Serial.printf("passSocket %d  \n", passSocket);
-  }
+  requestConnectedSweep();
 }
 BLYNK_WRITE(V18)
 {
-  String payload = performHttpGet(ipDelete);
+  String payload = performHttpGet(cfg()->urlDeleteIp);
   if (payload.isEmpty())
   {
     Serial.println("Failed to fetch ip for connected devices or no devices connected");
@@ -298,104 +403,78 @@ BLYNK_WRITE(V18)
 }
 BLYNK_WRITE(BLINK_TST)
 {
-  timer.disable(timerID1);
-  char *str = nullptr;
-  // Iterate through the map
-  for (const auto &pair : ipMap)
-  {
-    Serial.printf("Key: %s, Value: %s\n", pair.first.c_str(), pair.second.c_str());
-    str = socketClient((char *)pair.second.c_str(), (char *)"BLK");
-    Serial.printf("blk_tst %s \n", str);
-    free(str);
-  }
-
-  // int index = param.asInt();
-  //  char *str = socketClient((char *)ipAddr[index], (char *)"TST");
-  //  String foo = String(str);
-  //  index = foo.indexOf(":");
-  //  skip crc
-  //  Blynk.virtualWrite(V12, (foo.substring(index + 1)));
-  //  free(str);
-  timer.enable(timerID1);
+  // every device at once in the background, polling goes on (see broadcast.cpp)
+  if (!broadcastStart("BLK", NULL))
+    Serial.println("blk_tst: broadcast already running");
 }
 /**
- * @brief ISR (Interrupt Service Routine) for handling the lightweight watchdog timer (LWD).
+ * @brief Deadband filter for sensor widgets, true if `value` should be sent.
  *
- * This function is marked with `ICACHE_RAM_ATTR` to ensure it is placed in IRAM,
- * allowing it to be executed during interrupt handling. It checks if the elapsed
- * time since the last watchdog reset exceeds the defined timeout (`LWD_TIMEOUT`)
- * or if there is an inconsistency in the timeout calculation. If either condition
- * is met, it logs the event, writes a status to a Blynk virtual pin, queues the
- * current status, and restarts the ESP device.
- *
- * @note This function is intended to be called as an interrupt callback and
- *       should execute as quickly as possible to avoid interrupt blocking.
- *
- * @warning Restarting the ESP device will cause all current operations to stop
- *          and the device to reboot.
+ * A value within `band` of the last one sent to the same pin is dropped. Called from the
+ * poller and the socket recovery task.
  */
-void ICACHE_RAM_ATTR lwdtcb(void)
+static bool widgetChanged(uint8_t pin, float value, float band)
 {
-  // Serial.println("Interrupt generated!");
-
-  if ((millis() - lwdTime > LWD_TIMEOUT) || (lwdTimeout - lwdTime != LWD_TIMEOUT))
+  static float last[64];
+  static bool sent[64];
+  static portMUX_TYPE deadbandMux = portMUX_INITIALIZER_UNLOCKED;
+  static metric_t *mSkipped = metricRegister("widget_deadband_skipped", "Sensor widget writes dropped by the deadband", METRIC_COUNTER);
+  if (band <= 0 || pin >= 64)
+    return true;
+  portENTER_CRITICAL(&deadbandMux);
+  bool changed = !sent[pin] || fabsf(value - last[pin]) >= band;
+  if (changed)
   {
-    // Blynk.logEvent("3rd_WDTimer");
-    Serial.printf("3rd_WDTimer esp.restart %lu %lu\n", (millis() - lwdTime), (lwdTimeout - lwdTime));
-    Blynk.virtualWrite(V39, "3rd_WDTimer");
-    queStat();
-    ESP.restart();
+    last[pin] = value;
+    sent[pin] = true;
   }
+  portEXIT_CRITICAL(&deadbandMux);
+  if (!changed)
+    metricInc(mSkipped);
+  return changed;
 }
-/**
- * @brief Resets the lightweight watchdog timer by updating the current time and timeout.
- *
- * This function sets the `lwdTime` variable to the current time (in milliseconds)
- * and calculates the new timeout value by adding the predefined `LWD_TIMEOUT`
- * to the current time. It ensures that the lightweight watchdog timer does not
- * trigger a timeout as long as this function is called periodically.
- */
-void lwdtFeed(void)
-{
-  lwdTime = millis();
-  lwdTimeout = lwdTime + LWD_TIMEOUT;
-}
-
 /**
  * @brief Updates the widget values in the Blynk application based on the sensor data.
  *
- * This function takes the sensor name and an array of floating-point values (tokens)
- * representing sensor readings. It updates the corresponding virtual pins in the Blynk
- * application to display the sensor data.
+ * This function takes one sensor reading of a decoded batch (reading.h) and updates the
+ * corresponding virtual pins in the Blynk application to display the sensor data. Values
+ * are picked by the quantity of their channel, not by position.
  *
- * @param sensor A character pointer to the name of the sensor (e.g., "BME280", "BMP390", "SHT35", "ADS1115").
- * @param tokens An array of floating-point values representing the sensor readings.
- *               The specific indices used depend on the sensor type.
+ * @param reading The reading, `sensor` is the sensor name (e.g., "BME280", "BMP390", "SHT35", "ADS1115").
  *
  * @note The function supports the following sensors:
- *       - "BME280" or "BMP390": Updates temperature (V4). If "BME280" or "SHT35", also updates humidity (V6).
- *       - "ADS1115": Updates a gauge (GAUGE_HOUSE) and another virtual pin (V43) based on calculations.
+ *       - "BME280", "BMP390" or "SHT35": Updates temperature (V4) and humidity (V6) if the sensor has one.
+ *       - "ADS1115": Updates a gauge (GAUGE_HOUSE) from volt * ratio and another virtual pin (V43) from the supply.
  *
+ * @note Called from the poller and socket recovery tasks, values are posted to the mailbox
+ *       and written to Blynk by the loop.
+ * @note Values within the configured deadband (`deadband.temp`, `deadband.humidity`,
+ *       `deadband.volt`) of the last value sent are not posted.
  * @note Debugging information can be enabled by defining DEBUG_W, which prints sensor data to the Serial monitor.
  */
-void upDateWidget(char *sensor, float tokens[])
+void upDateWidget(const sensorReading_t &reading)
 {
   // #define DEBUG_W
-  String localSensorName = sensor;
+  String localSensorName = reading.sensor;
+  const config_t *c = cfg();
+  dashNote(reading);
 #ifdef DEBUG_W
   Serial.printf("sensor %s\n", localSensorName.c_str());
-  for (int j = 0; j < 5; j++)
+  for (int j = 0; j < reading.channels; j++)
   {
     Serial.printf(" %d ", j);
-    Serial.printf(" %f ", tokens[j]);
+    Serial.printf(" %f ", reading.channel[j].value);
   }
   Serial.println();
 #endif
   if (localSensorName == "BME280" || localSensorName == "BMP390" || localSensorName == "SHT35")
   {
-    Blynk.virtualWrite(V4, tokens[1]); // display temp to android app
-    if (localSensorName == "BME280" || localSensorName == "SHT35")
-      Blynk.virtualWrite(V6, tokens[2]); // display humidity
+    const readingChannel_t *temp = readingFind(reading, QTY_TEMPERATURE);
+    const readingChannel_t *humidity = readingFind(reading, QTY_HUMIDITY);
+    if (temp != NULL && widgetChanged(V4, temp->value, c->deadbandTemp))
+      widgetWrite(V4, temp->value); // display temp to android app
+    if (humidity != NULL && widgetChanged(V6, humidity->value, c->deadbandHumidity))
+      widgetWrite(V6, humidity->value); // display humidity
     return;
   }
   // if (localSensorName == "SHT35")
@@ -406,8 +485,14 @@ void upDateWidget(char *sensor, float tokens[])
   // }
   if (localSensorName == "ADS1115")
   {
-    Blynk.virtualWrite(V2, tokens[1] * tokens[3]); // display Jackery Volt
-    Blynk.virtualWrite(V43, tokens[2]);            // display v++ for esp32
+    const readingChannel_t *volt = readingFind(reading, QTY_VOLT);
+    const readingChannel_t *ratio = readingFind(reading, QTY_RATIO);
+    const readingChannel_t *supply = readingFind(reading, QTY_SUPPLY);
+    float jackery = (volt ? volt->value : 0) * (ratio ? ratio->value : 0);
+    if (widgetChanged(V2, jackery, c->deadbandVolt))
+      widgetWrite(V2, jackery); // display Jackery Volt
+    if (supply != NULL && widgetChanged(V43, supply->value, c->deadbandVolt))
+      widgetWrite(V43, supply->value); // display v++ for esp32
 
     return;
   }
@@ -420,15 +505,18 @@ void upDateWidget(char *sensor, float tokens[])
  *         Returns an empty string if the request fails or the HTTP response code is not 200.
  *
  * @note If the macro DEBUG_PHP is defined, the response payload will be printed to the Serial monitor.
+ * @note Each call uses its own HTTPClient, the poller and the loop may call it concurrently.
  */
 // #define DEBUG_PHP
 String performHttpGet(const char *url)
 {
+  HTTPClient http;
   http.begin(url);
   int httpResponseCode = http.GET();
   if (httpResponseCode != 200)
   {
     Serial.printf("HTTP GET failed with code: %d\n", httpResponseCode);
+    http.end();
     return ""; // Return an empty string on failure
   }
   String response = http.getString();
@@ -440,69 +528,6 @@ String performHttpGet(const char *url)
   return response;
 }
 
-/**
- * @brief Parses a string containing information about connected sensors and their IP addresses,
- *        and stores the sensor names and IPs in a map. Additionally, attempts to read sensor data
- *        from each connected device using a socket client.
- *
- * @param sensorsConnected A formatted string containing the number of devices and their details.
- *        Format: "<number_of_devices>|<sensor_name1>:<ip1>|<sensor_name2>:<ip2>|..."
- *        Example: "2|DS1_DS1:192.168.1.5|BMP:192.168.1.7|"
- *
- * @note The function assumes that the input string is well-formed and contains valid data.
- *       Debugging information can be enabled by defining the macros DEBUG_LIST and DEBUG.
- *
- * @details The function performs the following steps:
- *          1. Extracts the number of devices from the input string.
- *          2. Iterates through each device's information, extracting the sensor name and IP address.
- *          3. Stores the sensor name and IP address in a map (`ipMap`).
- *          4. Attempts to read sensor data from each device using the `socketClient` function.
- *          5. Logs debugging information if the DEBUG or DEBUG_LIST macros are defined.
- *
- * @warning The function modifies the input string `sensorsConnected` during processing.
- *          Ensure that the input string is not needed elsewhere in its original form.
- *
- * @note If the `socketClient` function fails for a device, an error message is printed to the serial monitor.
- */
-int getSensorData(const String &sensorsConnected)
-{
-
-  String rows = sensorsConnected.substring(0, sensorsConnected.indexOf("|"));
-  int numberOfRows = atoi(rows.c_str());
-
-#ifdef DEBUG_LIST
-  Serial.printf("list of devices: %s", sensorsConnected.c_str()); // warning "\n" in sensorConnected string
-#endif
-
-  String deviceConn = sensorsConnected.substring(sensorsConnected.indexOf("|") + 1,
-                                                 sensorsConnected.lastIndexOf("|"));
-
-  ipMap.clear(); // if sensor was removed (failed to connect) need to clear!!!!!
-  for (int i = 0; i < numberOfRows; i++)
-  {
-    int index = deviceConn.indexOf(":");
-    int index1 = deviceConn.indexOf(",");
-    int index2 = deviceConn.indexOf("|");
-    String ip = deviceConn.substring(index + 1, index2);
-    String sensorName = deviceConn.substring(index1 + 1, index);
-
-    ipMap[sensorName.c_str()] = ip.c_str(); // Store the IP address in the mapB
-#ifdef DEBUG
-    Serial.printf("Sensor: %s, IP: %s\n", sensorName.c_str(), ip.c_str());
-#endif
-
-    if (socketClient((char *)ip.c_str(), (char *)"ALL", 1)) // read sensor data from connected device
-    {
-      Serial.println("socketClient() failed");
-    }
-
-    deviceConn = deviceConn.substring(index2 + 1); // Move to the next device in string
-#ifdef DEBUG
-    Serial.printf("device connect %s \n ", deviceConn.c_str());
-#endif
-  } // end for
-  return numberOfRows;
-}
 /**
  * @brief Handles input from the Blynk terminal widget.
  *
@@ -513,20 +538,43 @@ int getSensorData(const String &sensorsConnected)
  * * Commands:
  * - "refr": Resets sensor connection status, refreshes widgets, and resets
  *           failure/recovery counters.
- * - "test": Triggers a test interrupt by calling the `generateInterrupt` function.
- * - "ping": Iterates through a map of IP addresses, checks server connectivity,
- *           and sends the results back to the terminal widget on V42.
+ * - "test": Stalls the loop (`generateInterrupt`) to test the heartbeat watchdog.
+ * - "ping": Probes every device and the backend concurrently (see probe.cpp) and
+ *           prints min/avg/max/p99 RTT and loss per host on V42.
+ * - "sched": Prints the per-device poll schedule and the worst dispatch lateness.
+ * - "twbench": Benchmarks the timing wheel with thousands of timers against BlynkTimer.
+ * - "mqttbench": Measures the MQTT sink throughput against the HTTP uploader (see mqtt.cpp).
+ * - "disc": Lists the devices alive on the multicast discovery registry (see discovery.cpp).
+ * - "zbench": Compression ratio and CPU time of upload batches (see deflate.cpp).
+ * - "lbench": Time per call of deferred logging against `Serial.printf` (see binLog.cpp).
+ * - "pool": Per core utilization of the worker pool and the duration of the last sweep
+ *           (see workPool.cpp).
+ * - "xbench [cmd ..]": Latency of a command sequence (default "ALL TST") per device, one
+ *   connection per command against pipelined on one connection (see exchange.cpp).
+ * - "bcast <cmd> [filter]": Sends a command to every device (or those whose name contains
+ *   the filter) at once, the status per device follows when all answered (see broadcast.cpp).
+ * - "alarm": The compiled alarm rules and the devices that have them active, "abench" the
+ *   time to evaluate one reading against them (see alarm.cpp).
+ * - "flow": Free credits of the upload and recovery stages and the readings admitted,
+ *           parked and dropped per priority class (see flow.cpp).
+ * - "rtt": Smoothed round trip, its variance and the connect/reply timeout per device
+ *          (see rtt.cpp).
+ * - "gbench": Bytes per sample and encode/decode time of the Gorilla encoder (see gorilla.cpp).
+ * - "hist": Size of the reading history per sensor, "hist <sensor>" its last samples
+ *           (see history.cpp).
+ * - "config": Lists the config record and its load time. "config reload" re-reads
+ *             /config.bin, "config set <key> <value>" changes one setting, both without a reboot.
  *
  *
  * @param param The parameter object containing the string sent to the terminal widget.
  */
 BLYNK_WRITE(V42)
 {
-  String validCommand[] = {"list", "reboot", "ping", "up", "adc", "bme", "bmx"};
-  char tmp[100];
+  String validCommand[] = {"list", "reboot", "ping", "up", "adc", "bme", "bmx", "sched", "twbench", "config", "mqttbench", "disc", "zbench", "gbench", "hist", "lbench", "pool", "rtt", "xbench", "bcast", "alarm", "abench", "flow"};
   int numberOfElements = sizeof(validCommand) / sizeof(validCommand[0]);
 
-  String input = param.asStr(); // Read the input string from the terminal
+  const char *raw = param.asStr(); // arguments sent to devices keep their case
+  String input = raw;              // Read the input string from the terminal
   if (input.isEmpty())
   {
     Serial.println("Invalid parameter received.");
@@ -540,15 +588,14 @@ BLYNK_WRITE(V42)
     for (int i = 0; i < numberOfElements; i++)
     {
       Serial.println(validCommand[i]);
-      sprintf(tmp, "%s %s", validCommand[i].c_str(), "\n");
-      Blynk.virtualWrite(V42, tmp);
+      termPrintf("%s \n", validCommand[i].c_str());
     }
   }
   if (input.startsWith("reboot"))
   {
     Serial.println("Reboot command received. Restarting...");
-    queStat();
-    ESP.restart();
+    queStat();     // a POST in flight, at most a few seconds
+    warmRestart(); // whatever is still queued goes into the snapshot
   }
   else if (input.startsWith("up"))
     printUptime();
@@ -561,87 +608,133 @@ BLYNK_WRITE(V42)
       label = "Volt";
       postFix = "V";
     }
-    bool foundValidIP = false;
 
     String ip = getIP(input.substring(0, 3).c_str());
     if (ip.isEmpty())
-      sprintf(tmp, "invalid ip@ for sensor %s ", input.c_str());
-    else
     {
-      // sprintf(tmp, "ip %s for %s \n", ip.c_str(), input.c_str());
-      if (socketClient((char *)ip.c_str(), (char *)"ALL", 1))
-        Serial.println("socketClient() failed");
-      else
-      {
-        sprintf(tmp, "%s %f %s \n", label.c_str(), tokens[0][1], postFix.c_str());
-        foundValidIP = true;
-      }
+      termPrintf("ERROR: No valid IP found for sensor %s\n", input.c_str());
     }
-
-    if (!foundValidIP)
-      sprintf(tmp, "ERROR: No valid IP found for sensor %s\n", input.c_str());
-
-    Blynk.virtualWrite(V42, tmp);
+    else // the poller reads the device and answers on the terminal
+      requestDeviceRead(ip.c_str(), label.c_str(), postFix.c_str());
+  }
+  else if (input.startsWith("sched"))
+    requestSchedReport();
+  else if (input.startsWith("twbench"))
+    timerBench();
+  else if (input.startsWith("mqttbench"))
+  {
+    if (!mqttBench())
+      termPrint("mqtt sink not enabled, config set sink 1 and reboot\n");
+  }
+  else if (input.startsWith("disc"))
+    discoveryReport();
+  else if (input.startsWith("zbench"))
+    deflateBench();
+  else if (input.startsWith("gbench"))
+    gorillaBench();
+  else if (input.startsWith("lbench"))
+    logBench();
+  else if (input.startsWith("pool"))
+    poolReport();
+  else if (input.startsWith("rtt"))
+    rttReport();
+  else if (input.startsWith("alarm"))
+    alarmReport();
+  else if (input.startsWith("abench"))
+    alarmBench();
+  else if (input.startsWith("flow"))
+    flowReport();
+  else if (input.startsWith("bcast"))
+  {
+    char cmd[BCAST_CMD_LEN] = "", filter[24] = "";
+    sscanf(raw + 5, "%15s %23s", cmd, filter); // "bcast BLK", the devices take upper case
+    if (!cmd[0])
+      termPrint("bcast <cmd> [filter]\n");
+    else if (!broadcastStart(cmd, filter))
+      termPrint("bcast already running\n");
+  }
+  else if (input.startsWith("xbench"))
+  {
+    if (!exchangeBenchStart(raw + 6)) // "ALL TST", not the lowercased input
+      termPrint("xbench already running\n");
   }
+  else if (input.startsWith("hist"))
+    historyReport(input.substring(4));
+  else if (input.startsWith("config"))
+    configCommand(param.asStr());
   else if (input.startsWith("refr"))
   {
-    lastSensorsConnected = ""; // force output
-    refreshWidgets();
+    requestSweep(true); // force output
     failSocket = recoveredSocket = retry = 0;
   }
   else if (input.startsWith("ping"))
   {
-    int dead, alive;
-    unsigned long start = millis();
-    char tmp[100], tmp1[100];
-
-    for (const auto &pair : ipMap)
-    {
-      alive = dead = 0;
-      sprintf(tmp, "%s %s:\n", pair.first.c_str(), pair.second.c_str());
-      for (int j = 0; j < 4; j++) // ping 4 times per element in ipMap
-      {
-        if (isServerConnected(pair.second.c_str()))
-          alive++;
-        else
-          dead++;
-      }
-
-      sprintf(tmp1, "\tpass %d dead %d  time: %lu ms\n", alive, dead, millis() - start);
-      strcat(tmp, tmp1);
-      Blynk.virtualWrite(V42, tmp);
-      if (dead)
-        // #D3435C - Blynk RED
-        Blynk.setProperty(V42, "color", "#D3435C");
-      // else
-      //   // #43d3b4ff - Blynk Green
-      //   Blynk.setProperty(V42, "color", "#43d3b4ff");
-    }
-    // ping http
-    sprintf(tmp, "%s\n", ipList);
-
-    alive = dead = 0;
-    start = millis();
-    for (int j = 0; j < 4; j++)
-    {
-      String sensorsConnected = performHttpGet(ipList);
-      if (sensorsConnected.isEmpty())
-        dead++;
-      else
-        alive++;
-    }
-    sprintf(tmp1, "\t%d pass %d dead time: %lu ms\n", alive, dead, millis() - start);
-    strcat(tmp, tmp1);
-    Blynk.virtualWrite(V42, tmp);
-    //   float tokens[5];
-    //   start = millis();
-    //   for (const auto &pair : ipMap)
-    //   {
-    //     setupHTTP_request(pair.second.c_str(), tokens);
-    //     Serial.printf("mySQL time %lu\n", millis() - start);
-    //   }
+    if (!probeStart()) // runs in its own task, the summary comes back through the mailbox
+      termPrint("ping already running\n");
   }
   // else if (input.startsWith("test"))
+  termEnd(); // one message for the output of the command
+}
+/**
+ * @brief Terminal "config" command: list, reload or set (see config.cpp).
+ *
+ * @param command The raw terminal line, values are case sensitive (URLs).
+ */
+void configCommand(const char *command)
+{
+  char tmp[200], key[24] = "", value[CONFIG_RULES_LEN] = "";
+  int n = sscanf(command, "%*s %23s %159s", key, value);
+  bool changed = false;
+  if (n >= 1 && !strcasecmp(key, "reload"))
+    changed = configReload(tmp, sizeof(tmp));
+  else if (n >= 1 && !strcasecmp(key, "set"))
+  {
+    char setKey[24] = "";
+    if (sscanf(command, "%*s %*s %23s %159s", setKey, value) == 2)
+      changed = configSet(setKey, value, tmp, sizeof(tmp));
+    else
+      snprintf(tmp, sizeof(tmp), "usage: config set <key> <value>\n");
+  }
+  else
+  {
+    for (int i = 0; configLine(i, tmp, sizeof(tmp)); i++)
+      termPrint(tmp);
+    return;
+  }
+  if (changed)
+    timer.changeInterval(timerID1, cfg()->refreshMs);
+  Serial.print(tmp);
+  termPrint(tmp);
+}
+static void benchNoop() {}
+/**
+ * @brief Compares the timing wheel with BlynkTimer (SimpleTimer) and prints both on the terminal.
+ *
+ * BlynkTimer is filled up to its fixed slot count, the cost of arming a timer and of one
+ * `run()` scan with every slot armed is measured. The wheel is measured with 2000 timers on
+ * a private wheel (see `twBench()`), the live timers are not disturbed.
+ */
+void timerBench()
+{
+  char tmp[128];
+  int ids[32], armed = 0;
+  unsigned long start = micros();
+  while (armed < 32 && (ids[armed] = timer.setTimeout(3600000L, benchNoop)) >= 0)
+    armed++;
+  unsigned long armUs = micros() - start;
+
+  start = micros();
+  for (int i = 0; i < 1000; i++)
+    timer.run();
+  unsigned long runUs = micros() - start;
+  for (int i = 0; i < armed; i++)
+    timer.deleteTimer(ids[i]);
+
+  snprintf(tmp, sizeof(tmp), "BlynkTimer: %d free slots, arm %lu ns, run() %lu ns with %d armed\n",
+           armed, armed ? armUs * 1000 / armed : 0, runUs, timer.getNumTimers() + armed);
+  termPrint(tmp);
+  twBench(2000, tmp, sizeof(tmp));
+  termPrint(tmp);
 }
 void printUptime()
 {
@@ -652,14 +745,12 @@ void printUptime()
   unsigned long minutes = seconds / 60;
   unsigned long hours = minutes / 60;
   unsigned long days = hours / 24;
-  char tmp[80];
   seconds %= 60;
   minutes %= 60;
   hours %= 24;
 
   // Print uptime to the serial monitor
-  sprintf(tmp, "Uptime: %lu days, %lu hours, %lu minutes, %lu seconds\n", days, hours, minutes, seconds);
-  Blynk.virtualWrite(V42, tmp);
+  termPrintf("Uptime: %lu days, %lu hours, %lu minutes, %lu seconds\n", days, hours, minutes, seconds);
   Serial.printf("Uptime: %lu days, %lu hours, %lu minutes, %lu seconds\n", days, hours, minutes, seconds);
 }
 
@@ -686,19 +777,17 @@ bool isServerConnected(const char *serverIP, uint16_t port)
   return false; // Server is not reachable
 }
 /**
- * @brief Simulates an interrupt by manually calling the ISR for testing purposes.
- *
- * This function disables interrupts, invokes the ISR manually, and then re-enables
- * interrupts. It is useful for testing interrupt handling logic without relying on
- * actual hardware interrupts.
+ * @brief Stalls the loop on purpose to test the heartbeat watchdog.
  *
+ * The loop stops checking in at stage "test", the watchdog records the stall in RTC memory
+ * and resets the system. After the reboot V39 shows the stall.
  */
 void generateInterrupt()
 {
-  Serial.println("Interrupt generated!");
-  noInterrupts(); // Disable interrupts
-  lwdtcb();       // Manually call the ISR for testing
-  interrupts();   // Re-enable interrupts
+  Serial.println("Stalling the loop for the watchdog test");
+  hbCheckIn(hbLoop, "test");
+  for (;;)
+    delay(100);
 }
 bool checkSSD()
 {
@@ -738,12 +827,10 @@ String getIP(String sensorName)
 {
   String sensorKey = sensorName, returnIPstring = "", mapKey;
   sensorKey.toUpperCase();
-  for (const auto &pair : ipMap)
+  for (const auto &pair : ipMapSnapshot())
   {
 #ifdef DEBUG_
-    char tmp[100];
-    sprintf(tmp, "Sensor %s ip %s\n", pair.first.c_str(), pair.second.c_str());
-    Blynk.virtualWrite(V42, tmp);
+    termPrintf("Sensor %s ip %s\n", pair.first.c_str(), pair.second.c_str());
 #endif
     mapKey = pair.first.c_str();
     mapKey.toUpperCase();
@@ -0,0 +1,131 @@
+/**
+ * @file metrics.cpp
+ * @brief Implementation of the in-memory metrics registry.
+ *
+ * @details
+ * - `metricRegister()` returns the existing entry when the same name/label pair is
+ *   registered twice, so modules can register lazily without coordinating.
+ * - Registration takes a spinlock (rare, at init or when a device joins). Updates are
+ *   plain atomics and never block.
+ * - When the table is full a shared scratch entry is returned and a warning is logged
+ *   once. Updates to it are harmless (a histogram without bounds uses `latencyBoundsMs`)
+ *   and it is never reported.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include "metrics.h"
+#include "binLog.h"
+
+const uint32_t latencyBoundsMs[HIST_BUCKETS] = {5, 10, 25, 50, 100, 250, 1000, 5000};
+
+static metric_t metrics[METRIC_MAX];
+static metric_t scratch;
+static std::atomic<int> metricsUsed(0);
+static bool fullLogged = false;
+static portMUX_TYPE metricsMux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Registers a metric or returns the one already registered under the same name/label.
+ *
+ * @param name Metric name, must be a string literal (the pointer is kept).
+ * @param help One line description, must be a string literal.
+ * @param type Counter, gauge or histogram.
+ * @param labelKey Name of the label, must be a string literal, e.g. "core" or "reason".
+ * @param label Optional label value, copied.
+ * @param bounds Histogram bucket upper bounds (HIST_BUCKETS entries), ignored otherwise.
+ * @return Pointer to the metric, never NULL.
+ */
+metric_t *metricRegister(const char *name, const char *help, metricType_t type,
+                         const char *labelKey, const char *label, const uint32_t *bounds)
+{
+    metric_t *m = &scratch;
+    bool full = false;
+    portENTER_CRITICAL(&metricsMux);
+    int used = metricsUsed.load();
+    for (int i = 0; i < used; i++)
+    {
+        if (!strcmp(metrics[i].name, name) && !strncmp(metrics[i].label, label ? label : "", METRIC_LABEL_LEN - 1))
+        {
+            m = &metrics[i];
+            break;
+        }
+    }
+    if (m == &scratch && used < METRIC_MAX)
+    {
+        m = &metrics[used];
+        m->name = name;
+        m->help = help;
+        m->type = type;
+        m->labelKey = labelKey;
+        strncpy(m->label, label ? label : "", METRIC_LABEL_LEN - 1);
+        m->bounds = bounds;
+        metricsUsed.store(used + 1); // publish only once the entry is filled
+    }
+    else if (m == &scratch && !fullLogged)
+        full = fullLogged = true;
+    portEXIT_CRITICAL(&metricsMux);
+    if (full) // not under the spinlock
+        LOG_W("metrics: table full (%d), %s and later metrics are not reported", METRIC_MAX, name);
+    return m;
+}
+
+void metricInc(metric_t *m, int32_t by)
+{
+    m->value.fetch_add(by, std::memory_order_relaxed);
+}
+
+void metricSet(metric_t *m, int32_t value)
+{
+    m->value.store(value, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Raises a gauge to `value` if it is larger than the current value (high water mark).
+ */
+void metricMax(metric_t *m, int32_t value)
+{
+    int32_t cur = m->value.load(std::memory_order_relaxed);
+    while (value > cur && !m->value.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+        ;
+}
+
+/**
+ * @brief Adds one sample to a histogram.
+ */
+void metricObserve(metric_t *m, uint32_t sample)
+{
+    const uint32_t *bounds = m->bounds ? m->bounds : latencyBoundsMs; // scratch has none
+    int i = 0;
+    while (i < HIST_BUCKETS && sample > bounds[i])
+        i++;
+    m->buckets[i].fetch_add(1, std::memory_order_relaxed); // bucket HIST_BUCKETS is +Inf
+    m->sum.fetch_add(sample, std::memory_order_relaxed);
+    m->value.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Hands a registered metric over to another label value and clears it, for series
+ *        whose label has gone (probe.cpp reuses the entry of a host no longer in ipMap).
+ */
+void metricRelabel(metric_t *m, const char *label)
+{
+    portENTER_CRITICAL(&metricsMux);
+    memset(m->label, 0, sizeof(m->label));
+    strncpy(m->label, label ? label : "", METRIC_LABEL_LEN - 1);
+    m->value.store(0, std::memory_order_relaxed);
+    m->sum.store(0, std::memory_order_relaxed);
+    for (auto &b : m->buckets)
+        b.store(0, std::memory_order_relaxed);
+    portEXIT_CRITICAL(&metricsMux);
+}
+
+int metricCount()
+{
+    return metricsUsed.load();
+}
+
+metric_t *metricAt(int index)
+{
+    return (index >= 0 && index < metricsUsed.load()) ? &metrics[index] : NULL;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file metrics.h
+ * @brief Fixed-size in-memory registry of counters, gauges and histograms.
+ *
+ * Metrics are registered once (name + optional label key and value) and updated lock-free
+ * from any task.
+ * Storage is a static array, nothing is allocated after registration.
+ */
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+
+#define METRIC_MAX 128
+#define METRIC_LABEL_LEN 24
+#define HIST_BUCKETS 8
+
+enum metricType_t : uint8_t
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+};
+
+typedef struct
+{
+    const char *name;
+    const char *help;
+    metricType_t type;
+    const char *labelKey;         // label name, e.g. "core" or "reason", NULL for none
+    char label[METRIC_LABEL_LEN]; // label value, empty for none
+    std::atomic<int32_t> value;   // counter / gauge value, histogram sample count
+    std::atomic<uint32_t> sum;    // histogram sum of samples
+    const uint32_t *bounds;       // histogram upper bounds, HIST_BUCKETS entries ascending
+    std::atomic<uint32_t> buckets[HIST_BUCKETS + 1];
+} metric_t;
+
+extern const uint32_t latencyBoundsMs[HIST_BUCKETS];
+
+metric_t *metricRegister(const char *name, const char *help, metricType_t type,
+                         const char *labelKey = NULL, const char *label = NULL,
+                         const uint32_t *bounds = latencyBoundsMs);
+void metricInc(metric_t *m, int32_t by = 1);
+void metricSet(metric_t *m, int32_t value);
+void metricMax(metric_t *m, int32_t value);
+void metricObserve(metric_t *m, uint32_t sample);
+void metricRelabel(metric_t *m, const char *label);
+int metricCount();
+metric_t *metricAt(int index);
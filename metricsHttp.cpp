@@ -0,0 +1,271 @@
+/**
+ * @file metricsHttp.cpp
+ * @brief Prometheus scrape endpoint on the device: `GET /metrics` returns every counter,
+ *        gauge and histogram of the registry (metrics.cpp) as text.
+ *
+ * The socket counters were only visible on Blynk pins, a cloud outage left no view of the
+ * device at all. A local collector can now scrape it directly.
+ *
+ * @details
+ * - **Server**: `taskMetricsHttp` (core 0, priority 1) listens on `metrics.port` and serves
+ *   one connection at a time, HTTP/1.0 with `Connection: close`. It runs below the poller,
+ *   the worker pool and the uploaders, a scrape only uses idle time and never holds a lock
+ *   they take. Socket waits are bounded by `METRICS_IO_MS`.
+ * - **Rendering**: `metricsRender()` formats straight into one `METRICS_CHUNK_LEN` buffer and
+ *   hands it to the socket each time it fills, the page is never assembled in memory and no
+ *   heap is used. Each value is one atomic load from the registry, a histogram's buckets are
+ *   copied first so its `_bucket`, `_sum` and `_count` lines agree.
+ * - **Format**: text exposition 0.0.4, `# HELP` and `# TYPE` once per name, the label under
+ *   the key it was registered with (`core="core0"`, `reason="push"`), histogram buckets cumulative with `le="+Inf"`. The socket counters of
+ *   main.cpp (`passSocket`, `failSocket`, `recoveredSocket`, `retry`) are appended.
+ * - **Config**: `metrics 1` enables the server on `metrics.port` (both need a reboot).
+ * - **Metrics**: `metrics_scrapes_total`, `metrics_render_us` (last scrape).
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <atomic>
+#include <stdarg.h>
+#include <algorithm>
+#include <lwip/sockets.h>
+#include "metricsHttp.h"
+#include "metrics.h"
+#include "config.h"
+
+#define METRICS_CORE 0
+#define METRICS_PRIORITY 1
+#define METRICS_STACK_SIZE 4096
+#define METRICS_RETRY_MS (5 * 1000) // listen failed
+#define METRICS_IO_MS 2000          // request read, response write
+#define METRICS_REQUEST_LEN 256
+#define METRICS_BACKLOG 2
+#define WORDS_PER_BYTE 4
+
+extern std::atomic<int> failSocket, passSocket, recoveredSocket, retry;
+
+static TaskHandle_t metrics_task_handle;
+static char chunk[METRICS_CHUNK_LEN];
+static metric_t *mScrapes, *mRenderUs;
+
+// Function Prototypes
+void taskMetricsHttp(void *pvParameters);
+void bootWaitWifi();
+
+static void flushChunk(metricsWriter_t &w)
+{
+    if (w.len && !w.failed)
+        w.failed = !w.flush(w.buf, w.len, w.arg);
+    w.total += w.len;
+    w.len = 0;
+}
+
+// one line, formatted into the buffer, flushed first if it does not fit
+static void emit(metricsWriter_t &w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void emit(metricsWriter_t &w, const char *fmt, ...)
+{
+    va_list args;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        va_start(args, fmt);
+        int n = vsnprintf(w.buf + w.len, w.cap - w.len, fmt, args);
+        va_end(args);
+        if (n < 0)
+            return;
+        if (w.len + n < w.cap)
+        {
+            w.len += n;
+            return;
+        }
+        if (w.len == 0)
+        {
+            w.len = w.cap - 1; // longer than the buffer, cut
+            return;
+        }
+        flushChunk(w);
+    }
+}
+
+static const char *typeName(metricType_t type)
+{
+    return type == METRIC_COUNTER ? "counter" : type == METRIC_GAUGE ? "gauge" : "histogram";
+}
+
+// `{key="x"}`, or nothing without a label
+static void labels(const metric_t &m, char *out, size_t len, const char *le = NULL)
+{
+    const char *key = m.labelKey ? m.labelKey : "label";
+    if (m.label[0] && le)
+        snprintf(out, len, "{%s=\"%s\",le=\"%s\"}", key, m.label, le);
+    else if (m.label[0])
+        snprintf(out, len, "{%s=\"%s\"}", key, m.label);
+    else if (le)
+        snprintf(out, len, "{le=\"%s\"}", le);
+    else
+        out[0] = 0;
+}
+
+static void renderOne(metricsWriter_t &w, const metric_t &m)
+{
+    char lab[METRIC_LABEL_LEN + 32];
+    if (m.type != METRIC_HISTOGRAM)
+    {
+        labels(m, lab, sizeof(lab));
+        emit(w, "%s%s %d\n", m.name, lab, m.value.load(std::memory_order_relaxed));
+        return;
+    }
+    uint32_t buckets[HIST_BUCKETS + 1], count = 0;
+    for (int i = 0; i <= HIST_BUCKETS; i++)
+        buckets[i] = m.buckets[i].load(std::memory_order_relaxed);
+    uint32_t sum = m.sum.load(std::memory_order_relaxed);
+    for (int i = 0; i <= HIST_BUCKETS; i++)
+    {
+        char le[12];
+        count += buckets[i];
+        if (i < HIST_BUCKETS)
+            snprintf(le, sizeof(le), "%u", m.bounds[i]);
+        labels(m, lab, sizeof(lab), i < HIST_BUCKETS ? le : "+Inf");
+        emit(w, "%s_bucket%s %u\n", m.name, lab, count);
+    }
+    labels(m, lab, sizeof(lab));
+    emit(w, "%s_sum%s %u\n%s_count%s %u\n", m.name, lab, sum, m.name, lab, count);
+}
+
+/**
+ * @brief Renders the whole registry through `w`, the last partial buffer included.
+ * @return Bytes rendered.
+ */
+size_t metricsRender(metricsWriter_t &w)
+{
+    int n = metricCount();
+    for (int i = 0; i < n; i++)
+    {
+        const metric_t *m = metricAt(i);
+        bool seen = false;
+        for (int j = 0; j < i && !seen; j++)
+            seen = !strcmp(metricAt(j)->name, m->name);
+        if (seen)
+            continue; // rendered with the first entry of its name
+        emit(w, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, typeName(m->type));
+        for (int j = i; j < n; j++)
+            if (!strcmp(metricAt(j)->name, m->name))
+                renderOne(w, *metricAt(j));
+    }
+    emit(w, "# TYPE socket_pass_total counter\nsocket_pass_total %d\n", passSocket.load());
+    emit(w, "# TYPE socket_fail_total counter\nsocket_fail_total %d\n", failSocket.load());
+    emit(w, "# TYPE socket_recovered_total counter\nsocket_recovered_total %d\n", recoveredSocket.load());
+    emit(w, "# TYPE socket_retry_total counter\nsocket_retry_total %d\n", retry.load());
+    flushChunk(w);
+    return w.total;
+}
+
+static bool sendAll(const char *buf, size_t len, void *arg)
+{
+    int fd = *(int *)arg;
+    while (len)
+    {
+        int n = send(fd, buf, len, 0);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int metricsListen(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 || listen(fd, METRICS_BACKLOG) < 0)
+    {
+        Serial.printf("metrics: cannot listen on %u (%d)\n", port, errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Reads the request head and answers it, `/metrics` or 404.
+ */
+static void metricsServe(int fd)
+{
+    char req[METRICS_REQUEST_LEN];
+    struct timeval tv = {METRICS_IO_MS / 1000, (METRICS_IO_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    size_t len = 0;
+    while (len < sizeof(req) - 1) // up to the end of the head, the rest is not needed
+    {
+        int n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+        if (n <= 0)
+            break;
+        len += n;
+        req[len] = 0;
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+    req[len] = 0;
+    if (strncmp(req, "GET /metrics", 12) || (req[12] != ' ' && req[12] != '?'))
+    {
+        const char *nf = "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n";
+        sendAll(nf, strlen(nf), &fd);
+        return;
+    }
+    const char *head = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+    if (!sendAll(head, strlen(head), &fd))
+        return;
+    uint32_t start = micros();
+    metricsWriter_t w = {chunk, sizeof(chunk), 0, 0, false, sendAll, &fd};
+    metricsRender(w);
+    metricInc(mScrapes);
+    metricSet(mRenderUs, micros() - start);
+}
+
+/**
+ * @brief Metrics server task, one scrape at a time.
+ *
+ * No heartbeat: at priority 1 it may be starved for a while under load, the scrape then
+ * takes longer, the device is not stalled.
+ *
+ * @param pvParameters Unused.
+ */
+void taskMetricsHttp(void *pvParameters)
+{
+    Serial.printf("Task Metrics running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    bootWaitWifi();
+    int listenFd;
+    while ((listenFd = metricsListen(cfg()->metricsPort)) < 0)
+        vTaskDelay(pdMS_TO_TICKS(METRICS_RETRY_MS));
+    Serial.printf("metrics: listening on %u\n", cfg()->metricsPort);
+    for (;;)
+    {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0)
+        {
+            vTaskDelay(pdMS_TO_TICKS(METRICS_IO_MS));
+            continue;
+        }
+        metricsServe(fd);
+        close(fd);
+    }
+}
+
+/**
+ * @brief Starts the metrics server, called by `initRTOS()` when the config enables it.
+ */
+bool metricsHttpStart()
+{
+    mScrapes = metricRegister("metrics_scrapes_total", "Scrapes of /metrics served", METRIC_COUNTER);
+    mRenderUs = metricRegister("metrics_render_us", "Render and send time of the last scrape", METRIC_GAUGE);
+    xTaskCreatePinnedToCore(taskMetricsHttp, "Task Metrics", METRICS_STACK_SIZE, NULL, METRICS_PRIORITY, &metrics_task_handle, METRICS_CORE);
+    return metrics_task_handle != NULL;
+}
@@ -0,0 +1,23 @@
+/**
+ * @file metricsHttp.h
+ * @brief Local HTTP endpoint serving the metrics registry in the Prometheus text format.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define METRICS_CHUNK_LEN 1024 // render buffer, flushed to the socket when full
+
+typedef bool (*metricsFlush_t)(const char *buf, size_t len, void *arg);
+
+typedef struct
+{
+    char *buf;
+    size_t cap, len;
+    size_t total; // bytes flushed
+    bool failed;  // a flush failed, the rest is dropped
+    metricsFlush_t flush;
+    void *arg;
+} metricsWriter_t;
+
+size_t metricsRender(metricsWriter_t &w);
+bool metricsHttpStart();
@@ -1,17 +1,88 @@
 #include <Arduino.h>
+#include <atomic>
 #include "time.h"
+#include <esp_sntp.h>
+#include <Blynk/BlynkHandlers.h>
+#include "mailbox.h"
+#include "config.h"
 
-const char *FAILED_TO_OBTAIN_TIME = "Failed to obtain time";
+#define GMT_OFFSET_SEC -18000
+#define DAYLIGHT_OFFSET_SEC 3600
+#define BOOT_TIME_LEN 64
+
+const char *WAITING_FOR_TIME = "Waiting for NTP";
+extern char lastBoot[];
 void getBootTime(char *lastBook, char *strReason);
 void get_reset_reason(int reason, char *strReason);
+void ntpStart();
+void ntpPoll();
+void bootPhase(const char *phase);
+
+static std::atomic<bool> ntpPending(false); // set by the SNTP callback, taken by the loop
+
+/**
+ * @brief Formats the boot time (now - uptime) and the reset reason code.
+ */
+static void formatBootTime(char *lastBoot, const struct tm &now)
+{
+  time_t boot = mktime((struct tm *)&now) - millis() / 1000;
+  struct tm timeinfo;
+  localtime_r(&boot, &timeinfo);
+  snprintf(lastBoot, BOOT_TIME_LEN, "%d/%d/%d %d:%02d 0x%02x",
+           timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_year + 1900,
+           timeinfo.tm_hour, timeinfo.tm_min, esp_reset_reason());
+}
 
 /**
- * @brief Retrieves the boot time and reset reason of the ESP32 device.
+ * @brief SNTP callback, runs in the lwIP task when the clock is set.
  *
- * This function configures the time using an NTP server, retrieves the local time,
- * and formats it into a human-readable string. It also determines the reset reason
- * and provides it as a string. If the time cannot be obtained, it retries up to
- * three times before failing.
+ * Only raises a flag: `lastBoot` belongs to the loop and `bootPhase()` takes a spinlock and
+ * prints, `ntpPoll()` does the rest.
+ */
+static void ntpSynced(struct timeval *tv)
+{
+  ntpPending.store(true);
+}
+
+/**
+ * @brief Called by the loop, the first sync fills in the boot time and posts it to V25,
+ *        later syncs are ignored.
+ */
+void ntpPoll()
+{
+  static bool synced = false;
+  struct tm timeinfo;
+  if (synced || !ntpPending.load() || !getLocalTime(&timeinfo, 0))
+    return;
+  synced = true;
+  formatBootTime(lastBoot, timeinfo);
+  widgetPrint(V25, lastBoot);
+  bootPhase("ntp");
+}
+
+/**
+ * @brief Starts the SNTP client in the background, called as soon as Wi-Fi is up.
+ *
+ * Nothing waits for the clock: the loop publishes the boot time when it arrives
+ * (`ntpPoll()`).
+ *
+ * @note The NTP server comes from the config record (default "pool.ntp.org"), the GMT
+ *       offset is -18000 seconds (UTC-5) and the daylight saving time offset is 3600 seconds.
+ */
+void ntpStart()
+{
+  static char server[sizeof(config_t::ntpServer)]; // SNTP keeps the pointer, a config reload must not move it
+  strcpy(server, cfg()->ntpServer);
+  sntp_set_time_sync_notification_cb(ntpSynced);
+  configTime(GMT_OFFSET_SEC, DAYLIGHT_OFFSET_SEC, server);
+}
+
+/**
+ * @brief Retrieves the boot time and reset reason of the ESP32 device without blocking.
+ *
+ * The reset reason is always available. The boot time is only known once SNTP (started
+ * by `ntpStart()`) has set the clock, until then `lastBoot` says so and `ntpPoll()`
+ * updates the widget later.
  *
  * @param[out] lastBoot A pointer to a character array where the formatted boot time
  *                      will be stored. The array should have enough space to hold
@@ -19,41 +90,19 @@ void get_reset_reason(int reason, char *strReason);
  * @param[out] strReason A pointer to a character array where the reset reason string
  *                       will be stored.
  *
- * @note The function uses the NTP server "pool.ntp.org" to synchronize the time.
- *       The GMT offset is set to -18000 seconds (UTC-5), and daylight saving time
- *       offset is set to 3600 seconds.
- *
  * @warning Ensure that the `lastBoot` and `strReason` pointers point to valid memory
  *          locations before calling this function.
  */
 void getBootTime(char *lastBoot, char *strReason)
 {
-  const char *ntpServer = "pool.ntp.org";
-  const long gmtOffset_sec = -18000;
-  const int daylightOffset_sec = 3600;
-  configTime(gmtOffset_sec, daylightOffset_sec, ntpServer);
   struct tm timeinfo;
 
   int reset_reason = esp_reset_reason();
   get_reset_reason(reset_reason, strReason);
-  int retries = 3;
-
-  while (retries--)
-  {
-    if (!getLocalTime(&timeinfo))
-    {
-      strncpy(lastBoot, FAILED_TO_OBTAIN_TIME, strlen(FAILED_TO_OBTAIN_TIME) + 1);
-      Serial.printf("Failed to obtain time retry: %d\n", 3 - retries);
-    }
-    else
-    {
-      int hr = timeinfo.tm_hour;
-      snprintf(lastBoot, 64, "%d/%d/%d %d:%02d 0x%02x",
-               timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_year + 1900,
-               hr, timeinfo.tm_min, reset_reason);
-      break; // passed 1st time!
-    }
-  }
+  if (getLocalTime(&timeinfo, 0)) // 0: do not wait for the sync
+    formatBootTime(lastBoot, timeinfo);
+  else
+    strncpy(lastBoot, WAITING_FOR_TIME, BOOT_TIME_LEN);
   Serial.printf("Boot time: %s, Reset reason: %s\n", lastBoot, strReason);
 }
 /**
@@ -0,0 +1,560 @@
+/**
+ * @file mqtt.cpp
+ * @brief Optional MQTT sink for sensor readings: one persistent connection, QoS 1
+ *        publishes with an in-flight window.
+ *
+ * The HTTP uploader (`taskSQL_HTTP`) does one form POST per reading, each on a new
+ * connection and followed by a `delay.http` pause, which caps the ingest rate at a few
+ * readings per second. This sink keeps a single TCP connection to the broker and keeps up
+ * to `mqtt.window` publishes unacknowledged at a time, so the rate is bound by the broker
+ * round trip divided by the window.
+ *
+ * @details
+ * - **Selection**: config `sink` (config.cpp) picks HTTP, MQTT or both at boot.
+ *   `setupHTTP_request()` hands each reading to `mqttPublish()`, which only queues it.
+ * - **Topics**: `<mqtt.topic>/<sensor>`, e.g. "esp32/HOME/BME280". The payload is
+ *   "value1,value2,value3", the same fields as the HTTP POST.
+ * - **QoS 1**: every publish carries a packet id and stays in the window until its PUBACK.
+ *   A publish not acknowledged after `MQTT_RETRY_MS`, or still in the window when the
+ *   connection is re-established, is sent again with the DUP flag (at least once delivery).
+ * - **Connection**: keep-alive PINGREQ at half `mqtt.keepalive`. The connection is dropped
+ *   when nothing arrives for 1.5 keep-alive periods. Reconnects back off from 1 s to 30 s.
+ *   A changed `mqtt.host`/`mqtt.port` (config reload) reconnects to the new broker.
+ * - **Broker**: any MQTT 3.1.1 broker. For bench tests point `mqtt.host` at a local
+ *   mosquitto (`mosquitto -v`), `mosquitto_sub -t 'esp32/#' -v` shows the readings.
+ * - **Benchmark**: the "mqttbench" terminal command publishes `MQTT_BENCH_COUNT` messages
+ *   to `<mqtt.topic>/bench` as fast as the window allows. It prints the rate and ack latency
+ *   next to the HTTP rate, from the measured POST time (`sink_send_ms{http}`) plus the
+ *   pacing delay.
+ * - **Metrics**: `sink_sent_total` and `sink_send_ms` (label http / mqtt), `mqtt_inflight`,
+ *   `mqtt_reconnects`, `mqtt_retransmits` and `sink_dropped_total{mqtt}` (queue full).
+ *
+ * @note Readings still queued or in flight are lost on a restart, the HTTP path remains the
+ *       durable one (warm restart snapshot, delete.php recovery).
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <WiFi.h>
+#include <atomic>
+#include <algorithm>
+#include <lwip/sockets.h>
+#include <Blynk/BlynkHandlers.h>
+#include "config.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "watchDog.h"
+#include "reading.h"
+
+#define MQTT_QUEUE_SIZE 32
+#define MQTT_CORE 0
+#define MQTT_PRIORITY 2
+#define MQTT_STACK_SIZE 4096
+#define MQTT_HEARTBEAT_MS (15 * 1000) // one connect attempt
+#define MQTT_CONNECT_MS 5000
+#define MQTT_RETRY_MS 5000 // resend a publish not acknowledged by then
+#define MQTT_BACKOFF_MIN_MS 1000
+#define MQTT_BACKOFF_MAX_MS (30 * 1000)
+#define MQTT_PACKET_LEN 128
+#define MQTT_TOPIC_LEN 48
+#define MQTT_BENCH_COUNT 500
+#define MQTT_BENCH_MS (20 * 1000)
+#define WORDS_PER_BYTE 4
+// #define DEBUG_MQTT
+
+// control packet types, first byte of the fixed header
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH_QOS1 0x32
+#define MQTT_DUP 0x08
+#define MQTT_PUBACK 0x40
+#define MQTT_PINGREQ 0xc0
+#define MQTT_PINGRESP 0xd0
+
+typedef struct
+{
+    char sensor[10]; // topic suffix
+    float value1, value2;
+    int value3;
+    uint32_t queuedMs;
+} mqttMsg_t;
+
+typedef struct
+{
+    mqttMsg_t msg;
+    uint16_t id;
+    uint32_t sentMs;
+    bool inUse;
+} mqttSlot_t;
+
+typedef struct
+{
+    uint8_t type;
+    uint32_t remaining;
+    uint32_t multiplier;
+    uint8_t body[4]; // CONNACK / PUBACK, longer bodies are skipped
+    uint32_t got;
+    uint8_t stage; // 0 type, 1 remaining length, 2 body
+} mqttRx_t;
+
+QueueHandle_t QueMQTT_Handle;
+TaskHandle_t mqtt_task_handle;
+static WiFiClient mqttClient;
+static mqttSlot_t window[CONFIG_MAX_WINDOW];
+static int inflight;
+static uint16_t nextId = 1;
+static uint32_t lastTx, lastRx;
+static int connackCode; // -1 waiting
+static mqttRx_t rxState;
+static char clientId[24];
+static uint32_t benchAcked, benchAckMs;
+static std::atomic<bool> benchRequest(false);
+static metric_t *mSent, *mSendMs, *mInflight, *mReconnects, *mRetransmits, *mDropped;
+
+extern std::atomic<int> passSocket;
+
+// Function Prototypes
+bool mqttStart();
+bool mqttPublish(const sensorReading_t &reading);
+bool mqttBench();
+void taskMQTT(void *pvParameters);
+void bootWaitWifi();
+
+/**
+ * @brief Creates the reading queue and starts the MQTT task, called by `initRTOS()` when
+ *        the config selects the MQTT sink.
+ */
+bool mqttStart()
+{
+    QueMQTT_Handle = xQueueCreate(MQTT_QUEUE_SIZE, sizeof(mqttMsg_t));
+    if (QueMQTT_Handle == NULL)
+    {
+        Serial.println("Queue mqtt could not be created..");
+        return false;
+    }
+    mSent = metricRegister("sink_sent_total", "Readings delivered by the sink", METRIC_COUNTER, "sink", "mqtt");
+    mSendMs = metricRegister("sink_send_ms", "Send to acknowledgement of one reading", METRIC_HISTOGRAM, "sink", "mqtt");
+    mInflight = metricRegister("mqtt_inflight", "Unacknowledged QoS 1 publishes", METRIC_GAUGE);
+    mReconnects = metricRegister("mqtt_reconnects", "Broker connections established", METRIC_COUNTER);
+    mRetransmits = metricRegister("mqtt_retransmits", "Publishes sent again with DUP", METRIC_COUNTER);
+    mDropped = metricRegister("sink_dropped_total", "Readings dropped, sink queue full", METRIC_COUNTER, "sink", "mqtt");
+    xTaskCreatePinnedToCore(taskMQTT, "Task MQTT", MQTT_STACK_SIZE, NULL, MQTT_PRIORITY, &mqtt_task_handle, MQTT_CORE);
+    return mqtt_task_handle != NULL;
+}
+
+/**
+ * @brief Queues one reading for the broker, never blocks.
+ *
+ * @param reading Sensor reading, its name is the last topic level, the first two values
+ *                are published.
+ * @return false if the sink is not running or its queue is full.
+ */
+bool mqttPublish(const sensorReading_t &reading)
+{
+    if (QueMQTT_Handle == NULL)
+        return false;
+    mqttMsg_t msg = {};
+    strncpy(msg.sensor, reading.sensor, sizeof(msg.sensor) - 1);
+    msg.value1 = readingValue(reading, 0);
+    msg.value2 = readingValue(reading, 1);
+    msg.value3 = passSocket;
+    msg.queuedMs = millis();
+    if (xQueueSend(QueMQTT_Handle, &msg, 0) != pdTRUE)
+    {
+        metricInc(mDropped);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Asks the MQTT task to run the throughput benchmark, the result goes to V42.
+ */
+bool mqttBench()
+{
+    if (mqtt_task_handle == NULL)
+        return false;
+    benchRequest = true;
+    return true;
+}
+
+// MQTT variable byte integer
+static int putLength(uint8_t *p, uint32_t len)
+{
+    int n = 0;
+    do
+    {
+        uint8_t b = len % 128;
+        len /= 128;
+        p[n++] = len ? b | 0x80 : b;
+    } while (len);
+    return n;
+}
+
+static int putString(uint8_t *p, const char *s, size_t len)
+{
+    p[0] = len >> 8;
+    p[1] = len & 0xff;
+    memcpy(p + 2, s, len);
+    return 2 + len;
+}
+
+static bool mqttWrite(const uint8_t *p, size_t len)
+{
+    if (mqttClient.write(p, len) != len)
+        return false;
+    lastTx = millis();
+    return true;
+}
+
+static void mqttDrop(const char *why)
+{
+    Serial.printf("mqtt: connection dropped, %s\n", why);
+    mqttClient.stop();
+}
+
+/**
+ * @brief Sends (or re-sends with DUP) the publish held in a window slot.
+ */
+static bool sendPublish(mqttSlot_t &slot, bool dup)
+{
+    uint8_t packet[MQTT_PACKET_LEN];
+    char topic[MQTT_TOPIC_LEN], payload[40];
+    int topicLen = snprintf(topic, sizeof(topic), "%s/%s", cfg()->mqttTopic, slot.msg.sensor);
+    int payloadLen = snprintf(payload, sizeof(payload), "%.2f,%.2f,%d", slot.msg.value1, slot.msg.value2, slot.msg.value3);
+    topicLen = std::min(topicLen, (int)sizeof(topic) - 1);
+    payloadLen = std::min(payloadLen, (int)sizeof(payload) - 1);
+
+    int n = 0;
+    packet[n++] = MQTT_PUBLISH_QOS1 | (dup ? MQTT_DUP : 0);
+    n += putLength(packet + n, 2 + topicLen + 2 + payloadLen);
+    n += putString(packet + n, topic, topicLen);
+    packet[n++] = slot.id >> 8;
+    packet[n++] = slot.id & 0xff;
+    memcpy(packet + n, payload, payloadLen);
+    n += payloadLen;
+    slot.sentMs = millis();
+    return mqttWrite(packet, n);
+}
+
+/**
+ * @brief Puts a message in a free window slot and publishes it.
+ */
+static bool publish(const mqttMsg_t &msg)
+{
+    for (int i = 0; i < CONFIG_MAX_WINDOW; i++)
+    {
+        mqttSlot_t &slot = window[i];
+        if (slot.inUse)
+            continue;
+        slot.msg = msg;
+        slot.id = nextId++;
+        if (nextId == 0) // packet id 0 is not allowed
+            nextId = 1;
+        slot.inUse = true;
+        inflight++;
+        metricSet(mInflight, inflight);
+        return sendPublish(slot, false);
+    }
+    return false;
+}
+
+static void handlePacket(const mqttRx_t &p)
+{
+    uint32_t now = millis();
+    switch (p.type & 0xf0)
+    {
+    case MQTT_CONNACK:
+        connackCode = p.got >= 2 ? p.body[1] : 0xff;
+        break;
+    case MQTT_PUBACK:
+    {
+        uint16_t id = p.body[0] << 8 | p.body[1];
+        for (int i = 0; i < CONFIG_MAX_WINDOW; i++)
+        {
+            mqttSlot_t &slot = window[i];
+            if (!slot.inUse || slot.id != id)
+                continue;
+            slot.inUse = false;
+            inflight--;
+            metricSet(mInflight, inflight);
+            metricInc(mSent);
+            metricObserve(mSendMs, now - slot.sentMs);
+            if (!strcmp(slot.msg.sensor, "bench"))
+            {
+                benchAcked++;
+                benchAckMs += now - slot.msg.queuedMs;
+            }
+            break;
+        }
+        break;
+    }
+    case MQTT_PINGRESP: // lastRx is all the keep-alive needs
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Reads whatever the broker sent and dispatches complete packets.
+ */
+static void mqttReceive()
+{
+    uint8_t buf[64];
+    int n;
+    while (mqttClient.available() > 0 && (n = mqttClient.read(buf, sizeof(buf))) > 0)
+    {
+        lastRx = millis();
+        for (int i = 0; i < n; i++)
+        {
+            mqttRx_t &r = rxState;
+            uint8_t b = buf[i];
+            if (r.stage == 0)
+            {
+                r = {};
+                r.type = b;
+                r.multiplier = 1;
+                r.stage = 1;
+                continue;
+            }
+            if (r.stage == 1)
+            {
+                r.remaining += (b & 0x7f) * r.multiplier;
+                r.multiplier *= 128;
+                if (b & 0x80)
+                    continue;
+                r.stage = 2;
+            }
+            else
+            {
+                if (r.got < sizeof(r.body))
+                    r.body[r.got] = b;
+                r.got++;
+            }
+            if (r.got == r.remaining)
+            {
+                handlePacket(r);
+                r.stage = 0;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Waits up to `ms` for data from the broker.
+ */
+static void waitReadable(uint32_t ms)
+{
+    int fd = mqttClient.fd();
+    if (fd < 0)
+    {
+        vTaskDelay(pdMS_TO_TICKS(ms));
+        return;
+    }
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    struct timeval tv = {(time_t)(ms / 1000), (suseconds_t)((ms % 1000) * 1000)};
+    select(fd + 1, &rfds, NULL, NULL, &tv);
+}
+
+/**
+ * @brief Opens the connection, sends CONNECT and waits for CONNACK, then re-sends the
+ *        publishes left in the window by the previous connection.
+ */
+static bool mqttConnect(const config_t *c)
+{
+    if (!mqttClient.connect(c->mqttHost, c->mqttPort, MQTT_CONNECT_MS))
+        return false;
+    mqttClient.setNoDelay(true);
+    rxState = {};
+
+    uint8_t packet[MQTT_PACKET_LEN];
+    size_t idLen = strlen(clientId);
+    int n = 0;
+    packet[n++] = MQTT_CONNECT;
+    n += putLength(packet + n, 10 + 2 + idLen);
+    n += putString(packet + n, "MQTT", 4);
+    packet[n++] = 4;    // protocol level 3.1.1
+    packet[n++] = 0x02; // clean session
+    packet[n++] = c->mqttKeepAliveS >> 8;
+    packet[n++] = c->mqttKeepAliveS & 0xff;
+    n += putString(packet + n, clientId, idLen);
+    connackCode = -1;
+    if (!mqttWrite(packet, n))
+    {
+        mqttClient.stop();
+        return false;
+    }
+
+    uint32_t start = millis();
+    while (connackCode < 0 && millis() - start < MQTT_CONNECT_MS && mqttClient.connected())
+    {
+        waitReadable(100);
+        mqttReceive();
+    }
+    if (connackCode != 0)
+    {
+        Serial.printf("mqtt: %s:%u refused (%d)\n", c->mqttHost, c->mqttPort, connackCode);
+        mqttClient.stop();
+        return false;
+    }
+    lastRx = millis();
+    metricInc(mReconnects);
+    Serial.printf("mqtt: connected to %s:%u as %s, %d in flight\n", c->mqttHost, c->mqttPort, clientId, inflight);
+    for (int i = 0; i < CONFIG_MAX_WINDOW; i++)
+    {
+        if (window[i].inUse)
+        {
+            metricInc(mRetransmits);
+            sendPublish(window[i], true);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Acks, retransmits and keep-alive, called on every pass of the task.
+ *
+ * @return false if the connection was dropped.
+ */
+static bool mqttService(const config_t *c)
+{
+    uint32_t now = millis();
+    mqttReceive();
+    for (int i = 0; i < CONFIG_MAX_WINDOW; i++)
+    {
+        if (window[i].inUse && now - window[i].sentMs > MQTT_RETRY_MS)
+        {
+            metricInc(mRetransmits);
+            if (!sendPublish(window[i], true))
+                break;
+        }
+    }
+    uint32_t keepAliveMs = c->mqttKeepAliveS * 1000;
+    if (now - lastTx >= keepAliveMs / 2)
+    {
+        uint8_t ping[2] = {MQTT_PINGREQ, 0};
+        mqttWrite(ping, sizeof(ping));
+    }
+    if (now - lastRx > keepAliveMs * 3 / 2)
+        mqttDrop("keep-alive timeout");
+    else if (!mqttClient.connected())
+        mqttDrop("closed by broker");
+    return mqttClient.connected();
+}
+
+/**
+ * @brief Publishes `MQTT_BENCH_COUNT` messages as fast as the window allows and compares
+ *        the rate with the HTTP uploader.
+ */
+static void runBench(heartbeat_t *hb)
+{
+    const config_t *c = cfg();
+    mqttMsg_t msg = {};
+    strcpy(msg.sensor, "bench");
+    benchAcked = benchAckMs = 0;
+    uint32_t start = millis();
+    int sent = 0;
+    while (benchAcked < MQTT_BENCH_COUNT && millis() - start < MQTT_BENCH_MS && mqttClient.connected())
+    {
+        hbCheckIn(hb, "bench");
+        while (sent < MQTT_BENCH_COUNT && inflight < c->mqttWindow)
+        {
+            msg.value1 = sent;
+            msg.queuedMs = millis();
+            if (!publish(msg))
+                break;
+            sent++;
+        }
+        waitReadable(5);
+        mqttService(c);
+    }
+    uint32_t elapsed = std::max((uint32_t)1, (uint32_t)(millis() - start));
+
+    metric_t *post = metricRegister("sink_send_ms", "Send to acknowledgement of one reading", METRIC_HISTOGRAM, "sink", "http");
+    int posts = post->value.load();
+    uint32_t postMs = posts ? post->sum.load() / posts : 0;
+    char tmp[MAILBOX_TEXT_LEN];
+    snprintf(tmp, sizeof(tmp), "mqtt: %u/%d acked in %u ms, %u msg/s, ack %u ms avg, window %u\n",
+             benchAcked, MQTT_BENCH_COUNT, elapsed, benchAcked * 1000 / elapsed,
+             benchAcked ? benchAckMs / benchAcked : 0, c->mqttWindow);
+    Serial.print(tmp);
+    widgetPrint(V42, tmp);
+    if (posts)
+        snprintf(tmp, sizeof(tmp), "http: %d posts, %u ms avg + %u ms pacing, %.2f msg/s\n",
+                 posts, postMs, c->httpDelayMs, 1000.0 / (postMs + c->httpDelayMs));
+    else
+        snprintf(tmp, sizeof(tmp), "http: no posts yet, pacing alone caps it at %.2f msg/s\n", 1000.0 / c->httpDelayMs);
+    Serial.print(tmp);
+    widgetPrint(V42, tmp);
+}
+
+/**
+ * @brief MQTT sink task: keeps the broker connection, moves queued readings into the
+ *        in-flight window and collects the acknowledgements.
+ *
+ * @param pvParameters Unused.
+ */
+void taskMQTT(void *pvParameters)
+{
+    mqttMsg_t msg;
+    uint32_t backoff = MQTT_BACKOFF_MIN_MS;
+    char host[sizeof(config_t::mqttHost)] = "";
+    uint16_t port = 0;
+    heartbeat_t *hb = hbRegister("mqtt", MQTT_HEARTBEAT_MS);
+    Serial.printf("Task MQTT running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    hbIdle(hb);
+    bootWaitWifi();
+
+    uint8_t mac[6];
+    WiFi.macAddress(mac);
+    snprintf(clientId, sizeof(clientId), "esp32-%02x%02x%02x", mac[3], mac[4], mac[5]);
+
+    for (;;)
+    {
+        const config_t *c = cfg();
+        hbCheckIn(hb, "connect");
+        if (mqttClient.connected() && (port != c->mqttPort || strcmp(host, c->mqttHost)))
+            mqttDrop("broker changed");
+        if (!mqttClient.connected())
+        {
+            strcpy(host, c->mqttHost);
+            port = c->mqttPort;
+            if (!mqttConnect(c))
+            {
+                hbIdle(hb);
+                vTaskDelay(pdMS_TO_TICKS(backoff));
+                backoff = std::min(backoff * 2, (uint32_t)MQTT_BACKOFF_MAX_MS);
+                continue;
+            }
+            backoff = MQTT_BACKOFF_MIN_MS;
+        }
+
+        if (benchRequest.exchange(false))
+            runBench(hb);
+
+        hbCheckIn(hb, "publish");
+        while (inflight < c->mqttWindow && xQueueReceive(QueMQTT_Handle, &msg, 0) == pdPASS)
+        {
+            if (!publish(msg))
+                break;
+#ifdef DEBUG_MQTT
+            Serial.printf("mqtt: %s queued %u ms\n", msg.sensor, millis() - msg.queuedMs);
+#endif
+        }
+
+        hbCheckIn(hb, "ack");
+        if (!mqttService(c))
+            continue;
+
+        if (inflight == 0)
+        {
+            hbIdle(hb); // nothing to acknowledge, sleep until a reading or the next ping
+            xQueuePeek(QueMQTT_Handle, &msg, pdMS_TO_TICKS(c->mqttKeepAliveS * 1000 / 2));
+        }
+        else
+            waitReadable(10);
+    }
+}
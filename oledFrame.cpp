@@ -0,0 +1,66 @@
+/**
+ * @file oledFrame.cpp
+ * @brief Framebuffer diff for incremental OLED updates (dashboard.cpp).
+ *
+ * @details
+ * - **Shadow**: a copy of what was last sent to the panel. A frame is compared with it page
+ *   by page, a page that differs gives one span from its first to its last changed column.
+ *   Only the spans go over I2C, a changed value costs its few columns, not the 1 KB frame.
+ * - **Commit**: a span is copied into the shadow once it has been sent. A failed transfer
+ *   leaves the shadow as it was, the span is sent again on the next update.
+ * - **Invalid shadow**: after a reset of the panel or another writer (the boot screen) the
+ *   content is unknown, every page is one full width span.
+ *
+ * @author Leon Freimour
+ */
+#include "oledFrame.h"
+
+/**
+ * @brief Marks the panel content unknown, the next diff covers the whole frame.
+ */
+void oledInvalidate(oledShadow_t *s)
+{
+    s->valid = false;
+}
+
+/**
+ * @brief Finds the changed columns of each page.
+ *
+ * @param spans Room for `OLED_PAGES` spans, one per dirty page in page order.
+ * @return Number of dirty pages.
+ */
+int oledDiff(const oledShadow_t *s, const uint8_t *frame, oledSpan_t *spans)
+{
+    int n = 0;
+    for (int page = 0; page < OLED_PAGES; page++)
+    {
+        const uint8_t *now = frame + page * OLED_COLS;
+        const uint8_t *was = s->shown + page * OLED_COLS;
+        int x0 = 0, x1 = OLED_COLS - 1;
+        if (s->valid)
+        {
+            while (x0 < OLED_COLS && now[x0] == was[x0])
+                x0++;
+            if (x0 == OLED_COLS)
+                continue;
+            while (now[x1] == was[x1])
+                x1--;
+        }
+        spans[n].page = (uint8_t)page;
+        spans[n].x0 = (uint8_t)x0;
+        spans[n].x1 = (uint8_t)x1;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * @brief Records `span` of `frame` as shown on the panel.
+ */
+void oledCommit(oledShadow_t *s, const uint8_t *frame, const oledSpan_t *span)
+{
+    size_t at = span->page * OLED_COLS + span->x0;
+    memcpy(s->shown + at, frame + at, span->x1 - span->x0 + 1);
+    if (!s->valid && span->page == OLED_PAGES - 1 && span->x0 == 0 && span->x1 == OLED_COLS - 1)
+        s->valid = true; // the full frame went out in page order
+}
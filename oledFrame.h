@@ -0,0 +1,34 @@
+/**
+ * @file oledFrame.h
+ * @brief Dirty region tracking for the SSD1306 framebuffer: which columns of which pages
+ *        differ from what the panel shows.
+ *
+ * Plain C, no I/O and no Arduino header, so it builds on a host (test/oledFrameTest.cpp).
+ * The framebuffer layout is the SSD1306 (and Adafruit_SSD1306) one, byte
+ * `x + page * OLED_COLS` holds the 8 pixels of column x in that page, LSB on top.
+ */
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define OLED_COLS 128
+#define OLED_PAGES 8 // 64 rows
+#define OLED_FRAME_BYTES (OLED_COLS * OLED_PAGES)
+
+typedef struct
+{
+    uint8_t page;
+    uint8_t x0, x1; // changed columns, inclusive
+} oledSpan_t;
+
+typedef struct
+{
+    bool valid; // false: the panel content is unknown, everything is dirty
+    uint8_t shown[OLED_FRAME_BYTES];
+} oledShadow_t;
+
+void oledInvalidate(oledShadow_t *s);
+int oledDiff(const oledShadow_t *s, const uint8_t *frame, oledSpan_t *spans);
+void oledCommit(oledShadow_t *s, const uint8_t *frame, const oledSpan_t *span);
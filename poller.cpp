@@ -0,0 +1,523 @@
+/**
+ * @file poller.cpp
+ * @brief Dedicated FreeRTOS task that sweeps the sensor fleet away from the Blynk loop.
+ *
+ * The poller owns everything that touches the network during a sweep:
+ * the ip.php device list (`fetchRegistry()`), and the per-device polls
+ * `socketClient()` -> `processSensorData()` -> `upDateWidget()`, which it hands to the
+ * worker pool on both cores (workPool.cpp, see scheduler.cpp). Widget values never go to
+ * Blynk from here, they are posted to the lock-free mailbox (see mailbox.cpp) and the
+ * Arduino loop writes them out. A slow sweep therefore no longer delays `Blynk.run()` nor
+ * the loop watchdog.
+ *
+ * @details
+ * - **Task**: `taskPoller` pinned to `POLLER_CORE`. It refreshes the device list from
+ *   ip.php every `registry_ms` (config.cpp), or every `seed_ms` while devices announced by
+ *   multicast discovery are alive, and polls each device when its wheel timer fires (see
+ *   scheduler.cpp), or earlier when a request arrives on `QuePoll_Handle`.
+ * - **Requests** (`pollReq_t`):
+ *   - `POLL_SWEEP`: refresh the device list and poll every device now, optionally forcing
+ *     the device list to the terminal.
+ *   - `POLL_CONNECTED`: fetch the row count from rows.php then do a forced sweep
+ *     (issued from `BLYNK_CONNECTED`).
+ *   - `POLL_DEVICE`: read a single device and answer on the terminal (bme/adc commands).
+ *   - `POLL_SCHED`: print the poll schedule on the terminal (sched command).
+ *   - `POLL_TIMER`: run a timing wheel callback in the poller (see `pollerDispatch()`).
+ *   - `POLL_CONFIG`: re-apply the poll intervals and recompile the alarm rules after a config
+ *     reload.
+ *   - `POLL_DISCOVERY`: a device announced itself, moved or expired (see discovery.cpp).
+ * - **Device list**: ip.php is read from the HTTP stream in `IPLIST_CHUNK` byte pieces and
+ *   parsed as it arrives (ipList.cpp), the body is never held in memory. A list cut short
+ *   leaves the previous one in place.
+ * - **ipMap**: rebuilt by the poller from the last ip.php list (the seed) plus the devices
+ *   alive on the discovery registry, an announced IP wins over the seed. Guarded by
+ *   `xMutex_ipMap`, other tasks use `ipMapSnapshot()` to get a private copy.
+ * - **Warm restart**: seeds the registry from the RTC snapshot on a warm boot and saves the
+ *   snapshot after every registry refresh (see warmState.cpp).
+ * - **Watchdog**: checks in with the heartbeat watchdog (watchDog.cpp) for every request
+ *   and is marked idle while it waits on the queue.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <atomic>
+#include <WiFi.h>
+#include <HTTPClient.h>
+#include <map>
+#include <algorithm>
+#include <string>
+#include <Blynk/BlynkHandlers.h>
+#include "mailbox.h"
+#include "timingWheel.h"
+#include "watchDog.h"
+#include "warmState.h"
+#include "config.h"
+#include "discovery.h"
+#include "binLog.h"
+#include "ipList.h"
+#include "reading.h"
+#include "alarm.h"
+
+#define POLL_QUEUE_SIZE 40 // room for every device timer firing at once
+#define POLLER_CORE 0
+#define POLLER_PRIORITY 1
+#define POLLER_STACK_SIZE 8192
+#define POLLER_HEARTBEAT_MS (20 * 1000) // one HTTP fetch or one device read
+#define WORDS_PER_BYTE 4
+#define IPLIST_CHUNK 64           // bytes read from the ip.php stream at a time
+#define IPLIST_TIMEOUT_MS 5000    // no body byte for this long, the fetch failed
+// #define DEBUG
+
+typedef enum
+{
+    POLL_SWEEP,
+    POLL_CONNECTED,
+    POLL_DEVICE,
+    POLL_SCHED,
+    POLL_TIMER,
+    POLL_CONFIG,
+    POLL_DISCOVERY,
+} pollType_t;
+
+typedef struct
+{
+    pollType_t type;
+    bool forceList;
+    char ipAddr[20];
+    char label[8];
+    char postFix[4];
+    twCallback_t cb;
+    void *arg;
+} pollReq_t;
+
+QueueHandle_t QuePoll_Handle;
+TaskHandle_t poll_task_handle;
+extern std::map<std::string, std::string> ipMap;
+extern SemaphoreHandle_t xMutex_ipMap;
+extern std::atomic<int> passSocket;
+
+// Function Prototypes
+bool initPoller();
+void taskPoller(void *pvParameters);
+void refreshRegistry(bool forceList);
+static int fetchRegistry(std::map<std::string, std::string> &devices, uint32_t &hash);
+static void applyRegistry(std::map<std::string, std::string> &devices);
+static void rebuildRegistry();
+bool requestSweep(bool forceList);
+bool requestSchedReport();
+bool pollerDispatch(twCallback_t cb, void *arg);
+bool requestConnectedSweep();
+bool requestDeviceRead(const char *ip, const char *label, const char *postFix);
+bool requestReconfigure();
+bool requestDiscoverySync();
+std::map<std::string, std::string> ipMapSnapshot();
+String performHttpGet(const char *url);
+int socketClient(char *espServer, char *command, bool updateErrorQueue, readingBatch_t &batch);
+void schedSync(const std::map<std::string, std::string> &devices);
+void schedPollAll(uint32_t now);
+void schedReport();
+void schedReconfigure();
+void schedHint(const char *name, const char *sensors);
+void bootWaitWifi();
+
+static uint32_t lastListHash = 0; // hash of the ip.php body last listed
+static std::map<std::string, std::string> seedDevices; // last ip.php list
+
+// name of the device at `ip` in ipMap, the IP itself if it is not listed
+static std::string deviceName(const char *ip)
+{
+    for (const auto &pair : ipMapSnapshot())
+        if (pair.second == ip)
+            return pair.first;
+    return ip;
+}
+
+/**
+ * @brief Creates the poll request queue and starts the poller task.
+ *
+ * Called from `initRTOS()` once `xMutex_ipMap` exists, before Wi-Fi is up: the task waits
+ * for the Wi-Fi gate (boot.cpp) before its first fetch. `BLYNK_CONNECTED` asks for the
+ * connected sweep once the cloud is up.
+ *
+ * @return true on success, false if the queue or the task could not be created.
+ */
+bool initPoller()
+{
+    QuePoll_Handle = xQueueCreate(POLL_QUEUE_SIZE, sizeof(pollReq_t));
+    if (QuePoll_Handle == NULL)
+    {
+        Serial.println("Queue poll could not be created..");
+        return false;
+    }
+    xTaskCreatePinnedToCore(taskPoller, "Task Poller", POLLER_STACK_SIZE, NULL, POLLER_PRIORITY, &poll_task_handle, POLLER_CORE);
+    return poll_task_handle != NULL;
+}
+
+/**
+ * @brief Poller task, refreshes the device list, dispatches due polls and serves requests
+ *        from the loop.
+ *
+ * @param pvParameters Unused.
+ *
+ * The task blocks on `QuePoll_Handle` until either a request arrives (device timers fire
+ * as `POLL_TIMER` requests) or the device list needs a refresh, so a request (e.g. "refr"
+ * from the terminal) is served immediately while every device keeps its own cadence.
+ */
+void taskPoller(void *pvParameters)
+{
+    pollReq_t req;
+    heartbeat_t *hb = hbRegister("poller", POLLER_HEARTBEAT_MS);
+    hbIdle(hb);
+    bootWaitWifi(); // started before Wi-Fi is up, see setup()
+    uint32_t lastRegistry = millis() - cfg()->registryMs; // fetch the list right away
+    if (warmSnapshot()->devices) // warm boot, poll the cached registry before ip.php answers
+    {
+        for (int i = 0; i < warmSnapshot()->devices; i++)
+            seedDevices[warmSnapshot()->device[i].name] = warmSnapshot()->device[i].ip;
+        rebuildRegistry();
+    }
+    Serial.printf("Task Poller running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+
+    for (;;)
+    {
+        uint32_t now = millis();
+        uint32_t elapsed = now - lastRegistry;
+        uint32_t registryMs = discoveryAlive() ? std::max(cfg()->seedMs, cfg()->registryMs) : cfg()->registryMs;
+        uint32_t wait = elapsed >= registryMs ? 0 : registryMs - elapsed;
+
+        hbIdle(hb);
+        if (xQueueReceive(QuePoll_Handle, &req, wait / portTICK_PERIOD_MS) == pdPASS)
+        {
+            switch (req.type)
+            {
+            case POLL_CONNECTED:
+            {
+                hbCheckIn(hb, "rows");
+                String payload = performHttpGet(cfg()->urlRows);
+                if (payload.isEmpty())
+                {
+                    LOG_W("Failed to HHTP request");
+                    break;
+                }
+                passSocket = payload.toInt();
+                widgetWrite(V7, passSocket.load());
+                LOG_I("passSocket %d", passSocket.load());
+            }
+                // fall through, a fresh connection always gets a full listing
+            case POLL_SWEEP:
+                hbCheckIn(hb, "sweep");
+                refreshRegistry(req.forceList || req.type == POLL_CONNECTED);
+                warmSave(false);
+                lastRegistry = millis();
+                schedPollAll(lastRegistry);
+                break;
+
+            case POLL_DEVICE:
+            {
+                char tmp[MAILBOX_TEXT_LEN];
+                readingBatch_t batch;
+                hbCheckIn(hb, "device");
+                int rc = socketClient(req.ipAddr, (char *)"ALL", 1, batch);
+                if (rc)
+                    snprintf(tmp, sizeof(tmp), "ERROR: %s %s: %s\n", deviceName(req.ipAddr).c_str(), req.ipAddr,
+                             rc == 1 ? "connect failed" : rc == 2 ? "no reply, timeout" : "bad frame, CRC");
+                else
+                    snprintf(tmp, sizeof(tmp), "%s %f %s \n", req.label, batch.first ? readingValue(*batch.first, 0) : 0.0f, req.postFix);
+                widgetPrint(V42, tmp);
+                break;
+            }
+
+            case POLL_SCHED:
+                hbCheckIn(hb, "sched");
+                schedReport();
+                break;
+
+            case POLL_TIMER:
+                hbCheckIn(hb, "timer"); // scheduled device poll
+                req.cb(req.arg);
+                break;
+
+            case POLL_CONFIG:
+                hbCheckIn(hb, "config");
+                schedReconfigure();
+                alarmReload();
+                break;
+
+            case POLL_DISCOVERY:
+                hbCheckIn(hb, "discovery");
+                rebuildRegistry();
+                break;
+            }
+        }
+
+        now = millis();
+        if (now - lastRegistry >= registryMs)
+        {
+            hbCheckIn(hb, "registry");
+            refreshRegistry(false);
+            warmSave(false);
+            lastRegistry = now;
+        }
+    }
+}
+
+/**
+ * @brief Fetches the device list from ip.php and brings the registry and schedule up to date.
+ *
+ * While announced devices are alive a failed fetch or an empty list is only logged, the
+ * registry keeps running on discovery. Status messages and the terminal device listing are posted to the mailbox, the loop
+ * writes them to Blynk. Polling itself is left to the scheduler.
+ *
+ * @param forceList When true the device list is written to the terminal even if it did
+ *                  not change since the last refresh.
+ */
+void refreshRegistry(bool forceList)
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    std::map<std::string, std::string> devices;
+    uint32_t hash;
+    int listed = fetchRegistry(devices, hash);
+    if (listed < 0)
+    {
+        if (discoveryAlive())
+            Serial.println("Failed to fetch sensors from mySQL, using discovery");
+        else
+            widgetPrint(V39, "Failed to fetch sensors from mySQL ");
+        return;
+    }
+    seedDevices.swap(devices);
+    rebuildRegistry();
+    if (listed == 0 && !discoveryAlive())
+    {
+        widgetPrint(V39, "No devices connected to network");
+        return;
+    }
+
+    if (forceList || lastListHash != hash)
+    {
+        widgetPrint(V42, "\nStart:\n");
+        for (const auto &pair : ipMapSnapshot())
+        {
+            Serial.printf("Sensor: %s, IP: %s\n", pair.first.c_str(), pair.second.c_str());
+            snprintf(tmp, sizeof(tmp), "\tSensor: %s, IP: %s\n", pair.first.c_str(), pair.second.c_str());
+            widgetPrint(V42, tmp);
+        }
+        widgetPrint(V42, "\n\tenter 'list' for valid commands\n");
+        lastListHash = hash;
+    }
+}
+
+static void addDevice(const char *name, const char *ip, void *arg)
+{
+    (*(std::map<std::string, std::string> *)arg)[name] = ip;
+#ifdef DEBUG
+    Serial.printf("Sensor: %s, IP: %s\n", name, ip);
+#endif
+}
+
+/**
+ * @brief Reads the ip.php device list into `devices`, parsing the HTTP body as it arrives.
+ *
+ * Format: "<number_of_devices>|<sensor_name1>:<ip1>|<sensor_name2>:<ip2>|...", e.g.
+ * "2|DS1_DS1:192.168.1.5|BMP:192.168.1.7|" (see ipList.cpp). The request is HTTP/1.0 so
+ * the body is never chunk encoded and the stream can be parsed as is. Only `IPLIST_CHUNK`
+ * bytes and the parser state are held at any time, whatever the length of the list.
+ *
+ * @param devices Receives device name -> IP address.
+ * @param hash Receives the hash of the body, for change detection.
+ * @return The number of devices listed, -1 if the fetch failed or the body was cut short.
+ */
+static int fetchRegistry(std::map<std::string, std::string> &devices, uint32_t &hash)
+{
+    HTTPClient http;
+    ipListParser_t parser;
+    char buf[IPLIST_CHUNK];
+
+    http.useHTTP10(true);
+    http.begin(cfg()->urlList);
+    int httpResponseCode = http.GET();
+    if (httpResponseCode != 200)
+    {
+        LOG_W("HTTP GET failed with code: %d", httpResponseCode);
+        http.end();
+        return -1;
+    }
+    ipListBegin(parser, addDevice, &devices);
+    WiFiClient *stream = http.getStreamPtr();
+    int remaining = http.getSize(); // -1: until the server closes
+    uint32_t lastRx = millis();
+    while (!ipListDone(parser) && remaining != 0)
+    {
+        int avail = stream->available();
+        if (avail <= 0)
+        {
+            if (!stream->connected() || millis() - lastRx > IPLIST_TIMEOUT_MS)
+                break;
+            vTaskDelay(1);
+            continue;
+        }
+        int n = stream->read((uint8_t *)buf, std::min(avail, (int)sizeof(buf)));
+        if (n <= 0)
+            break;
+        ipListFeed(parser, buf, n);
+        if (remaining > 0)
+            remaining -= n;
+        lastRx = millis();
+    }
+    http.end();
+    if (!ipListDone(parser))
+    {
+        LOG_W("ip.php list cut short, %d of %d devices", parser.seen, parser.expected);
+        return -1;
+    }
+    hash = parser.hash;
+    return parser.count;
+}
+
+/**
+ * @brief Merges the ip.php seed with the devices alive on the discovery registry and
+ *        applies the result.
+ *
+ * An announced device overrides the seed entry of the same name (its IP is current).
+ * The announced sensor types set the poll interval before the first poll.
+ */
+static void rebuildRegistry()
+{
+    static discDevice_t found[DISC_MAX_DEVICES]; // poller task only
+    std::map<std::string, std::string> devices = seedDevices;
+    int n = std::min(discoverySnapshot(found, DISC_MAX_DEVICES), DISC_MAX_DEVICES);
+    for (int i = 0; i < n; i++)
+        devices[found[i].name] = found[i].ip;
+    applyRegistry(devices);
+    for (int i = 0; i < n; i++)
+        schedHint(found[i].name, found[i].sensors);
+}
+
+/**
+ * @brief Makes `devices` the registry: schedule, `ipMap` and the warm restart snapshot.
+ *
+ * @param devices Map of device name -> IP address, emptied (swapped into `ipMap`).
+ */
+static void applyRegistry(std::map<std::string, std::string> &devices)
+{
+    schedSync(devices);
+    warmNoteRegistry(devices);
+
+    // if sensor was removed (failed to connect) it must disappear from the map!!!!!
+    xSemaphoreTake(xMutex_ipMap, portMAX_DELAY);
+    ipMap.swap(devices);
+    xSemaphoreGive(xMutex_ipMap);
+}
+
+/**
+ * @brief Returns a private copy of `ipMap` taken under `xMutex_ipMap`.
+ *
+ * Callers can iterate the copy for as long as they like (ping, broadcast, ...) without
+ * holding up the poller.
+ */
+std::map<std::string, std::string> ipMapSnapshot()
+{
+    xSemaphoreTake(xMutex_ipMap, portMAX_DELAY);
+    std::map<std::string, std::string> copy = ipMap;
+    xSemaphoreGive(xMutex_ipMap);
+    return copy;
+}
+
+static bool sendPollRequest(const pollReq_t &req)
+{
+    if (QuePoll_Handle == NULL)
+        return false;
+    if (xQueueSend(QuePoll_Handle, (void *)&req, 0) != pdTRUE)
+    {
+        LOG_W(".......unable to send request to poll Queue is Full");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Asks the poller for an immediate sweep. Never blocks the caller.
+ *
+ * @param forceList Write the device list to the terminal even if unchanged.
+ * @return true if the request was queued.
+ */
+bool requestSweep(bool forceList)
+{
+    pollReq_t req = {};
+    req.type = POLL_SWEEP;
+    req.forceList = forceList;
+    return sendPollRequest(req);
+}
+
+/**
+ * @brief Asks the poller to refresh `passSocket` from rows.php and run a forced sweep.
+ */
+bool requestConnectedSweep()
+{
+    pollReq_t req = {};
+    req.type = POLL_CONNECTED;
+    return sendPollRequest(req);
+}
+
+/**
+ * @brief Asks the poller to print the poll schedule on the terminal.
+ */
+bool requestSchedReport()
+{
+    pollReq_t req = {};
+    req.type = POLL_SCHED;
+    return sendPollRequest(req);
+}
+
+/**
+ * @brief Asks the poller to re-apply the poll intervals of a reloaded config (config.cpp).
+ */
+bool requestReconfigure()
+{
+    pollReq_t req = {};
+    req.type = POLL_CONFIG;
+    return sendPollRequest(req);
+}
+
+/**
+ * @brief Asks the poller to merge the discovery registry after a device joined, moved or
+ *        expired (discovery.cpp).
+ */
+bool requestDiscoverySync()
+{
+    pollReq_t req = {};
+    req.type = POLL_DISCOVERY;
+    return sendPollRequest(req);
+}
+
+/**
+ * @brief Timing wheel dispatch hook, runs a timer callback in the poller task.
+ *
+ * Called by the wheel driver, never blocks.
+ */
+bool pollerDispatch(twCallback_t cb, void *arg)
+{
+    pollReq_t req = {};
+    req.type = POLL_TIMER;
+    req.cb = cb;
+    req.arg = arg;
+    return QuePoll_Handle != NULL && xQueueSend(QuePoll_Handle, (void *)&req, 0) == pdTRUE;
+}
+
+/**
+ * @brief Asks the poller to read one device and print its first value on the terminal.
+ *
+ * @param ip IP address of the device.
+ * @param label Text printed in front of the value (e.g. "Temp").
+ * @param postFix Unit printed after the value (e.g. "F").
+ */
+bool requestDeviceRead(const char *ip, const char *label, const char *postFix)
+{
+    pollReq_t req = {};
+    req.type = POLL_DEVICE;
+    strncpy(req.ipAddr, ip, sizeof(req.ipAddr) - 1);
+    strncpy(req.label, label, sizeof(req.label) - 1);
+    strncpy(req.postFix, postFix, sizeof(req.postFix) - 1);
+    return sendPollRequest(req);
+}
@@ -0,0 +1,407 @@
+/**
+ * @file probe.cpp
+ * @brief Concurrent network probe engine behind the `ping` terminal command.
+ *
+ * Every device in ipMap gets `PROBE_COUNT` TCP connect probes on the sensor port and the
+ * backend gets `PROBE_COUNT` HTTP probes of ip.php. All probes of a run are in flight at the
+ * same time (up to `PROBE_MAX_INFLIGHT` sockets) on non-blocking lwIP sockets multiplexed
+ * with `select()`, so a run takes about one round trip plus the slowest host instead of the
+ * sum of every connect, and a dead host costs at most `PROBE_TIMEOUT_MS`.
+ *
+ * @details
+ * - **Task**: `probeStart()` spawns the short lived `taskProbe`, the Blynk loop is never
+ *   blocked. Only one run at a time.
+ * - **Deadline**: the whole run ends after `PROBE_DEADLINE_MS`, probes still in flight then
+ *   count as lost, probes not yet started are not counted.
+ * - **HTTP probe**: connect, send `GET <path> HTTP/1.0`, wait for the status line. The RTT
+ *   is connect to first response byte, anything but a 200 is a loss.
+ * - **Report**: min/avg/max/p99 RTT and loss per host, formatted into a static buffer and
+ *   sent to the terminal as one write (`widgetPrintBuffer()`).
+ * - **Timeouts**: a completed TCP probe is a connect sample for the device's adaptive
+ *   timeouts (rtt.cpp).
+ * - **Metrics**: `probe_rtt_ms` histogram and `probe_loss_pct` gauge labelled with the
+ *   host name, for at most `PROBE_METRIC_HOSTS` hosts. The series of a host that is no
+ *   longer probed is handed over to a new one, hosts beyond that have no series.
+ *   `probe_run_ms` gauge for the last run.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <Blynk/BlynkHandlers.h>
+#include "mailbox.h"
+#include "metrics.h"
+#include "config.h"
+#include "rtt.h"
+
+#define PROBE_COUNT 4           // probes per host
+#define PROBE_MAX_HOSTS 24      // devices + backend
+#define PROBE_METRIC_HOSTS 8    // hosts with their own rtt/loss series, 2 metrics each
+#define PROBE_MAX_INFLIGHT 8    // stay well inside the lwIP socket table
+#define PROBE_TIMEOUT_MS 1000   // one probe
+#define PROBE_DEADLINE_MS 3000  // whole run
+#define PROBE_SUMMARY_LEN 1024
+#define PROBE_CORE 0
+#define PROBE_PRIORITY 1
+#define PROBE_STACK_SIZE 4096
+// #define DEBUG_PROBE
+
+typedef enum : uint8_t
+{
+    PROBE_TCP,  // connect only
+    PROBE_HTTP, // connect, GET, status line
+} probeKind_t;
+
+typedef struct
+{
+    char name[16];
+    char path[24];
+    probeKind_t kind;
+    struct sockaddr_in addr;
+    uint8_t sent;
+    uint8_t recv;
+    uint32_t rttUs[PROBE_COUNT];
+    metric_t *mRtt; // NULL when no series was free
+    metric_t *mLoss;
+} probeHost_t;
+
+typedef struct
+{
+    metric_t *mRtt; // NULL while unused
+    metric_t *mLoss;
+    bool used;      // taken by a host of the current run
+} probeSeries_t;
+
+typedef struct
+{
+    int fd;
+    int host;
+    uint32_t startUs;
+    bool requestSent; // HTTP probe connected, waiting for the status line
+} probe_t;
+
+static probeHost_t hosts[PROBE_MAX_HOSTS];
+static probeSeries_t series[PROBE_METRIC_HOSTS];
+static int hostCount;
+static char summary[PROBE_SUMMARY_LEN];
+static volatile bool summaryBusy = false; // summary owned by the loop until written
+static std::atomic<bool> probeRunning(false);
+static metric_t *mRunMs;
+
+
+// Function Prototypes
+bool probeStart();
+void taskProbe(void *pvParameters);
+uint32_t probeRun(uint32_t deadlineMs);
+std::map<std::string, std::string> ipMapSnapshot();
+
+/**
+ * @brief Resolves `host` and fills in a probe target.
+ */
+static bool addHost(const char *name, const char *host, uint16_t port, probeKind_t kind, const char *path)
+{
+    if (hostCount >= PROBE_MAX_HOSTS)
+        return false;
+    struct addrinfo hints = {}, *res = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL)
+    {
+        Serial.printf("probe: cannot resolve %s\n", host);
+        return false;
+    }
+    probeHost_t &h = hosts[hostCount++];
+    memset(&h, 0, sizeof(h));
+    strncpy(h.name, name, sizeof(h.name) - 1);
+    strncpy(h.path, path, sizeof(h.path) - 1);
+    h.kind = kind;
+    h.addr = *(struct sockaddr_in *)res->ai_addr;
+    h.addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return true;
+}
+
+/**
+ * @brief Gives the hosts of this run their metric series. A host keeps the series it had
+ *        in the last run, the others take a never used one or one whose host has gone.
+ */
+static void bindSeries()
+{
+    for (probeSeries_t &s : series)
+        s.used = false;
+    for (int i = 0; i < hostCount; i++) // hosts seen before
+    {
+        hosts[i].mRtt = hosts[i].mLoss = NULL;
+        for (probeSeries_t &s : series)
+            if (s.mRtt && !strcmp(s.mRtt->label, hosts[i].name))
+            {
+                hosts[i].mRtt = s.mRtt;
+                hosts[i].mLoss = s.mLoss;
+                s.used = true;
+                break;
+            }
+    }
+    for (int i = 0; i < hostCount; i++) // new hosts
+    {
+        probeHost_t &h = hosts[i];
+        for (int k = 0; k < PROBE_METRIC_HOSTS && h.mRtt == NULL; k++)
+        {
+            probeSeries_t &s = series[k];
+            if (s.used)
+                continue;
+            if (s.mRtt == NULL)
+            {
+                s.mRtt = metricRegister("probe_rtt_ms", "Round trip time of ping probes", METRIC_HISTOGRAM, "host", h.name);
+                s.mLoss = metricRegister("probe_loss_pct", "Ping probe loss of the last run", METRIC_GAUGE, "host", h.name);
+            }
+            else
+            {
+                metricRelabel(s.mRtt, h.name);
+                metricRelabel(s.mLoss, h.name);
+            }
+            h.mRtt = s.mRtt;
+            h.mLoss = s.mLoss;
+            s.used = true;
+        }
+    }
+}
+
+/**
+ * @brief Adds the backend from an "http://host[:port]/path" URL as an HTTP probe target.
+ */
+static bool addBackend(const char *url)
+{
+    char host[40];
+    uint16_t port = 80;
+    const char *p = strstr(url, "://");
+    p = p ? p + 3 : url;
+    size_t n = strcspn(p, ":/");
+    if (n == 0 || n >= sizeof(host))
+        return false;
+    memcpy(host, p, n);
+    host[n] = 0;
+    p += n;
+    if (*p == ':')
+        port = (uint16_t)strtoul(p + 1, (char **)&p, 10);
+    const char *name = strrchr(url, '/');
+    return addHost(name && name[1] ? name + 1 : host, host, port, PROBE_HTTP, *p ? p : "/");
+}
+
+/**
+ * @brief Opens a non-blocking socket and starts the connect.
+ * @return The socket, or -1 if the connect failed right away.
+ */
+static int probeOpen(const probeHost_t &h)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(fd, (const struct sockaddr *)&h.addr, sizeof(h.addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Advances one probe whose socket is ready.
+ * @return 1 done and answered, -1 done and lost, 0 still in flight.
+ */
+static int probeStep(probe_t &p, const probeHost_t &h, bool readable, bool writable)
+{
+    if (!p.requestSent && writable)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(p.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+            return -1;
+        if (h.kind == PROBE_TCP)
+            return 1;
+        char req[96];
+        int n = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", h.path, inet_ntoa(h.addr.sin_addr));
+        if (send(p.fd, req, n, 0) != n)
+            return -1;
+        p.requestSent = true;
+    }
+    else if (p.requestSent && readable)
+    {
+        char status[16];
+        int n = recv(p.fd, status, sizeof(status) - 1, 0);
+        if (n <= 0)
+            return -1;
+        status[n] = 0;
+        // "HTTP/1.x 200 ..."
+        return (n >= 12 && !strncmp(status, "HTTP/1.", 7) && !strncmp(status + 9, "200", 3)) ? 1 : -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs every probe of every host in `hosts` concurrently.
+ *
+ * Probes are started round robin (first probe of every host, then the second ...) so a
+ * short deadline still samples every host. Each socket is closed as soon as its probe
+ * completes, times out or the deadline passes.
+ *
+ * @param deadlineMs Budget for the whole run.
+ * @return Duration of the run in ms.
+ */
+uint32_t probeRun(uint32_t deadlineMs)
+{
+    probe_t inflight[PROBE_MAX_INFLIGHT];
+    int active = 0, next = 0, total = hostCount * PROBE_COUNT;
+    uint32_t begin = micros();
+
+    for (;;)
+    {
+        uint32_t now = micros();
+        bool expired = now - begin >= deadlineMs * 1000;
+        while (!expired && active < PROBE_MAX_INFLIGHT && next < total)
+        {
+            int host = next++ % hostCount;
+            hosts[host].sent++;
+            int fd = probeOpen(hosts[host]);
+            if (fd >= 0)
+                inflight[active++] = {fd, host, (uint32_t)micros(), false};
+        }
+        if (active == 0 && (expired || next >= total))
+            break;
+
+        fd_set rd, wr;
+        FD_ZERO(&rd);
+        FD_ZERO(&wr);
+        int maxFd = -1;
+        uint32_t waitUs = expired ? 0 : deadlineMs * 1000 - (now - begin);
+        for (int i = 0; i < active; i++)
+        {
+            FD_SET(inflight[i].fd, inflight[i].requestSent ? &rd : &wr);
+            maxFd = std::max(maxFd, inflight[i].fd);
+            uint32_t age = now - inflight[i].startUs;
+            uint32_t left = age < PROBE_TIMEOUT_MS * 1000 ? PROBE_TIMEOUT_MS * 1000 - age : 0;
+            waitUs = std::min(waitUs, left);
+        }
+        struct timeval tv = {(time_t)(waitUs / 1000000), (suseconds_t)(waitUs % 1000000)};
+        if (select(maxFd + 1, &rd, &wr, NULL, &tv) < 0)
+        {
+            FD_ZERO(&rd);
+            FD_ZERO(&wr);
+        }
+
+        now = micros();
+        expired = now - begin >= deadlineMs * 1000;
+        for (int i = active - 1; i >= 0; i--)
+        {
+            probe_t &p = inflight[i];
+            probeHost_t &h = hosts[p.host];
+            int done = probeStep(p, h, FD_ISSET(p.fd, &rd), FD_ISSET(p.fd, &wr));
+            if (!done && (expired || now - p.startUs >= PROBE_TIMEOUT_MS * 1000))
+                done = -1;
+            if (!done)
+                continue;
+            if (done > 0)
+            {
+                h.rttUs[h.recv] = micros() - p.startUs;
+                if (h.kind == PROBE_TCP)
+                    rttSample(inet_ntoa(h.addr.sin_addr), RTT_CONNECT, h.rttUs[h.recv]);
+                h.recv++;
+            }
+            close(p.fd);
+            inflight[i] = inflight[--active];
+        }
+    }
+    return (micros() - begin) / 1000;
+}
+
+/**
+ * @brief Appends one host line to the summary and updates its metrics.
+ */
+static size_t reportHost(probeHost_t &h, char *out, size_t len)
+{
+    // insertion sort, at most PROBE_COUNT samples
+    for (int i = 1; i < h.recv; i++)
+    {
+        uint32_t v = h.rttUs[i];
+        int j = i;
+        for (; j > 0 && h.rttUs[j - 1] > v; j--)
+            h.rttUs[j] = h.rttUs[j - 1];
+        h.rttUs[j] = v;
+    }
+    int loss = h.sent ? 100 * (h.sent - h.recv) / h.sent : 0;
+    if (h.mLoss)
+        metricSet(h.mLoss, loss);
+    if (!h.recv)
+        return snprintf(out, len, "%s %s\t0/%d lost\n", h.name, inet_ntoa(h.addr.sin_addr), h.sent);
+
+    uint64_t sum = 0;
+    for (int i = 0; i < h.recv; i++)
+    {
+        sum += h.rttUs[i];
+        if (h.mRtt)
+            metricObserve(h.mRtt, (h.rttUs[i] + 999) / 1000);
+    }
+    int p99 = (h.recv * 99 + 99) / 100 - 1;
+    return snprintf(out, len, "%s %s\t%d/%d %.1f/%.1f/%.1f/%.1f ms%s\n",
+                    h.name, inet_ntoa(h.addr.sin_addr), h.recv, h.sent,
+                    h.rttUs[0] / 1000.0, sum / h.recv / 1000.0, h.rttUs[h.recv - 1] / 1000.0, h.rttUs[p99] / 1000.0,
+                    loss ? " LOSS" : "");
+}
+
+/**
+ * @brief One ping run: probe everything, post the summary, exit.
+ */
+void taskProbe(void *pvParameters)
+{
+    hostCount = 0;
+    for (const auto &pair : ipMapSnapshot())
+        addHost(pair.first.c_str(), pair.second.c_str(), cfg()->sensorPort, PROBE_TCP, "");
+    addBackend(cfg()->urlList);
+    bindSeries();
+
+    uint32_t ms = probeRun(PROBE_DEADLINE_MS);
+    if (mRunMs == NULL)
+        mRunMs = metricRegister("probe_run_ms", "Duration of the last ping run", METRIC_GAUGE);
+    metricSet(mRunMs, ms);
+
+    while (summaryBusy) // previous summary not written out yet
+        vTaskDelay(pdMS_TO_TICKS(10));
+    bool lost = false;
+    size_t n = snprintf(summary, sizeof(summary), "ping %d hosts in %u ms, ok/sent min/avg/max/p99\n", hostCount, ms);
+    for (int i = 0; i < hostCount && n < sizeof(summary); i++)
+    {
+        n += reportHost(hosts[i], summary + n, sizeof(summary) - n);
+        lost |= hosts[i].recv != hosts[i].sent;
+    }
+#ifdef DEBUG_PROBE
+    Serial.print(summary);
+#endif
+    if (lost) // #D3435C - Blynk RED
+        widgetColor(V42, "#D3435C");
+    if (!widgetPrintBuffer(V42, summary, &summaryBusy))
+        Serial.println("probe: mailbox full, summary dropped");
+
+    probeRunning = false;
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Starts a ping run in the background (terminal "ping").
+ * @return false if a run is already in progress or the task could not be created.
+ */
+bool probeStart()
+{
+    if (probeRunning.exchange(true))
+        return false;
+    if (xTaskCreatePinnedToCore(taskProbe, "probe", PROBE_STACK_SIZE, NULL, PROBE_PRIORITY, NULL, PROBE_CORE) != pdPASS)
+    {
+        probeRunning = false;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,300 @@
+/**
+ * @file push.cpp
+ * @brief Optional push ingestion server: devices connect to the client and send their
+ *        readings when they change, instead of waiting for the next `ALL` poll.
+ *
+ * Polling costs a connect, a command and a reply per device per interval even when nothing
+ * changed, and a change waits up to one interval before it is seen. With push enabled a
+ * device keeps one TCP connection to the client and writes a frame whenever a reading
+ * changes. The frame goes through the same `decodeFrame()` -> `processSensorData()` path as
+ * a polled reply, so widgets, the sinks and the warm snapshot see no difference.
+ *
+ * @details
+ * - **Framing**: one poll reply per line, "<crc32 hex>:<base64 AES payload>\n", i.e. exactly
+ *   what the device sends for `ALL`, terminated by a newline. The client answers every line
+ *   with "OK\n" or "ERR\n" so the device can resend a rejected frame.
+ * - **I/O**: a single task multiplexes the listening socket and up to `PUSH_MAX_CONN`
+ *   device connections with `select()` (non-blocking sockets, the same model as the probe
+ *   in probe.cpp). A slow or silent device never blocks the others. A connection idle for
+ *   `PUSH_IDLE_MS` is closed, the device reconnects on its next change. A connection beyond
+ *   `PUSH_MAX_CONN` is refused.
+ * - **Liveness**: `pushFresh()` tells the scheduler (scheduler.cpp) that a device pushed a
+ *   valid frame within `liveness_ms`, its poll is then skipped. Polling is only a liveness
+ *   check for pushing devices, a device that stops pushing is polled again at its interval.
+ * - **Config**: `push 1` enables the server on `push.port` (reboot), `liveness_ms` can be
+ *   changed live.
+ * - **Metrics**: `push_connections`, `push_frames_total`, `push_bad_total`,
+ *   `push_refused_total` and `polls_skipped_total{push}` (scheduler).
+ *
+ * @note The frames are CRC checked and AES encrypted with the fleet key, a frame that does
+ *       not decode is rejected like a bad poll reply.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <algorithm>
+#include <lwip/sockets.h>
+#include "config.h"
+#include "metrics.h"
+#include "watchDog.h"
+#include "reading.h"
+
+#define PUSH_CORE 1
+#define PUSH_PRIORITY 2
+#define PUSH_STACK_SIZE 4096
+#define PUSH_HEARTBEAT_MS (5 * 1000)
+#define PUSH_TICK_MS 1000
+#define PUSH_RETRY_MS (5 * 1000) // listen failed
+#define PUSH_MAX_CONN 8          // lwIP has 16 sockets in total
+#define PUSH_MAX_DEVICES 32
+#define PUSH_IDLE_MS (120 * 1000)
+#define PUSH_LINE_LEN 160
+#define PUSH_BACKLOG 4
+#define WORDS_PER_BYTE 4
+// #define DEBUG_PUSH
+
+typedef struct
+{
+    int fd;
+    in_addr_t addr;
+    uint32_t lastRx; // millis()
+    uint16_t len;
+    char line[PUSH_LINE_LEN];
+} pushConn_t;
+
+typedef struct
+{
+    in_addr_t addr;
+    uint32_t lastFrame; // millis() of the last valid frame
+} pushSeen_t;
+
+static pushConn_t conns[PUSH_MAX_CONN];
+static int connCount = 0;
+static pushSeen_t seen[PUSH_MAX_DEVICES];
+static portMUX_TYPE seenMux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t push_task_handle;
+static metric_t *mConns, *mFrames, *mBad, *mRefused;
+
+// Function Prototypes
+bool pushStart();
+bool pushFresh(const char *ip, uint32_t withinMs);
+void taskPush(void *pvParameters);
+int decodeFrame(char *frame, readingBatch_t &batch);
+void processSensorData(readingBatch_t &batch, bool updateErrorQueue);
+void bootWaitWifi();
+
+/**
+ * @brief Starts the push server task, called by `initRTOS()` when the config enables it.
+ */
+bool pushStart()
+{
+    mConns = metricRegister("push_connections", "Open device push connections", METRIC_GAUGE);
+    mFrames = metricRegister("push_frames_total", "Frames pushed by devices and ingested", METRIC_COUNTER);
+    mBad = metricRegister("push_bad_total", "Pushed frames rejected (CRC, decode, overlong)", METRIC_COUNTER);
+    mRefused = metricRegister("push_refused_total", "Push connections refused, all slots busy", METRIC_COUNTER);
+    xTaskCreatePinnedToCore(taskPush, "Task Push", PUSH_STACK_SIZE, NULL, PUSH_PRIORITY, &push_task_handle, PUSH_CORE);
+    return push_task_handle != NULL;
+}
+
+/**
+ * @brief true if `ip` pushed a valid frame within the last `withinMs`.
+ *
+ * Called by the scheduler from the poller task.
+ */
+bool pushFresh(const char *ip, uint32_t withinMs)
+{
+    if (push_task_handle == NULL)
+        return false;
+    in_addr_t addr = inet_addr(ip);
+    uint32_t now = millis();
+    bool fresh = false;
+    portENTER_CRITICAL(&seenMux);
+    for (int i = 0; i < PUSH_MAX_DEVICES && seen[i].addr; i++)
+    {
+        if (seen[i].addr == addr)
+        {
+            fresh = now - seen[i].lastFrame < withinMs;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&seenMux);
+    return fresh;
+}
+
+static void noteFrame(in_addr_t addr, uint32_t now)
+{
+    portENTER_CRITICAL(&seenMux);
+    int oldest = 0;
+    for (int i = 0; i < PUSH_MAX_DEVICES; i++)
+    {
+        if (seen[i].addr == addr || seen[i].addr == 0)
+        {
+            oldest = i;
+            break;
+        }
+        if (now - seen[i].lastFrame > now - seen[oldest].lastFrame)
+            oldest = i;
+    }
+    seen[oldest].addr = addr;
+    seen[oldest].lastFrame = now;
+    portEXIT_CRITICAL(&seenMux);
+}
+
+static int pushListen(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 || listen(fd, PUSH_BACKLOG) < 0)
+    {
+        Serial.printf("push: cannot listen on %u (%d)\n", port, errno);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static void pushClose(int i)
+{
+    close(conns[i].fd);
+    conns[i] = conns[--connCount];
+    metricSet(mConns, connCount);
+}
+
+static void pushAccept(int listenFd, uint32_t now)
+{
+    struct sockaddr_in src;
+    socklen_t len = sizeof(src);
+    int fd;
+    while ((fd = accept(listenFd, (struct sockaddr *)&src, &len)) >= 0)
+    {
+        if (connCount == PUSH_MAX_CONN)
+        {
+            close(fd);
+            metricInc(mRefused);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // the acks are tiny
+        pushConn_t &c = conns[connCount++];
+        c.fd = fd;
+        c.addr = src.sin_addr.s_addr;
+        c.lastRx = now;
+        c.len = 0;
+        metricSet(mConns, connCount);
+#ifdef DEBUG_PUSH
+        Serial.printf("push: %s connected, %d open\n", inet_ntoa(src.sin_addr), connCount);
+#endif
+        len = sizeof(src);
+    }
+}
+
+/**
+ * @brief Decodes one pushed line and feeds it to `processSensorData()`.
+ */
+static void pushIngest(pushConn_t &c, char *line, uint32_t now)
+{
+    readingBatch_t batch;
+    size_t n = strlen(line);
+    while (n && line[n - 1] == '\r')
+        line[--n] = 0;
+    if (n == 0)
+        return;
+    bool ok = decodeFrame(line, batch) == 0;
+    send(c.fd, ok ? "OK\n" : "ERR\n", ok ? 3 : 4, MSG_DONTWAIT);
+    if (!ok)
+    {
+        metricInc(mBad);
+        return;
+    }
+    metricInc(mFrames);
+    noteFrame(c.addr, now);
+    processSensorData(batch, false);
+}
+
+/**
+ * @brief Reads what a connection has, ingests every complete line.
+ * @return false if the connection is to be closed.
+ */
+static bool pushRead(pushConn_t &c, uint32_t now)
+{
+    int n = recv(c.fd, c.line + c.len, sizeof(c.line) - 1 - c.len, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+        return false;
+    if (n < 0)
+        return true;
+    c.len += n;
+    c.line[c.len] = 0;
+    c.lastRx = now;
+
+    char *start = c.line, *end;
+    while ((end = strchr(start, '\n')) != NULL)
+    {
+        *end = 0;
+        pushIngest(c, start, now);
+        start = end + 1;
+    }
+    c.len -= start - c.line;
+    memmove(c.line, start, c.len);
+    if (c.len == sizeof(c.line) - 1) // no newline in a full buffer, not a frame
+    {
+        metricInc(mBad);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Push server task, accepts device connections and ingests their frames.
+ *
+ * @param pvParameters Unused.
+ */
+void taskPush(void *pvParameters)
+{
+    heartbeat_t *hb = hbRegister("push", PUSH_HEARTBEAT_MS);
+    Serial.printf("Task Push running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    hbIdle(hb);
+    bootWaitWifi();
+
+    int listenFd;
+    while ((listenFd = pushListen(cfg()->pushPort)) < 0)
+        vTaskDelay(pdMS_TO_TICKS(PUSH_RETRY_MS));
+    Serial.printf("push: listening on %u\n", cfg()->pushPort);
+
+    for (;;)
+    {
+        fd_set rd;
+        FD_ZERO(&rd);
+        FD_SET(listenFd, &rd);
+        int maxFd = listenFd;
+        for (int i = 0; i < connCount; i++)
+        {
+            FD_SET(conns[i].fd, &rd);
+            maxFd = std::max(maxFd, conns[i].fd);
+        }
+        struct timeval tv = {PUSH_TICK_MS / 1000, (PUSH_TICK_MS % 1000) * 1000};
+        hbIdle(hb);
+        if (select(maxFd + 1, &rd, NULL, NULL, &tv) < 0)
+            FD_ZERO(&rd);
+        hbCheckIn(hb, "ingest");
+
+        uint32_t now = millis();
+        for (int i = connCount - 1; i >= 0; i--)
+        {
+            bool open = FD_ISSET(conns[i].fd, &rd) ? pushRead(conns[i], now) : now - conns[i].lastRx < PUSH_IDLE_MS;
+            if (!open)
+                pushClose(i);
+        }
+        if (FD_ISSET(listenFd, &rd))
+            pushAccept(listenFd, now);
+    }
+}
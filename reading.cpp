@@ -0,0 +1,162 @@
+/**
+ * @file reading.cpp
+ * @brief Reading batches: the sensor rows of one device frame with per-channel metadata.
+ *
+ * Replaces the global `float tokens[5][5]`, which held at most 5 sensors of 5 values,
+ * kept the sensor id in column 0 and was written by the poller, the socket recovery and
+ * the push tasks alike.
+ *
+ * @details
+ * - **Arena**: a batch carries `READING_ARENA_SIZE` bytes. `readingOpen()` bump-allocates a
+ *   reading, `readingPush()` appends a channel right behind it, so a reading's channels
+ *   are contiguous and there is no per-value bookkeeping. `readingBegin()` frees it all.
+ *   There is no limit on sensors per frame or values per sensor other than the arena,
+ *   which holds any frame `decodeFrame()` accepts. A frame that does not fit is cut and
+ *   `truncated` is set.
+ * - **Metadata**: the sensor id and type name are fields of the reading, not a value.
+ *   Every channel carries its quantity from the sensor table below, consumers look values
+ *   up with `readingFind()` or take them by position (`readingValue()`) where the position
+ *   is the contract, e.g. value1/value2 of the mySQL row.
+ * - **Ownership**: a batch is a local of the task that reads the frame and is passed by
+ *   reference, see `processSensorData()`.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <algorithm>
+#include "reading.h"
+
+#define SENSOR_MAX_CHANNELS 3
+
+typedef struct
+{
+    int code;
+    const char *name;
+    uint8_t quantity[SENSOR_MAX_CHANNELS]; // by position, QTY_VALUE beyond
+} sensorType_t;
+
+// sensor id sent by the device -> sensor name and channel quantities
+static const sensorType_t sensorTypes[] =
+    {
+        {77, "BMP390", {QTY_TEMPERATURE}},
+        {76, "BME280", {QTY_TEMPERATURE, QTY_HUMIDITY}},
+        {58, "BMP280", {QTY_TEMPERATURE}},
+        {44, "SHT35", {QTY_TEMPERATURE, QTY_HUMIDITY}},
+        {48, "ADS1115", {QTY_VOLT, QTY_SUPPLY, QTY_RATIO}},
+        {28, "DS1", {QTY_TEMPERATURE}}};
+
+static const sensorType_t *findType(int code)
+{
+    for (const sensorType_t &t : sensorTypes)
+        if (t.code == code)
+            return &t;
+    return NULL;
+}
+
+static void *arenaAlloc(readingBatch_t &b, size_t bytes)
+{
+    bytes = (bytes + 3) & ~(size_t)3;
+    if (b.used + bytes > sizeof(b.arena))
+    {
+        b.truncated = true;
+        return NULL;
+    }
+    void *p = b.arena + b.used;
+    b.used += bytes;
+    return p;
+}
+
+/**
+ * @brief Empties the batch, called before decoding a frame into it.
+ */
+void readingBegin(readingBatch_t &b)
+{
+    b.first = b.last = NULL;
+    b.count = 0;
+    b.used = 0;
+    b.truncated = false;
+}
+
+/**
+ * @brief Starts a new reading for sensor id `code`, `readingPush()` adds its values.
+ *
+ * @return The reading, NULL if the arena is full.
+ */
+sensorReading_t *readingOpen(readingBatch_t &b, int code)
+{
+    sensorReading_t *r = (sensorReading_t *)arenaAlloc(b, sizeof(sensorReading_t));
+    if (r == NULL)
+        return NULL;
+    const sensorType_t *type = findType(code);
+    r->next = NULL;
+    r->sensor = type ? type->name : NULL;
+    r->code = code;
+    r->channels = 0;
+    r->channel = (readingChannel_t *)(b.arena + b.used);
+    if (b.last)
+        b.last->next = r;
+    else
+        b.first = r;
+    b.last = r;
+    b.count++;
+    return r;
+}
+
+/**
+ * @brief Appends a value to the reading opened last.
+ *
+ * @return false if there is no open reading or the arena is full.
+ */
+bool readingPush(readingBatch_t &b, float value)
+{
+    sensorReading_t *r = b.last;
+    if (r == NULL || (uint8_t *)(r->channel + r->channels) != b.arena + b.used)
+        return false; // channels must follow their reading
+    readingChannel_t *ch = (readingChannel_t *)arenaAlloc(b, sizeof(readingChannel_t));
+    if (ch == NULL)
+        return false;
+    const sensorType_t *type = findType(r->code);
+    ch->value = value;
+    ch->quantity = type && r->channels < SENSOR_MAX_CHANNELS ? type->quantity[r->channels] : QTY_VALUE;
+    r->channels++;
+    return true;
+}
+
+/**
+ * @brief Value of channel `index`, 0 if the sensor did not send it.
+ */
+float readingValue(const sensorReading_t &r, int index)
+{
+    return index >= 0 && index < r.channels ? r.channel[index].value : 0;
+}
+
+/**
+ * @brief Copies the first `n` values, missing ones as 0 (history and spill columns).
+ */
+void readingValues(const sensorReading_t &r, float *out, int n)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = readingValue(r, i);
+}
+
+/**
+ * @brief First channel carrying `quantity`, NULL if the reading has none.
+ */
+const readingChannel_t *readingFind(const sensorReading_t &r, uint8_t quantity)
+{
+    for (int i = 0; i < r.channels; i++)
+        if (r.channel[i].quantity == quantity)
+            return &r.channel[i];
+    return NULL;
+}
+
+/**
+ * @brief Maps a sensor name (e.g. "BME280") to the id its devices send, -1 if unknown.
+ */
+int sensorCode(const char *name)
+{
+    for (const sensorType_t &t : sensorTypes)
+        if (!strcasecmp(t.name, name))
+            return t.code;
+    return -1;
+}
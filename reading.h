@@ -0,0 +1,60 @@
+/**
+ * @file reading.h
+ * @brief Typed batch of the sensor readings decoded from one device frame, allocated from
+ *        an arena inside the batch.
+ *
+ * A batch is a local of the task that polls (or ingests) a frame and is passed by reference
+ * down the pipeline, nothing is shared between tasks.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define READING_ARENA_SIZE 512 // any frame that fits decodeFrame()'s 120 byte clear text
+#define READING_KEY_CHANNEL 2  // the third value doubles as the mySQL key
+
+typedef enum : uint8_t
+{
+    QTY_VALUE,       // not described for this sensor type
+    QTY_TEMPERATURE,
+    QTY_HUMIDITY,
+    QTY_VOLT,        // ADS1115 input, scaled by QTY_RATIO
+    QTY_SUPPLY,      // ADS1115 device supply
+    QTY_RATIO,       // ADS1115 divider ratio
+} quantity_t;
+
+typedef struct
+{
+    float value;
+    uint8_t quantity; // quantity_t
+} readingChannel_t;
+
+typedef struct sensorReading
+{
+    struct sensorReading *next;
+    const char *sensor; // sensor type name, NULL for an unknown id
+    uint16_t code;      // sensor id sent by the device
+    uint16_t channels;
+    readingChannel_t *channel; // in the arena, right after the reading
+} sensorReading_t;
+
+typedef struct
+{
+    sensorReading_t *first, *last;
+    uint16_t count;
+    uint16_t used;  // arena bytes
+    bool truncated; // arena full, the rest of the frame was dropped
+    alignas(4) uint8_t arena[READING_ARENA_SIZE];
+} readingBatch_t;
+
+void readingBegin(readingBatch_t &b);
+sensorReading_t *readingOpen(readingBatch_t &b, int code);
+bool readingPush(readingBatch_t &b, float value);
+float readingValue(const sensorReading_t &r, int index);
+void readingValues(const sensorReading_t &r, float *out, int n);
+const readingChannel_t *readingFind(const sensorReading_t &r, uint8_t quantity);
+int sensorCode(const char *name);
+
+inline int readingKey(const sensorReading_t &r)
+{
+    return (int)readingValue(r, READING_KEY_CHANNEL);
+}
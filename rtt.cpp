@@ -0,0 +1,203 @@
+/**
+ * @file rtt.cpp
+ * @brief Adaptive connect and reply timeouts per device from measured round trips.
+ *
+ * `socketClient()` waited a fixed 5 s for a reply whatever the device: a LAN device that
+ * answers in 10 ms took 5 s to be declared dead, a device at the edge of Wi-Fi range
+ * had no more margin than a healthy one.
+ *
+ * @details
+ * - **Estimator** (RFC 6298): per device and per kind (connect, reply), the first sample
+ *   R sets SRTT = R, RTTVAR = R / 2. Then RTTVAR += (|SRTT - R| - RTTVAR) / 4 and
+ *   SRTT += (R - SRTT) / 8. The timeout is SRTT + max(`RTT_CLOCK_MS`, 4 * RTTVAR), kept
+ *   between `RTT_MIN_MS` and `RTT_MAX_MS`. Kept in microseconds, a 10 ms device does not
+ *   round to nothing.
+ * - **Backoff**: a timeout doubles the device's timeout (up to the ceiling) until the
+ *   next reply, a slow or congested link is not timed out again at the same value. An
+ *   expired wait gives no sample.
+ * - **Unknown devices** get `RTT_MAX_MS`, i.e. the old fixed timeout, until they answered
+ *   once. The table holds `RTT_MAX_DEVICES`, the least recently used entry is reused.
+ * - **Sources**: device reads (`socketRead()` in socketClient.cpp) sample both kinds, the
+ *   TCP probes of "ping" (probe.cpp) sample the connect time. Commands that run on the
+ *   device before answering (BLK/RST through the broadcast, `rttCommandMs()`) add their run time
+ *   to the reply timeout and give no reply sample.
+ * - **Retries**: the socket recovery task (freeRtos.cpp) waits `rttRetryMs()`, the longer
+ *   of the device's two timeouts, before it retries a failed read, at least
+ *   `delay.socket`. A device that keeps timing out is retried less and less often.
+ * - **Report**: "rtt" on the terminal lists SRTT, RTTVAR and the timeout per device.
+ * - **Metrics**: `socket_timeouts_total{connect|reply}`.
+ *
+ * @note Called from the poller, the worker pool, the socket recovery and the probe tasks,
+ *       the table is guarded by a spinlock.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <algorithm>
+#include <lwip/sockets.h>
+#include <Blynk/BlynkHandlers.h>
+#include "rtt.h"
+#include "mailbox.h"
+#include "metrics.h"
+
+typedef struct
+{
+    in_addr_t addr; // 0: free
+    uint32_t lastUse; // millis()
+    rttEst_t est[RTT_KINDS];
+} rttDevice_t;
+
+static rttDevice_t devices[RTT_MAX_DEVICES];
+static portMUX_TYPE rttMux = portMUX_INITIALIZER_UNLOCKED;
+static metric_t *mTimeouts[RTT_KINDS];
+static const char *const kindName[RTT_KINDS] = {"connect", "reply"};
+
+// called with rttMux held
+static rttEst_t *findEst(const char *ip, rttKind_t kind, bool create)
+{
+    in_addr_t addr = inet_addr(ip);
+    uint32_t now = millis();
+    int oldest = 0;
+    for (int i = 0; i < RTT_MAX_DEVICES; i++)
+    {
+        if (devices[i].addr == addr)
+        {
+            devices[i].lastUse = now;
+            return &devices[i].est[kind];
+        }
+        if (devices[i].addr == 0 || (devices[oldest].addr != 0 && now - devices[i].lastUse > now - devices[oldest].lastUse))
+            oldest = i;
+    }
+    if (!create || addr == 0 || addr == INADDR_NONE)
+        return NULL;
+    memset(&devices[oldest], 0, sizeof(devices[oldest]));
+    devices[oldest].addr = addr;
+    devices[oldest].lastUse = now;
+    return &devices[oldest].est[kind];
+}
+
+static uint32_t timeoutMs(const rttEst_t &e)
+{
+    if (e.samples == 0)
+        return RTT_MAX_MS;
+    uint32_t rto = (e.srttUs + std::max((uint32_t)RTT_CLOCK_MS * 1000, 4 * e.rttvarUs) + 999) / 1000;
+    rto = std::max(rto, (uint32_t)RTT_MIN_MS) << std::min(e.backoff, (uint8_t)8);
+    return std::min(rto, (uint32_t)RTT_MAX_MS);
+}
+
+/**
+ * @brief Timeout for the next connect or reply wait on `ip`, in ms.
+ */
+uint32_t rttTimeout(const char *ip, rttKind_t kind)
+{
+    portENTER_CRITICAL(&rttMux);
+    rttEst_t *e = findEst(ip, kind, false);
+    uint32_t ms = e ? timeoutMs(*e) : RTT_MAX_MS;
+    portEXIT_CRITICAL(&rttMux);
+    return ms;
+}
+
+/**
+ * @brief Feeds a measured round trip of `us` microseconds.
+ */
+void rttSample(const char *ip, rttKind_t kind, uint32_t us)
+{
+    portENTER_CRITICAL(&rttMux);
+    rttEst_t *e = findEst(ip, kind, true);
+    if (e != NULL)
+    {
+        if (e->samples == 0)
+        {
+            e->srttUs = us;
+            e->rttvarUs = us / 2;
+        }
+        else
+        {
+            int32_t delta = (int32_t)(us - e->srttUs);
+            e->rttvarUs += ((int32_t)abs(delta) - (int32_t)e->rttvarUs) / 4;
+            e->srttUs += delta / 8;
+        }
+        if (e->samples < UINT16_MAX)
+            e->samples++;
+        e->backoff = 0;
+    }
+    portEXIT_CRITICAL(&rttMux);
+}
+
+/**
+ * @brief Records a wait on `ip` that ran out, the next one is twice as long.
+ */
+void rttExpired(const char *ip, rttKind_t kind)
+{
+    if (mTimeouts[0] == NULL)
+    {
+        for (int k = 0; k < RTT_KINDS; k++) // metricRegister() returns the existing entry on a race
+            mTimeouts[k] = metricRegister("socket_timeouts_total", "Device connect or reply waits that ran out", METRIC_COUNTER, "wait", kindName[k]);
+    }
+    metricInc(mTimeouts[kind]);
+    portENTER_CRITICAL(&rttMux);
+    rttEst_t *e = findEst(ip, kind, true);
+    if (e != NULL && e->samples && timeoutMs(*e) < RTT_MAX_MS)
+        e->backoff++;
+    portEXIT_CRITICAL(&rttMux);
+}
+
+/**
+ * @brief Wait before retrying a failed read of `ip`, 0 for a device never measured.
+ */
+uint32_t rttRetryMs(const char *ip)
+{
+    uint32_t ms = 0;
+    portENTER_CRITICAL(&rttMux);
+    rttEst_t *e = findEst(ip, RTT_CONNECT, false);
+    if (e != NULL)
+    {
+        for (int k = 0; k < RTT_KINDS; k++)
+            if (e[k].samples)
+                ms = std::max(ms, timeoutMs(e[k]));
+    }
+    portEXIT_CRITICAL(&rttMux);
+    return ms;
+}
+
+/**
+ * @brief Reply timeout of `cmd` on `ip`: `BLK`/`RST` run `CMD_RUN_MS` on the device first.
+ */
+uint32_t rttCommandMs(const char *ip, const char *cmd)
+{
+    uint32_t ms = rttTimeout(ip, RTT_REPLY);
+    if (!strncmp(cmd, "BLK", 3) || !strncmp(cmd, "RST", 3))
+        ms += CMD_RUN_MS;
+    return ms;
+}
+
+/**
+ * @brief Terminal "rtt": SRTT, RTTVAR and timeout per device and kind.
+ */
+void rttReport()
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    rttDevice_t copy[RTT_MAX_DEVICES];
+    portENTER_CRITICAL(&rttMux);
+    memcpy(copy, devices, sizeof(copy));
+    portEXIT_CRITICAL(&rttMux);
+    widgetPrint(V42, "rtt: srtt/rttvar -> timeout ms\n");
+    for (const rttDevice_t &d : copy)
+    {
+        if (d.addr == 0)
+            continue;
+        struct in_addr a = {d.addr};
+        int n = snprintf(tmp, sizeof(tmp), "\t%s", inet_ntoa(a));
+        for (int k = 0; k < RTT_KINDS; k++)
+        {
+            const rttEst_t &e = d.est[k];
+            n += snprintf(tmp + n, sizeof(tmp) - n, " %s %u.%u/%u.%u->%u%s", kindName[k],
+                          e.srttUs / 1000, e.srttUs / 100 % 10, e.rttvarUs / 1000, e.rttvarUs / 100 % 10,
+                          timeoutMs(e), e.backoff ? "*" : "");
+            if (n >= (int)sizeof(tmp) - 1)
+                break;
+        }
+        snprintf(tmp + std::min(n, (int)sizeof(tmp) - 2), 2, "\n");
+        widgetPrint(V42, tmp);
+    }
+}
@@ -0,0 +1,35 @@
+/**
+ * @file rtt.h
+ * @brief Per-device round trip estimators (smoothed RTT and variance, TCP RTO style) that
+ *        set the connect and reply timeouts of a device read.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define RTT_MAX_DEVICES 32
+#define RTT_MIN_MS 50      // floor: a healthy LAN device fails in tens of ms
+#define RTT_MAX_MS 5000    // ceiling, and the timeout before the first sample
+#define RTT_CLOCK_MS 2     // granularity of the reply wait loop
+#define CMD_RUN_MS 30000   // BLK/RST run on the device before it answers
+
+typedef enum : uint8_t
+{
+    RTT_CONNECT, // TCP handshake
+    RTT_REPLY,   // command sent -> first byte of the reply
+    RTT_KINDS,
+} rttKind_t;
+
+typedef struct
+{
+    uint32_t srttUs;   // smoothed RTT
+    uint32_t rttvarUs; // smoothed mean deviation
+    uint16_t samples;
+    uint8_t backoff;   // timeouts in a row, doubles the timeout each
+} rttEst_t;
+
+uint32_t rttTimeout(const char *ip, rttKind_t kind);
+void rttSample(const char *ip, rttKind_t kind, uint32_t us);
+void rttExpired(const char *ip, rttKind_t kind);
+uint32_t rttRetryMs(const char *ip);
+uint32_t rttCommandMs(const char *ip, const char *cmd);
+void rttReport();
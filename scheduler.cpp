@@ -0,0 +1,446 @@
+/**
+ * @file scheduler.cpp
+ * @brief Per-device poll schedule with staggered dispatch, driven by the poller task.
+ *
+ * Each device gets its own poll interval instead of the single 20 s sweep, the tables are
+ * part of the config record (config.cpp):
+ * - A device name prefix table (`deviceInterval`) gives the interval for known devices.
+ * - Once a device has answered, the sensor types it reported (`sensorInterval`) take over,
+ *   the fastest sensor on a device sets the pace (ADS1115 Jackery volts vs. temperature).
+ *   A device found by multicast discovery announces its sensor types, they are applied
+ *   before the first poll (`schedHint()`).
+ * - Anything else is polled every `defaultPollMs`.
+ * - After a config reload `schedReconfigure()` starts every device over from the tables.
+ * - A device that pushed a reading within `liveness_ms` (push.cpp) is not polled, its slot
+ *   passes without network traffic and polling is only a liveness check.
+ *
+ * Devices sharing an interval are spread evenly over it: device k of n in a group gets the
+ * phase k * interval / n. The phases are recomputed whenever ip.php adds or drops a device,
+ * a new device is polled right away and then joins its slot.
+ *
+ * @details
+ * - Each device has a one shot timer on the timing wheel (timingWheel.cpp) armed for its next
+ *   due time. On expiry the wheel hands `schedFire()` to the poller task, which hands the
+ *   read to the worker pool (workPool.cpp, `socketPollAsync()`) and re-arms the timer right
+ *   away, so a slow device no longer delays the next one. The poller reads the device
+ *   itself when the pool is not running or full. A device whose last read is still in
+ *   flight skips its slot (`polls_skipped_total{busy}`).
+ * - The sensor types a device reported are applied back in the poller (`schedLearn()`),
+ *   the worker only leaves the interval in the entry.
+ * - Owned by the poller task, no locking. Other tasks ask for a report through the poller
+ *   request queue (`sched` terminal command).
+ * - Backpressure: a device is classed by the readings it reported (`flowBatchClass()`,
+ *   flow.cpp). While the uploader has no credit for its class the slot passes without a
+ *   read (`polls_skipped_total{backpressure}`), an overloaded uploader slows the ambient
+ *   sensors down instead of dropping their readings after the read.
+ * - Lateness (dispatch time - due time) is recorded in the `poll_lateness_ms` histogram and
+ *   the `poll_lateness_max_ms` gauge of the metrics registry.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <Blynk/BlynkHandlers.h>
+#include "mailbox.h"
+#include "metrics.h"
+#include "timingWheel.h"
+#include "config.h"
+#include "binLog.h"
+#include "reading.h"
+#include "flow.h"
+
+#define MAX_DEVICES 32
+
+typedef struct
+{
+    char name[16];
+    char ip[20];
+    uint32_t intervalMs;
+    uint32_t phaseMs;
+    uint32_t nextDue; // millis()
+    uint32_t polls;
+    uint32_t lateMax;
+    bool learned; // interval taken from the reported sensor types
+    bool inUse;
+    volatile bool busy;         // read in flight on the worker pool
+    volatile bool hinted;       // hintMs left by the worker for schedLearn()
+    volatile uint8_t flowClass; // flowClass_t of the last readings, FLOW_HIGH until read
+    uint32_t hintMs;
+    twTimer_t timer; // linked in the wheel, entries never move while in use
+} schedEntry_t;
+
+static schedEntry_t schedule[MAX_DEVICES];
+static int scheduled = 0;
+static uint32_t schedEpoch = 0;
+static metric_t *mLateness, *mLateMax, *mPolls, *mDevices, *mSkipped, *mBusy, *mThrottled;
+
+// Function Prototypes
+void schedSync(const std::map<std::string, std::string> &devices);
+void schedFire(void *arg);
+void schedPollAll(uint32_t now);
+void schedReport();
+void schedReconfigure();
+void schedHint(const char *name, const char *sensors);
+bool pollerDispatch(twCallback_t cb, void *arg);
+int socketClient(char *espServer, char *command, bool updateErrorQueue, readingBatch_t &batch);
+bool pushFresh(const char *ip, uint32_t withinMs);
+bool socketPollAsync(const char *ip, void (*done)(const readingBatch_t *batch, void *arg), void *arg);
+
+static inline bool due(uint32_t t, uint32_t now)
+{
+    return (int32_t)(now - t) >= 0; // millis() wrap safe
+}
+
+static uint32_t lookupInterval(const cfgInterval_t *table, size_t n, const char *key, bool prefix)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (prefix ? !strncasecmp(key, table[i].key, strlen(table[i].key)) : !strcmp(key, table[i].key))
+            return table[i].intervalMs;
+    }
+    return 0;
+}
+
+// (re)arms the entry's wheel timer for its nextDue, the poll runs in the poller task
+static void armEntry(schedEntry_t &e, uint32_t now)
+{
+    timerArm(&e.timer, due(e.nextDue, now) ? 0 : e.nextDue - now, schedFire, &e, pollerDispatch);
+}
+
+/**
+ * @brief Moves a device's next due time to the first slot of its phase after `now`.
+ */
+static void alignNext(schedEntry_t &e, uint32_t now)
+{
+    uint32_t offset = (now - schedEpoch) % e.intervalMs;
+    uint32_t wait = (e.phaseMs + e.intervalMs - offset) % e.intervalMs;
+    e.nextDue = now + (wait ? wait : e.intervalMs);
+    armEntry(e, now);
+}
+
+/**
+ * @brief Recomputes the phase of every device so each interval group is evenly spread.
+ *
+ * Devices with the same interval are numbered in name order. Only a device whose phase
+ * changed moves to its new slot, a device that never ran keeps its immediate due time.
+ */
+static void restagger(uint32_t now)
+{
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        schedEntry_t &e = schedule[i];
+        if (!e.inUse)
+            continue;
+        int k = 0, n = 0;
+        for (int j = 0; j < MAX_DEVICES; j++)
+        {
+            if (!schedule[j].inUse || schedule[j].intervalMs != e.intervalMs)
+                continue;
+            if (strcmp(schedule[j].name, e.name) < 0)
+                k++;
+            n++;
+        }
+        uint32_t phase = (uint32_t)((uint64_t)e.intervalMs * k / n);
+        if (phase == e.phaseMs)
+            continue;
+        e.phaseMs = phase;
+        if (e.polls)
+            alignNext(e, now);
+    }
+}
+
+/**
+ * @brief Interval of a device before it has reported its sensor types.
+ */
+static uint32_t deviceInterval(const char *name)
+{
+    const config_t *c = cfg();
+    uint32_t t = lookupInterval(c->deviceInterval, c->deviceIntervals, name, true);
+    return t ? t : c->defaultPollMs;
+}
+
+static schedEntry_t *findEntry(const char *name)
+{
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        if (schedule[i].inUse && !strcmp(schedule[i].name, name))
+            return &schedule[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Brings the schedule in line with the device list fetched from ip.php.
+ *
+ * New devices are added and due immediately, devices no longer listed are dropped (their
+ * timer is cancelled), then the phases are recomputed if anything changed.
+ *
+ * @param devices Map of device name -> IP address.
+ */
+void schedSync(const std::map<std::string, std::string> &devices)
+{
+    uint32_t now = millis();
+    bool changed = false;
+
+    if (mLateness == NULL)
+    {
+        schedEpoch = now;
+        mLateness = metricRegister("poll_lateness_ms", "Delay between a device poll being due and dispatched", METRIC_HISTOGRAM);
+        mLateMax = metricRegister("poll_lateness_max_ms", "Largest poll dispatch delay since boot", METRIC_GAUGE);
+        mPolls = metricRegister("polls_dispatched_total", "Device polls dispatched by the scheduler", METRIC_COUNTER);
+        mDevices = metricRegister("devices_scheduled", "Devices on the poll schedule", METRIC_GAUGE);
+        mSkipped = metricRegister("polls_skipped_total", "Device polls skipped", METRIC_COUNTER, "reason", "push");
+        mBusy = metricRegister("polls_skipped_total", "Device polls skipped", METRIC_COUNTER, "reason", "busy");
+        mThrottled = metricRegister("polls_skipped_total", "Device polls skipped", METRIC_COUNTER, "reason", "backpressure");
+    }
+
+    // drop devices that left
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        schedEntry_t &e = schedule[i];
+        if (!e.inUse)
+            continue;
+        auto it = devices.find(e.name);
+        if (it == devices.end() || it->second != e.ip)
+        {
+            timerCancel(&e.timer);
+            e.inUse = false;
+            scheduled--;
+            changed = true;
+        }
+    }
+
+    // add devices that joined
+    for (const auto &pair : devices)
+    {
+        if (findEntry(pair.first.c_str()))
+            continue;
+        schedEntry_t *e = NULL;
+        for (int i = 0; i < MAX_DEVICES && e == NULL; i++)
+            if (!schedule[i].inUse && !twArmed(&schedule[i].timer) && !schedule[i].busy)
+                e = &schedule[i];
+        if (e == NULL)
+        {
+            Serial.printf("schedule full, %s not polled\n", pair.first.c_str());
+            continue;
+        }
+        memset(e, 0, sizeof(*e));
+        strncpy(e->name, pair.first.c_str(), sizeof(e->name) - 1);
+        strncpy(e->ip, pair.second.c_str(), sizeof(e->ip) - 1);
+        e->intervalMs = deviceInterval(e->name);
+        e->nextDue = now;
+        e->inUse = true;
+        armEntry(*e, now);
+        scheduled++;
+        changed = true;
+    }
+
+    if (changed)
+    {
+        restagger(now);
+        metricSet(mDevices, scheduled);
+    }
+}
+
+// the fastest sensor sets the pace, 0 if none of the types is in the table
+static uint32_t sensorPace(uint32_t interval, const char *sensor)
+{
+    const config_t *c = cfg();
+    uint32_t t = lookupInterval(c->sensorInterval, c->sensorIntervals, sensor, false);
+    return t && (!interval || t < interval) ? t : interval;
+}
+
+static void setInterval(schedEntry_t &e, uint32_t interval, uint32_t now)
+{
+    e.learned = true;
+    if (interval && interval != e.intervalMs)
+    {
+        e.intervalMs = interval;
+        restagger(now);
+        if (e.polls)
+            alignNext(e, now); // a device that never ran keeps its immediate first poll
+    }
+}
+
+// poll interval for the sensor types of a batch, 0 if none is in the table
+static uint32_t batchPace(const readingBatch_t &batch)
+{
+    uint32_t interval = 0;
+    for (const sensorReading_t *r = batch.first; r != NULL; r = r->next)
+    {
+        if (r->sensor != NULL)
+            interval = sensorPace(interval, r->sensor);
+    }
+    return interval;
+}
+
+/**
+ * @brief Poller callback, applies the interval a worker picked from the sensor types a
+ *        device reported.
+ */
+static void schedLearn(void *arg)
+{
+    schedEntry_t &e = *(schedEntry_t *)arg;
+    if (e.inUse && e.hinted && !e.learned) // not dropped or re-learning since
+        setInterval(e, e.hintMs, millis());
+    e.hinted = false;
+}
+
+/**
+ * @brief Called on the worker when a read handed to the pool is done.
+ */
+static void schedPolled(const readingBatch_t *batch, void *arg)
+{
+    schedEntry_t &e = *(schedEntry_t *)arg;
+    if (batch == NULL)
+        LOG_W("socketClient() failed %s", e.ip);
+    else
+        e.flowClass = flowBatchClass(*batch);
+    if (batch != NULL && !e.learned && !e.hinted)
+    {
+        e.hintMs = batchPace(*batch);
+        e.hinted = true;
+        if (!pollerDispatch(schedLearn, &e))
+            e.hinted = false; // learned on a later poll
+    }
+    e.busy = false; // the entry may be reused from here on
+}
+
+/**
+ * @brief Picks the poll interval from the sensor types a device announced (discovery.cpp).
+ *
+ * @param name Device name.
+ * @param sensors Comma separated sensor types, e.g. "BME280,ADS1115".
+ */
+void schedHint(const char *name, const char *sensors)
+{
+    schedEntry_t *e = findEntry(name);
+    if (e == NULL || e->learned || *sensors == 0)
+        return;
+    char list[48];
+    char *save = NULL;
+    uint32_t interval = 0;
+    strncpy(list, sensors, sizeof(list) - 1);
+    list[sizeof(list) - 1] = 0;
+    for (char *sensor = strtok_r(list, ",", &save); sensor; sensor = strtok_r(NULL, ",", &save))
+        interval = sensorPace(interval, sensor);
+    setInterval(*e, interval, millis());
+}
+
+/**
+ * @brief Wheel timer callback, polls one device and re-arms it for its next slot.
+ *
+ * Runs in the poller task (dispatched through `pollerDispatch()`).
+ *
+ * @param arg The `schedEntry_t` of the device.
+ */
+void schedFire(void *arg)
+{
+    schedEntry_t &e = *(schedEntry_t *)arg;
+    uint32_t start = millis();
+    if (!e.inUse || !due(e.nextDue, start))
+        return; // device dropped or re-phased after the timer was dispatched
+
+    uint32_t late = start - e.nextDue;
+    metricObserve(mLateness, late);
+    metricMax(mLateMax, late);
+    metricInc(mPolls);
+    if (late > e.lateMax)
+        e.lateMax = late;
+
+    bool first = e.polls++ == 0;
+    if (pushFresh(e.ip, cfg()->livenessMs))
+        metricInc(mSkipped); // the device pushes its readings, it is alive
+    else if (e.busy)
+        metricInc(mBusy); // the last read of this device has not finished
+    else if (flowThrottled((flowClass_t)e.flowClass))
+        metricInc(mThrottled); // the uploader would drop its readings
+    else
+    {
+        e.busy = true;
+        if (!socketPollAsync(e.ip, schedPolled, &e))
+        {
+            readingBatch_t batch;
+            e.busy = false;
+            if (socketClient(e.ip, (char *)"ALL", 1, batch)) // read sensor data from connected device
+                LOG_W("socketClient() failed %s", e.ip);
+            else
+            {
+                e.flowClass = flowBatchClass(batch);
+                if (!e.learned)
+                    setInterval(e, batchPace(batch), millis());
+            }
+        }
+    }
+
+    uint32_t now = millis();
+    if (first)
+        alignNext(e, now); // leave the immediate first poll, join the phase slot
+    else
+    {
+        // keep the phase, skip the slots we already missed
+        do
+            e.nextDue += e.intervalMs;
+        while (due(e.nextDue, now));
+        armEntry(e, now);
+    }
+    LOG_D("sched %s late %u ms next in %d ms", e.name, late, (int)(e.nextDue - now));
+}
+
+/**
+ * @brief Makes every device due now (terminal "refr", Blynk reconnect).
+ */
+void schedPollAll(uint32_t now)
+{
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        if (!schedule[i].inUse)
+            continue;
+        schedule[i].nextDue = now;
+        armEntry(schedule[i], now);
+    }
+}
+
+/**
+ * @brief Re-applies the poll interval tables after a config reload.
+ *
+ * Every device goes back to its device name interval and learns its sensor interval again
+ * on the next poll. Runs in the poller task (`POLL_CONFIG` request).
+ */
+void schedReconfigure()
+{
+    uint32_t now = millis();
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        if (schedule[i].inUse)
+        {
+            schedule[i].intervalMs = deviceInterval(schedule[i].name);
+            schedule[i].learned = false;
+        }
+    }
+    restagger(now);
+    for (int i = 0; i < MAX_DEVICES; i++)
+        if (schedule[i].inUse && schedule[i].polls)
+            alignNext(schedule[i], now); // restagger() only moves devices whose phase changed
+}
+
+/**
+ * @brief Prints the schedule on the terminal: interval, phase, next due and worst lateness.
+ */
+void schedReport()
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    uint32_t now = millis();
+    snprintf(tmp, sizeof(tmp), "schedule: %d devices, max late %d ms\n", scheduled, mLateMax ? (int)mLateMax->value : 0);
+    widgetPrint(V42, tmp);
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        const schedEntry_t &e = schedule[i];
+        if (!e.inUse)
+            continue;
+        snprintf(tmp, sizeof(tmp), "\t%s every %us +%ums next %dms late %ums%s\n",
+                 e.name, e.intervalMs / 1000, e.phaseMs, (int)(e.nextDue - now), e.lateMax, e.learned ? "" : " *");
+        widgetPrint(V42, tmp);
+    }
+}
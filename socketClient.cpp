@@ -9,16 +9,26 @@
  * @details
  * - The `socketClient` function handles communication with the server, including sending
  *   commands, receiving data, and validating the received data using CRC.
+ * - The `decodeFrame` function checks and decodes one "<crc>:<AES payload>" frame into a
+ *   reading batch (reading.cpp), it is shared with the push ingestion server (push.cpp)
+ *   which receives the same frames.
  * - The `processSensorData` function processes the received sensor data and updates widgets
- *   and sends HTTP requests based on the sensor type.
- * - The `printTokens` function is a debug utility for printing parsed sensor data.
- * - The file also includes an overloaded version of `socketClient` that returns a dynamically
- *   allocated buffer containing the server's response.
+ *   and sends HTTP requests based on the sensor type, and evaluates the alarm rules
+ *   (alarm.cpp) on every reading.
+ * - The `printReadings` function is a debug utility for printing parsed sensor data.
+ * - `socketPollAsync` runs the same read as a pipeline of worker pool jobs (workPool.cpp):
+ *   poll (connect, command, reply), decrypt (CRC and AES) and decode (rows into a reading
+ *   batch, then `processSensorData`). Each stage queues the next one, so the other core
+ *   can steal it. The job state lives in one of `POLL_JOB_SLOTS` static slots.
+ * - Connect and reply timeouts are per device (rtt.cpp), from the round trips measured by
+ *   `socketRead()`: a dead LAN device is given up after tens of ms instead of 5 s, a slow
+ *   one gets its own margin.
  *
  * @note
  * - The `NO_SOCKET_AES` macro disables AES decryption for socket communication.
- * - The `DEBUG` macro enables debug output for token printing.
- * - The file uses a map to associate sensor ids with their corresponding sensor names.
+ * - The `DEBUG_TOKENS` macro enables debug output of the decoded readings.
+ * - The batch a poll decodes into is a local of the polling task, a caller that needs the
+ *   readings afterwards (scheduler, bme/adc commands) passes its own.
  *
  * @dependencies
  * - Arduino framework
@@ -38,26 +48,55 @@
 #include <time.h>
 #include <CRC32.h>
 #include <Wire.h>
-#include <map>
+#include <atomic>
+#include "warmState.h"
+#include "config.h"
+#include "binLog.h"
+#include "reading.h"
+#include "workPool.h"
+#include "rtt.h"
+#include "alarm.h"
 #define NO_UPDATE_FAIL 0
 #define INPUT_BUFFER_LIMIT 2048
 // #define NO_SOCKET_AES
 #define MAX_LINE_LENGTH 120
-#define PORT 8888
+#define FRAME_LENGTH 80
+#define POLL_JOB_SLOTS 8 // device polls in flight in the pool
 
 // #define DEBUG
 
-extern String lastMsg;
-extern int failSocket, passSocket, recoveredSocket, retry;
+extern std::atomic<int> failSocket, passSocket, recoveredSocket, retry;
 extern byte enc_iv_to[16], aes_iv[16];
 extern char cleartext[];
+extern SemaphoreHandle_t xMutex_aes;
 void taskSQL_HTTP(void *pvParameters);
-void setupHTTP_request(String sensorName, float tokens[]);
+void setLastMsg(const char *what, const char *host);
+void setupHTTP_request(const sensorReading_t &reading, bool alarmed);
 int socketRecovery(char *IP, char *cmd2Send);
 int socketClient(char *espServer, char *command, bool updateErrorQueue);
-void upDateWidget(char *sensor, float tokens[]);
-void processSensorData(float tokens[5][5], bool updateErrorQueue);
-void printTokens(float tokens[5][5]);
+int socketClient(char *espServer, char *command, bool updateErrorQueue, readingBatch_t &batch);
+void upDateWidget(const sensorReading_t &reading);
+void processSensorData(readingBatch_t &batch, bool updateErrorQueue);
+void historyAppend(const sensorReading_t &reading);
+int decodeFrame(char *frame, readingBatch_t &batch);
+void printReadings(const readingBatch_t &batch);
+bool socketPollAsync(const char *ip, void (*done)(const readingBatch_t *batch, void *arg), void *arg);
+static int socketRead(char *espServer, char *command, char *str, size_t len);
+static void socketFailed(char *espServer, char *command, bool updateErrorQueue, int rc);
+static int decryptFrame(char *frame, char *rows, size_t len);
+static void parseRows(char *rows, readingBatch_t &batch);
+
+typedef struct
+{
+    std::atomic<bool> inUse;
+    char ip[20];
+    char frame[FRAME_LENGTH];
+    char rows[MAX_LINE_LENGTH];
+    void (*done)(const readingBatch_t *batch, void *arg);
+    void *arg;
+} pollJob_t;
+
+static pollJob_t pollJobs[POLL_JOB_SLOTS];
 void decrypt_to_cleartext(char *msg, uint16_t msgLen, byte iv[], char *cleartext);
 
 /**
@@ -75,17 +114,17 @@ void decrypt_to_cleartext(char *msg, uint16_t msgLen, byte iv[], char *cleartext
  *
  * @details
  * The function performs the following steps:
- * 1. Attempts to connect to the server using the provided address and PORT.
+ * 1. Attempts to connect to the server using the provided address and the configured sensor port.
  * 2. Sends the specified command to the server if the connection is successful.
  * 3. Waits for a response from the server with a timeout of 5 seconds.
  * 4. Reads the response data and optionally decrypts it if AES encryption is enabled.
  * 5. Validates the response using CRC to ensure data integrity.
- * 6. Parses the response data into tokens and processes the sensor data.
+ * 6. Decodes the response into a reading batch and processes the sensor data.
  *
  * If the connection fails, times out, or CRC validation fails, the function updates the error recovery queue
  * (if `updateErrorQueue` is true) and increments the failure counter (`failSocket`).
  *
- * @note The function uses global variables such as `lastMsg`, `failSocket`, and `PORT`.
+ * @note The function uses the V39 warning (`setLastMsg()`), the atomic `failSocket`, and `cfg()->sensorPort`.
  *
  * @warning Ensure that the server address and command strings are properly null-terminated.
  *
@@ -93,265 +132,302 @@ void decrypt_to_cleartext(char *msg, uint16_t msgLen, byte iv[], char *cleartext
  */
 int socketClient(char *espServer, char *command, bool updateErrorQueue)
 {
-    extern float tokens[5][5];
-    char str[80];
-    bzero(str, 80);
+    readingBatch_t batch;
+    return socketClient(espServer, command, updateErrorQueue, batch);
+}
+/**
+ * @brief As above, the decoded readings are left in `batch` for the caller.
+ */
+int socketClient(char *espServer, char *command, bool updateErrorQueue, readingBatch_t &batch)
+{
+    char str[FRAME_LENGTH];
+    int rc = socketRead(espServer, command, str, sizeof(str));
+    if (rc == 0 && decodeFrame(str, batch))
+        rc = 3;
+    if (rc)
+    {
+        socketFailed(espServer, command, updateErrorQueue, rc);
+        return rc;
+    }
+    processSensorData(batch, updateErrorQueue);
+
+    return 0;
+}
+/**
+ * @brief Connects, sends `command` and reads the reply into `str`.
+ *
+ * The wait for the reply yields, the core is free while the device answers.
+ *
+ * @return 0 on success, 1 if the connection fails, 2 on a timeout.
+ */
+static int socketRead(char *espServer, char *command, char *str, size_t len)
+{
+    memset(str, 0, len);
     WiFiClient client;
-    CRC32 crc;
 
-    if (!client.connect(espServer, PORT))
+    uint32_t limit = rttTimeout(espServer, RTT_CONNECT);
+    uint32_t start = micros();
+    if (!client.connect(espServer, cfg()->sensorPort, limit))
     {
-        if (updateErrorQueue)
-        {                                       // don't update if in recovery mode ie last i/o failed
-            socketRecovery(espServer, command); // current failed write to error recovery queue
-            failSocket++;
-            Serial.printf(">>> failed to connect: %s!\n", espServer);
-            lastMsg = "failed to connect " + String(espServer);
-        }
+        if (micros() - start >= limit * 1000) // not refused, ran out
+            rttExpired(espServer, RTT_CONNECT);
         return 1;
     }
+    rttSample(espServer, RTT_CONNECT, micros() - start);
 
     if (client.connected())
         client.println(command); // send cmd to esp8266 server  ie ALL/BLK/RST
 
-    unsigned long timeout = millis();
+    limit = rttTimeout(espServer, RTT_REPLY);
+    start = micros();
     // wait for data to be available
     while (client.available() == 0)
     {
-        if (millis() - timeout > 5000)
+        if (micros() - start > limit * 1000)
         {
-            Serial.println(">>> Client Timeout!");
-            lastMsg = "Client Timeout " + String(espServer);
+            rttExpired(espServer, RTT_REPLY);
             client.stop();
-            delay(600);
-            if (updateErrorQueue)
-            {
-                socketRecovery(espServer, command); // write to error recovery queque
-                failSocket++;
-            }
             return 2;
         }
+        vTaskDelay(1);
     }
-    int index = 0;
-    while (client.available())
+    rttSample(espServer, RTT_REPLY, micros() - start);
+    size_t index = 0;
+    while (client.available() && index < len - 1)
         str[index++] = client.read(); // read sensor data from sever
     client.stop();
-
-    int calculatedCrc;
-    String copyStr = str;
-
-    client.stop();
-    index = copyStr.indexOf(":");
-    String crcString = copyStr.substring(0, index);
-    sscanf(crcString.c_str(), "%x", &calculatedCrc); //convert ASCII string to hex 0xYY
-    String parsed = copyStr.substring(index + 1);
-    crc.add((uint8_t *)parsed.c_str(), parsed.length());
-    if (calculatedCrc != crc.calc())
+    return 0;
+}
+/**
+ * @brief Error handling of a failed read, `rc` as returned by `socketClient()`.
+ */
+static void socketFailed(char *espServer, char *command, bool updateErrorQueue, int rc)
+{
+    if (rc == 1 && !updateErrorQueue)
+        return; // don't update if in recovery mode ie last i/o failed
+    if (rc == 1)
     {
-        lastMsg = "CRC invalid " + String(espServer);
-        if (updateErrorQueue)
-        {
-            socketRecovery(espServer, command); // write to error recovery queque
-            failSocket++;
-        }
-        return 3;
+        LOG_W(">>> failed to connect: %s!", espServer);
+        setLastMsg("failed to connect", espServer);
+    }
+    else if (rc == 2)
+    {
+        LOG_W(">>> Client Timeout! %s", espServer);
+        setLastMsg("Client Timeout", espServer); // no pause here, the recovery task backs off (rttRetryMs())
     }
-    
+    else
+        setLastMsg("CRC invalid", espServer);
+    if (updateErrorQueue)
+    {
+        socketRecovery(espServer, command); // write to error recovery queque
+        failSocket++;
+    }
+}
+/**
+ * @brief Checks and decodes one frame sent by a device into sensor rows.
+ *
+ * Frame format: "<crc32 hex>:<base64 AES payload>", the CRC covers the payload. The clear
+ * text is "id,v1,v2,...,|,id,v1,..." one row per sensor.
+ *
+ * Limits: a polled frame is read into `FRAME_LENGTH` (80) bytes, a pushed one into
+ * `PUSH_LINE_LEN` (160, push.cpp), a longer frame is cut and fails the CRC. The clear text
+ * is cut to `MAX_LINE_LENGTH` - 1 (119) characters before it is parsed. Within that the
+ * number of rows and values is free, the reading arena holds any 119 character clear text
+ * (`batch.truncated` stays false).
+ *
+ * @param frame The frame, modified.
+ * @param batch Emptied, then one reading per row.
+ * @return 0 on success, 3 if the CRC does not match.
+ *
+ * @note Called by the poller, the socket recovery task, the worker pool and the push
+ *       server.
+ */
+int decodeFrame(char *frame, readingBatch_t &batch)
+{
+    char rows[MAX_LINE_LENGTH];
+    if (decryptFrame(frame, rows, sizeof(rows)))
+        return 3;
+    parseRows(rows, batch);
+    return 0;
+}
+/**
+ * @brief Checks the CRC of a frame and decrypts its payload into `rows`.
+ *
+ * @return 0 on success, 3 if the CRC does not match.
+ *
+ * @note The AES buffers (`enc_iv_to`, `cleartext`) and the AESLib instance are shared,
+ *       `xMutex_aes` serializes their use.
+ */
+static int decryptFrame(char *frame, char *rows, size_t len)
+{
+    uint32_t calculatedCrc = 0;
+    char *payload = strchr(frame, ':');
+    if (payload == NULL)
+        return 3;
+    *payload++ = 0;
+    sscanf(frame, "%x", &calculatedCrc); //convert ASCII string to hex 0xYY
+    if (calculatedCrc != CRC32::calculate((const uint8_t *)payload, strlen(payload)))
+        return 3;
+
+    // crc passed !
 #ifndef NO_SOCKET_AES
+    xSemaphoreTake(xMutex_aes, portMAX_DELAY);
     // make a copy decrypt_to_cleartext() corrupts byte array aes_iv!
     memcpy(enc_iv_to, aes_iv, sizeof(aes_iv));
-    decrypt_to_cleartext((char *)parsed.c_str(), parsed.length(), enc_iv_to, cleartext);
-    parsed = String(cleartext);
+    decrypt_to_cleartext(payload, strlen(payload), enc_iv_to, cleartext);
+    strlcpy(rows, cleartext, len);
+    xSemaphoreGive(xMutex_aes);
+#else
+    strlcpy(rows, payload, len);
 #endif
-
-
-    // crc passed !
-    memset(tokens, 0, sizeof(tokens));
-    char *token = strtok((char *)parsed.c_str(), ",");
-    int j = 0, z = 0;
+    return 0;
+}
+/**
+ * @brief Splits decrypted rows "id,v1,v2,...,|,id,..." into `batch`, modifies `rows`.
+ */
+static void parseRows(char *rows, readingBatch_t &batch)
+{
+    readingBegin(batch);
+    char *save = NULL;
+    char *token = strtok_r(rows, ",", &save);
+    bool open = false; // a row is open, the next token is a value
     while (token != NULL)
     {
         if (!strcmp(token, "|"))
-        {
-            z++;
-            j = 0;
-        }
+            open = false;
+        else if (open)
+            readingPush(batch, atof(token));
         else
-            tokens[z][j++] = atof(token);
+            open = readingOpen(batch, static_cast<int>(atof(token))) != NULL;
 
-        token = strtok(NULL, ",");
+        token = strtok_r(NULL, ",", &save);
     }
+    if (batch.truncated)
+        LOG_W("frame cut, %d readings kept", batch.count);
 // #define DEBUG_TOKENS
 #ifdef DEBUG_TOKENS
-    printTokens(tokens);
+    printReadings(batch);
 #endif
-    processSensorData(tokens, updateErrorQueue);
-
-    return 0;
 }
 /**
  * @brief Processes sensor data and performs actions based on sensor type.
  *
- * This function takes a 2D array of sensor data tokens and processes each sensor's data.
- * It identifies the sensor type using a predefined mapping, then performs actions such as
- * setting up an HTTP request to update mySQL. If an unknown sensor code is encountered,
- * the function continues.
+ * This function takes the readings decoded from one frame and processes each sensor's data.
+ * The sensor type was resolved from its id when the frame was decoded (reading.cpp), each
+ * known sensor gets an HTTP request to update mySQL, its widgets, its warm restart slot and
+ * a row in its history (history.cpp). If an unknown sensor code is encountered, the
+ * function continues.
  *
- * @param tokens A 2D array of sensor data, where each row represents a sensor's data.
- *               The first element in each row is the sensor code (as a float).
+ * @param batch The readings of one frame, passed down by reference.
  * @param updateErrorQueue A boolean flag indicating whether to update the error queue.
  *                         (Currently unused due to a resolved bug.)
  *
- * @note The function uses a predefined mapping of sensor codes to sensor names for identification.
- *       If a sensor code is not found in the mapping, the function continues to next.
+ * @note If a sensor code is not found in the sensor table, the function continues to next.
  * @note A previous bug related to "Stack canary" exceptions was resolved by increasing the stack size.
  * @note A previous bug related to "Stack canary" exceptions was resolved by increasing the stack size.
  */
-void processSensorData(float tokens[5][5], bool updateErrorQueue)
+void processSensorData(readingBatch_t &batch, bool updateErrorQueue)
 {
-    const std::map<int, const char *> sensorMap =
-        {
-            {77, "BMP390"},
-            {76, "BME280"},
-            {58, "BMP280"},
-            {44, "SHT35"},
-            {48, "ADS1115"},
-            {28, "DS1"}};
-
-    char sensor[10];
-
-    for (int i = 0; i < 5; i++)
+    for (sensorReading_t *r = batch.first; r != NULL; r = r->next)
     {
-        int sensorCode = static_cast<int>(tokens[i][0]);
-        auto it = sensorMap.find(sensorCode);
-        if (it != sensorMap.end())
+        if (r->sensor != NULL)
         {
-            strcpy(sensor, it->second);
             passSocket++;
-            setupHTTP_request(sensor, tokens[i]);
-            upDateWidget(sensor, tokens[i]);
+            bool alarmed = alarmEvaluate(*r); // first, an alarm reading is uploaded ahead
+            setupHTTP_request(*r, alarmed);
+            upDateWidget(*r);
+            warmNoteReading(*r);
+            historyAppend(*r);
         }
         else
             continue; // Unknown sensor code
     }
 }
 /**
- * @brief Prints the contents of a 2D array of tokens to the Serial monitor.
+ * @brief Prints the readings of a batch to the Serial monitor.
  *
- * This function iterates through a 5x5 array of floating-point numbers and
- * prints each row to the Serial monitor. The first element of each row is
- * treated as a sensor ID and is printed in hexadecimal format, while the
- * remaining elements are printed as floating-point numbers. The function
- * stops processing rows when the first element of a row is zero.
+ * One line per reading: the sensor id and name, then every channel as value/quantity
+ * (see `quantity_t` in reading.h).
  *
- * @param tokens A 5x5 array of floating-point numbers representing the tokens.
- *               The first element of each row is treated as a sensor ID.
+ * @param batch The readings decoded from one frame.
  */
-void printTokens(float tokens[5][5])
+void printReadings(const readingBatch_t &batch)
 {
-    for (int i = 0; i < 5; i++)
+    for (const sensorReading_t *r = batch.first; r != NULL; r = r->next)
     {
-        if (!tokens[i][0])
-            break;
-
-        for (int j = 0; j < 5; j++)
-        {
-            if (j == 0)
-                Serial.printf("sensor id: 0x%d ", static_cast<int>(tokens[i][j]));
-            else
-                Serial.printf("%f ", tokens[i][j]);
-        }
+        Serial.printf("sensor id: %d %s ", r->code, r->sensor ? r->sensor : "?");
+        for (int j = 0; j < r->channels; j++)
+            Serial.printf("%f/%d ", r->channel[j].value, r->channel[j].quantity);
         Serial.println();
     }
 }
-/**  this overload returns malloc its your duty to free!!!
- * @brief Establishes a socket connection to a server, sends a command, and retrieves the response.
- *
- * @param espServer A pointer to a character array containing the server's address.
- * @param command A pointer to a character array containing the command to send to the server.
- * @return A pointer to a dynamically allocated character array containing the server's response.
- *         Returns NULL if the connection fails, a timeout occurs, or memory allocation fails.
- *
- * @note The caller is responsible for freeing the memory allocated for the response using free().
- *
- * @details
- * - The function attempts to connect to the specified server using the WiFiClient class.
- * - If the connection is successful, it sends the provided command to the server.
- * - The function waits for a response from the server, with a timeout of 35 seconds.
- * - If no response is received within the timeout period, the connection is closed, and NULL is returned.
- * - The response from the server is read into a dynamically allocated buffer.
- * - If memory allocation fails, the ESP device is restarted.
- * - The connection is closed after reading the response.
- *
- * @warning Ensure that free() is called on the returned pointer to avoid memory leaks.
- * @warning The function restarts the ESP device if memory allocation fails.
- *
- * @example
- * char *response = socketClient("192.168.1.100", "BLK");
- * if (response != NULL) {
- *     Serial.println(response);
- *     free(response);
- * } else {
- *     Serial.println("Failed to get a response from the server.");
- * }
- */
-char *socketClient(char *espServer, char *command)
+static void pollDone(pollJob_t &job, const readingBatch_t *batch)
 {
-    // char *socketClient(char *espServer, char *command)
-    // {
-    //   // Placeholder implementation for socketClient
-    //   char *response = (char *)malloc(100);
-    //   if (response == nullptr)
-    //   {
-    //     Serial.println("Memory allocation failed");
-    //     return nullptr;
-    //   }
-    //   snprintf(response, 100, "Response from %s with command %s", espServer, command);
-    //   return response;
-    // }
-    int j = 0;
-    WiFiClient client;
-    if (!client.connect(espServer, PORT))
+    if (job.done != NULL)
+        job.done(batch, job.arg);
+    job.inUse = false;
+}
+
+// pool stages, each queues the next one or runs it here if the deque is full
+static void stageDecode(void *arg)
+{
+    pollJob_t &job = *(pollJob_t *)arg;
+    readingBatch_t batch;
+    parseRows(job.rows, batch);
+    processSensorData(batch, true);
+    pollDone(job, &batch);
+}
+
+static void stageDecrypt(void *arg)
+{
+    pollJob_t &job = *(pollJob_t *)arg;
+    if (decryptFrame(job.frame, job.rows, sizeof(job.rows)))
     {
-        Serial.print("connection failed from socketClient ");
-        Serial.println(espServer);
-        delay(5000);
-        return NULL;
+        socketFailed(job.ip, (char *)"ALL", true, 3);
+        pollDone(job, NULL);
     }
-    if (client.connected())
-        client.println(command); // send cmd to server (esp8266) ie "BLK"/"RST"
+    else if (!poolSubmit(stageDecode, &job))
+        stageDecode(&job);
+}
 
-    unsigned long timeout = millis();
-    // wait for data to be available
-    while (client.available() == 0)
+static void stagePoll(void *arg)
+{
+    pollJob_t &job = *(pollJob_t *)arg;
+    int rc = socketRead(job.ip, (char *)"ALL", job.frame, sizeof(job.frame));
+    if (rc)
     {
-        if (millis() - timeout > 35000)
-        {
-            Serial.println(">>> Client Timeout !");
-            client.stop();
-            delay(600);
-            return NULL;
-        }
+        socketFailed(job.ip, (char *)"ALL", true, rc);
+        pollDone(job, NULL);
     }
-    char *mem = (char *)malloc(80);
-    if (mem == NULL)
+    else if (!poolSubmit(stageDecrypt, &job))
+        stageDecrypt(&job);
+}
+
+/**
+ * @brief Reads a device ("ALL") on the worker pool, like `socketClient(ip, "ALL", 1)`.
+ *
+ * @param ip Device address.
+ * @param done Called on the worker once the readings have been processed, with NULL if
+ *             the read failed. The batch is only valid during the call.
+ * @param arg Passed to `done`.
+ * @return false if the pool is not running or all job slots are in flight, the caller
+ *         then reads the device itself.
+ */
+bool socketPollAsync(const char *ip, void (*done)(const readingBatch_t *batch, void *arg), void *arg)
+{
+    for (int i = 0; i < POLL_JOB_SLOTS; i++)
     {
-        //  did you call free()?
-        // Blynk.logEvent("mem_alloc_failed");
-        // queStat();
-        ESP.restart();
-    }
-    // read sensor data from sever
-    while (client.available())
-    { // read data from server (esp8266)
-        char ch = static_cast<char>(client.read());
-        mem[j++] = ch;
+        pollJob_t &job = pollJobs[i];
+        bool idle = false;
+        if (!job.inUse.compare_exchange_strong(idle, true))
+            continue;
+        strlcpy(job.ip, ip, sizeof(job.ip));
+        job.done = done;
+        job.arg = arg;
+        if (poolSubmit(stagePoll, &job))
+            return true;
+        job.inUse = false;
+        return false;
     }
-
-    // Close the connection
-    client.stop();
-    // Serial.println("closing connection");
-
-    mem[j--] = '\0';
-    return mem;
-}
\ No newline at end of file
+    return false;
+}
@@ -0,0 +1,204 @@
+/**
+ * @file spill.cpp
+ * @brief Outage spill: readings that find the mySQL upload queue full are parked Gorilla
+ *        encoded on LittleFS and replayed once the backend takes uploads again.
+ *
+ * While the backend is down every POST fails and is requeued (`postFailed()`), the queue
+ * fills, and `setupHTTP_request()` used to drop every new reading. Now it parks it here
+ * instead. A parked row costs a few bytes (gorilla.cpp) instead of a 120 byte `message_t`.
+ *
+ * @details
+ * - **Park**: `spillPark()` appends the row to the sensor's open block in RAM. A full block
+ *   is appended to `SPILL_FILE` as one fixed size record (sensor name + block). The file is
+ *   capped at `SPILL_MAX_BYTES`, rows beyond it are dropped and counted.
+ * - **Replay**: after a successful POST the HTTP task calls `spillReplay()` with the free
+ *   queue slots as budget. A replay pass first seals the open blocks into the file, then
+ *   streams the records back with a cursor kept across calls, so a pass can span many
+ *   POSTs. The file is removed when a pass has read it to the end.
+ * - **Timestamps**: the replayed rows carry "&reading_time=<epoch s>" so the backend can
+ *   store the time of the reading instead of the time of the insert. Rows parked before NTP
+ *   set the clock have no epoch time and are sent without it.
+ * - **Restart**: `spillFlush()` seals the open blocks, `warmRestart()` calls it, the file
+ *   survives the restart and is replayed by the next boot.
+ * - **Metrics**: `spill_rows_total{parked}`, `spill_rows_total{replayed}`,
+ *   `spill_dropped_total`.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <LittleFS.h>
+#include "gorilla.h"
+#include "metrics.h"
+#include "reading.h"
+
+#define SPILL_FILE "/spill.gor"
+#define SPILL_SENSORS 6 // sensor types in sensorMap
+#define SPILL_MAX_BYTES (64 * 1024)
+
+typedef struct
+{
+    char sensor[10];
+    gorillaBlock_t block;
+} spillRecord_t;
+
+static spillRecord_t parked[SPILL_SENSORS]; // open blocks, guarded by spillMutex
+static SemaphoreHandle_t spillMutex;
+static metric_t *mParked, *mReplayed, *mDropped;
+
+// Function Prototypes
+bool spillStart();
+void spillPark(const sensorReading_t &reading);
+void spillFlush();
+int spillReplay(bool (*send)(const char *sensor, uint32_t ts, const float values[]), int budget);
+
+/**
+ * @brief Creates the spill lock and reports rows left by the previous boot. Called by
+ *        `initRTOS()` before the tasks that park or replay start.
+ */
+bool spillStart()
+{
+    mParked = metricRegister("spill_rows_total", "Rows parked or replayed by the outage spill", METRIC_COUNTER, "action", "parked");
+    mReplayed = metricRegister("spill_rows_total", "Rows parked or replayed by the outage spill", METRIC_COUNTER, "action", "replayed");
+    mDropped = metricRegister("spill_dropped_total", "Rows dropped, the spill file was full", METRIC_COUNTER);
+    spillMutex = xSemaphoreCreateMutex();
+    File file = LittleFS.open(SPILL_FILE, "r");
+    if (file)
+    {
+        Serial.printf("spill: %u blocks to replay\n", (unsigned)(file.size() / sizeof(spillRecord_t)));
+        file.close();
+    }
+    return spillMutex != NULL;
+}
+
+// called with spillMutex held
+static bool spillWrite(const spillRecord_t &rec)
+{
+    File file = LittleFS.open(SPILL_FILE, "a");
+    if (!file)
+        return false;
+    bool ok = file.size() + sizeof(rec) <= SPILL_MAX_BYTES && file.write((const uint8_t *)&rec, sizeof(rec)) == sizeof(rec);
+    file.close();
+    return ok;
+}
+
+/**
+ * @brief Parks one sensor row the upload queue had no room for.
+ */
+void spillPark(const sensorReading_t &reading)
+{
+    if (spillMutex == NULL)
+        return;
+    const char *sensor = reading.sensor;
+    float values[GORILLA_COLUMNS];
+    readingValues(reading, values, GORILLA_COLUMNS);
+    uint32_t ts = gorillaNow();
+    xSemaphoreTake(spillMutex, portMAX_DELAY);
+    int i = 0;
+    while (i < SPILL_SENSORS && parked[i].sensor[0] && strncmp(parked[i].sensor, sensor, sizeof(parked[i].sensor) - 1))
+        i++;
+    bool ok = i < SPILL_SENSORS;
+    int lost = 0;
+    if (ok && parked[i].sensor[0] == 0)
+    {
+        strncpy(parked[i].sensor, sensor, sizeof(parked[i].sensor) - 1);
+        gorillaReset(parked[i].block);
+    }
+    if (ok && !gorillaAppend(parked[i].block, ts, values))
+    {
+        if (!spillWrite(parked[i]))
+            lost = parked[i].block.count; // a block the file had no room for is lost
+        gorillaReset(parked[i].block);
+        gorillaAppend(parked[i].block, ts, values);
+    }
+    xSemaphoreGive(spillMutex);
+    metricInc(ok ? mParked : mDropped);
+    if (lost)
+        metricInc(mDropped, lost);
+}
+
+// called with spillMutex held
+static void sealParked()
+{
+    for (int i = 0; i < SPILL_SENSORS && parked[i].sensor[0]; i++)
+    {
+        if (parked[i].block.count == 0)
+            continue;
+        if (!spillWrite(parked[i]))
+            metricInc(mDropped, parked[i].block.count);
+        gorillaReset(parked[i].block);
+    }
+}
+
+/**
+ * @brief Writes the open blocks to the spill file, e.g. before a restart.
+ */
+void spillFlush()
+{
+    if (spillMutex == NULL)
+        return;
+    xSemaphoreTake(spillMutex, portMAX_DELAY);
+    sealParked();
+    xSemaphoreGive(spillMutex);
+}
+
+/**
+ * @brief Replays up to `budget` parked rows through `send`, oldest block first.
+ *
+ * Called by the HTTP task only. A row `send` refuses is kept and offered again next call.
+ *
+ * @return Number of rows sent.
+ */
+int spillReplay(bool (*send)(const char *sensor, uint32_t ts, const float values[]), int budget)
+{
+    static spillRecord_t rec;
+    static gorillaCursor_t cur;
+    static uint32_t offset = 0, ts;
+    static float values[GORILLA_COLUMNS];
+    static bool open = false, pending = false;
+    int sent = 0;
+
+    if (spillMutex == NULL)
+        return 0;
+    while (sent < budget)
+    {
+        if (!open)
+        {
+            bool more = false;
+            xSemaphoreTake(spillMutex, portMAX_DELAY);
+            if (offset == 0)
+                sealParked();
+            File file = LittleFS.open(SPILL_FILE, "r");
+            if (file)
+            {
+                more = offset + sizeof(rec) <= file.size() && file.seek(offset) && file.read((uint8_t *)&rec, sizeof(rec)) == sizeof(rec);
+                file.close();
+                if (!more)
+                {
+                    LittleFS.remove(SPILL_FILE);
+                    if (offset)
+                        Serial.printf("spill: replayed %u blocks\n", (unsigned)(offset / sizeof(rec)));
+                    offset = 0;
+                }
+            }
+            xSemaphoreGive(spillMutex);
+            if (!more)
+                break;
+            rec.sensor[sizeof(rec.sensor) - 1] = 0;
+            gorillaOpen(cur, &rec.block);
+            open = true;
+        }
+        if (!pending && !gorillaNext(cur, ts, values))
+        {
+            open = false;
+            offset += sizeof(rec);
+            continue;
+        }
+        pending = true;
+        if (!send(rec.sensor, ts, values))
+            break;
+        pending = false;
+        sent++;
+    }
+    metricInc(mReplayed, sent);
+    return sent;
+}
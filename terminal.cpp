@@ -0,0 +1,130 @@
+/**
+ * @file terminal.cpp
+ * @brief Buffered writer for the V42 terminal: output is assembled into chunks of up to
+ *        one Blynk message instead of one `Blynk.virtualWrite()` per line.
+ *
+ * Every `virtualWrite` is a separate Blynk message with its own header and cloud round
+ * trip. `list` wrote one message per command, the device listing one per device, a
+ * benchmark one per result line.
+ *
+ * @details
+ * - **Buffer**: one static chunk of `TERM_CHUNK_LEN` bytes, no allocation. `termPrint()`
+ *   appends, a line that does not fit flushes the chunk first, a line longer than a chunk
+ *   is split. `termPrintf()` formats straight into the chunk.
+ * - **Flush**: when the next line does not fit, on `termEnd()` (end of a terminal
+ *   command, flushed after the mailbox has been drained on the same loop pass) and when
+ *   the oldest buffered byte is `TERM_LINGER_MS` old, for output other tasks post later
+ *   (ping, sched, the device listing).
+ * - **Sources**: the V42 command handler in main.cpp calls it directly, `widgetDrain()`
+ *   routes V42 text from the mailbox here, so other tasks keep using `widgetPrint(V42, ..)`.
+ * - **Metrics**: `terminal_messages_total`, Blynk messages written to V42.
+ *
+ * @note Loop task only, like `Blynk.virtualWrite()`. There is no locking.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <stdarg.h>
+#include <algorithm>
+#include "terminal.h"
+#include "metrics.h"
+
+static char chunk[TERM_CHUNK_LEN + 1];
+static size_t len = 0;
+static uint32_t firstMs;
+static bool endOfCommand = false;
+static void (*sink)(const char *text);
+static metric_t *mMessages;
+
+/**
+ * @brief Sets the function that writes a chunk to the widget, called from `setup()`.
+ */
+void termBegin(void (*write)(const char *text))
+{
+    sink = write;
+    mMessages = metricRegister("terminal_messages_total", "Blynk messages written to the V42 terminal", METRIC_COUNTER);
+}
+
+/**
+ * @brief Writes the buffered output as one message.
+ */
+void termFlush()
+{
+    endOfCommand = false;
+    if (len == 0)
+        return;
+    chunk[len] = 0;
+    if (sink != NULL)
+        sink(chunk);
+    metricInc(mMessages);
+    len = 0;
+}
+
+static void append(const char *text, size_t n)
+{
+    if (len == 0)
+        firstMs = millis();
+    memcpy(chunk + len, text, n);
+    len += n;
+}
+
+/**
+ * @brief Buffers `text`, usually one or more complete lines.
+ */
+void termPrint(const char *text)
+{
+    size_t n = strlen(text);
+    if (len + n > TERM_CHUNK_LEN)
+        termFlush(); // keep lines whole when they fit in a chunk
+    while (n > TERM_CHUNK_LEN - len)
+    {
+        size_t part = TERM_CHUNK_LEN - len;
+        append(text, part);
+        termFlush();
+        text += part;
+        n -= part;
+    }
+    append(text, n);
+}
+
+/**
+ * @brief Formats into the buffer, a line longer than a chunk is cut.
+ */
+void termPrintf(const char *fmt, ...)
+{
+    va_list args;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        va_start(args, fmt);
+        int n = vsnprintf(chunk + len, TERM_CHUNK_LEN + 1 - len, fmt, args);
+        va_end(args);
+        if (n < 0)
+            return;
+        if (len + n <= TERM_CHUNK_LEN || len == 0)
+        {
+            if (len == 0)
+                firstMs = millis();
+            len += std::min((size_t)n, TERM_CHUNK_LEN - len);
+            return;
+        }
+        termFlush(); // did not fit, send what was there and format again
+    }
+}
+
+/**
+ * @brief Marks the end of a terminal command, `termPoll()` flushes on this loop pass.
+ */
+void termEnd()
+{
+    endOfCommand = true;
+}
+
+/**
+ * @brief Flushes at the end of a command or once the buffered output has lingered
+ *        `TERM_LINGER_MS`. Called by `loop()` after `widgetDrain()`.
+ */
+void termPoll()
+{
+    if (endOfCommand || (len && millis() - firstMs >= TERM_LINGER_MS))
+        termFlush();
+}
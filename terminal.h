@@ -0,0 +1,16 @@
+/**
+ * @file terminal.h
+ * @brief Buffered writer for the V42 terminal widget, loop task only.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define TERM_CHUNK_LEN 992 // below BLYNK_MAX_SENDBYTES (main.cpp) less the virtualWrite header
+#define TERM_LINGER_MS 100
+
+void termBegin(void (*write)(const char *text));
+void termPrint(const char *text);
+void termPrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void termFlush();
+void termEnd();
+void termPoll();
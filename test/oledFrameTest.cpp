@@ -0,0 +1,101 @@
+/**
+ * @file oledFrameTest.cpp
+ * @brief Host test of the OLED framebuffer diff (oledFrame.cpp), no board needed.
+ *
+ * Build and run from the repository root:
+ *   g++ -std=gnu++17 -I. test/oledFrameTest.cpp oledFrame.cpp -o oledFrameTest && ./oledFrameTest
+ *
+ * @details
+ * - **Cost**: `spanBytes()` is the I2C byte count of `flushSpan()` in dashboard.cpp, the
+ *   7 byte addressing command plus one control byte per `DASH_I2C_CHUNK` data transfer.
+ * - **Cases**: an invalid shadow (full frame, 1120 bytes), an unchanged frame (0), a value
+ *   of 6 columns (14), a change on two pages, a failed transfer (span not committed, sent
+ *   again) and `oledInvalidate()` after the panel was written by someone else.
+ *
+ * @author Leon Freimour
+ */
+#include <stdio.h>
+#include "oledFrame.h"
+
+#define DASH_I2C_CHUNK 32 // dashboard.cpp
+#define ADDRESSING_BYTES 7
+
+static int failures = 0;
+
+#define CHECK(cond)                                                  \
+    do                                                               \
+    {                                                                \
+        if (!(cond))                                                 \
+        {                                                            \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);  \
+            failures++;                                              \
+        }                                                            \
+    } while (0)
+
+static size_t spanBytes(const oledSpan_t &span)
+{
+    int cols = span.x1 - span.x0 + 1;
+    int transfers = (cols + DASH_I2C_CHUNK - 2) / (DASH_I2C_CHUNK - 1);
+    return ADDRESSING_BYTES + cols + transfers;
+}
+
+// one update: diff, send (commit unless `fail`), returns the bytes sent
+static size_t update(oledShadow_t &shadow, const uint8_t *frame, int &spans, bool fail = false)
+{
+    oledSpan_t span[OLED_PAGES];
+    size_t bytes = 0;
+    spans = oledDiff(&shadow, frame, span);
+    for (int i = 0; i < spans; i++)
+    {
+        bytes += spanBytes(span[i]);
+        if (!fail)
+            oledCommit(&shadow, frame, &span[i]);
+    }
+    return bytes;
+}
+
+int main()
+{
+    static oledShadow_t shadow;
+    static uint8_t frame[OLED_FRAME_BYTES];
+    int spans;
+
+    for (size_t i = 0; i < sizeof(frame); i++)
+        frame[i] = (uint8_t)(i * 7);
+    oledInvalidate(&shadow);
+    CHECK(update(shadow, frame, spans) == 1120);
+    CHECK(spans == OLED_PAGES);
+    CHECK(shadow.valid);
+    CHECK(memcmp(shadow.shown, frame, sizeof(frame)) == 0);
+
+    CHECK(update(shadow, frame, spans) == 0);
+    CHECK(spans == 0);
+
+    for (int x = 40; x < 46; x++) // one 6 column character on page 3
+        frame[3 * OLED_COLS + x] ^= 0xff;
+    oledSpan_t span[OLED_PAGES];
+    CHECK(oledDiff(&shadow, frame, span) == 1);
+    CHECK(span[0].page == 3 && span[0].x0 == 40 && span[0].x1 == 45);
+    CHECK(update(shadow, frame, spans) == 14);
+    CHECK(update(shadow, frame, spans) == 0);
+
+    frame[0 * OLED_COLS + 127] ^= 1; // last column of page 0, first of page 7
+    frame[7 * OLED_COLS + 0] ^= 1;
+    CHECK(oledDiff(&shadow, frame, span) == 2);
+    CHECK(span[0].page == 0 && span[0].x0 == 127 && span[0].x1 == 127);
+    CHECK(span[1].page == 7 && span[1].x0 == 0 && span[1].x1 == 0);
+
+    size_t failed = update(shadow, frame, spans, true); // transfer failed, nothing committed
+    CHECK(failed == 2 * (ADDRESSING_BYTES + 2));
+    CHECK(update(shadow, frame, spans) == failed); // the same spans again
+    CHECK(update(shadow, frame, spans) == 0);
+
+    oledInvalidate(&shadow); // e.g. the boot screen was drawn
+    CHECK(update(shadow, frame, spans, true) == 1120);
+    CHECK(!shadow.valid);
+    CHECK(update(shadow, frame, spans) == 1120);
+    CHECK(shadow.valid);
+
+    printf("oledFrame: %s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,396 @@
+/**
+ * @file timingWheel.cpp
+ * @brief Hierarchical timing wheel and the FreeRTOS task that drives it.
+ *
+ * @details
+ * - **Levels**: level 0 holds timers due in the next 64 ms, one slot per ms. Level n holds
+ *   timers due within 64^(n+1) ms, one slot per 64^n ms. Every 64 ticks the matching slot of
+ *   the level above is cascaded (re-inserted) into the levels below, Linux style.
+ * - **Cost**: arm and cancel are O(1) (hash to a slot, link/unlink an intrusive list). A tick
+ *   only touches one level 0 slot plus, every 64 ticks, one slot per level above. Idle ticks
+ *   are skipped using the per level occupancy bitmaps.
+ * - **Dispatch**: when a timer expires its callback runs in the driver task, or is handed to
+ *   its `dispatch` function which posts it to the task that must run it (e.g. the poller).
+ *   When the target queue is full a one shot timer is armed again for `TW_RETRY_MS`, unless
+ *   its owner re-armed or cancelled it meanwhile (`timer_dispatch_retries_total`).
+ * - **Locking**: arm/cancel/advance take the wheel spinlock for a few instructions only,
+ *   callbacks always run with the lock released so they may re-arm or cancel timers.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include "timingWheel.h"
+#include "watchDog.h"
+#include "metrics.h"
+#include "binLog.h"
+
+#define TW_TASK_PRIORITY 4
+#define TW_TASK_CORE 1
+#define TW_STACK_SIZE 4096
+#define TW_IDLE_MS 1000 // longest sleep of the driver, bounds the cost of a missed notify
+#define TW_HEARTBEAT_MS (5 * 1000)
+#define TW_RANGE ((1UL << (TW_SLOT_BITS * TW_LEVELS)) - 1)
+#define WORDS_PER_BYTE 4
+
+timingWheel_t wheel;
+TaskHandle_t wheel_task_handle;
+static metric_t *mRetries; // application wheel only
+
+void taskTimerWheel(void *pvParameters);
+
+static inline uint32_t slotIndex(uint32_t expires, int level)
+{
+    return (expires >> (TW_SLOT_BITS * level)) & (TW_SLOTS - 1);
+}
+
+// link t into the slot matching its expiry, caller holds the lock
+static void place(timingWheel_t *w, twTimer_t *t)
+{
+    uint32_t expires = t->expires;
+    uint32_t delta = (int32_t)(expires - w->tick) < 0 ? 0 : expires - w->tick;
+    int level = 0;
+
+    if (delta == 0)
+        expires = w->tick; // overdue, run on the next tick
+    else if (delta > TW_RANGE)
+    {
+        expires = w->tick + TW_RANGE; // park at the far end, re-cascaded until due
+        delta = TW_RANGE;
+    }
+    while (level < TW_LEVELS - 1 && delta >= (1UL << (TW_SLOT_BITS * (level + 1))))
+        level++;
+
+    uint32_t index = slotIndex(expires, level);
+    twTimer_t **head = &w->slots[level][index];
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+    t->slot = level * TW_SLOTS + index;
+    w->occupied[level] |= 1ULL << index;
+}
+
+// unlink t from its list, caller holds the lock
+static void unlink(timingWheel_t *w, twTimer_t *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    if (t->slot != TW_DETACHED)
+    {
+        int level = t->slot / TW_SLOTS, index = t->slot % TW_SLOTS;
+        if (w->slots[level][index] == NULL)
+            w->occupied[level] &= ~(1ULL << index);
+    }
+    t->pprev = NULL;
+    t->next = NULL;
+}
+
+// re-insert every timer of a higher level slot, caller holds the lock
+static void cascade(timingWheel_t *w, int level, uint32_t index)
+{
+    twTimer_t *t = w->slots[level][index];
+    w->slots[level][index] = NULL;
+    w->occupied[level] &= ~(1ULL << index);
+    while (t)
+    {
+        twTimer_t *next = t->next;
+        place(w, t);
+        t = next;
+    }
+}
+
+// process the tick w->tick, returns the number of timers fired
+static int runTick(timingWheel_t *w)
+{
+    int fired = 0;
+    twTimer_t *pending;
+
+    portENTER_CRITICAL(&w->mux);
+    uint32_t tick = w->tick;
+    // when level 0 wraps cascade the matching slot of level 1, and so on up while the lower
+    // level wrapped too; highest level first so timers trickle all the way down
+    int top = 0;
+    while (top + 1 < TW_LEVELS && slotIndex(tick, top) == 0)
+        top++;
+    for (int level = top; level >= 1; level--)
+        cascade(w, level, slotIndex(tick, level));
+    uint32_t index = slotIndex(tick, 0);
+    pending = w->slots[0][index];
+    w->slots[0][index] = NULL;
+    w->occupied[0] &= ~(1ULL << index);
+    if (pending)
+        pending->pprev = &pending;
+    for (twTimer_t *t = pending; t; t = t->next)
+        t->slot = TW_DETACHED; // a re-arm for tick + 64 must not land in this list
+    w->tick = tick + 1;
+    portEXIT_CRITICAL(&w->mux);
+
+    for (;;)
+    {
+        portENTER_CRITICAL(&w->mux);
+        twTimer_t *t = pending;
+        if (t == NULL)
+        {
+            portEXIT_CRITICAL(&w->mux);
+            break;
+        }
+        unlink(w, t);
+        w->armed--;
+        twCallback_t cb = t->cb;
+        void *arg = t->arg;
+        twDispatch_t dispatch = t->dispatch;
+        if (t->period)
+        {
+            t->expires = tick + t->period;
+            place(w, t);
+            w->armed++;
+        }
+        portEXIT_CRITICAL(&w->mux);
+
+        if (dispatch == NULL)
+            cb(arg);
+        else if (!dispatch(cb, arg))
+        {
+            portENTER_CRITICAL(&w->mux);
+            bool retry = t->pprev == NULL && t->slot == TW_DETACHED; // not re-armed or cancelled since
+            if (retry)
+            {
+                t->expires = w->tick + TW_RETRY_MS;
+                place(w, t);
+                w->armed++;
+            }
+            portEXIT_CRITICAL(&w->mux);
+            if (mRetries && retry)
+                metricInc(mRetries);
+            LOG_W("timer dispatch failed, target queue is full%s", retry ? ", retrying" : "");
+        }
+        fired++;
+    }
+    return fired;
+}
+
+/**
+ * @brief Initialises an empty wheel whose first tick is `now`.
+ */
+void twInit(timingWheel_t *w, uint32_t now)
+{
+    memset(w->slots, 0, sizeof(w->slots));
+    memset(w->occupied, 0, sizeof(w->occupied));
+    w->tick = now;
+    w->armed = 0;
+    w->mux = portMUX_INITIALIZER_UNLOCKED;
+}
+
+/**
+ * @brief Arms (or re-arms) a timer. O(1).
+ *
+ * @param w The wheel.
+ * @param t Caller owned timer, may already be armed (it is moved).
+ * @param delayMs Delay from the wheel's current tick.
+ * @param cb Callback, runs once per expiry.
+ * @param arg Passed to the callback.
+ * @param dispatch Function posting the callback to its target task, NULL to run it in the
+ *                 driver task (keep those short).
+ * @param periodMs Re-arm period, 0 for a one shot timer.
+ */
+void twArm(timingWheel_t *w, twTimer_t *t, uint32_t delayMs, twCallback_t cb, void *arg,
+           twDispatch_t dispatch, uint32_t periodMs)
+{
+    portENTER_CRITICAL(&w->mux);
+    if (t->pprev)
+    {
+        unlink(w, t);
+        w->armed--;
+    }
+    t->cb = cb;
+    t->arg = arg;
+    t->dispatch = dispatch;
+    t->period = periodMs;
+    t->expires = w->tick + delayMs;
+    place(w, t);
+    w->armed++;
+    portEXIT_CRITICAL(&w->mux);
+}
+
+/**
+ * @brief Cancels a timer. O(1).
+ *
+ * @return true if the timer was armed. A callback already handed to its dispatch queue is
+ *         not recalled, its owner has to tolerate one late call.
+ */
+bool twCancel(timingWheel_t *w, twTimer_t *t)
+{
+    bool armed = false;
+    portENTER_CRITICAL(&w->mux);
+    if (t->pprev)
+    {
+        unlink(w, t);
+        w->armed--;
+        armed = true;
+    }
+    else if (t->slot == TW_DETACHED)
+        t->slot = TW_CANCELLED; // being dispatched, no retry if that fails
+    portEXIT_CRITICAL(&w->mux);
+    return armed;
+}
+
+bool twArmed(const twTimer_t *t)
+{
+    return t->pprev != NULL;
+}
+
+/**
+ * @brief Processes every tick up to and including `now`.
+ *
+ * Ticks with nothing in level 0 are skipped up to the next cascade point, so catching up
+ * after a long sleep costs one step per 64 ms rather than one per ms.
+ *
+ * @return Number of timers fired.
+ */
+int twAdvance(timingWheel_t *w, uint32_t now)
+{
+    int fired = 0;
+    while ((int32_t)(now - w->tick) >= 0)
+    {
+        portENTER_CRITICAL(&w->mux);
+        uint32_t tick = w->tick;
+        uint32_t index = slotIndex(tick, 0);
+        bool idle = index != 0 && (w->occupied[0] >> index) == 0;
+        if (idle)
+        {
+            uint32_t boundary = (tick | (TW_SLOTS - 1)) + 1;
+            w->tick = (int32_t)(boundary - (now + 1)) > 0 ? now + 1 : boundary;
+        }
+        portEXIT_CRITICAL(&w->mux);
+        if (!idle)
+            fired += runTick(w);
+    }
+    return fired;
+}
+
+/**
+ * @brief Milliseconds from `now` until the wheel has work to do (a level 0 timer or a
+ *        cascade), 0 if it is behind, UINT32_MAX if nothing is armed.
+ */
+uint32_t twNextExpiry(timingWheel_t *w, uint32_t now)
+{
+    uint32_t target;
+    portENTER_CRITICAL(&w->mux);
+    uint32_t tick = w->tick;
+    uint32_t index = slotIndex(tick, 0);
+    uint64_t ahead = index ? w->occupied[0] >> index : w->occupied[0];
+    bool empty = w->armed == 0;
+    portEXIT_CRITICAL(&w->mux);
+
+    if (empty)
+        return UINT32_MAX;
+    if (ahead)
+        target = tick + __builtin_ctzll(ahead);
+    else
+        target = (tick | (TW_SLOTS - 1)) + 1; // next cascade point
+    return (int32_t)(target - now) > 0 ? target - now : 0;
+}
+
+/**
+ * @brief Starts the task driving the application wheel.
+ */
+bool twStart()
+{
+    twInit(&wheel, millis());
+    mRetries = metricRegister("timer_dispatch_retries_total", "Timers re-armed because their target queue was full", METRIC_COUNTER);
+    xTaskCreatePinnedToCore(taskTimerWheel, "Task Wheel", TW_STACK_SIZE, NULL, TW_TASK_PRIORITY, &wheel_task_handle, TW_TASK_CORE);
+    return wheel_task_handle != NULL;
+}
+
+/**
+ * @brief Arms a timer on the application wheel and wakes the driver so it can shorten its
+ *        sleep if this timer is the next one due.
+ */
+void timerArm(twTimer_t *t, uint32_t delayMs, twCallback_t cb, void *arg, twDispatch_t dispatch, uint32_t periodMs)
+{
+    // the driver may lag behind millis() by up to one sleep, compensate
+    uint32_t lag = millis() - wheel.tick;
+    twArm(&wheel, t, delayMs + ((int32_t)lag > 0 ? lag : 0), cb, arg, dispatch, periodMs);
+    if (wheel_task_handle)
+        xTaskNotifyGive(wheel_task_handle);
+}
+
+bool timerCancel(twTimer_t *t)
+{
+    return twCancel(&wheel, t);
+}
+
+/**
+ * @brief Task driving the application wheel.
+ *
+ * Sleeps until the next level 0 timer or cascade point, or until `timerArm()` notifies it.
+ */
+void taskTimerWheel(void *pvParameters)
+{
+    heartbeat_t *hb = hbRegister("wheel", TW_HEARTBEAT_MS); // the driver never sleeps longer than TW_IDLE_MS
+    Serial.printf("Task Wheel running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    for (;;)
+    {
+        hbCheckIn(hb, "advance");
+        twAdvance(&wheel, millis());
+        uint32_t wait = twNextExpiry(&wheel, millis());
+        if (wait > TW_IDLE_MS)
+            wait = TW_IDLE_MS;
+        if (wait)
+            ulTaskNotifyTake(pdTRUE, wait / portTICK_PERIOD_MS);
+    }
+}
+
+static int benchFired;
+static void benchCallback(void *arg)
+{
+    benchFired++;
+}
+
+/**
+ * @brief Benchmarks arm, cancel and expiry of `timers` timers on a private wheel.
+ *
+ * Delays are spread over one minute; half the timers are cancelled, the rest fire.
+ *
+ * @param timers Number of timers to arm.
+ * @param report Receives a one line summary.
+ * @param len Size of `report`.
+ * @return 0 on success, 1 if the memory could not be allocated.
+ */
+int twBench(int timers, char *report, size_t len)
+{
+    timingWheel_t *bw = (timingWheel_t *)malloc(sizeof(timingWheel_t));
+    twTimer_t *t = (twTimer_t *)calloc(timers, sizeof(twTimer_t));
+    if (bw == NULL || t == NULL)
+    {
+        free(bw);
+        free(t);
+        snprintf(report, len, "twbench: no memory for %d timers\n", timers);
+        return 1;
+    }
+    twInit(bw, 0);
+    benchFired = 0;
+
+    unsigned long start = micros();
+    for (int i = 0; i < timers; i++)
+        twArm(bw, &t[i], 1 + esp_random() % 60000, benchCallback, NULL);
+    unsigned long armUs = micros() - start;
+
+    start = micros();
+    for (int i = 0; i < timers; i += 2)
+        twCancel(bw, &t[i]);
+    unsigned long cancelUs = micros() - start;
+
+    start = micros();
+    twAdvance(bw, 60001);
+    unsigned long advanceUs = micros() - start;
+
+    snprintf(report, len, "wheel %d timers: arm %lu ns cancel %lu ns, 60 s of ticks %lu us, fired %d\n",
+             timers, armUs * 1000 / timers, cancelUs * 2000 / timers, advanceUs, benchFired);
+    free(t);
+    free(bw);
+    return 0;
+}
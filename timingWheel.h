@@ -0,0 +1,58 @@
+/**
+ * @file timingWheel.h
+ * @brief Hierarchical timing wheel, O(1) arm/cancel for per-device timers, timeouts and backoffs.
+ *
+ * Timers are intrusive: the caller owns the `twTimer_t` (usually embedded in a device entry),
+ * the wheel only links it. 4 levels of 64 slots at 1 ms resolution cover 2^24 ms (~4.6 h);
+ * longer delays are parked in the top level and re-cascaded.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_DETACHED 0xffff // timer picked up by the tick being processed
+#define TW_CANCELLED 0xfffe // cancelled while its callback was being dispatched
+#define TW_RETRY_MS 100     // a one shot timer whose dispatch failed fires again after this
+
+typedef void (*twCallback_t)(void *arg);
+// posts the callback to the task that must run it, NULL runs it in the wheel driver
+typedef bool (*twDispatch_t)(twCallback_t cb, void *arg);
+
+typedef struct twTimer
+{
+    struct twTimer *next;
+    struct twTimer **pprev; // NULL when not armed
+    uint32_t expires;       // absolute tick (ms)
+    uint32_t period;        // ms, 0 for one shot
+    twCallback_t cb;
+    void *arg;
+    twDispatch_t dispatch;
+    uint16_t slot; // level * TW_SLOTS + index, to clear the occupancy bit on cancel
+} twTimer_t;
+
+typedef struct
+{
+    twTimer_t *slots[TW_LEVELS][TW_SLOTS];
+    uint64_t occupied[TW_LEVELS];
+    uint32_t tick; // next tick to process
+    uint32_t armed;
+    portMUX_TYPE mux;
+} timingWheel_t;
+
+void twInit(timingWheel_t *w, uint32_t now);
+void twArm(timingWheel_t *w, twTimer_t *t, uint32_t delayMs, twCallback_t cb, void *arg,
+           twDispatch_t dispatch = NULL, uint32_t periodMs = 0);
+bool twCancel(timingWheel_t *w, twTimer_t *t);
+bool twArmed(const twTimer_t *t);
+int twAdvance(timingWheel_t *w, uint32_t now);
+uint32_t twNextExpiry(timingWheel_t *w, uint32_t now);
+
+// the application wheel, driven by taskTimerWheel
+extern timingWheel_t wheel;
+bool twStart();
+void timerArm(twTimer_t *t, uint32_t delayMs, twCallback_t cb, void *arg,
+              twDispatch_t dispatch = NULL, uint32_t periodMs = 0);
+bool timerCancel(twTimer_t *t);
+int twBench(int timers, char *report, size_t len);
@@ -0,0 +1,239 @@
+/**
+ * @file warmState.cpp
+ * @brief Warm-restart snapshot: device registry, last readings, counters and pending
+ *        recovery work kept in RTC slow memory so a reset does not start from nothing.
+ *
+ * @details
+ * - **Shadow**: the running state is collected in a RAM copy as it changes
+ *   (`warmNoteRegistry()` from the poller, `warmNoteReading()` from `processSensorData()`,
+ *   `warmNoteWifi()` once the station is associated).
+ * - **Save**: `warmSave()` copies the shadow plus the socket counters, stamps version, size
+ *   and CRC32, and only then writes it to RTC memory. A reset half way through a save
+ *   leaves a CRC mismatch, i.e. a cold boot, never a half old / half new state. The poller
+ *   saves after every registry refresh (20 s), `warmRestart()` and the heartbeat watchdog
+ *   save with `drainQueues`, moving the queued socket recovery and mySQL posts into the
+ *   snapshot (the queues cannot be read without emptying them).
+ * - **Restore**: `warmRestore()` at the top of `setup()` checks the snapshot and restores
+ *   the counters. Then `setup()` replays the last readings to the widgets, `initRTOS()`
+ *   requeues the pending work and the poller starts polling the cached registry before
+ *   ip.php answers. The live sweep overwrites everything as it arrives.
+ * - **Measurement**: `warmFirstWidget()` is called by the loop when the first sensor widget
+ *   reaches Blynk. The time since boot is reported on the terminal next to the last cold /
+ *   warm figure and as the `boot_first_widget_ms` gauge (label cold or warm).
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <CRC32.h>
+#include <stddef.h>
+#include <atomic>
+#include <algorithm>
+#include <Blynk/BlynkHandlers.h>
+#include "warmState.h"
+#include "mailbox.h"
+#include "metrics.h"
+
+#define WARM_MAGIC 0x5741524d // "WARM"
+
+RTC_NOINIT_ATTR static warmState_t rtcState; // survives a reset, garbage after power on
+static warmState_t restored;                 // left by the previous boot, read only
+static warmState_t shadow;                   // current state, committed by warmSave()
+static warmState_t staging;                  // save buffer, too big for the callers' stacks
+static bool warm = false;
+static std::atomic<bool> saving(false);
+static portMUX_TYPE warmMux = portMUX_INITIALIZER_UNLOCKED;
+
+extern std::atomic<int> passSocket, failSocket, recoveredSocket, retry;
+
+// Function Prototypes
+int pendingCollect(warmState_t &state);
+void spillFlush();
+void logDrain();
+
+static uint32_t warmCrc(const warmState_t &s)
+{
+    return CRC32::calculate((const uint8_t *)&s, offsetof(warmState_t, crc));
+}
+
+/**
+ * @brief Validates the RTC snapshot and restores the counters from it.
+ *
+ * Must run first in `setup()`. On a warm boot the snapshot is re-saved right away without
+ * the pending work, so a reset before it is requeued cannot replay it twice.
+ *
+ * @return true on a warm boot.
+ */
+bool warmRestore()
+{
+    warm = rtcState.magic == WARM_MAGIC && rtcState.version == WARM_VERSION &&
+           rtcState.size == sizeof(warmState_t) && rtcState.crc == warmCrc(rtcState);
+    if (!warm)
+    {
+        memset(&restored, 0, sizeof(restored));
+        memset(&shadow, 0, sizeof(shadow));
+        Serial.println("cold boot, no warm state");
+        return false;
+    }
+    restored = rtcState;
+    restored.devices = std::min(restored.devices, (uint8_t)WARM_MAX_DEVICES);
+    restored.readings = std::min(restored.readings, (uint8_t)WARM_MAX_READINGS);
+    restored.sockets = std::min(restored.sockets, (uint8_t)WARM_MAX_SOCKETS);
+    restored.posts = std::min(restored.posts, (uint8_t)WARM_MAX_POSTS);
+    passSocket = restored.passSocket;
+    failSocket = restored.failSocket;
+    recoveredSocket = restored.recoveredSocket;
+    retry = restored.retry;
+
+    shadow = restored;
+    shadow.warmBoots++;
+    shadow.sockets = shadow.posts = 0; // requeued by initRTOS()
+    warmSave(false);
+    Serial.printf("warm boot #%u: %d devices %d readings %d pending sockets %d pending posts\n",
+                  shadow.warmBoots, restored.devices, restored.readings, restored.sockets, restored.posts);
+    return true;
+}
+
+bool warmBoot()
+{
+    return warm;
+}
+
+/**
+ * @brief State left by the previous boot (all zero on a cold boot).
+ */
+const warmState_t *warmSnapshot()
+{
+    return &restored;
+}
+
+/**
+ * @brief Records the device list just fetched from ip.php.
+ */
+void warmNoteRegistry(const std::map<std::string, std::string> &devices)
+{
+    warmDevice_t list[WARM_MAX_DEVICES] = {};
+    uint8_t n = 0;
+    for (const auto &pair : devices)
+    {
+        if (n == WARM_MAX_DEVICES)
+            break;
+        strncpy(list[n].name, pair.first.c_str(), sizeof(list[n].name) - 1);
+        strncpy(list[n].ip, pair.second.c_str(), sizeof(list[n].ip) - 1);
+        n++;
+    }
+    portENTER_CRITICAL(&warmMux);
+    memcpy(shadow.device, list, sizeof(list));
+    shadow.devices = n;
+    portEXIT_CRITICAL(&warmMux);
+}
+
+/**
+ * @brief Records the last reading reported for a sensor type, its first
+ *        `WARM_READING_VALUES` values.
+ */
+void warmNoteReading(const sensorReading_t &reading)
+{
+    const char *sensor = reading.sensor;
+    portENTER_CRITICAL(&warmMux);
+    int i = 0;
+    while (i < shadow.readings && strncmp(shadow.reading[i].sensor, sensor, sizeof(shadow.reading[i].sensor) - 1))
+        i++;
+    if (i < WARM_MAX_READINGS)
+    {
+        if (i == shadow.readings)
+        {
+            strncpy(shadow.reading[i].sensor, sensor, sizeof(shadow.reading[i].sensor) - 1);
+            shadow.readings++;
+        }
+        shadow.reading[i].code = reading.code;
+        shadow.reading[i].values = std::min((int)reading.channels, WARM_READING_VALUES);
+        readingValues(reading, shadow.reading[i].value, WARM_READING_VALUES);
+    }
+    portEXIT_CRITICAL(&warmMux);
+}
+
+/**
+ * @brief Records the AP the station associated with, used for the next fast reconnect.
+ */
+void warmNoteWifi(const uint8_t *bssid, int32_t channel)
+{
+    if (bssid == NULL)
+        return;
+    portENTER_CRITICAL(&warmMux);
+    memcpy(shadow.wifiBssid, bssid, sizeof(shadow.wifiBssid));
+    shadow.wifiChannel = (uint8_t)channel;
+    portEXIT_CRITICAL(&warmMux);
+}
+
+/**
+ * @brief Commits the current state to RTC memory.
+ *
+ * @param drainQueues Also move the queued socket recovery and mySQL posts into the
+ *                    snapshot, only before a restart since it empties the queues.
+ */
+void warmSave(bool drainQueues)
+{
+    while (saving.exchange(true))
+        vTaskDelay(1);
+    portENTER_CRITICAL(&warmMux);
+    staging = shadow;
+    portEXIT_CRITICAL(&warmMux);
+
+    staging.passSocket = passSocket;
+    staging.failSocket = failSocket;
+    staging.recoveredSocket = recoveredSocket;
+    staging.retry = retry;
+    staging.sockets = staging.posts = 0;
+    if (drainQueues)
+        pendingCollect(staging);
+    staging.magic = WARM_MAGIC;
+    staging.version = WARM_VERSION;
+    staging.size = sizeof(warmState_t);
+    staging.saves++;
+    staging.crc = warmCrc(staging);
+
+    rtcState.magic = 0; // invalid until the copy is complete
+    memcpy(&rtcState, &staging, sizeof(staging));
+    portENTER_CRITICAL(&warmMux);
+    shadow.saves = staging.saves;
+    portEXIT_CRITICAL(&warmMux);
+    saving = false;
+}
+
+/**
+ * @brief Saves the state including the pending work, then restarts. Parked outage rows
+ *        are flushed to their file (spill.cpp) for the next boot to replay, the log rings
+ *        are printed (binLog.cpp).
+ */
+void warmRestart()
+{
+    spillFlush();
+    warmSave(true);
+    logDrain();
+    ESP.restart();
+}
+
+/**
+ * @brief Reports the time from boot to the first sensor widget written to Blynk, once.
+ *
+ * Called by the loop for every sensor value it writes.
+ */
+void warmFirstWidget()
+{
+    static bool done = false;
+    if (done)
+        return;
+    done = true;
+
+    uint32_t ms = millis();
+    portENTER_CRITICAL(&warmMux);
+    shadow.firstWidgetMs[warm] = ms;
+    portEXIT_CRITICAL(&warmMux);
+    metricSet(metricRegister("boot_first_widget_ms", "Boot to first valid sensor widget", METRIC_GAUGE, "boot", warm ? "warm" : "cold"), ms);
+
+    char tmp[MAILBOX_TEXT_LEN];
+    snprintf(tmp, sizeof(tmp), "first widget %u ms after %s boot (last cold %u ms, warm %u ms)\n",
+             ms, warm ? "warm" : "cold", restored.firstWidgetMs[0], restored.firstWidgetMs[1]);
+    Serial.print(tmp);
+    widgetPrint(V42, tmp);
+}
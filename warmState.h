@@ -0,0 +1,76 @@
+/**
+ * @file warmState.h
+ * @brief Warm-restart snapshot kept in RTC slow memory across `ESP.restart()` and watchdog resets.
+ *
+ * The snapshot is versioned and CRC32 checked, a power on, a new layout or a reset in the
+ * middle of a save all give a cold boot.
+ */
+#pragma once
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include "reading.h"
+#include "config.h"
+
+#define WARM_VERSION 4
+#define WARM_MAX_DEVICES 16
+#define WARM_MAX_READINGS 8
+#define WARM_READING_VALUES 4 // values kept per reading
+#define WARM_MAX_SOCKETS CONFIG_MAX_QUEUE // deepest queue.socket
+#define WARM_MAX_POSTS CONFIG_MAX_QUEUE   // deepest queue.http
+
+typedef struct
+{
+    char name[16];
+    char ip[20];
+} warmDevice_t;
+
+typedef struct
+{
+    char sensor[10];
+    uint8_t code; // sensor id
+    uint8_t values;
+    float value[WARM_READING_VALUES]; // last values reported for this sensor type
+} warmReading_t;
+
+typedef struct
+{
+    char ipAddr[20];
+    char cmd[20];
+} warmSocket_t;
+
+typedef struct
+{
+    char device[10];
+    char line[120];
+    int key;
+} warmPost_t;
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+    uint32_t saves;        // since power on
+    uint32_t warmBoots;    // since power on
+    uint32_t firstWidgetMs[2]; // last cold / warm boot, time to the first sensor widget
+    int passSocket, failSocket, recoveredSocket, retry;
+    uint8_t wifiBssid[6]; // last AP, for the fast reconnect
+    uint8_t wifiChannel;  // 0 when unknown
+    uint8_t devices, readings, sockets, posts;
+    warmDevice_t device[WARM_MAX_DEVICES];
+    warmReading_t reading[WARM_MAX_READINGS];
+    warmSocket_t socket[WARM_MAX_SOCKETS]; // pending socket recovery
+    warmPost_t post[WARM_MAX_POSTS];       // pending mySQL posts
+    uint32_t crc; // CRC32 of everything above
+} warmState_t;
+
+bool warmRestore();
+bool warmBoot();
+const warmState_t *warmSnapshot();
+void warmNoteRegistry(const std::map<std::string, std::string> &devices);
+void warmNoteReading(const sensorReading_t &reading);
+void warmNoteWifi(const uint8_t *bssid, int32_t channel);
+void warmSave(bool drainQueues);
+void warmRestart();
+void warmFirstWidget();
@@ -1,25 +1,230 @@
-// #include <Arduino.h>
-
-// Ticker lwdTicker;
-// #define LWD_TIMEOUT 15 * 1000 // Reboot if loop watchdog timer reaches this time out value
-// unsigned long lwdTime = 0;
-// unsigned long lwdTimeout = LWD_TIMEOUT;
-
-// void lwdtFeed(void);
-// void ICACHE_RAM_ATTR lwdtcb(void);
-// void lwdtFeed(void)
-// {
-//   lwdTime = millis();
-//   lwdTimeout = lwdTime + LWD_TIMEOUT;
-// }
-// void ICACHE_RAM_ATTR lwdtcb(void)
-// {
-//   if ((millis() - lwdTime > LWD_TIMEOUT) || (lwdTimeout - lwdTime != LWD_TIMEOUT))
-//   {
-//     // Blynk.logEvent("3rd_WDTimer");
-//     Serial.printf("3rd_WDTimer esp.restart %lu %lu\n", (millis() - lwdTime), (lwdTimeout - lwdTime));
-//     Blynk.virtualWrite(V39, "3rd_WDTimer");
-//     queStat();
-//     ESP.restart();
-//   }
-//  }
\ No newline at end of file
+/**
+ * @file watchDog.cpp
+ * @brief Heartbeat watchdog: every task checks in, a monitor task feeds the ESP-IDF task
+ *        watchdog only while all of them are on time.
+ *
+ * Replaces the loop-only Ticker watchdog (lwdtcb), which could not see a hung
+ * `taskSQL_HTTP` or `taskSocketRecov` and did blocking work (Blynk, queStat) from the
+ * timer callback before restarting.
+ *
+ * @details
+ * - **Registry**: `hbRegister()` from the task itself, with the longest busy stretch the
+ *   task may have between two check-ins (a full HTTP POST, a socket read ...).
+ * - **Check-in**: `hbCheckIn(hb, "stage")` stores the time and the pipeline stage, two
+ *   atomic stores. `hbIdle()` before a blocking queue wait takes the task out of the check,
+ *   a task waiting for work is not stalled.
+ * - **Monitor**: `taskHeartbeat` is the only task subscribed to the task watchdog
+ *   (`esp_task_wdt`). Every `HB_CHECK_MS` it compares each busy task's check-in age with its
+ *   timeout and resets the watchdog only if all are on time. On a stall it writes the task,
+ *   stage and gap to RTC memory, saves the warm restart snapshot (warmState.cpp) and
+ *   stops feeding, the task watchdog resets the chip
+ *   `HB_WDT_TIMEOUT_S` later. A starved or hung monitor trips the watchdog the same way.
+ * - **After the reset**: `hbStart()` reads the record back, `hbLastStall()` returns it as
+ *   text (written to V39 on connect) and `watchdog_stalls` counts stalls since power on.
+ * - **Metrics**: `heartbeat_gap_max_ms` (label = task) is the longest busy gap seen
+ *   between two check-ins, the margin left against each timeout.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <esp_task_wdt.h>
+#include <esp_idf_version.h>
+#include "watchDog.h"
+#include "warmState.h"
+
+#define HB_CHECK_MS 500
+#define HB_WDT_TIMEOUT_S 3
+#define HB_TASK_PRIORITY 5 // above every worker so a busy task cannot starve the check
+#define HB_STACK_SIZE 2048
+#define HB_STALL_MAGIC 0x48425354 // "HBST"
+#define WORDS_PER_BYTE 4
+
+typedef struct
+{
+    uint32_t magic;
+    char task[HB_NAME_LEN];
+    char stage[HB_NAME_LEN];
+    uint32_t gapMs;
+    uint32_t uptimeMs;
+    uint32_t stalls; // since power on
+    bool pending;    // not reported yet
+} hbStall_t;
+
+RTC_NOINIT_ATTR static hbStall_t rtcStall; // survives the watchdog reset, garbage after power on
+static heartbeat_t heartbeats[HB_MAX_TASKS];
+static heartbeat_t scratch;
+static std::atomic<int> hbUsed(0);
+static portMUX_TYPE hbMux = portMUX_INITIALIZER_UNLOCKED;
+static char lastStall[80];
+TaskHandle_t heartbeat_task_handle;
+
+// Function Prototypes
+void taskHeartbeat(void *pvParameters);
+
+/**
+ * @brief Registers the calling task's heartbeat.
+ *
+ * @param name Task name, must be a string literal (the pointer is kept).
+ * @param timeoutMs Longest time the task may stay busy between two check-ins.
+ * @return The heartbeat, never NULL (a shared unmonitored entry when the table is full).
+ */
+heartbeat_t *hbRegister(const char *name, uint32_t timeoutMs)
+{
+    heartbeat_t *hb = &scratch;
+    portENTER_CRITICAL(&hbMux);
+    int used = hbUsed.load();
+    if (used < HB_MAX_TASKS)
+    {
+        hb = &heartbeats[used];
+        hb->name = name;
+        hb->timeoutMs = timeoutMs;
+        hb->last = millis();
+        hb->stage = "start";
+        hb->idle = false;
+        hbUsed.store(used + 1); // publish only once the entry is filled
+    }
+    portEXIT_CRITICAL(&hbMux);
+    if (hb == &scratch)
+        Serial.printf("heartbeat table full, %s not monitored\n", name);
+    else
+        hb->mGap = metricRegister("heartbeat_gap_max_ms", "Longest busy gap between two watchdog check-ins", METRIC_GAUGE, "task", name);
+    return hb;
+}
+
+/**
+ * @brief Tells the monitor the task is alive and which stage it is entering.
+ *
+ * @param stage String literal naming the pipeline stage, kept for the stall report.
+ */
+void hbCheckIn(heartbeat_t *hb, const char *stage)
+{
+    uint32_t now = millis();
+    if (!hb->idle.load(std::memory_order_relaxed) && hb->mGap)
+        metricMax(hb->mGap, now - hb->last.load(std::memory_order_relaxed));
+    hb->stage.store(stage, std::memory_order_relaxed);
+    hb->last.store(now, std::memory_order_relaxed);
+    hb->idle.store(false); // after last, the monitor must not see busy with a stale time
+}
+
+/**
+ * @brief Marks the task as blocked waiting for work, the next `hbCheckIn()` resumes monitoring.
+ */
+void hbIdle(heartbeat_t *hb)
+{
+    hb->stage.store("idle", std::memory_order_relaxed);
+    hb->idle.store(true);
+}
+
+/**
+ * @brief Keeps the stall in RTC memory for the next boot.
+ */
+static void recordStall(const heartbeat_t &hb, const char *stage, uint32_t gap, uint32_t now)
+{
+    uint32_t stalls = rtcStall.magic == HB_STALL_MAGIC ? rtcStall.stalls : 0;
+    memset(&rtcStall, 0, sizeof(rtcStall));
+    strncpy(rtcStall.task, hb.name, HB_NAME_LEN - 1);
+    strncpy(rtcStall.stage, stage, HB_NAME_LEN - 1);
+    rtcStall.gapMs = gap;
+    rtcStall.uptimeMs = now;
+    rtcStall.stalls = stalls + 1;
+    rtcStall.pending = true;
+    rtcStall.magic = HB_STALL_MAGIC;
+}
+
+/**
+ * @brief Monitor task, feeds the task watchdog while every busy task is within its timeout.
+ */
+void taskHeartbeat(void *pvParameters)
+{
+    esp_task_wdt_add(NULL);
+    Serial.printf("Task Heartbeat running on CoreID:%d Free Bytes: %d\n",
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    for (;;)
+    {
+        uint32_t now = millis();
+        int used = hbUsed.load();
+        for (int i = 0; i < used; i++)
+        {
+            heartbeat_t &hb = heartbeats[i];
+            if (hb.idle.load())
+                continue;
+            uint32_t gap = now - hb.last.load();
+            if ((int32_t)gap <= (int32_t)hb.timeoutMs) // a check-in racing `now` gives a negative gap
+                continue;
+            const char *stage = hb.stage.load();
+            recordStall(hb, stage, gap, now);
+            warmSave(true); // pending recovery work survives the reset
+            Serial.printf("watchdog: %s stalled in %s for %u ms, restarting\n", hb.name, stage, gap);
+            for (;;)
+                vTaskDelay(portMAX_DELAY); // stop feeding, esp_task_wdt resets the chip
+        }
+        esp_task_wdt_reset();
+        vTaskDelay(pdMS_TO_TICKS(HB_CHECK_MS));
+    }
+}
+
+/**
+ * @brief Applies `HB_WDT_TIMEOUT_S` with panic to the task watchdog. The Arduino core may
+ *        have started it already with its own settings, it is reconfigured then.
+ */
+static bool wdtSetup()
+{
+#if ESP_IDF_VERSION_MAJOR >= 5
+    esp_task_wdt_config_t config = {};
+    config.timeout_ms = HB_WDT_TIMEOUT_S * 1000;
+    config.idle_core_mask = 0; // the monitor is the only task subscribed
+    config.trigger_panic = true;
+    esp_err_t err = esp_task_wdt_init(&config);
+    if (err == ESP_ERR_INVALID_STATE)
+        err = esp_task_wdt_reconfigure(&config);
+#else
+    esp_err_t err = esp_task_wdt_init(HB_WDT_TIMEOUT_S, true); // panic, i.e. reset, on timeout
+    if (err == ESP_ERR_INVALID_STATE)
+    {
+        // running with the core's settings: drop its idle task subscriptions and start over
+        for (int cpu = 0; cpu < portNUM_PROCESSORS; cpu++)
+            esp_task_wdt_delete(xTaskGetIdleTaskHandleForCPU(cpu));
+        esp_task_wdt_deinit();
+        err = esp_task_wdt_init(HB_WDT_TIMEOUT_S, true);
+    }
+#endif
+    if (err != ESP_OK)
+        Serial.printf("watchdog: task watchdog setup failed (%d), stalls may not reset\n", (int)err);
+    return err == ESP_OK;
+}
+
+/**
+ * @brief Reports the stall left in RTC memory by the previous boot, arms the task watchdog
+ *        and starts the monitor.
+ *
+ * Called from `initRTOS()` before the tasks are created.
+ */
+bool hbStart()
+{
+    if (rtcStall.magic == HB_STALL_MAGIC && rtcStall.pending)
+    {
+        rtcStall.task[HB_NAME_LEN - 1] = rtcStall.stage[HB_NAME_LEN - 1] = 0;
+        snprintf(lastStall, sizeof(lastStall), "WDT %s stalled in %s %u ms (up %u s, #%u)",
+                 rtcStall.task, rtcStall.stage, rtcStall.gapMs, rtcStall.uptimeMs / 1000, rtcStall.stalls);
+        Serial.println(lastStall);
+        rtcStall.pending = false;
+    }
+    else if (rtcStall.magic != HB_STALL_MAGIC)
+    {
+        memset(&rtcStall, 0, sizeof(rtcStall)); // power on, RTC memory holds garbage
+        rtcStall.magic = HB_STALL_MAGIC;
+    }
+    metricSet(metricRegister("watchdog_stalls", "Heartbeat stalls since power on", METRIC_GAUGE), rtcStall.stalls);
+
+    wdtSetup();
+    xTaskCreatePinnedToCore(taskHeartbeat, "Task Heartbeat", HB_STACK_SIZE, NULL, HB_TASK_PRIORITY, &heartbeat_task_handle, tskNO_AFFINITY);
+    return heartbeat_task_handle != NULL;
+}
+
+/**
+ * @brief Text of the stall that caused the last reset, NULL if the last reset was not a stall.
+ */
+const char *hbLastStall()
+{
+    return lastStall[0] ? lastStall : NULL;
+}
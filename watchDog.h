@@ -0,0 +1,31 @@
+/**
+ * @file watchDog.h
+ * @brief Per-task heartbeat registry on top of the ESP-IDF task watchdog.
+ *
+ * Each task registers once with the longest time it may run between two check-ins, then
+ * calls `hbCheckIn()` at every pipeline stage and `hbIdle()` before blocking for work.
+ * The stalled task and stage are kept in RTC memory across the watchdog reset.
+ */
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include "metrics.h"
+
+#define HB_MAX_TASKS 12
+#define HB_NAME_LEN 16
+
+typedef struct
+{
+    const char *name;
+    uint32_t timeoutMs;               // longest allowed gap between two busy check-ins
+    std::atomic<uint32_t> last;       // millis() of the last check-in
+    std::atomic<const char *> stage;  // string literal, current pipeline stage
+    std::atomic<bool> idle;           // blocked waiting for work, not monitored
+    metric_t *mGap;
+} heartbeat_t;
+
+heartbeat_t *hbRegister(const char *name, uint32_t timeoutMs);
+void hbCheckIn(heartbeat_t *hb, const char *stage);
+void hbIdle(heartbeat_t *hb);
+bool hbStart();
+const char *hbLastStall();
@@ -0,0 +1,263 @@
+/**
+ * @file workPool.cpp
+ * @brief Worker pool: one task pinned to each core, each with its own deque of jobs, an
+ *        idle worker steals from the other one.
+ *
+ * A sweep used to poll the devices one after the other in the poller task on core 0,
+ * while core 1 only ran the Blynk loop and the mostly idle socket recovery task. The
+ * scheduler now hands each poll to the pool (see `socketPollAsync()` in socketClient.cpp),
+ * so two devices are read at a time and the decrypt and decode stages of one device run
+ * while the other core waits on the network.
+ *
+ * @details
+ * - **Deques**: a ring of `POOL_DEQUE_SIZE` jobs per worker, guarded by a spinlock held
+ *   for a few instructions. The owner pushes and pops at the bottom (newest first, the
+ *   next stage of the job it just ran is still warm), a thief takes from the top (the
+ *   oldest job, most likely a poll that has waited longest).
+ * - **Submit**: from a worker the job goes to its own deque, from any other task to the
+ *   worker with fewer queued jobs. The owner is notified, the other worker too when the
+ *   owner is busy, it then steals. `poolSubmit()` never blocks, it returns false when the
+ *   deque is full and the caller runs the job itself.
+ * - **Workers**: `taskWorker` pinned to each core at `POOL_PRIORITY`, blocked on its task
+ *   notification while both deques are empty. A job must not wait on another pool job.
+ * - **Report**: "pool" on the terminal prints per core the share of time spent in jobs
+ *   since the last report, jobs run, jobs stolen and queue depth, plus the wall clock of
+ *   the last burst (from a job submitted to an idle pool until the pool is idle again,
+ *   i.e. a sweep).
+ * - **Metrics**: `pool_jobs_total{core}`, `pool_steals_total{core}`.
+ *
+ * @author Leon Freimour
+ */
+#include <Arduino.h>
+#include <atomic>
+#include <Blynk/BlynkHandlers.h>
+#include "workPool.h"
+#include "mailbox.h"
+#include "metrics.h"
+#include "watchDog.h"
+
+#define POOL_PRIORITY 1
+#define POOL_STACK_SIZE 6144      // a decode job runs processSensorData() and its sinks
+#define POOL_HEARTBEAT_MS (20 * 1000) // one device read, like the poller
+#define POOL_IDLE_MS 1000
+#define WORDS_PER_BYTE 4
+
+typedef struct
+{
+    poolJob_t job[POOL_DEQUE_SIZE];
+    uint32_t top, bottom; // thieves take at top, the owner at bottom
+    portMUX_TYPE mux;
+} poolDeque_t;
+
+typedef struct
+{
+    poolDeque_t deque;
+    TaskHandle_t task;
+    std::atomic<bool> running; // in a job
+    std::atomic<uint32_t> busyUs, jobs, steals;
+    uint32_t reportBusyUs; // busyUs at the last report
+    metric_t *mJobs, *mSteals;
+} poolWorker_t;
+
+static poolWorker_t workers[POOL_WORKERS];
+static std::atomic<int> active(0); // jobs queued or running
+static std::atomic<uint32_t> burstStart(0), burstUs(0), burstJobs(0);
+static uint32_t reportUs;
+
+// Function Prototypes
+void taskWorker(void *pvParameters);
+
+static void dequeInit(poolDeque_t &d)
+{
+    d.top = d.bottom = 0;
+    d.mux = portMUX_INITIALIZER_UNLOCKED;
+}
+
+static bool pushBottom(poolDeque_t &d, const poolJob_t &job)
+{
+    bool ok;
+    portENTER_CRITICAL(&d.mux);
+    ok = d.bottom - d.top < POOL_DEQUE_SIZE;
+    if (ok)
+        d.job[d.bottom++ % POOL_DEQUE_SIZE] = job;
+    portEXIT_CRITICAL(&d.mux);
+    return ok;
+}
+
+static bool popBottom(poolDeque_t &d, poolJob_t &job)
+{
+    bool ok;
+    portENTER_CRITICAL(&d.mux);
+    ok = d.bottom != d.top;
+    if (ok)
+        job = d.job[--d.bottom % POOL_DEQUE_SIZE];
+    portEXIT_CRITICAL(&d.mux);
+    return ok;
+}
+
+static bool stealTop(poolDeque_t &d, poolJob_t &job)
+{
+    bool ok;
+    portENTER_CRITICAL(&d.mux);
+    ok = d.bottom != d.top;
+    if (ok)
+        job = d.job[d.top++ % POOL_DEQUE_SIZE];
+    portEXIT_CRITICAL(&d.mux);
+    return ok;
+}
+
+static int depth(poolDeque_t &d)
+{
+    portENTER_CRITICAL(&d.mux);
+    int n = d.bottom - d.top;
+    portEXIT_CRITICAL(&d.mux);
+    return n;
+}
+
+/**
+ * @brief Starts one worker per core, called by `initRTOS()` before the poller.
+ */
+bool poolStart()
+{
+    char label[8];
+    for (int core = 0; core < POOL_WORKERS; core++)
+    {
+        poolWorker_t &w = workers[core];
+        dequeInit(w.deque);
+        snprintf(label, sizeof(label), "core%d", core);
+        w.mJobs = metricRegister("pool_jobs_total", "Jobs run by the worker pool", METRIC_COUNTER, "core", label);
+        w.mSteals = metricRegister("pool_steals_total", "Jobs a worker stole from the other core", METRIC_COUNTER, "core", label);
+    }
+    reportUs = micros();
+    for (int core = 0; core < POOL_WORKERS; core++)
+    {
+        xTaskCreatePinnedToCore(taskWorker, core ? "Task Worker 1" : "Task Worker 0", POOL_STACK_SIZE,
+                                (void *)(intptr_t)core, POOL_PRIORITY, &workers[core].task, core);
+        if (workers[core].task == NULL)
+            return false;
+    }
+    return true;
+}
+
+bool poolRunning()
+{
+    for (int core = 0; core < POOL_WORKERS; core++)
+        if (workers[core].task == NULL)
+            return false;
+    return true;
+}
+
+/**
+ * @brief Queues a job, never blocks.
+ *
+ * @return false if the pool is not running or the deque is full, the caller then runs
+ *         `fn` itself.
+ */
+bool poolSubmit(poolFn_t fn, void *arg)
+{
+    if (!poolRunning())
+        return false;
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    int target = -1;
+    for (int core = 0; core < POOL_WORKERS; core++)
+        if (workers[core].task == self)
+            target = core;
+    if (target < 0) // not a worker, the shorter deque
+    {
+        target = 0;
+        for (int core = 1; core < POOL_WORKERS; core++)
+            if (depth(workers[core].deque) < depth(workers[target].deque))
+                target = core;
+    }
+    if (active.fetch_add(1) == 0)
+    {
+        burstStart = micros();
+        burstJobs = 0;
+    }
+    if (!pushBottom(workers[target].deque, {fn, arg}))
+    {
+        active--;
+        return false;
+    }
+    xTaskNotifyGive(workers[target].task);
+    for (int core = 0; core < POOL_WORKERS; core++) // a busy owner, let the others steal
+        if (core != target && workers[target].running)
+            xTaskNotifyGive(workers[core].task);
+    return true;
+}
+
+/**
+ * @brief Worker task, runs jobs from its deque and steals when it is empty.
+ *
+ * @param pvParameters The core, i.e. the index of the worker.
+ */
+void taskWorker(void *pvParameters)
+{
+    int self = (intptr_t)pvParameters;
+    poolWorker_t &w = workers[self];
+    heartbeat_t *hb = hbRegister(self ? "worker1" : "worker0", POOL_HEARTBEAT_MS);
+    Serial.printf("Task Worker %d running on CoreID:%d Free Bytes: %d\n", self,
+                  xPortGetCoreID(), uxTaskGetStackHighWaterMark(NULL) * WORDS_PER_BYTE);
+    for (;;)
+    {
+        poolJob_t job;
+        bool got = popBottom(w.deque, job);
+        for (int core = 0; !got && core < POOL_WORKERS; core++)
+        {
+            if (core != self && stealTop(workers[core].deque, job))
+            {
+                got = true;
+                w.steals++;
+                metricInc(w.mSteals);
+            }
+        }
+        if (!got)
+        {
+            hbIdle(hb);
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(POOL_IDLE_MS));
+            continue;
+        }
+
+        hbCheckIn(hb, "job");
+        w.running = true;
+        uint32_t start = micros();
+        job.fn(job.arg);
+        uint32_t end = micros();
+        w.running = false;
+        w.busyUs += end - start;
+        w.jobs++;
+        metricInc(w.mJobs);
+        burstJobs++;
+        if (--active == 0)
+            burstUs = end - burstStart;
+    }
+}
+
+/**
+ * @brief Terminal "pool": per core utilization since the last report and the last burst.
+ */
+void poolReport()
+{
+    char tmp[MAILBOX_TEXT_LEN];
+    if (!poolRunning())
+    {
+        widgetPrint(V42, "pool: not running\n");
+        return;
+    }
+    uint32_t now = micros();
+    uint32_t window = now - reportUs;
+    reportUs = now;
+    snprintf(tmp, sizeof(tmp), "pool: %d workers, last burst %u ms %u jobs, %d in flight\n",
+             POOL_WORKERS, burstUs / 1000, (unsigned)burstJobs, active.load());
+    widgetPrint(V42, tmp);
+    for (int core = 0; core < POOL_WORKERS; core++)
+    {
+        poolWorker_t &w = workers[core];
+        uint32_t busy = w.busyUs - w.reportBusyUs;
+        w.reportBusyUs += busy;
+        snprintf(tmp, sizeof(tmp), "\tcore %d: busy %u.%u%% jobs %u stolen %u queued %d\n", core,
+                 (unsigned)((uint64_t)busy * 100 / window), (unsigned)((uint64_t)busy * 1000 / window % 10),
+                 (unsigned)w.jobs, (unsigned)w.steals, depth(w.deque));
+        widgetPrint(V42, tmp);
+    }
+}
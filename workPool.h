@@ -0,0 +1,23 @@
+/**
+ * @file workPool.h
+ * @brief One worker task per core with work-stealing deques, for device polls and frame
+ *        decoding.
+ */
+#pragma once
+#include <Arduino.h>
+
+#define POOL_WORKERS portNUM_PROCESSORS
+#define POOL_DEQUE_SIZE 16 // jobs queued per worker
+
+typedef void (*poolFn_t)(void *arg);
+
+typedef struct
+{
+    poolFn_t fn;
+    void *arg;
+} poolJob_t;
+
+bool poolStart();
+bool poolSubmit(poolFn_t fn, void *arg);
+bool poolRunning();
+void poolReport();